@@ -0,0 +1,64 @@
+import os
+import sys
+import subprocess
+import pandas as pd
+
+if len(sys.argv) != 2:
+    print("Usage: python3 compare_decrypt_throughput.py <number_of_runs>")
+    exit(1)
+
+number_of_runs = int(sys.argv[1])
+path = ["squeezenet1.0-7/", "mobilenetv2-7/", "densenet-7/", "efficientnet-lite4-11/", "inception-v3-12/", "resnet101-v2-7/", "resnet152-v2-7/", "efficientnet-v2-l-18/"]
+model_names = [
+    "SqueezeNet 1.0", "MobileNet V2", "DenseNet121", "EfficientNet Lite4",
+    "Inception V3", "ResNet101 V2", "ResNet152 V2", "EfficientNet V2"
+]
+
+# One AES-GCM stream over the whole partition vs. the chunked format, per model
+def generate_decrypt_times():
+    rows = []
+    for i in range(len(path)):
+        command = f"./decrypt_benchmark ../../../models/{path[i]}new_partitions/ {number_of_runs}"
+        print(command)
+        output = subprocess.run(command, shell=True, stdout=subprocess.PIPE)
+        if output.returncode != 0:
+            print("Error: decrypt_benchmark failed.")
+            exit(1)
+
+        lines = output.stdout.decode('utf-8').splitlines()
+        total = [line for line in lines if line.startswith("total,")]
+        if not total:
+            print(f"Error: no partitions found for {path[i]}")
+            exit(1)
+        columns = lines[0].split(",")[2:]
+        values = total[0].split(",")
+        size = int(values[1])
+        times = dict(zip(columns, (float(v) for v in values[2:])))
+        single_ms = times["single_ms"]
+        for column, ms in times.items():
+            rows.append({
+                'Model': model_names[i],
+                'Partition bytes': size,
+                'Format': column[:-len("_ms")],
+                'Open (ms)': f"{ms:.2f}",
+                'Throughput (MB/s)': f"{size / ms / 1000:.1f}" if ms > 0 else "-",
+                'Speedup over single stream': f"{single_ms / ms:.2f}" if ms > 0 else "-"
+            })
+    return rows
+
+def generate_csv(rows):
+    df = pd.DataFrame(rows)
+    if not os.path.exists("results/"):
+        os.mkdir("results")
+    df.to_csv(f'results/decrypt_throughput.csv', index=False)
+
+if __name__ == "__main__":
+    current_path = os.getcwd()
+    os.chdir(f"src/server_with_tls/scripts")
+    os.system(f"make clean && make decrypt_benchmark")
+
+    rows = generate_decrypt_times()
+    os.system(f"make clean")
+    os.chdir(current_path)
+
+    generate_csv(rows)
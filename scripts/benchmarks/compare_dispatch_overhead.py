@@ -0,0 +1,56 @@
+import os
+import sys
+import subprocess
+import pandas as pd
+
+if len(sys.argv) != 2:
+    print("Usage: python3 compare_dispatch_overhead.py <number_of_runs>")
+    exit(1)
+
+number_of_runs = int(sys.argv[1])
+path = ["squeezenet1.0-7/", "mobilenetv2-7/", "densenet-7/", "efficientnet-lite4-11/", "inception-v3-12/", "resnet101-v2-7/", "resnet152-v2-7/", "efficientnet-v2-l-18/"]
+model_names = [
+    "SqueezeNet 1.0", "MobileNet V2", "DenseNet121", "EfficientNet Lite4",
+    "Inception V3", "ResNet101 V2", "ResNet152 V2", "EfficientNet V2"
+]
+
+# Per-request dispatch of the recursive DFS vs. the flat execution plan on the per-operator splits
+def generate_dispatch_times():
+    rows = []
+    for i in range(len(path)):
+        command = f"./plan_benchmark ../../../models/{path[i]}operators {number_of_runs}"
+        print(command)
+        output = subprocess.run(command, shell=True, stdout=subprocess.PIPE)
+        if output.returncode != 0:
+            print("Error: plan_benchmark failed.")
+            exit(1)
+
+        lines = output.stdout.decode('utf-8').splitlines()
+        partitions, registration_ms, plan_build_ms, dfs_ms, plan_ms = lines[-1].split(",")
+        dfs_ms, plan_ms = float(dfs_ms), float(plan_ms)
+        rows.append({
+            'Model': model_names[i],
+            'Operators': partitions,
+            'Plan build (ms)': f"{float(plan_build_ms):.3f}",
+            'DFS dispatch (ms)': f"{dfs_ms:.3f}",
+            'Plan dispatch (ms)': f"{plan_ms:.3f}",
+            'Speedup': f"{dfs_ms / plan_ms:.2f}" if plan_ms > 0 else "-"
+        })
+    return rows
+
+def generate_csv(rows):
+    df = pd.DataFrame(rows)
+    if not os.path.exists("results/"):
+        os.mkdir("results")
+    df.to_csv(f'results/dispatch_overhead.csv', index=False)
+
+if __name__ == "__main__":
+    current_path = os.getcwd()
+    os.chdir(f"src/server_with_tls/scripts")
+    os.system(f"make clean && make plan_benchmark")
+
+    rows = generate_dispatch_times()
+    os.system(f"make clean")
+    os.chdir(current_path)
+
+    generate_csv(rows)
@@ -0,0 +1,113 @@
+import os
+import re
+import sys
+import subprocess
+import statistics
+import time
+import pandas as pd
+
+if len(sys.argv) != 3:
+    print("Usage: python3 compare_handshake_resumption.py <num_connections> <path_to_inferONNX>")
+    exit(1)
+
+try:
+    num_connections = int(sys.argv[1])
+except ValueError:
+    print("Usage: python3 compare_handshake_resumption.py <num_connections> <path_to_inferONNX>")
+    exit(1)
+
+inferONNX_path = os.path.abspath(sys.argv[2])
+path_to_occlum = inferONNX_path + "/.."
+server_with_tls_path = inferONNX_path + "/src/server_with_tls"
+client_command = f"{server_with_tls_path}/./ssl_client"
+session_file = "/tmp/inferonnx_session"
+model_path = f"{inferONNX_path}/models/mobilenetv2-7/"
+input_file = f"{model_path}test_data_set_0/input_0.pb"
+
+def build():
+    os.chdir(f"{server_with_tls_path}/src")
+    command = "make clean && make USE_AES=0 USE_OCCLUM=0 USE_SYS_TIME=1 server"
+    print(f"Command: {command}")
+    output = subprocess.run(command, shell=True, stdout=subprocess.PIPE)
+    if output.returncode != 0:
+        print("Error: building the server failed.")
+        exit(1)
+
+# Every connection sends one inference request, the client prints its handshake time
+def connect(options):
+    output = subprocess.run(f"{client_command} {options} inputs 1 {input_file}", shell=True, stdout=subprocess.DEVNULL, stderr=subprocess.PIPE)
+    match = re.search(rb"Handshake time: ([0-9.]+) ms \((.+?)\)", output.stderr)
+    if output.returncode != 0 or match is None or b"Inference:" not in output.stderr:
+        print("Error: inference request failed.")
+        return None
+    return float(match.group(1)), match.group(2).decode()
+
+def measure():
+    os.chdir(f"{path_to_occlum}/occlum_workspace/")
+    server = subprocess.Popen(f"{server_with_tls_path}/src/./server", shell=True, stderr=subprocess.DEVNULL)
+    time.sleep(2)
+
+    subprocess.run(f"{client_command} models {input_file} {model_path}", shell=True, stdout=subprocess.PIPE)
+
+    full = []
+    for _ in range(num_connections):
+        result = connect("")
+        if result is not None:
+            full.append(result[0])
+
+    # The first connection saves the session, the following ones resume it
+    if os.path.exists(session_file):
+        os.remove(session_file)
+    connect(f"--session {session_file}")
+    resumed = []
+    for _ in range(num_connections):
+        result = connect(f"--session {session_file}")
+        if result is not None and result[1] == "resumption offered":
+            resumed.append(result[0])
+
+    subprocess.run(f"{client_command} quit", shell=True, stdout=subprocess.PIPE)
+    server.wait()
+    if os.path.exists(session_file):
+        os.remove(session_file)
+    return full, resumed
+
+def generate_rows(full, resumed):
+    rows = []
+    for kind, times in [("Full", full), ("Resumed", resumed)]:
+        mean = statistics.mean(times) if times else 0
+        rows.append({
+            'Handshake': kind,
+            'Connections': len(times),
+            'Mean (ms)': f"{mean:.3f}",
+            'Median (ms)': f"{statistics.median(times):.3f}" if times else "-"
+        })
+        print(f"{kind}: {len(times)} connections, {mean:.3f} ms/handshake")
+    full_mean = statistics.mean(full) if full else 0
+    resumed_mean = statistics.mean(resumed) if resumed else 0
+    for row in rows:
+        row['Speedup'] = f"{full_mean / resumed_mean:.2f}" if resumed_mean > 0 else "-"
+    return rows
+
+def generate_csv(rows):
+    df = pd.DataFrame(rows)
+    if not os.path.exists("results/"):
+        os.mkdir("results")
+    df.to_csv(f'results/handshake_resumption.csv', index=False)
+
+if __name__ == "__main__":
+    current_path = os.getcwd()
+
+    os.chdir(server_with_tls_path)
+    os.system("make clean && make USE_AES=0 USE_OCCLUM=0 USE_SYS_TIME=0")
+    build()
+
+    full, resumed = measure()
+    rows = generate_rows(full, resumed)
+
+    os.chdir(server_with_tls_path)
+    os.system("make clean")
+    os.chdir(f"{server_with_tls_path}/src")
+    os.system("make clean")
+    os.chdir(current_path)
+
+    generate_csv(rows)
@@ -0,0 +1,58 @@
+import os
+import sys
+import subprocess
+import pandas as pd
+
+if len(sys.argv) != 2:
+    print("Usage: python3 compare_load_times.py <number_of_runs>")
+    exit(1)
+
+number_of_runs = int(sys.argv[1])
+path = ["squeezenet1.0-7/", "mobilenetv2-7/", "densenet-7/", "efficientnet-lite4-11/", "inception-v3-12/", "resnet101-v2-7/", "resnet152-v2-7/", "efficientnet-v2-l-18/"]
+model_names = [
+    "SqueezeNet 1.0", "MobileNet V2", "DenseNet121", "EfficientNet Lite4",
+    "Inception V3", "ResNet101 V2", "ResNet152 V2", "EfficientNet V2"
+]
+
+# ONNX parse + type vs. loading the compiled (NNEF) partitions, per model
+def generate_load_times():
+    rows = []
+    for i in range(len(path)):
+        command = f"./load_benchmark ../../../models/{path[i]}new_partitions/ {number_of_runs}"
+        print(command)
+        output = subprocess.run(command, shell=True, stdout=subprocess.PIPE)
+        if output.returncode != 0:
+            print("Error: load_benchmark failed.")
+            exit(1)
+
+        total = [line for line in output.stdout.decode('utf-8').splitlines() if line.startswith("total,")]
+        if not total:
+            print(f"Error: no partitions found for {path[i]}")
+            exit(1)
+        _, onnx_ms, compiled_ms, compile_ms = total[0].split(",")
+        onnx_ms, compiled_ms, compile_ms = float(onnx_ms), float(compiled_ms), float(compile_ms)
+        rows.append({
+            'Model': model_names[i],
+            'ONNX load (ms)': f"{onnx_ms:.2f}",
+            'Compiled load (ms)': f"{compiled_ms:.2f}",
+            'Speedup': f"{onnx_ms / compiled_ms:.2f}" if compiled_ms > 0 else "-",
+            'One-time compile (ms)': f"{compile_ms:.2f}"
+        })
+    return rows
+
+def generate_csv(rows):
+    df = pd.DataFrame(rows)
+    if not os.path.exists("results/"):
+        os.mkdir("results")
+    df.to_csv(f'results/load_times.csv', index=False)
+
+if __name__ == "__main__":
+    current_path = os.getcwd()
+    os.chdir(f"src/server_with_tls/scripts")
+    os.system(f"make clean && make load_benchmark")
+
+    rows = generate_load_times()
+    os.system(f"make clean")
+    os.chdir(current_path)
+
+    generate_csv(rows)
@@ -0,0 +1,115 @@
+import os
+import sys
+import json
+import struct
+import subprocess
+import time
+import pandas as pd
+
+if len(sys.argv) != 3:
+    print("Usage: python3 compare_local_transports.py <round_trips> <path_to_inferONNX>")
+    exit(1)
+
+try:
+    round_trips = int(sys.argv[1])
+except ValueError:
+    print("Usage: python3 compare_local_transports.py <round_trips> <path_to_inferONNX>")
+    exit(1)
+
+inferONNX_path = os.path.abspath(sys.argv[2])
+server_without_tls_path = inferONNX_path + "/src/server_without_tls"
+client_command = f"{server_without_tls_path}/./client"
+transports = ["tcp", "uds", "shm"]
+shapes = [[1, 3, 8, 8], [1, 3, 64, 64], [1, 3, 224, 224]]
+# No model is registered under this id: the server reads and parses the whole
+# request and answers that the model is unknown, so only the transport is timed
+unknown_model = 999999
+
+def build():
+    os.chdir(server_without_tls_path)
+    command = "make clean && make USE_AES=0 USE_MEMORY_ONLY=1 && cd src && make clean && make USE_AES=0 USE_MEMORY_ONLY=1 server"
+    print(f"Command: {command}")
+    output = subprocess.run(command, shell=True, stdout=subprocess.PIPE)
+    if output.returncode != 0:
+        print("Error: building the server or the client failed.")
+        exit(1)
+
+def varint(value):
+    out = b""
+    while value > 127:
+        out += bytes([value & 0x7f | 0x80])
+        value >>= 7
+    return out + bytes([value])
+
+# Input of the given shape in the layout the client reads: the dims and the
+# data type of a TensorProto, then the elements
+def write_input(shape, file_name):
+    header = b"".join(b"\x08" + varint(d) for d in shape)
+    header += b"\x10\x01\x4a"
+    elements = shape[0] * shape[1] * shape[2] * shape[3]
+    with open(file_name, "wb") as fd:
+        fd.write(header + bytes(4 * elements))
+    return elements * 4
+
+def run_client(transport, input_file):
+    command = f"{client_command} --transport {transport} --repeat {round_trips} inputs {unknown_model} {input_file}"
+    output = subprocess.run(command, shell=True, stdout=subprocess.PIPE, stderr=subprocess.DEVNULL)
+    for line in output.stdout.decode().splitlines():
+        if line.startswith("{"):
+            return json.loads(line)
+    print(f"Error: {command} failed.")
+    return None
+
+def compare():
+    os.chdir(f"{server_without_tls_path}/src")
+    server = subprocess.Popen(f"{server_without_tls_path}/src/./server", shell=True, stderr=subprocess.DEVNULL)
+    time.sleep(2)
+
+    rows = []
+    for shape in shapes:
+        input_file = f"/tmp/transport_input_{shape[2]}x{shape[3]}.pb"
+        input_bytes = write_input(shape, input_file)
+        baseline = None
+        for transport in transports:
+            result = run_client(transport, input_file)
+            if result is None:
+                continue
+            latency = result["latency_us"]
+            if transport == "tcp":
+                baseline = latency["p50"]
+            print(f"{input_bytes} bytes over {transport}: p50 {latency['p50']:.1f} us, p99 {latency['p99']:.1f} us")
+            rows.append({
+                'Input bytes': input_bytes,
+                'Request bytes': result["request_bytes"],
+                'Transport': transport,
+                'Round trips': result["repeat"],
+                'Mean (us)': f"{latency['mean']:.1f}",
+                'p50 (us)': f"{latency['p50']:.1f}",
+                'p99 (us)': f"{latency['p99']:.1f}",
+                'Speedup over TCP (p50)': f"{baseline / latency['p50']:.2f}" if baseline else "-"
+            })
+        os.remove(input_file)
+
+    subprocess.run(f"{client_command} quit", shell=True, stdout=subprocess.PIPE)
+    server.wait()
+    return rows
+
+def generate_csv(rows):
+    df = pd.DataFrame(rows)
+    if not os.path.exists("results/"):
+        os.mkdir("results")
+    df.to_csv(f'results/local_transports.csv', index=False)
+
+if __name__ == "__main__":
+    current_path = os.getcwd()
+
+    build()
+    rows = compare()
+
+    os.chdir(server_without_tls_path)
+    os.system("make clean")
+    os.chdir(f"{server_without_tls_path}/src")
+    os.system("make clean")
+    os.chdir(current_path)
+
+    generate_csv(rows)
@@ -0,0 +1,110 @@
+import os
+import sys
+import subprocess
+import time
+import pandas as pd
+
+if len(sys.argv) != 3:
+    print("Usage: python3 compare_model_registration.py <runs> <path_to_inferONNX>")
+    exit(1)
+
+try:
+    runs = int(sys.argv[1])
+except ValueError:
+    print("Usage: python3 compare_model_registration.py <runs> <path_to_inferONNX>")
+    exit(1)
+
+inferONNX_path = os.path.abspath(sys.argv[2])
+path_to_occlum = inferONNX_path + "/.."
+server_with_tls_path = inferONNX_path + "/src/server_with_tls"
+client_command = f"{server_with_tls_path}/./ssl_client"
+path = ["squeezenet1.0-7/", "mobilenetv2-7/", "resnet152-v2-7/"]
+model_names = ["SqueezeNet 1.0", "MobileNet V2", "ResNet152 V2"]
+# Registration threads only matter with AES, where every partition is encrypted
+configurations = [("AES", 1, 1), ("AES", 1, 2), ("AES", 1, 4), ("AES", 1, 8), ("No AES", 0, 1)]
+
+# The partitions are registered in place from the models directory of the repo
+def build(use_aes, threads):
+    os.chdir(f"{server_with_tls_path}/src")
+    command = f"make clean && make USE_AES={use_aes} USE_OCCLUM=0 USE_SYS_TIME=0 LOCAL_MODEL_ROOT={inferONNX_path}/models REGISTRATION_THREADS={threads} server"
+    print(f"Command: {command}")
+    output = subprocess.run(command, shell=True, stdout=subprocess.PIPE)
+    if output.returncode != 0:
+        print("Error: building the server failed.")
+        exit(1)
+
+def partitions_size(partitions_path):
+    return sum(os.path.getsize(f"{partitions_path}/{name}") for name in os.listdir(partitions_path))
+
+# One registration on a fresh server, the same partitions cannot be registered twice
+def register(method, model_path):
+    partitions_path = f"{model_path}partitions"
+    if method == "upload":
+        command = f"{client_command} models {model_path}test_data_set_0/input_0.pb {partitions_path}"
+    else:
+        command = f"{client_command} local {partitions_path}"
+
+    os.chdir(f"{path_to_occlum}/occlum_workspace/")
+    server = subprocess.Popen(f"{server_with_tls_path}/src/./server", shell=True, stderr=subprocess.DEVNULL)
+    time.sleep(2)
+
+    start = time.time()
+    output = subprocess.run(command, shell=True, stdout=subprocess.PIPE, stderr=subprocess.PIPE)
+    elapsed = (time.time() - start) * 1000
+
+    subprocess.run(f"{client_command} quit", shell=True, stdout=subprocess.PIPE)
+    server.wait()
+
+    if output.returncode != 0 or b"Message from server:" not in output.stderr:
+        print(f"Error: {command} failed.")
+        return None
+    return elapsed
+
+def compare(configuration, threads):
+    rows = []
+    for i in range(len(path)):
+        model_path = f"{inferONNX_path}/models/{path[i]}"
+        size = partitions_size(f"{model_path}partitions")
+        means = {}
+        for method in ["upload", "local"]:
+            times = [t for t in (register(method, model_path) for _ in range(runs)) if t is not None]
+            if not times:
+                continue
+            means[method] = sum(times) / len(times)
+            print(f"{model_names[i]} ({configuration}, {threads} threads): {method}, {means[method]:.2f} ms")
+            rows.append({
+                'Model': model_names[i],
+                'Configuration': configuration,
+                'Registration threads': threads,
+                'Method': method,
+                'Partition bytes': size,
+                'Runs': len(times),
+                'Mean registration (ms)': f"{means[method]:.2f}",
+                'Min registration (ms)': f"{min(times):.2f}",
+                'Speedup over upload': f"{means['upload'] / means[method]:.2f}" if "upload" in means else "-"
+            })
+    return rows
+
+def generate_csv(rows):
+    df = pd.DataFrame(rows)
+    if not os.path.exists("results/"):
+        os.mkdir("results")
+    df.to_csv(f'results/model_registration.csv', index=False)
+
+if __name__ == "__main__":
+    current_path = os.getcwd()
+
+    rows = []
+    for configuration, use_aes, threads in configurations:
+        os.chdir(server_with_tls_path)
+        os.system(f"make clean && make USE_AES={use_aes} USE_OCCLUM=0 USE_SYS_TIME=0")
+        build(use_aes, threads)
+        rows += compare(configuration, threads)
+
+    os.chdir(server_with_tls_path)
+    os.system("make clean")
+    os.chdir(f"{server_with_tls_path}/src")
+    os.system("make clean")
+    os.chdir(current_path)
+
+    generate_csv(rows)
@@ -0,0 +1,116 @@
+import os
+import sys
+import subprocess
+import threading
+import time
+import pandas as pd
+
+if len(sys.argv) != 3:
+    print("Usage: python3 compare_server_workers.py <requests_per_client> <path_to_inferONNX>")
+    exit(1)
+
+try:
+    requests_per_client = int(sys.argv[1])
+except ValueError:
+    print("Usage: python3 compare_server_workers.py <requests_per_client> <path_to_inferONNX>")
+    exit(1)
+
+inferONNX_path = os.path.abspath(sys.argv[2])
+path_to_occlum = inferONNX_path + "/.."
+server_with_tls_path = inferONNX_path + "/src/server_with_tls"
+client_command = f"{server_with_tls_path}/./ssl_client"
+worker_counts = [1, 2, 4, 8]
+num_clients = 8
+path = ["squeezenet1.0-7/", "mobilenetv2-7/"]
+model_names = ["SqueezeNet 1.0", "MobileNet V2"]
+
+def build(workers):
+    os.chdir(f"{server_with_tls_path}/src")
+    command = f"make clean && make USE_AES=0 USE_OCCLUM=0 USE_SYS_TIME=1 SERVER_WORKERS={workers} server"
+    print(f"Command: {command}")
+    output = subprocess.run(command, shell=True, stdout=subprocess.PIPE)
+    if output.returncode != 0:
+        print("Error: building the server failed.")
+        exit(1)
+
+# Every client sends its inference requests back to back, on a new connection each
+def client_side(input_file, latencies, lock):
+    for _ in range(requests_per_client):
+        start = time.time()
+        output = subprocess.run(f"{client_command} inputs 1 {input_file}", shell=True, stdout=subprocess.DEVNULL, stderr=subprocess.PIPE)
+        elapsed = (time.time() - start) * 1000
+        if output.returncode != 0 or b"Inference:" not in output.stderr:
+            print("Error: inference request failed.")
+            continue
+        with lock:
+            latencies.append(elapsed)
+
+def run_load(model_index, workers):
+    model_path = f"{inferONNX_path}/models/{path[model_index]}"
+    input_file = f"{model_path}test_data_set_0/input_0.pb"
+
+    os.chdir(f"{path_to_occlum}/occlum_workspace/")
+    server = subprocess.Popen(f"{server_with_tls_path}/src/./server", shell=True, stderr=subprocess.DEVNULL)
+    time.sleep(2)
+
+    subprocess.run(f"{client_command} models {input_file} {model_path}", shell=True, stdout=subprocess.PIPE)
+
+    latencies = []
+    lock = threading.Lock()
+    clients = [threading.Thread(target=client_side, args=(input_file, latencies, lock)) for _ in range(num_clients)]
+    start = time.time()
+    for client in clients:
+        client.start()
+    for client in clients:
+        client.join()
+    wall_time = time.time() - start
+
+    subprocess.run(f"{client_command} quit", shell=True, stdout=subprocess.PIPE)
+    server.wait()
+
+    throughput = len(latencies) / wall_time if wall_time > 0 else 0
+    mean_latency = sum(latencies) / len(latencies) if latencies else 0
+    print(f"{model_names[model_index]}: {workers} workers, {throughput:.2f} requests/s, {mean_latency:.2f} ms/request")
+    return throughput, mean_latency, len(latencies)
+
+def generate_throughput():
+    rows = []
+    for i in range(len(path)):
+        baseline = None
+        for workers in worker_counts:
+            build(workers)
+            throughput, mean_latency, completed = run_load(i, workers)
+            if baseline is None:
+                baseline = throughput
+            rows.append({
+                'Model': model_names[i],
+                'Workers': workers,
+                'Clients': num_clients,
+                'Requests': completed,
+                'Throughput (req/s)': f"{throughput:.2f}",
+                'Mean latency (ms)': f"{mean_latency:.2f}",
+                'Scaling': f"{throughput / baseline:.2f}" if baseline else "-"
+            })
+    return rows
+
+def generate_csv(rows):
+    df = pd.DataFrame(rows)
+    if not os.path.exists("results/"):
+        os.mkdir("results")
+    df.to_csv(f'results/server_workers.csv', index=False)
+
+if __name__ == "__main__":
+    current_path = os.getcwd()
+
+    os.chdir(server_with_tls_path)
+    os.system("make clean && make USE_AES=0 USE_OCCLUM=0 USE_SYS_TIME=0")
+
+    rows = generate_throughput()
+
+    os.chdir(server_with_tls_path)
+    os.system("make clean")
+    os.chdir(f"{server_with_tls_path}/src")
+    os.system("make clean")
+    os.chdir(current_path)
+
+    generate_csv(rows)
@@ -0,0 +1,122 @@
+import os
+import sys
+import json
+import subprocess
+import time
+import pandas as pd
+
+if len(sys.argv) != 3:
+    print("Usage: python3 measure_server_load.py <duration_s> <path_to_inferONNX>")
+    exit(1)
+
+try:
+    duration = float(sys.argv[1])
+except ValueError:
+    print("Usage: python3 measure_server_load.py <duration_s> <path_to_inferONNX>")
+    exit(1)
+
+inferONNX_path = os.path.abspath(sys.argv[2])
+path_to_occlum = inferONNX_path + "/.."
+server_with_tls_path = inferONNX_path + "/src/server_with_tls"
+client_command = f"{server_with_tls_path}/./ssl_client"
+# A kept-alive session holds a worker while it sends requests, the server
+# needs one worker per connection or the extra ones wait in its accept queue
+connections = 4
+concurrency_levels = [1, 2, 4, 8, 16]
+rate_fractions = [0.25, 0.5, 0.75, 0.9, 1.0]
+path = ["squeezenet1.0-7/", "mobilenetv2-7/"]
+model_names = ["SqueezeNet 1.0", "MobileNet V2"]
+
+def build():
+    os.chdir(f"{server_with_tls_path}/src")
+    command = f"make clean && make USE_AES=0 USE_OCCLUM=0 USE_SYS_TIME=1 SERVER_WORKERS={connections} server"
+    print(f"Command: {command}")
+    output = subprocess.run(command, shell=True, stdout=subprocess.PIPE)
+    if output.returncode != 0:
+        print("Error: building the server failed.")
+        exit(1)
+
+# One run of the load generator, its JSON line is the last line of stdout
+def run_load(options, input_file):
+    command = f"{client_command} --connections {connections} {options} --duration {duration} load 1 {input_file}"
+    output = subprocess.run(command, shell=True, stdout=subprocess.PIPE, stderr=subprocess.DEVNULL)
+    lines = output.stdout.decode().strip().splitlines()
+    if output.returncode != 0 or not lines:
+        print(f"Error: {command} failed.")
+        return None
+    return json.loads(lines[-1])
+
+def row(model_index, result):
+    latency = result["latency_ms"]
+    return {
+        'Model': model_names[model_index],
+        'Loop': result["loop"],
+        'Concurrency': result.get("concurrency", "-"),
+        'Target rate (req/s)': f"{result['target_rate']:.2f}" if "target_rate" in result else "-",
+        'Completed': result["completed"],
+        'Errors': result["errors"],
+        'Throughput (req/s)': f"{result['throughput_rps']:.2f}",
+        'p50 (ms)': f"{latency['p50']:.2f}",
+        'p90 (ms)': f"{latency['p90']:.2f}",
+        'p99 (ms)': f"{latency['p99']:.2f}",
+        'p99.9 (ms)': f"{latency['p99.9']:.2f}"
+    }
+
+# Closed loop first, its peak throughput sets the rates of the open loop
+def measure(model_index):
+    model_path = f"{inferONNX_path}/models/{path[model_index]}"
+    input_file = f"{model_path}test_data_set_0/input_0.pb"
+
+    os.chdir(f"{path_to_occlum}/occlum_workspace/")
+    server = subprocess.Popen(f"{server_with_tls_path}/src/./server", shell=True, stderr=subprocess.DEVNULL)
+    time.sleep(2)
+
+    subprocess.run(f"{client_command} models {input_file} {model_path}", shell=True, stdout=subprocess.PIPE)
+
+    rows = []
+    peak = 0
+    for concurrency in concurrency_levels:
+        result = run_load(f"--concurrency {concurrency}", input_file)
+        if result is None:
+            continue
+        peak = max(peak, result["throughput_rps"])
+        print(f"{model_names[model_index]}: concurrency {concurrency}, {result['throughput_rps']:.2f} requests/s, p99 {result['latency_ms']['p99']:.2f} ms")
+        rows.append(row(model_index, result))
+
+    for fraction in rate_fractions:
+        if peak == 0:
+            break
+        result = run_load(f"--inflight 4 --rate {peak * fraction:.3f}", input_file)
+        if result is None:
+            continue
+        print(f"{model_names[model_index]}: {result['target_rate']:.2f} requests/s offered, {result['throughput_rps']:.2f} served, p99 {result['latency_ms']['p99']:.2f} ms")
+        rows.append(row(model_index, result))
+
+    subprocess.run(f"{client_command} quit", shell=True, stdout=subprocess.PIPE)
+    server.wait()
+    return rows
+
+def generate_csv(rows):
+    df = pd.DataFrame(rows)
+    if not os.path.exists("results/"):
+        os.mkdir("results")
+    df.to_csv(f'results/server_load.csv', index=False)
+
+if __name__ == "__main__":
+    current_path = os.getcwd()
+
+    os.chdir(server_with_tls_path)
+    os.system("make clean && make USE_AES=0 USE_OCCLUM=0 USE_SYS_TIME=0")
+    build()
+
+    rows = []
+    for i in range(len(path)):
+        rows += measure(i)
+
+    os.chdir(server_with_tls_path)
+    os.system("make clean")
+    os.chdir(f"{server_with_tls_path}/src")
+    os.system("make clean")
+    os.chdir(current_path)
+
+    generate_csv(rows)
@@ -0,0 +1,15 @@
+#ifndef BATCHER_H
+#define BATCHER_H
+
+#include <definitions.h>
+
+// Dynamic batching of concurrent requests against one model: compatible
+// requests (same input shapes past the batch axis and, with USE_AES, the same
+// tags) are concatenated along the batch axis, the plan runs once and every
+// caller gets the argmax, and the top-k or tensors it asked for, of its own
+// rows back.
+model_batcher *create_model_batcher(const execution_plan *plan);
+double batcher_submit(model_batcher *batcher, TractValue **inputs, int num_inputs, plan_runner *runner, unsigned char **tags, int num_tags, request_result *result);
+void free_model_batcher(model_batcher *batcher);
+
+#endif // BATCHER_H
@@ -0,0 +1,33 @@
+#ifndef CHUNKED_GCM_H
+#define CHUNKED_GCM_H
+
+#include <definitions.h>
+
+// Chunked AES-GCM container. The plaintext is cut into chunks of chunk_bytes
+// (the last one shorter), each sealed on its own with a nonce derived from the
+// file IV and the chunk index, so chunks are authenticated and decrypted
+// independently, on as many threads as there are, while the rest of the file
+// is still being read. Every chunk authenticates the header and its index as
+// additional data, and the header carries a tag of its own, so the chunk size,
+// count and order are bound to the key: chunks cannot be dropped, reordered
+// or moved between files.
+//
+//   header: magic u32 | version u16 | reserved u16 | chunk_bytes u32 | num_chunks u32 | plain_size u64 | iv[12] | header_tag[16]
+//   chunk:  ciphertext | tag[16]
+//
+// Chunk i is sealed under the IV with i xored into its last 4 bytes, big
+// endian, and header | i (u32) | aad as additional data, header being the
+// fields in front of the header tag; the header tag is that of an empty chunk
+// of index CHUNKED_HEADER_INDEX. All fields are little endian.
+#define CHUNKED_MAGIC 0x43475849u      // "IXGC"
+#define CHUNKED_VERSION 1
+#define CHUNKED_FIELDS_BYTES 36        // the header without its tag
+#define CHUNKED_HEADER_BYTES (CHUNKED_FIELDS_BYTES + TAG_BYTES)
+#define CHUNKED_HEADER_INDEX 0xFFFFFFFFu
+
+bool chunked_seal(const char *path, const unsigned char *plain, size_t size, size_t chunk_bytes,
+                  const unsigned char *key, const unsigned char *aad, size_t aad_length);
+int chunked_open_memfd(const char *path, const unsigned char *key, const unsigned char *aad, size_t aad_length,
+                       int threads, size_t *size);
+
+#endif // CHUNKED_GCM_H
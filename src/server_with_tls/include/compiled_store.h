@@ -0,0 +1,20 @@
+#ifndef COMPILED_STORE_H
+#define COMPILED_STORE_H
+
+#include <definitions.h>
+#include <partition_buffer.h>
+
+// Compiled partitions live next to their ONNX file as `<partition>.nnef.tar`.
+// With USE_AES the tar is sealed with the model key in the chunked format of
+// chunked_gcm.h and the partition tag is used as additional data, so a
+// compiled partition only opens for requests presenting the same tag as the
+// ONNX one.
+#define COMPILED_SUFFIX ".nnef.tar"
+
+char *compiled_partition_path(const char *model_name);
+bool compile_partition(const char *model_name, TractInferenceModel **inference_model, const unsigned char *key, const unsigned char *tag,
+                       partition_buffer **compiled);
+TractRunnable *load_compiled_partition(const char *model_name, const unsigned char *key, const unsigned char *tag);
+TractRunnable *load_compiled_buffer(const char *model_name, const partition_buffer *buffer);
+
+#endif // COMPILED_STORE_H
@@ -0,0 +1,56 @@
+#ifndef CONTENT_STORE_H
+#define CONTENT_STORE_H
+
+#include <definitions.h>
+
+#define DIGEST_BYTES 32
+#define CONTENT_STORE_BUCKETS 4096
+
+// A partition file named by the SHA-256 of its plaintext. Models registering
+// the same bytes, such as variants sharing a backbone, share one entry: the
+// file is written, compiled, cached and prefetched once, and removed with the
+// last model referencing it, identical partitions of one model holding a
+// reference each. Digests are uniformly distributed, so their leading bytes
+// index the table directly.
+//
+// With USE_AES an entry is scoped to the keys its file is encrypted under and
+// goes by the digest of the plaintext digest and those keys, which it keeps.
+// Registrations get fresh keys, so only identical partitions of one model
+// share an entry; a model never runs bytes authenticated under another
+// model's keys, nor learns that another model registered them.
+typedef struct stored_partition
+{
+    unsigned char digest[DIGEST_BYTES];
+    char *path;                         // <models dir>/<hex digest>, or the source of an in-place registration
+    bool owned;                         // the store wrote the file and removes it
+    bool compiled;                      // a registration took charge of compiling it
+    int refs;
+#ifdef USE_AES
+    unsigned char key[KEY_BYTES];
+    unsigned char IV[IV_BYTES];
+    unsigned char AAD[ADD_DATA_BYTES];
+    unsigned char tag[TAG_BYTES];
+#endif
+    struct stored_partition *next;
+} stored_partition;
+
+int content_digest(const unsigned char *data, size_t size, unsigned char *digest);
+
+model_partitions *create_model_partitions(int count);
+
+// Registration: stage_partitions acquires the partitions whose digest is
+// already stored, none with USE_AES, and returns a fresh file to write each
+// of the others to (NULL for the acquired ones); commit_partitions moves the
+// written files under their digest and returns the paths the model goes by.
+// Without digests, as for a streamed upload, every partition is written.
+char **stage_partitions(model_partitions *partitions, const unsigned char *digests);
+char **commit_partitions(model_partitions *partitions, char **staged, const unsigned char *digests,
+                         encrypted_models_info *keys);
+void abort_staged_partitions(char **staged, int count);
+
+// In-place registration of files that stay where they are, never removed
+char **commit_sources(model_partitions *partitions, char **sources, const unsigned char *digests);
+
+bool claim_compilation(stored_partition *partition);
+
+#endif // CONTENT_STORE_H
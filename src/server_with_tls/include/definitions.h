@@ -1,3 +1,6 @@
+#ifndef DEFINITIONS_H
+#define DEFINITIONS_H
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -5,6 +8,7 @@
 #include <stdbool.h>
 #include <math.h>
 #include <stdint.h>
+#include <pthread.h>
 
 #if USE_SYS_TIME == 1 || USE_AES == 0
 #include <sys/time.h>
@@ -28,6 +32,117 @@
 #define HASH_MULTIPLIER 65599
 #define CAPACITY 3000
 
+// Byte budget for compiled partitions kept resident between requests
+// (defaults to the 85MB EPC figure used by the partitioner)
+#ifndef RUNNABLE_CACHE_BYTES
+#define RUNNABLE_CACHE_BYTES (85 * 1024 * 1024)
+#endif
+#define RUNNABLE_CACHE_BUCKETS 256
+
+// Request rates the runnable cache ranks partitions by halve every
+// RESIDENCY_HALF_LIFE_MS, so the resident set follows shifts in traffic
+#ifndef RESIDENCY_HALF_LIFE_MS
+#define RESIDENCY_HALF_LIFE_MS 10000
+#endif
+
+// Byte budget for decrypted compiled partitions kept in memory between
+// requests with USE_AES, loaded without unsealing them again
+#ifndef RESIDENT_BUFFER_BYTES
+#define RESIDENT_BUFFER_BYTES (64 * 1024 * 1024)
+#endif
+
+// Model uploads are received, encrypted and written this many bytes at a time,
+// the bound on the memory an upload takes whatever the model size
+#ifndef UPLOAD_CHUNK_BYTES
+#define UPLOAD_CHUNK_BYTES (1024 * 1024)
+#endif
+
+// Sealed compiled partitions are cut into chunks of SEAL_CHUNK_BYTES, which
+// up to DECRYPT_THREADS threads decrypt while the file is still being read
+#ifndef SEAL_CHUNK_BYTES
+#define SEAL_CHUNK_BYTES (1024 * 1024)
+#endif
+#ifndef DECRYPT_THREADS
+#define DECRYPT_THREADS 4
+#endif
+
+// Partitions of a registration encrypted and written at the same time
+#ifndef REGISTRATION_THREADS
+#define REGISTRATION_THREADS 4
+#endif
+
+// Models registered by server-local path must lie under this directory,
+// relative to $HOME unless it starts with a slash
+#ifndef LOCAL_MODEL_ROOT
+#define LOCAL_MODEL_ROOT "staged_models"
+#endif
+
+// Workers running independent partitions of one request, and how many
+// partitions may be loaded at the same time across them
+#ifndef PARALLEL_WORKERS
+#define PARALLEL_WORKERS 1
+#endif
+#ifndef MAX_RESIDENT_PARTITIONS
+#define MAX_RESIDENT_PARTITIONS 2
+#endif
+
+// Pipelined mode: number of stages (0 for one stage per partition) and the
+// requests that may wait in front of each stage
+#ifndef PIPELINE_STAGES
+#define PIPELINE_STAGES 0
+#endif
+#ifndef PIPELINE_QUEUE_DEPTH
+#define PIPELINE_QUEUE_DEPTH 4
+#endif
+
+// Dynamic batching: a batch closes after BATCH_WINDOW_US or once
+// BATCH_MAX_REQUESTS requests are waiting, whichever comes first
+#ifndef BATCH_WINDOW_US
+#define BATCH_WINDOW_US 2000
+#endif
+#ifndef BATCH_MAX_REQUESTS
+#define BATCH_MAX_REQUESTS 8
+#endif
+
+// TLS server: connections served concurrently, and accepted connections that
+// may wait for a free worker
+#ifndef SERVER_WORKERS
+#define SERVER_WORKERS 4
+#endif
+#define CONNECTION_QUEUE_DEPTH 64
+
+// Largest request body the TLS server buffers, larger ones end their session.
+// Version 2 model uploads are streamed and not bound by it.
+#ifndef MAX_REQUEST_BYTES
+#define MAX_REQUEST_BYTES 1073741824
+#endif
+#if MAX_REQUEST_BYTES > 2147483647
+#error "MAX_REQUEST_BYTES must fit in an int"
+#endif
+
+// Keep-alive: a session ends after KEEPALIVE_IDLE_MS without a request (0 for
+// no limit), idle reads wake up every IDLE_POLL_MS to notice a stopping server
+// or connections waiting for a worker
+#ifndef KEEPALIVE_IDLE_MS
+#define KEEPALIVE_IDLE_MS 30000
+#endif
+#define IDLE_POLL_MS 1000
+
+// What a MODEL_INPUT request gets back: the argmax text of the legacy server,
+// the k best categories of the last output with their scores, or every output
+// tensor of the last partition
+#define RESULT_ARGMAX 0
+#define RESULT_TOP_K 1
+#define RESULT_RAW 2
+
+// The argmax covers the first ARGMAX_SCORES scores of a row, the ImageNet
+// classes of the models the server reports on
+#define ARGMAX_SCORES 1000
+
+// An input tensor starts with its shape, 4 floats whose unused trailing
+// dimensions are 0, followed by its values
+#define INPUT_SHAPE_FLOATS 4
+
 typedef struct __attribute__((packed)) {
     int command;
     int id;
@@ -41,32 +156,46 @@ typedef struct __attribute__((packed)) {
     unsigned char **tags;
     int tokenizer_size;
     uint8_t *tokenizer; 
+    char *buffer;               // receive buffer: models, input, tags and tokenizer
+                                // point into it, it is freed with the request
+    int result_mode;            // RESULT_*, RESULT_ARGMAX for legacy requests
+    int top_k;
 } request;
 
 typedef struct encrypted_models_info
 {
-    unsigned char **encrypted_model;
     unsigned char key[KEY_BYTES];
     unsigned char IV[IV_BYTES];
     unsigned char AAD[ADD_DATA_BYTES];
     unsigned char **tag;
 } encrypted_models_info;
 
+struct request_result;
+
 typedef struct client_result
 {
     unsigned char *result;
     int size;
     unsigned char **tag;
+    struct request_result *output;  // top-k or raw tensors of a MODEL_INPUT, NULL otherwise
+    char *log;                      // timing lines of the request, appended to the inference_time file in one block
 } client_result;
 
+struct partition_loader;
+struct execution_context;
+struct plan_step;
+
+// Immutable once load_model_to_memory returns, per-request state lives in execution_context
 typedef struct operator_node {
-    #if USE_AES == 0 && USE_MEMORY_ONLY == 0 || USE_AES == 1 && USE_MEMORY_ONLY == 1
-        void (*run_inference)(struct operator_node **node, TractValue **input_values, TractInferenceModel *inference_model);
+    #if USE_MEMORY_ONLY == 1
+        void (*run_inference)(const struct plan_step *step, struct execution_context *ctx, TractRunnable *runnable);
     #elif USE_AES == 1
-        void (*run_inference)(struct operator_node **node, TractValue **input_values, struct EncryptionParameters *params);
+        void (*run_inference)(const struct plan_step *step, struct execution_context *ctx, struct EncryptionParameters *params, struct partition_loader *loader);
+    #else
+        void (*run_inference)(const struct plan_step *step, struct execution_context *ctx, struct partition_loader *loader);
     #endif
-    TractValue **outputs;
     char *model_name;
+    int index;
     int num_inputs;
     int num_outputs;
     int num_children;
@@ -74,29 +203,318 @@ typedef struct operator_node {
     struct operator_node **parents;
     struct operator_node **children;
     int *parent_output_indices;
+    int *output_consumers;      // children inputs reading each output, from parent_output_indices
+}operator_node;
+
+// Input slot of a planned step: output `output` of the node with index `producer`,
+// or every request input when `producer` is 0
+typedef struct plan_input
+{
+    int producer;
+    int output;
+} plan_input;
+
+typedef struct plan_step
+{
+    operator_node *node;
+    int num_inputs;
+    plan_input *inputs;
+    int num_producers;          // distinct steps that must complete first
+    int num_dependents;
+    int *dependents;            // step indices reading this step's outputs
+} plan_step;
+
+// Flat topological order built once at registration, requests only walk `steps`
+typedef struct execution_plan
+{
+    int num_steps;
+    plan_step *steps;
+    int result_index;
+} execution_plan;
+
+// Activations and result of one partition for a single request
+typedef struct node_state
+{
+    TractValue **outputs;
+    int num_outputs;
+    int *pending;               // consumers that have not run yet, the output is destroyed at 0
     double pred;
     int category;
-    double elapsedTime;
-}operator_node;
+    double elapsed_time;
+} node_state;
+
+// Everything a request writes while running a model, indexed by operator_node::index
+// (0 is the input node, whose outputs are the request inputs)
+typedef struct execution_context
+{
+    int num_nodes;
+    node_state *states;
+    size_t live_bytes;
+    size_t peak_bytes;
+    pthread_mutex_t lock;       // pending counts and byte accounting are shared between workers
+} execution_context;
+
+// Ready-queue executor of one request: a step is dispatched once every
+// producer has completed, at most max_running at a time
+typedef struct plan_scheduler
+{
+    const execution_plan *plan;
+    execution_context *ctx;
+    FILE *fd;
+    TractRunnable **runnables;
+    unsigned char **tags;
+    EncryptionParameters *params;
+    struct partition_loader *loader;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int *missing;               // producers still running per step, -1 once dispatched
+    int *ready;
+    int num_ready;
+    int frontier;               // lowest step not dispatched yet
+    int running;
+    int max_running;
+    int completed;
+    bool failed;
+    double *durations;          // wall time per step, loading included
+    double elapsed_time;        // sum of the partitions' run times
+} plan_scheduler;
+
+struct partition_buffer;
+
+// Decrypted compiled partitions of a model kept in memory, indexed like its
+// names; partitions without a buffer are loaded from disk
+typedef struct model_buffers
+{
+    struct partition_buffer **buffers;
+    int count;
+    void (*free_buffers)(struct model_buffers *buffers);
+} model_buffers;
+
+struct stored_partition;
+
+// Entries of the content store a model holds a reference to, indexed like its
+// names. release_partition drops one of them and is true when it was the
+// last reference; free_partitions drops those left.
+typedef struct model_partitions
+{
+    struct stored_partition **partitions;
+    int count;
+    bool (*release_partition)(struct model_partitions *partitions, int i);
+    void (*free_partitions)(struct model_partitions *partitions);
+} model_partitions;
 
 typedef struct model
 {
     char *id;
     int size;
-    char **names;
+    char **names;                       // paths of the partitions in the content store
     unsigned char key[KEY_BYTES];
     unsigned char IV[IV_BYTES];
     unsigned char AAD[ADD_DATA_BYTES];
-    TractInferenceModel **inference_models;
+    TractRunnable **runnables;
     operator_node *head;
+    execution_plan *plan;
+    struct model_pipeline *pipeline;
+    struct model_batcher *batcher;
+    model_buffers *buffers;
+    model_partitions *partitions;
     struct model *next;
 } model;
 
+// Everything besides the context that a request needs to run its model
+typedef struct plan_runner
+{
+    model *m;
+    FILE *fd;
+    unsigned char **tags;
+    EncryptionParameters *params;
+    struct partition_loader *loader;
+    double (*run)(execution_context *ctx, struct plan_runner *runner);
+} plan_runner;
+
+// Output tensor of the last partition, data holds size bytes in row-major order
+typedef struct output_tensor
+{
+    DatumType datum_type;
+    uintptr_t rank;
+    uintptr_t *shape;
+    size_t size;
+    void *data;
+} output_tensor;
+
+// Result of the last partition for one request. mode and k are set by the
+// caller; the argmax is always filled in, the top-k or the tensors as asked.
+typedef struct request_result
+{
+    int mode;
+    int k;
+    double pred;
+    int category;
+    int num_top;                // best first
+    int *top_categories;
+    float *top_scores;
+    int num_tensors;
+    output_tensor *tensors;
+    size_t peak_bytes;
+    int batch_size;
+    char *log;                  // timing lines of the run, handed over to the client_result
+} request_result;
+
+// Request waiting in a batcher, owned by the submitting thread
+typedef struct batch_request
+{
+    TractValue **inputs;
+    int num_inputs;
+    unsigned char **tags;
+    int num_tags;
+    plan_runner *runner;
+    request_result *result;
+    double elapsed_time;
+    bool done;
+    struct batch_request *next;
+} batch_request;
+
+// Per-model batching layer, the first waiting request leads the next batch
+typedef struct model_batcher
+{
+    const execution_plan *plan;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    batch_request *head;
+    batch_request *tail;
+    int num_pending;
+    bool leader_active;
+    bool fixed_batch;                   // a batch failed where its requests ran alone, the model takes one at a time
+    unsigned long batches;
+    unsigned long batched_requests;
+    void (*free_batcher)(struct model_batcher *batcher);
+} model_batcher;
+
+// Request travelling through the stages of a pipeline, the submitter waits on it
+typedef struct pipeline_job
+{
+    execution_context *ctx;
+    bool done;
+    bool failed;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} pipeline_job;
+
+// Bounded FIFO in front of a stage
+typedef struct pipeline_queue
+{
+    pipeline_job **jobs;
+    int capacity;
+    int head;
+    int count;
+    bool closed;
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+} pipeline_queue;
+
+// Contiguous steps [first_step, last_step) of the plan run by one thread
+typedef struct pipeline_stage
+{
+    struct model_pipeline *pipeline;
+    int first_step;
+    int last_step;
+    pipeline_queue *in;
+    pipeline_queue *out;                // NULL for the last stage
+    pthread_t thread;
+    unsigned long jobs;
+    double busy_time;
+} pipeline_stage;
+
+// Per-model pipeline, every stage keeps the runnables of its partitions resident
+typedef struct model_pipeline
+{
+    const execution_plan *plan;
+    TractRunnable **runnables;          // indexed by operator_node::index
+    int num_runnables;
+    bool owns_runnables;
+    unsigned char **tags;               // tags the resident partitions were authenticated with
+    int num_stages;
+    pipeline_stage *stages;
+    pipeline_queue *queues;
+    pthread_mutex_t stats_lock;
+    void (*free_pipeline)(struct model_pipeline *pipeline);
+} model_pipeline;
+
+// Measured costs of a partition, kept while it is not resident so the cache
+// can tell which partitions are worth the bytes they would take
+typedef struct residency_stats
+{
+    char *name;
+    size_t size;
+    double load_ms;                     // time a request waited for the partition to load, averaged over misses
+    double run_ms;                      // time the partition ran, averaged
+    double rate;                        // requests, decayed with RESIDENCY_HALF_LIFE_MS
+    double updated_ms;                  // when rate was last decayed
+    bool resident;
+    struct residency_stats *next;
+} residency_stats;
+
+// Cache of runnables keyed by partition path, shared by the models using the
+// partition. Within the budget it keeps the partitions saving the most load
+// time per resident byte, the others are loaded from disk on every request.
+typedef struct runnable_entry
+{
+    char *name;
+    unsigned char tag[TAG_BYTES * 2];
+    bool has_tag;
+    TractRunnable *runnable;
+    size_t size;
+    residency_stats *stats;
+    struct runnable_entry *next;
+    struct runnable_entry *lru_prev;
+    struct runnable_entry *lru_next;
+} runnable_entry;
+
+typedef struct runnable_cache
+{
+    size_t budget;
+    size_t bytes;
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long evictions;
+    unsigned long rejections;           // misses left on disk, worth less than what they would evict
+    runnable_entry **entries;
+    residency_stats **stats;
+    runnable_entry *lru_head;
+    runnable_entry *lru_tail;
+    pthread_mutex_t lock;
+} runnable_cache;
+
+// Partition loaded by a background thread while the previous one runs
+typedef struct prefetch_slot
+{
+    pthread_t thread;
+    bool active;
+    char *model_name;
+    unsigned char tag[TAG_BYTES * 2];
+    bool has_tag;
+    TractRunnable *runnable;
+} prefetch_slot;
+
+// Per-inference state used to obtain the runnable of each partition
+typedef struct partition_loader
+{
+    runnable_cache *cache;
+    const model_buffers *buffers;
+    const model_partitions *partitions;
+    char **names;
+    EncryptionParameters *params;
+    prefetch_slot prefetch;
+} partition_loader;
+
 typedef struct onnx_table
 {
     int count;
     model **model;
     unsigned int top;
+    runnable_cache *cache;
+    pthread_rwlock_t lock;      // lookups from the server workers, exclusive for insert/remove
 } onnx_table;
 
 typedef struct {
@@ -105,4 +523,6 @@ typedef struct {
     char **input_names;
     int output_names_length;
     char **output_names;
-}operator_io;
\ No newline at end of file
+}operator_io;
+
+#endif // DEFINITIONS_H
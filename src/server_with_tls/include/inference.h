@@ -23,16 +23,22 @@
 } while (0)
 
 #if USE_AES
-    void load_model_to_memory(model **m, unsigned char **tags, int count_tags);
+    int load_model_to_memory(model **m, unsigned char **tags, int count_tags);
     #if USE_MEMORY_ONLY
-        void run_inference(operator_node **node, TractValue **input_values, TractInferenceModel *inference_model);
-        char *inference_memory_only(float **images, int num_images, model *m);
+        void run_inference(const plan_step *step, execution_context *ctx, TractRunnable *runnable);
+        char *inference_memory_only(float **images, int *size_images, int num_images, model *m, request_result *result);
     #else
-        void run_inference(operator_node **node, TractValue **input_values, struct EncryptionParameters *params);
-        char *inference_aes(float **images, int num_images, uint8_t *tokenizer, int tokenizer_size, model *m, unsigned char **tags, int count_tags);
+        void run_inference(const plan_step *step, execution_context *ctx, struct EncryptionParameters *params, partition_loader *loader);
+        char *inference_aes(float **images, int *size_images, int num_images, uint8_t *tokenizer, int tokenizer_size, model *m, unsigned char **tags, int count_tags, runnable_cache *cache, request_result *result);
     #endif
 #else
-    void run_inference(operator_node **node, TractValue **input_values, TractInferenceModel *inference_model);
-    char *inference_no_aes(float **images, int num_images, uint8_t *tokenizer, int tokenizer_size, model *m);
-    void load_model_to_memory(model **m);
-#endif
\ No newline at end of file
+    void run_inference(const plan_step *step, execution_context *ctx, partition_loader *loader);
+    char *inference_no_aes(float **images, int *size_images, int num_images, uint8_t *tokenizer, int tokenizer_size, model *m, runnable_cache *cache, request_result *result);
+    int load_model_to_memory(model **m);
+#endif
+
+#ifdef USE_PIPELINE
+void start_model_pipeline(model *m, unsigned char **tags);
+#endif
+void run_step_on_state(const plan_step *step, execution_context *ctx, TractState *state);
+double execute_plan(const execution_plan *plan, execution_context *ctx, FILE *fd, TractRunnable **runnables, unsigned char **tags, EncryptionParameters *params, partition_loader *loader);
\ No newline at end of file
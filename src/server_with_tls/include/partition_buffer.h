@@ -0,0 +1,27 @@
+#ifndef PARTITION_BUFFER_H
+#define PARTITION_BUFFER_H
+
+#include <definitions.h>
+
+// A decrypted compiled partition kept in memory, an anonymous file holding
+// the plaintext compile_partition sealed. tract only loads models by path,
+// it opens the file as /proc/self/fd/<fd>, so a load skips reading and
+// unsealing the sealed file.
+typedef struct partition_buffer
+{
+    int fd;
+    size_t size;
+    unsigned char tag[TAG_BYTES * 2];   // the tag the contents were authenticated with
+    char path[32];
+} partition_buffer;
+
+partition_buffer *partition_buffer_adopt(int fd, size_t size);
+void partition_buffer_free(partition_buffer *b);
+
+// Kept buffers share one budget of RESIDENT_BUFFER_BYTES across models
+bool partition_buffer_reserve(size_t size);
+void partition_buffer_unreserve(size_t size);
+
+model_buffers *create_model_buffers(int count);
+
+#endif // PARTITION_BUFFER_H
@@ -0,0 +1,14 @@
+#ifndef PIPELINE_H
+#define PIPELINE_H
+
+#include <definitions.h>
+
+// Pipelined execution across requests: the plan is cut into contiguous
+// stages, each one run by its own thread on resident runnables, so request
+// k+1 can run the first stage while request k runs the next one.
+model_pipeline *create_model_pipeline(const execution_plan *plan, TractRunnable **runnables, int num_runnables, bool owns_runnables, unsigned char **tags);
+double pipeline_run(model_pipeline *pipeline, execution_context *ctx, unsigned char **tags);
+void print_model_pipeline(model_pipeline *pipeline);
+void free_model_pipeline(model_pipeline *pipeline);
+
+#endif // PIPELINE_H
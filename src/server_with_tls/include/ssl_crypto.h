@@ -15,6 +15,11 @@
 #if defined(MBEDTLS_SSL_CACHE_C)
 #include <mbedtls/ssl_cache.h>
 #endif
+#if defined(MBEDTLS_SSL_TICKET_C)
+#include <mbedtls/ssl_ticket.h>
+#endif
+
+#include <definitions.h>
 
 #define HTTP_RESPONSE \
     "HTTP/1.0 200 OK\r\nContent-Type: text/html\r\n\r\n" \
@@ -23,6 +28,53 @@
 
 #define DEBUG_LEVEL 0
 
+// Resumption: sessions kept by id for reconnecting clients, and how long a
+// stateless ticket stays valid
+#define SESSION_CACHE_ENTRIES 1024
+#define TICKET_LIFETIME_S 86400
+
+// Shared by the acceptor and the workers. The mbedtls build has no
+// MBEDTLS_THREADING_C, the DRBG and the session cache are locked here.
+typedef struct tls_server
+{
+    mbedtls_ssl_config *conf;                   // read-only once the workers run
+    mbedtls_x509_crt *srvcert;
+    mbedtls_net_context *listen_fd;
+    onnx_table *table;
+    mbedtls_ctr_drbg_context *ctr_drbg;
+    pthread_mutex_t rng_lock;
+#if defined(MBEDTLS_SSL_CACHE_C)
+    mbedtls_ssl_cache_context *cache;
+    pthread_mutex_t cache_lock;
+    unsigned long resumed_by_id;
+#endif
+#if defined(MBEDTLS_SSL_TICKET_C)
+    mbedtls_ssl_ticket_context *ticket;         // keys rotate inside the write callback
+    pthread_mutex_t ticket_lock;
+    unsigned long resumed_by_ticket;
+#endif
+    pthread_mutex_t log_lock;                   // one timing block at a time in the inference_time files
+    // Accepted sockets waiting for a worker
+    int connections[CONNECTION_QUEUE_DEPTH];
+    int head;
+    int count;
+    bool stopping;
+    int exit_code;
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+} tls_server;
+
+typedef struct tls_worker
+{
+    tls_server *server;
+    int id;
+    pthread_t thread;
+    mbedtls_ssl_context ssl;                    // own record state, set up on the shared config
+    mbedtls_pk_context pkey;                    // RSA blinding state changes on every signature
+    unsigned long connections;
+} tls_worker;
+
 void debug_ssl(void *ctx, int level, const char *file, int line, const char *str);
 
 #endif // CRYPTO_H
\ No newline at end of file
@@ -10,8 +10,6 @@ void resize_table(onnx_table *table, int index, model *m);
 
 bool contains_key(onnx_table *table, char *id);
 
-char *find_duplicate_names_from_id(onnx_table *table, char **names);
-
 model *get_model(onnx_table *table, char *id);
 
 int remove_model_from_table(onnx_table *table, char *id);
@@ -20,12 +18,32 @@ void free_inference_model(TractInferenceModel *inference_model);
 
 void free_inference_models(TractInferenceModel **inference_models, int length);
 
+void free_runnables(TractRunnable **runnables, int length);
+
 void deallocate_model(model *current);
 
 void free_onnx_table(onnx_table* table);
 
 void print_table(onnx_table *table);
 
+runnable_cache *init_runnable_cache(size_t budget);
+
+TractState *runnable_cache_spawn_state(runnable_cache *cache, const char *name, const unsigned char *tag);
+
+bool runnable_cache_contains(runnable_cache *cache, const char *name, const unsigned char *tag);
+
+bool runnable_cache_put(runnable_cache *cache, const char *name, const unsigned char *tag, TractRunnable *runnable, size_t size, double load_ms);
+
+void runnable_cache_record_run(runnable_cache *cache, const char *name, double run_ms);
+
+void runnable_cache_remove(runnable_cache *cache, const char *name);
+
+void runnable_cache_counts(runnable_cache *cache, unsigned long *hits, unsigned long *misses);
+
+void free_runnable_cache(runnable_cache *cache);
+
+void print_runnable_cache(runnable_cache *cache);
+
 operator_io **init_operator_io(int length);
 
 void resize_operators_io(operator_io ***io, int length, int index);
@@ -44,7 +62,7 @@ void insert_parent_to_operator_node(operator_node *parent, operator_node *child)
 
 void insert_child_to_operator_node(operator_node *parent, operator_node *child);
 
-void update_node(operator_io **io, int id, operator_node *head);
+void update_node(operator_io **io, int id, operator_node **nodes);
 
 bool is_node_visited(operator_node *node, char **visited_nodes, int visited_count);
 
@@ -52,4 +70,26 @@ operator_node *search_operator_node_by_name(operator_node *node, const char *tar
 
 void free_operator_node(operator_node *node, char **visited_nodes, int *visited_count);
 
+execution_plan *build_execution_plan(operator_node **nodes, int num_nodes);
+
+void free_execution_plan(execution_plan *plan);
+
+size_t datum_size(DatumType datum_type);
+
+int row_argmax(const float *row, uintptr_t length, float *max);
+
+execution_context *init_execution_context(int num_nodes, TractValue **input_values);
+
+void retain_node_outputs(execution_context *ctx, const operator_node *node, TractValue **outputs);
+
+void release_activations(execution_context *ctx, const plan_step *step);
+
+void free_node_outputs(node_state *state);
+
+void free_execution_context(execution_context *ctx);
+
+bool collect_request_result(const execution_plan *plan, execution_context *ctx, uintptr_t first_row, uintptr_t rows, request_result *result);
+
+void free_request_result(request_result *result);
+
 void print_operator_node(operator_node *node, char **visited_nodes, int *visited_count);
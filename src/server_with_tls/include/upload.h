@@ -0,0 +1,78 @@
+#ifndef UPLOAD_H
+#define UPLOAD_H
+
+#include <definitions.h>
+#include <wire.h>
+
+// Writes a partition to disk as it arrives. With USE_AES every chunk is
+// encrypted with AES-GCM under the model key, IV and AAD, so the file is the
+// same as a one-shot encryption and the tag comes out of the close; nothing
+// larger than UPLOAD_CHUNK_BYTES is held.
+typedef struct partition_writer
+{
+    FILE *fd;
+    const char *path;
+#ifdef USE_AES
+    mbedtls_gcm_context gcm;
+    unsigned char *out;
+#endif
+    size_t written;
+} partition_writer;
+
+int partition_writer_open(partition_writer *w, const char *path, const encrypted_models_info *keys);
+int partition_writer_write(partition_writer *w, const unsigned char *data, size_t length);
+int partition_writer_close(partition_writer *w, unsigned char *tag);
+void partition_writer_abort(partition_writer *w);
+
+// Writes buffered partitions on up to REGISTRATION_THREADS threads
+int write_partitions(char **paths, unsigned char **models, const int *size_models, int count,
+                     encrypted_models_info *keys);
+
+// Reads exactly length bytes of the request body, 0 or an error
+typedef int (*upload_read_fn)(void *ctx, unsigned char *buf, size_t length);
+
+// Body of a version 2 MODEL request read off the session section by section.
+// The names come first and are kept; upload_read_names stops in front of the
+// first partition so the caller can choose paths and keys, then
+// upload_write_partitions streams every partition to its writer. Inputs and
+// unknown sections are read and dropped.
+typedef struct model_upload
+{
+    upload_read_fn read;
+    void *ctx;
+    uint64_t remaining;         // body bytes not read yet
+    wire_section next;          // section whose header was read
+    bool pending;               // next is set and its payload not read yet
+    char **names;               // NULL-terminated
+    int num_names;
+    int num_models;
+    int num_inputs;
+    unsigned char *chunk;
+    int error;                  // read error, the session cannot go on
+} model_upload;
+
+int upload_init(model_upload *u, const wire_header *header, upload_read_fn read, void *ctx);
+int upload_read_names(model_upload *u);
+int upload_write_partitions(model_upload *u, char **paths, encrypted_models_info *keys, unsigned char *digests);
+int upload_drain(model_upload *u);
+void upload_free(model_upload *u);
+
+// Body of a version 2 MODEL_LOCAL request: partitions already on the server's
+// host, named by path under LOCAL_MODEL_ROOT. A directory stands for the
+// files in it, in version order, the order the client uploads a directory in.
+// Every partition needs the SHA-256 the client expects, matched by file name,
+// and is only registered if the file has that digest.
+typedef struct local_model
+{
+    char **sources;             // resolved paths, NULL-terminated
+    char **names;               // file names, NULL-terminated
+    const unsigned char **digests;
+    int num_partitions;
+} local_model;
+
+int local_model_read(local_model *l, const unsigned char *body, size_t body_length);
+int local_model_write(local_model *l, char **paths, encrypted_models_info *keys);
+int local_model_verify(local_model *l);
+void local_model_free(local_model *l);
+
+#endif // UPLOAD_H
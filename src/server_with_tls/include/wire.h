@@ -0,0 +1,103 @@
+#ifndef WIRE_H
+#define WIRE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Binary wire protocol, version 2. Every message is a fixed little-endian
+// header followed by body_length bytes of sections; a section is a type, a
+// reserved field and an explicit length, followed by its payload. Readers skip
+// section types they do not know, so a version only bumps for changes to the
+// header. Messages are parsed in one pass: the header gives the body length
+// and every section gives its own, nothing is NUL-terminated. Payloads are
+// zero-padded to WIRE_ALIGN bytes, so tensors in a body read into an aligned
+// buffer can be used in place.
+//
+//   header:  magic u32 | version u16 | command u16 | flags u32 | request_id u32 | body_length u64
+//   section: type u16 | reserved u16 | length u32 | payload | padding
+//
+// Responses echo the command and request id of their request, so a client may
+// pipeline requests on a session and match the answers.
+#define WIRE_MAGIC 0x584E4F49u         // "IONX"
+#define WIRE_VERSION 2
+#define WIRE_HEADER_BYTES 24
+#define WIRE_SECTION_BYTES 8
+#define WIRE_ALIGN 8
+
+// Commands, same numbering as the legacy request
+#define WIRE_CMD_MODEL 0
+#define WIRE_CMD_MODEL_INPUT 1
+#define WIRE_CMD_QUIT 2
+#define WIRE_CMD_MODEL_LOCAL 3         // version 2 only: MODEL from files on the server's host
+
+// Result modes of a MODEL_INPUT, same numbering as RESULT_* of the server
+#define WIRE_RESULT_ARGMAX 0
+#define WIRE_RESULT_TOP_K 1
+#define WIRE_RESULT_RAW 2
+
+// Header flags
+#define WIRE_FLAG_RESPONSE 0x1
+#define WIRE_FLAG_ERROR 0x2
+
+// Section types
+#define WIRE_SECTION_NAME 1            // request: partition name, no NUL
+#define WIRE_SECTION_MODEL 2           // request: partition bytes, in the order of the names
+#define WIRE_SECTION_INPUT 3           // request: float32 input tensor
+#define WIRE_SECTION_TAG 4             // request: hex tag of a partition; response: raw tag
+#define WIRE_SECTION_TOKENIZER 5       // request: tokenizer bytes
+#define WIRE_SECTION_MODEL_ID 6        // request: i32 id of a registered model
+#define WIRE_SECTION_RESULT 7          // response: text result
+#define WIRE_SECTION_TENSOR 8          // response: output tensor, see below
+#define WIRE_SECTION_ERROR 9           // response: text error
+#define WIRE_SECTION_RESULT_MODE 10    // request: mode u32 | k u32, the argmax text without it
+#define WIRE_SECTION_TOP_K 11          // response: category i32 | score f32 per entry, best first
+#define WIRE_SECTION_LOCAL_PATH 12     // request: server path of a partition, or of a directory of them
+#define WIRE_SECTION_DIGEST 13         // request: SHA-256 of a partition | its file name, no NUL
+#define WIRE_DIGEST_BYTES 32
+
+// Payload of a tensor section: the tract datum type code, the rank and the
+// dimensions, then the elements in row-major order
+//
+//   tensor:  datum_type u32 | rank u32 | dim u64 * rank | data
+#define WIRE_MAX_RANK 8
+
+typedef struct wire_header {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t command;
+    uint32_t flags;
+    uint32_t request_id;
+    uint64_t body_length;
+} wire_header;
+
+typedef struct wire_section {
+    uint16_t type;
+    uint32_t length;
+    const unsigned char *data;
+} wire_section;
+
+typedef struct wire_tensor {
+    uint32_t datum_type;
+    uint32_t rank;
+    uint64_t shape[WIRE_MAX_RANK];
+    const unsigned char *data;
+    size_t size;
+} wire_tensor;
+
+void wire_init_header(wire_header *header, uint16_t command, uint32_t flags, uint32_t request_id);
+void wire_encode_header(const wire_header *header, unsigned char *out);
+bool wire_has_magic(const unsigned char *in, size_t length);
+int wire_decode_header(const unsigned char *in, size_t length, wire_header *header);
+size_t wire_section_size(size_t length);
+unsigned char *wire_put_section(unsigned char *out, uint16_t type, const void *data, uint32_t length);
+void wire_decode_section(const unsigned char *in, wire_section *section);
+int wire_next_section(const unsigned char *body, size_t body_length, size_t *offset, wire_section *section);
+size_t wire_tensor_size(uint32_t rank, size_t size);
+unsigned char *wire_put_tensor(unsigned char *out, uint32_t datum_type, uint32_t rank, const uintptr_t *shape, const void *data, size_t size);
+int wire_read_tensor(const wire_section *section, wire_tensor *tensor);
+unsigned char *wire_put_top_k(unsigned char *out, int count, const int *categories, const float *scores);
+int wire_top_k_count(const wire_section *section);
+void wire_top_k_entry(const wire_section *section, int i, int32_t *category, float *score);
+
+#endif // WIRE_H
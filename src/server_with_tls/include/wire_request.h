@@ -0,0 +1,15 @@
+#ifndef WIRE_REQUEST_H
+#define WIRE_REQUEST_H
+
+#include <definitions.h>
+#include <wire.h>
+
+// Server side of the version 2 protocol: the sections of a request body fill
+// the same request struct as the legacy deserializer, with views into the body
+// that the request takes over on success, and a client_result is sent back as
+// a result section plus one raw section per tag, then the top-k or tensor
+// sections of its output.
+int deserialize_wire_request(const wire_header *header, unsigned char *body, size_t body_length, request *req);
+unsigned char *encode_wire_response(const wire_header *request_header, const client_result *c_l, size_t *length);
+
+#endif // WIRE_REQUEST_H
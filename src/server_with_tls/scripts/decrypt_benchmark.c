@@ -0,0 +1,229 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/time.h>
+#include <sys/mman.h>
+#include <dirent.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <chunked_gcm.h>
+
+// Decrypt thread counts measured for the chunked format
+static const int thread_counts[] = {1, 2, 4, 8};
+#define NUM_THREAD_COUNTS (int)(sizeof(thread_counts) / sizeof(thread_counts[0]))
+
+double
+elapsed_ms(struct timeval *t1, struct timeval *t2)
+{
+    double elapsed_time = (t2->tv_sec - t1->tv_sec) * 1000.0;      // sec to ms
+    elapsed_time += (t2->tv_usec - t1->tv_usec) / 1000.0;          // us to ms
+    return elapsed_time;
+}
+
+unsigned char *
+read_file(const char *path, size_t *size)
+{
+    FILE *fd = fopen(path, "rb");
+    if (!fd) return NULL;
+    fseek(fd, 0, SEEK_END);
+    long length = ftell(fd);
+    rewind(fd);
+
+    unsigned char *buffer = (unsigned char *)malloc(length > 0 ? (size_t)length : 1);
+    if (buffer && fread(buffer, 1, length, fd) != (size_t)length) {
+        free(buffer);
+        buffer = NULL;
+    }
+    fclose(fd);
+    *size = (size_t)length;
+    return buffer;
+}
+
+// Former sealed format: IV | TAG | ciphertext, one GCM stream over the whole file
+int
+seal_single(const char *path, const unsigned char *plain, size_t size, const unsigned char *key, const unsigned char *aad)
+{
+    mbedtls_gcm_context gcm;
+    unsigned char *sealed = (unsigned char *)malloc(IV_BYTES + TAG_BYTES + size);
+    if (!sealed) return -1;
+    for (int i = 0; i < IV_BYTES; i++) sealed[i] = rand() & 0xff;
+
+    mbedtls_gcm_init(&gcm);
+    int ret = mbedtls_gcm_setkey(&gcm, MBEDTLS_CIPHER_ID_AES, key, KEY_BITS);
+    if (ret == 0) {
+        ret = mbedtls_gcm_crypt_and_tag(&gcm, MBEDTLS_GCM_ENCRYPT, size, sealed, IV_BYTES, aad, TAG_BYTES * 2,
+                                        plain, sealed + IV_BYTES + TAG_BYTES, TAG_BYTES, sealed + IV_BYTES);
+    }
+    mbedtls_gcm_free(&gcm);
+
+    FILE *fd = fopen(path, "wb");
+    if (ret != 0 || !fd || fwrite(sealed, 1, IV_BYTES + TAG_BYTES + size, fd) != IV_BYTES + TAG_BYTES + size) ret = -1;
+    if (fd) fclose(fd);
+    free(sealed);
+    return ret;
+}
+
+// Former open path: read the whole file, decrypt it on one core, copy the
+// plaintext into an in-memory file
+int
+open_single(const char *path, const unsigned char *key, const unsigned char *aad)
+{
+    mbedtls_gcm_context gcm;
+    size_t size = 0;
+    unsigned char *sealed = read_file(path, &size);
+    if (!sealed || size < IV_BYTES + TAG_BYTES) {
+        free(sealed);
+        return -1;
+    }
+    size -= IV_BYTES + TAG_BYTES;
+    unsigned char *plain = (unsigned char *)malloc(size > 0 ? size : 1);
+
+    mbedtls_gcm_init(&gcm);
+    int ret = plain ? mbedtls_gcm_setkey(&gcm, MBEDTLS_CIPHER_ID_AES, key, KEY_BITS) : -1;
+    if (ret == 0) {
+        ret = mbedtls_gcm_auth_decrypt(&gcm, size, sealed, IV_BYTES, aad, TAG_BYTES * 2,
+                                       sealed + IV_BYTES, TAG_BYTES, sealed + IV_BYTES + TAG_BYTES, plain);
+    }
+    mbedtls_gcm_free(&gcm);
+    free(sealed);
+
+    int memfd = -1;
+    if (ret == 0) {
+        memfd = memfd_create("sealed_partition", MFD_CLOEXEC);
+        if (memfd >= 0 && write(memfd, plain, size) != (ssize_t)size) {
+            close(memfd);
+            memfd = -1;
+        }
+    }
+    free(plain);
+    return memfd;
+}
+
+int
+is_partition(const char *dir_path, const char *name)
+{
+    struct stat st;
+    char full_path[1024];
+
+    snprintf(full_path, sizeof(full_path), "%s/%s", dir_path, name);
+    if (stat(full_path, &st) != 0) return 0;
+
+    size_t length = strlen(name);
+    return S_ISREG(st.st_mode) && length > 5 && strcmp(name + length - 5, ".onnx") == 0;
+}
+
+int
+main(int argc, char **argv)
+{
+    struct timeval t1, t2;
+    unsigned char key[KEY_BYTES], aad[TAG_BYTES * 2];
+
+    if (argc < 2) {
+        fprintf(stderr, "Usage: %s <path_to_dir> [runs] [chunk_bytes]\n", argv[0]);
+        return 1;
+    }
+
+    const char *path = argv[1];
+    int runs = argc > 2 ? atoi(argv[2]) : 10;
+    if (runs <= 0) runs = 1;
+    long chunk_bytes = argc > 3 ? atol(argv[3]) : SEAL_CHUNK_BYTES;
+    if (chunk_bytes <= 0) chunk_bytes = SEAL_CHUNK_BYTES;
+
+    srand(time(NULL));
+    for (int i = 0; i < KEY_BYTES; i++) key[i] = rand() & 0xff;
+    for (int i = 0; i < TAG_BYTES * 2; i++) aad[i] = "0123456789abcdef"[rand() & 0xf];
+
+    char tmp_dir[] = "/tmp/decrypt_benchmark_XXXXXX";
+    if (!mkdtemp(tmp_dir)) {
+        perror("mkdtemp");
+        return 1;
+    }
+
+    struct dirent **namelist;
+    int num_entries = scandir(path, &namelist, NULL, alphasort);
+    if (num_entries == -1) {
+        perror("scandir");
+        return 1;
+    }
+
+    // Files are opened from the page cache after the first run, the times are
+    // those of reading, authenticating and staging the plaintext in memory
+    double total_single = 0.0, total_chunked[NUM_THREAD_COUNTS] = {0.0};
+    size_t total_bytes = 0;
+    printf("partition,bytes,single_ms");
+    for (int t = 0; t < NUM_THREAD_COUNTS; t++) printf(",chunked_%d_ms", thread_counts[t]);
+    printf("\n");
+
+    for (int i = 0; i < num_entries; i++) {
+        if (!is_partition(path, namelist[i]->d_name)) {
+            free(namelist[i]);
+            continue;
+        }
+
+        char partition[1024], single[1024], chunked[1024];
+        snprintf(partition, sizeof(partition), "%s/%s", path, namelist[i]->d_name);
+        snprintf(single, sizeof(single), "%s/%s.single", tmp_dir, namelist[i]->d_name);
+        snprintf(chunked, sizeof(chunked), "%s/%s.chunked", tmp_dir, namelist[i]->d_name);
+
+        size_t size = 0;
+        unsigned char *plain = read_file(partition, &size);
+        if (!plain || seal_single(single, plain, size, key, aad) != 0 ||
+            !chunked_seal(chunked, plain, size, chunk_bytes, key, aad, sizeof(aad))) {
+            fprintf(stderr, "Error sealing %s\n", partition);
+            return 1;
+        }
+        free(plain);
+
+        double single_time = 0.0, chunked_time[NUM_THREAD_COUNTS] = {0.0};
+        for (int j = 0; j < runs; j++) {
+            gettimeofday(&t1, NULL);
+            int memfd = open_single(single, key, aad);
+            gettimeofday(&t2, NULL);
+            if (memfd < 0) {
+                fprintf(stderr, "Error opening %s\n", single);
+                return 1;
+            }
+            close(memfd);
+            single_time += elapsed_ms(&t1, &t2);
+
+            for (int t = 0; t < NUM_THREAD_COUNTS; t++) {
+                size_t opened = 0;
+                gettimeofday(&t1, NULL);
+                memfd = chunked_open_memfd(chunked, key, aad, sizeof(aad), thread_counts[t], &opened);
+                gettimeofday(&t2, NULL);
+                if (memfd < 0 || opened != size) {
+                    fprintf(stderr, "Error opening %s\n", chunked);
+                    return 1;
+                }
+                close(memfd);
+                chunked_time[t] += elapsed_ms(&t1, &t2);
+            }
+        }
+
+        printf("%s,%ld,%f", namelist[i]->d_name, size, single_time / runs);
+        for (int t = 0; t < NUM_THREAD_COUNTS; t++) {
+            printf(",%f", chunked_time[t] / runs);
+            total_chunked[t] += chunked_time[t] / runs;
+        }
+        printf("\n");
+        total_single += single_time / runs;
+        total_bytes += size;
+
+        remove(single);
+        remove(chunked);
+        free(namelist[i]);
+    }
+    free(namelist);
+    rmdir(tmp_dir);
+
+    printf("total,%ld,%f", total_bytes, total_single);
+    for (int t = 0; t < NUM_THREAD_COUNTS; t++) printf(",%f", total_chunked[t]);
+    printf("\n");
+    fprintf(stderr, "Decrypt throughput: single stream %.1f MB/s, chunked on %d threads %.1f MB/s\n",
+            total_single > 0.0 ? total_bytes / total_single / 1000.0 : 0.0, thread_counts[NUM_THREAD_COUNTS - 1],
+            total_chunked[NUM_THREAD_COUNTS - 1] > 0.0 ? total_bytes / total_chunked[NUM_THREAD_COUNTS - 1] / 1000.0 : 0.0);
+    return 0;
+}
@@ -0,0 +1,183 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <string.h>
+#include <sys/time.h>
+#include <tract.h>
+
+#include <dirent.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define check(call) {                                                           \
+    TRACT_RESULT result = call;                                                 \
+    if(result == TRACT_RESULT_KO) {                                             \
+        fprintf(stderr, "Error calling tract: %s\n", tract_get_last_error());   \
+        exit(1) ;                                                               \
+    }                                                                           \
+}
+
+double
+elapsed_ms(struct timeval *t1, struct timeval *t2)
+{
+    double elapsed_time = (t2->tv_sec - t1->tv_sec) * 1000.0;      // sec to ms
+    elapsed_time += (t2->tv_usec - t1->tv_usec) / 1000.0;          // us to ms
+    return elapsed_time;
+}
+
+TractNnef *
+create_nnef(void)
+{
+    TractNnef *nnef = NULL;
+    check(tract_nnef_create(&nnef));
+    check(tract_nnef_enable_tract_core(nnef));
+    check(tract_nnef_enable_tract_extra(nnef));
+    check(tract_nnef_enable_onnx(nnef));
+    return nnef;
+}
+
+// Hot path of the server without the compiled store
+TractRunnable *
+load_onnx(const char *path)
+{
+    TractOnnx *onnx = NULL;
+    TractInferenceModel *inference_model = NULL;
+    TractModel *model = NULL;
+    TractRunnable *runnable = NULL;
+
+    check(tract_onnx_create(&onnx));
+    check(tract_onnx_model_for_path(onnx, path, &inference_model));
+    check(tract_onnx_destroy(&onnx));
+    check(tract_inference_model_into_typed(&inference_model, &model));
+    check(tract_model_into_runnable(&model, &runnable));
+    return runnable;
+}
+
+// Done once at registration
+void
+compile_onnx(const char *path, const char *compiled_path)
+{
+    TractOnnx *onnx = NULL;
+    TractInferenceModel *inference_model = NULL;
+    TractModel *model = NULL;
+
+    check(tract_onnx_create(&onnx));
+    check(tract_onnx_model_for_path(onnx, path, &inference_model));
+    check(tract_onnx_destroy(&onnx));
+    check(tract_inference_model_into_typed(&inference_model, &model));
+    check(tract_model_declutter(model));
+
+    TractNnef *nnef = create_nnef();
+    check(tract_nnef_write_model_to_tar(nnef, compiled_path, model));
+    check(tract_nnef_destroy(&nnef));
+    check(tract_model_destroy(&model));
+}
+
+// Hot path of the server with the compiled store
+TractRunnable *
+load_compiled(const char *compiled_path)
+{
+    TractModel *model = NULL;
+    TractRunnable *runnable = NULL;
+
+    TractNnef *nnef = create_nnef();
+    check(tract_nnef_model_for_path(nnef, compiled_path, &model));
+    check(tract_nnef_destroy(&nnef));
+    check(tract_model_optimize(model));
+    check(tract_model_into_runnable(&model, &runnable));
+    return runnable;
+}
+
+int
+is_partition(const char *dir_path, const char *name)
+{
+    struct stat st;
+    char full_path[1024];
+
+    snprintf(full_path, sizeof(full_path), "%s/%s", dir_path, name);
+    if (stat(full_path, &st) != 0) return 0;
+
+    size_t length = strlen(name);
+    return S_ISREG(st.st_mode) && length > 5 && strcmp(name + length - 5, ".onnx") == 0;
+}
+
+int
+main(int argc, char **argv)
+{
+    struct timeval t1, t2;
+
+    if (argc < 2) {
+        fprintf(stderr, "Usage: %s <path_to_dir> [runs]\n", argv[0]);
+        return 1;
+    }
+
+    const char *path = argv[1];
+    int runs = argc > 2 ? atoi(argv[2]) : 10;
+    if (runs <= 0) runs = 1;
+
+    char tmp_dir[] = "/tmp/load_benchmark_XXXXXX";
+    if (!mkdtemp(tmp_dir)) {
+        perror("mkdtemp");
+        return 1;
+    }
+
+    struct dirent **namelist;
+    int num_entries = scandir(path, &namelist, NULL, alphasort);
+    if (num_entries == -1) {
+        perror("scandir");
+        return 1;
+    }
+
+    double total_onnx = 0.0, total_compiled = 0.0, total_compile = 0.0;
+    printf("partition,onnx_load_ms,compiled_load_ms,compile_ms\n");
+    for (int i = 0; i < num_entries; i++) {
+        if (!is_partition(path, namelist[i]->d_name)) {
+            free(namelist[i]);
+            continue;
+        }
+
+        char partition[1024], compiled[1024];
+        snprintf(partition, sizeof(partition), "%s/%s", path, namelist[i]->d_name);
+        snprintf(compiled, sizeof(compiled), "%s/%s.nnef.tar", tmp_dir, namelist[i]->d_name);
+
+        gettimeofday(&t1, NULL);
+        compile_onnx(partition, compiled);
+        gettimeofday(&t2, NULL);
+        double compile_time = elapsed_ms(&t1, &t2);
+
+        double onnx_time = 0.0, compiled_time = 0.0;
+        for (int j = 0; j < runs; j++) {
+            TractRunnable *runnable = NULL;
+
+            gettimeofday(&t1, NULL);
+            runnable = load_onnx(partition);
+            gettimeofday(&t2, NULL);
+            onnx_time += elapsed_ms(&t1, &t2);
+            check(tract_runnable_release(&runnable));
+
+            gettimeofday(&t1, NULL);
+            runnable = load_compiled(compiled);
+            gettimeofday(&t2, NULL);
+            compiled_time += elapsed_ms(&t1, &t2);
+            check(tract_runnable_release(&runnable));
+        }
+        onnx_time /= runs;
+        compiled_time /= runs;
+
+        printf("%s,%f,%f,%f\n", namelist[i]->d_name, onnx_time, compiled_time, compile_time);
+        total_onnx += onnx_time;
+        total_compiled += compiled_time;
+        total_compile += compile_time;
+
+        remove(compiled);
+        free(namelist[i]);
+    }
+    free(namelist);
+    rmdir(tmp_dir);
+
+    printf("total,%f,%f,%f\n", total_onnx, total_compiled, total_compile);
+    fprintf(stderr, "Load time per request: ONNX %f ms, compiled %f ms (%.2fx)\n",
+            total_onnx, total_compiled, total_compiled > 0.0 ? total_onnx / total_compiled : 0.0);
+    return 0;
+}
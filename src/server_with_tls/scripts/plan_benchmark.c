@@ -0,0 +1,257 @@
+#include <storage.h>
+#include <sys/time.h>
+#include <dirent.h>
+#include <ctype.h>
+
+// Dispatch overhead of the recursive DFS against the flat execution plan, on
+// the graph the server builds for a directory of partitions (e.g. the
+// operators/ directories of split_models_per_operator.py). Partitions are not
+// run, only the per-request bookkeeping is timed.
+
+#define check(call) {                                                           \
+    TRACT_RESULT result = call;                                                 \
+    if(result == TRACT_RESULT_KO) {                                             \
+        fprintf(stderr, "Error calling tract: %s\n", tract_get_last_error());   \
+        exit(1) ;                                                               \
+    }                                                                           \
+}
+
+static TractValue *dummy_value = (TractValue *)&dummy_value;
+
+double
+elapsed_ms(struct timeval *t1, struct timeval *t2)
+{
+    double elapsed_time = (t2->tv_sec - t1->tv_sec) * 1000.0;      // sec to ms
+    elapsed_time += (t2->tv_usec - t1->tv_usec) / 1000.0;          // us to ms
+    return elapsed_time;
+}
+
+int
+version_compare(const void *a, const void *b)
+{
+    const char *str1 = *(const char **)a;
+    const char *str2 = *(const char **)b;
+
+    while (*str1 && *str2) {
+        if (isdigit(*str1) && isdigit(*str2)) {
+            long num1 = strtol(str1, (char **)&str1, 10);
+            long num2 = strtol(str2, (char **)&str2, 10);
+            if (num1 != num2) {
+                return (num1 > num2) - (num1 < num2);
+            }
+        } else {
+            if (*str1 != *str2) {
+                return (*str1 > *str2) - (*str1 < *str2);
+            }
+            str1++;
+            str2++;
+        }
+    }
+    return (*str1 == '\0') - (*str2 == '\0');
+}
+
+// Same registration as onnx_model_inputs in inference.c
+void
+register_partition(operator_io ***io, int index, operator_node **nodes, char *model_name)
+{
+    TractOnnx *onnx = NULL;
+    TractInferenceModel *inference_model = NULL;
+    uintptr_t num_inputs = 0, num_outputs = 0;
+
+    check(tract_onnx_create(&onnx));
+    check(tract_onnx_model_for_path(onnx, model_name, &inference_model));
+    check(tract_onnx_destroy(&onnx));
+
+    check(tract_inference_model_input_count(inference_model, &num_inputs));
+    char **input_names = malloc((num_inputs + 1) * sizeof(char *));
+    for (int i = 0; i < (int)num_inputs; i++) {
+        check(tract_inference_model_input_name(inference_model, i, &input_names[i]));
+    }
+    input_names[num_inputs] = NULL;
+
+    check(tract_inference_model_output_count(inference_model, &num_outputs));
+    char **output_names = malloc((num_outputs + 1) * sizeof(char *));
+    for (int i = 0; i < (int)num_outputs; i++) {
+        check(tract_inference_model_output_name(inference_model, i, (int8_t **)&output_names[i]));
+    }
+    output_names[num_outputs] = NULL;
+    check(tract_inference_model_destroy(&inference_model));
+
+    if (index == 1) {
+        operator_io o_io_first = {NULL, 0, NULL, num_inputs, input_names};
+        insert_into_operator_io(io, &o_io_first, 0, "input");
+        update_node(*io, 0, NULL);
+    }
+
+    operator_io o_io = {NULL, num_inputs, num_inputs ? input_names : NULL, num_outputs, output_names};
+    insert_into_operator_io(io, &o_io, index, model_name);
+    if (num_inputs == 0) {
+        nodes[index]->num_inputs = 0;
+        nodes[index]->num_outputs = num_outputs;
+    } else {
+        update_node(*io, index, nodes);
+    }
+
+    for (int i = 0; i < (int)num_inputs; i++) tract_free_cstring(input_names[i]);
+    free(input_names);
+    for (int i = 0; i < (int)num_outputs; i++) tract_free_cstring(output_names[i]);
+    free(output_names);
+}
+
+// The former execute_tree walk: visited scan per node and parent pointer chasing
+int
+legacy_dispatch(operator_node *node, TractValue ***outputs, char **visited_nodes, int *visited_count, TractValue **inputs)
+{
+    int gathered = 0;
+    if (is_node_visited(node, visited_nodes, *visited_count)) return 0;
+
+    visited_nodes[*visited_count] = node->model_name;
+    (*visited_count)++;
+
+    if (*visited_count != 1) {
+        int k = 0;
+        for (int i = 0; i < node->num_inputs && node->parents && node->parents[i]; i++) {
+            if (strcmp(node->parents[i]->model_name, "input") == 0) {
+                inputs[k++] = dummy_value;
+                continue;
+            }
+            inputs[k++] = outputs[node->parents[i]->index][node->parent_output_indices[i]];
+        }
+        gathered += k;
+    }
+
+    for (int i = 0; i < node->num_children; i++) {
+        gathered += legacy_dispatch(node->children[i], outputs, visited_nodes, visited_count, inputs);
+    }
+    return gathered;
+}
+
+int
+plan_dispatch(const execution_plan *plan, TractValue ***outputs, TractValue **inputs)
+{
+    int gathered = 0;
+    for (int s = 0; s < plan->num_steps; s++) {
+        const plan_step *step = &plan->steps[s];
+        int k = 0;
+        for (int i = 0; i < step->num_inputs; i++) {
+            const plan_input *input = &step->inputs[i];
+            inputs[k++] = input->producer == 0 ? dummy_value : outputs[input->producer][input->output];
+        }
+        gathered += k;
+    }
+    return gathered;
+}
+
+int
+main(int argc, char **argv)
+{
+    struct timeval t1, t2;
+
+    if (argc < 2) {
+        fprintf(stderr, "Usage: %s <path_to_dir> [runs]\n", argv[0]);
+        return 1;
+    }
+    const char *path = argv[1];
+    int runs = argc > 2 ? atoi(argv[2]) : 100;
+    if (runs <= 0) runs = 1;
+
+    struct dirent **namelist;
+    int num_entries = scandir(path, &namelist, NULL, NULL);
+    if (num_entries == -1) {
+        perror("scandir");
+        return 1;
+    }
+
+    int num_models = 0;
+    char **names = malloc((num_entries + 1) * sizeof(char *));
+    for (int i = 0; i < num_entries; i++) {
+        size_t length = strlen(namelist[i]->d_name);
+        if (length > 5 && strcmp(namelist[i]->d_name + length - 5, ".onnx") == 0) {
+            names[num_models] = malloc(strlen(path) + length + 2);
+            sprintf(names[num_models], "%s/%s", path, namelist[i]->d_name);
+            num_models++;
+        }
+        free(namelist[i]);
+    }
+    free(namelist);
+    names[num_models] = NULL;
+    qsort(names, num_models, sizeof(char *), version_compare);
+    if (num_models == 0) {
+        fprintf(stderr, "No partitions found in %s\n", path);
+        return 1;
+    }
+
+    int initial_length = 10;
+    operator_io **io = init_operator_io(initial_length);
+    operator_node **nodes = calloc(num_models + 1, sizeof(operator_node *));
+    operator_node *head = create_operator_node("input");
+    nodes[0] = head;
+
+    gettimeofday(&t1, NULL);
+    for (int i = 1; i < num_models + 1; i++) {
+        if (i == initial_length) {
+            resize_operators_io(&io, initial_length + 5, initial_length);
+            initial_length += 5;
+        }
+        nodes[i] = create_operator_node(names[i-1]);
+        nodes[i]->index = i;
+        insert_child_to_operator_node(nodes[i-1], nodes[i]);
+        register_partition(&io, i, nodes, names[i-1]);
+    }
+    gettimeofday(&t2, NULL);
+    double registration_time = elapsed_ms(&t1, &t2);
+
+    gettimeofday(&t1, NULL);
+    execution_plan *plan = build_execution_plan(nodes, num_models + 1);
+    gettimeofday(&t2, NULL);
+    double plan_time = elapsed_ms(&t1, &t2);
+
+    // Stand-ins for the activations, dispatch only looks pointers up
+    int max_inputs = 1;
+    TractValue ***outputs = calloc(num_models + 1, sizeof(TractValue **));
+    for (int i = 1; i < num_models + 1; i++) {
+        int count = nodes[i]->num_outputs > 0 ? nodes[i]->num_outputs : 1;
+        outputs[i] = malloc(count * sizeof(TractValue *));
+        for (int j = 0; j < count; j++) outputs[i][j] = dummy_value;
+        if (plan->steps[i-1].num_inputs > max_inputs) max_inputs = plan->steps[i-1].num_inputs;
+    }
+    TractValue **inputs = malloc((max_inputs + 1) * sizeof(TractValue *));
+
+    long checksum = 0;
+    gettimeofday(&t1, NULL);
+    for (int r = 0; r < runs; r++) {
+        char **visited_nodes = malloc((num_models + 1) * sizeof(char *));
+        int visited_count = 0;
+        checksum += legacy_dispatch(head, outputs, visited_nodes, &visited_count, inputs);
+        checksum += search_operator_node_by_name(head, names[num_models-1]) != NULL;
+        free(visited_nodes);
+    }
+    gettimeofday(&t2, NULL);
+    double legacy_time = elapsed_ms(&t1, &t2) / runs;
+
+    gettimeofday(&t1, NULL);
+    for (int r = 0; r < runs; r++) {
+        checksum += plan_dispatch(plan, outputs, inputs);
+        checksum += plan->steps[plan->result_index - 1].node != NULL;
+    }
+    gettimeofday(&t2, NULL);
+    double planned_time = elapsed_ms(&t1, &t2) / runs;
+
+    printf("partitions,registration_ms,plan_build_ms,dfs_dispatch_ms,plan_dispatch_ms\n");
+    printf("%d,%f,%f,%f,%f\n", num_models, registration_time, plan_time, legacy_time, planned_time);
+    fprintf(stderr, "Per-request dispatch: DFS %f ms, plan %f ms (checksum %ld)\n", legacy_time, planned_time, checksum);
+
+    for (int i = 1; i < num_models + 1; i++) free(outputs[i]);
+    free(outputs);
+    free(inputs);
+    free_execution_plan(plan);
+    free(nodes);
+    free_operator_io(io);
+    char **visited_nodes = malloc((num_models + 1) * sizeof(char *));
+    int visited_count = 0;
+    free_operator_node(head, visited_nodes, &visited_count);
+    free(visited_nodes);
+    for (int i = 0; i < num_models; i++) free(names[i]);
+    free(names);
+    return 0;
+}
@@ -0,0 +1,394 @@
+#include <errno.h>
+#include <time.h>
+#include <batcher.h>
+#include <storage.h>
+
+model_batcher *
+create_model_batcher(const execution_plan *plan)
+{
+    assert(plan);
+
+    model_batcher *batcher = (model_batcher *)calloc(1, sizeof(model_batcher));
+    if (!batcher) {
+        fprintf(stderr, "Memory allocation for batcher failed\n");
+        return NULL;
+    }
+    batcher->plan = plan;
+    batcher->free_batcher = free_model_batcher;
+    pthread_mutex_init(&batcher->lock, NULL);
+    pthread_cond_init(&batcher->cond, NULL);
+    return batcher;
+}
+
+void
+free_model_batcher(model_batcher *batcher)
+{
+    if (!batcher) return;
+
+    assert(!batcher->head);
+    pthread_cond_destroy(&batcher->cond);
+    pthread_mutex_destroy(&batcher->lock);
+    free(batcher);
+}
+
+static void
+free_input_values(TractValue **inputs, int num_inputs)
+{
+    if (!inputs) return;
+    for (int i = 0; i < num_inputs; i++) {
+        if (inputs[i] && tract_value_destroy(&inputs[i]) != TRACT_RESULT_OK) {
+            fprintf(stderr, "Error destroying tract value\n");
+        }
+    }
+    free(inputs);
+}
+
+// Inputs can share a batch when only their batch axis differs
+static bool
+same_input_shapes(const batch_request *a, const batch_request *b)
+{
+    if (a->num_inputs != b->num_inputs) return false;
+
+    for (int i = 0; i < a->num_inputs; i++) {
+        DatumType type_a, type_b;
+        uintptr_t rank_a = 0, rank_b = 0;
+        const uintptr_t *shape_a = NULL, *shape_b = NULL;
+
+        if (tract_value_as_bytes(a->inputs[i], &type_a, &rank_a, &shape_a, NULL) != TRACT_RESULT_OK ||
+            tract_value_as_bytes(b->inputs[i], &type_b, &rank_b, &shape_b, NULL) != TRACT_RESULT_OK) {
+            return false;
+        }
+        if (type_a != type_b || rank_a != rank_b || rank_a == 0) return false;
+        for (uintptr_t j = 1; j < rank_a; j++) {
+            if (shape_a[j] != shape_b[j]) return false;
+        }
+    }
+    return true;
+}
+
+// The batch runs with the oldest request's runner, so only requests running
+// the batcher's plan of the same model the same way join it
+static bool
+same_runner(const model_batcher *batcher, const batch_request *a, const batch_request *b)
+{
+    return a->runner->m == b->runner->m && a->runner->run == b->runner->run &&
+           b->runner->m->plan == batcher->plan;
+}
+
+// A batch runs under one set of tags, so only requests presenting the same ones join it
+static bool
+same_tags(const batch_request *a, const batch_request *b)
+{
+    if (a->num_tags != b->num_tags) return false;
+    for (int i = 0; i < a->num_tags; i++) {
+        if (memcmp(a->tags[i], b->tags[i], TAG_BYTES * 2) != 0) return false;
+    }
+    return true;
+}
+
+// Unlinks the oldest pending request and every compatible one after it
+static batch_request *
+take_batch(model_batcher *batcher, int *batch_size)
+{
+    batch_request *first = batcher->head, *last = first;
+    batch_request *previous = first, *current = first->next;
+
+    batcher->head = first->next;
+    first->next = NULL;
+    *batch_size = 1;
+
+    while (current && *batch_size < BATCH_MAX_REQUESTS && !batcher->fixed_batch) {
+        batch_request *next = current->next;
+        if (same_runner(batcher, first, current) && same_input_shapes(first, current) && same_tags(first, current)) {
+            if (previous == first) {
+                batcher->head = next;
+            } else {
+                previous->next = next;
+            }
+            current->next = NULL;
+            last->next = current;
+            last = current;
+            (*batch_size)++;
+        } else {
+            previous = current;
+        }
+        current = next;
+    }
+
+    batcher->tail = NULL;
+    for (batch_request *r = batcher->head; r; r = r->next) batcher->tail = r;
+    batcher->num_pending -= *batch_size;
+    return first;
+}
+
+// Concatenates input `index` of every request along the batch axis
+static TractValue *
+concat_batch_input(batch_request *batch, int index)
+{
+    DatumType datum_type;
+    uintptr_t rank = 0, rows = 0;
+    const uintptr_t *shape = NULL;
+    const void *data = NULL;
+    size_t row_bytes = 0;
+
+    for (batch_request *r = batch; r; r = r->next) {
+        if (tract_value_as_bytes(r->inputs[index], &datum_type, &rank, &shape, NULL) != TRACT_RESULT_OK) {
+            fprintf(stderr, "Error calling tract: %s\n", tract_get_last_error());
+            return NULL;
+        }
+        rows += shape[0];
+    }
+
+    uintptr_t *batch_shape = (uintptr_t *)malloc(rank * sizeof(uintptr_t));
+    assert(batch_shape);
+    memcpy(batch_shape, shape, rank * sizeof(uintptr_t));
+    batch_shape[0] = rows;
+
+    row_bytes = datum_size(datum_type);
+    if (row_bytes == 0) {
+        fprintf(stderr, "Datum type %d cannot be batched\n", (int)datum_type);
+        free(batch_shape);
+        return NULL;
+    }
+    for (uintptr_t j = 1; j < rank; j++) {
+        row_bytes *= shape[j];
+    }
+
+    unsigned char *buffer = (unsigned char *)malloc(rows * row_bytes > 0 ? rows * row_bytes : 1);
+    if (!buffer) {
+        fprintf(stderr, "Memory allocation for batched input failed\n");
+        free(batch_shape);
+        return NULL;
+    }
+
+    size_t offset = 0;
+    for (batch_request *r = batch; r; r = r->next) {
+        if (tract_value_as_bytes(r->inputs[index], NULL, NULL, &shape, &data) != TRACT_RESULT_OK) {
+            fprintf(stderr, "Error calling tract: %s\n", tract_get_last_error());
+            free(buffer);
+            free(batch_shape);
+            return NULL;
+        }
+        memcpy(buffer + offset, data, shape[0] * row_bytes);
+        offset += shape[0] * row_bytes;
+    }
+
+    TractValue *value = NULL;
+    if (tract_value_from_bytes(datum_type, rank, batch_shape, buffer, &value) != TRACT_RESULT_OK) {
+        fprintf(stderr, "Error calling tract: %s\n", tract_get_last_error());
+        value = NULL;
+    }
+    free(buffer);
+    free(batch_shape);
+    return value;
+}
+
+// Argmax of rows [first_row, first_row + rows) of the last output, the batch
+// result of the rows a request contributed
+static bool
+scatter_rows(const TractValue *output, uintptr_t first_row, uintptr_t rows, request_result *result)
+{
+    DatumType datum_type;
+    uintptr_t rank = 0, row_length = 1;
+    const uintptr_t *shape = NULL;
+    const float *data = NULL;
+
+    if (tract_value_as_bytes((TractValue *)output, &datum_type, &rank, &shape, (const void **)&data) != TRACT_RESULT_OK) return false;
+    if (datum_type != TRACT_DATUM_TYPE_F32 || rank == 0 || first_row + rows > shape[0]) return false;
+    for (uintptr_t j = 1; j < rank; j++) {
+        row_length *= shape[j];
+    }
+
+    // Requests normally send a single image, its first row carries the answer
+    float max = 0.0;
+    result->category = row_argmax(data + first_row * row_length, row_length, &max);
+    result->pred = max;
+    return true;
+}
+
+static void
+run_single(model_batcher *batcher, batch_request *request)
+{
+    const execution_plan *plan = batcher->plan;
+
+    execution_context *ctx = init_execution_context(plan->num_steps + 1, request->inputs);
+    request->inputs = NULL;
+    if (!ctx) {
+        request->elapsed_time = -1;
+        return;
+    }
+
+    request->elapsed_time = request->runner->run(ctx, request->runner);
+    if (request->elapsed_time != -1) {
+        node_state *last_state = &ctx->states[plan->result_index];
+        request->result->pred = last_state->pred;
+        request->result->category = last_state->category;
+        collect_request_result(plan, ctx, 0, 0, request->result);
+    }
+    request->result->peak_bytes = ctx->peak_bytes;
+    request->result->batch_size = 1;
+    free_execution_context(ctx);
+}
+
+// Runs the plan once for the whole batch with the oldest request's runner. Partitions
+// exported with a fixed batch of 1 reject the batched input, those requests
+// are then run one by one and the model is no longer batched.
+static void
+run_batch(model_batcher *batcher, batch_request *batch, int batch_size)
+{
+    const execution_plan *plan = batcher->plan;
+
+    if (batch_size == 1) {
+        run_single(batcher, batch);
+        return;
+    }
+
+    int num_inputs = batch->num_inputs;
+    TractValue **inputs = (TractValue **)calloc(num_inputs + 1, sizeof(TractValue *));
+    assert(inputs);
+    bool ok = true;
+    for (int i = 0; i < num_inputs && ok; i++) {
+        inputs[i] = concat_batch_input(batch, i);
+        ok = inputs[i] != NULL;
+    }
+
+    execution_context *ctx = NULL;
+    double elapsed_time = -1;
+    if (ok) {
+        ctx = init_execution_context(plan->num_steps + 1, inputs);
+        inputs = NULL;
+    }
+    if (ctx) elapsed_time = batch->runner->run(ctx, batch->runner);
+
+    const TractValue *output = NULL;
+    if (elapsed_time != -1) {
+        const operator_node *last = plan->steps[plan->result_index - 1].node;
+        node_state *last_state = &ctx->states[plan->result_index];
+        if (last_state->outputs && last->num_outputs > 0) output = last_state->outputs[last->num_outputs - 1];
+    }
+
+    uintptr_t first_row = 0;
+    for (batch_request *r = batch; r && output; r = r->next) {
+        const uintptr_t *shape = NULL;
+        if (tract_value_as_bytes(r->inputs[0], NULL, NULL, &shape, NULL) != TRACT_RESULT_OK ||
+            !scatter_rows(output, first_row, shape[0], r->result)) {
+            output = NULL;
+            break;
+        }
+        first_row += shape[0];
+    }
+
+    if (!output) {
+        fprintf(stderr, "Batch of %d requests failed, running them one by one\n", batch_size);
+        free_input_values(inputs, num_inputs);
+        free_execution_context(ctx);
+        bool single_ran = false;
+        for (batch_request *r = batch; r; r = r->next) {
+            run_single(batcher, r);
+            single_ran |= r->elapsed_time != -1;
+        }
+
+        // The model only takes its exported batch size, later requests are
+        // not held back for a batch that would fail again
+        if (single_ran) {
+            pthread_mutex_lock(&batcher->lock);
+            if (!batcher->fixed_batch) fprintf(stderr, "Model has a fixed batch size, batching disabled for it\n");
+            batcher->fixed_batch = true;
+            pthread_mutex_unlock(&batcher->lock);
+        }
+        return;
+    }
+
+    // Every request gets the top-k or the tensors of its own rows
+    first_row = 0;
+    for (batch_request *r = batch; r; r = r->next) {
+        const uintptr_t *shape = NULL;
+        tract_value_as_bytes(r->inputs[0], NULL, NULL, &shape, NULL);
+        collect_request_result(plan, ctx, first_row, shape[0], r->result);
+        first_row += shape[0];
+    }
+
+    for (batch_request *r = batch; r; r = r->next) {
+        r->elapsed_time = elapsed_time;
+        r->result->peak_bytes = ctx->peak_bytes;
+        r->result->batch_size = batch_size;
+        free_input_values(r->inputs, r->num_inputs);
+        r->inputs = NULL;
+    }
+    free_execution_context(ctx);
+}
+
+// Queues the request and waits for its batch to run. The first waiting
+// request collects a batch for up to BATCH_WINDOW_US and runs it on its own
+// thread, every other caller sleeps. The inputs are consumed. Returns the
+// summed run time of the partitions, -1 on failure.
+double
+batcher_submit(model_batcher *batcher, TractValue **inputs, int num_inputs, plan_runner *runner, unsigned char **tags, int num_tags, request_result *result)
+{
+    assert(batcher);
+    assert(inputs);
+    assert(runner && runner->run);
+    assert(runner->m && runner->m->plan == batcher->plan);
+    assert(result);
+
+    batch_request request;
+    request.inputs = inputs;
+    request.num_inputs = num_inputs;
+    request.tags = tags;
+    request.num_tags = tags ? num_tags : 0;
+    request.runner = runner;
+    request.result = result;
+    request.elapsed_time = -1;
+    request.done = false;
+    request.next = NULL;
+
+    pthread_mutex_lock(&batcher->lock);
+    if (batcher->tail) {
+        batcher->tail->next = &request;
+    } else {
+        batcher->head = &request;
+    }
+    batcher->tail = &request;
+    batcher->num_pending++;
+    pthread_cond_broadcast(&batcher->cond);
+
+    while (!request.done) {
+        if (batcher->leader_active || !batcher->head) {
+            pthread_cond_wait(&batcher->cond, &batcher->lock);
+            continue;
+        }
+
+        batcher->leader_active = true;
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += (long)BATCH_WINDOW_US * 1000;
+        deadline.tv_sec += deadline.tv_nsec / 1000000000;
+        deadline.tv_nsec %= 1000000000;
+        while (batcher->num_pending < BATCH_MAX_REQUESTS && !batcher->fixed_batch) {
+            if (pthread_cond_timedwait(&batcher->cond, &batcher->lock, &deadline) == ETIMEDOUT) break;
+        }
+
+        int batch_size = 0;
+        batch_request *batch = take_batch(batcher, &batch_size);
+        batcher->batches++;
+        batcher->batched_requests += batch_size;
+        pthread_mutex_unlock(&batcher->lock);
+
+        fprintf(stderr, "Batch size: %d\n", batch_size);
+        run_batch(batcher, batch, batch_size);
+
+        pthread_mutex_lock(&batcher->lock);
+        for (batch_request *r = batch, *next = NULL; r; r = next) {
+            next = r->next;
+            r->next = NULL;
+            r->done = true;
+        }
+        batcher->leader_active = false;
+        pthread_cond_broadcast(&batcher->cond);
+    }
+    fprintf(stderr, "Batcher: %lu batches, %f requests/batch\n", batcher->batches,
+            batcher->batches ? (double)batcher->batched_requests / batcher->batches : 0.0);
+    pthread_mutex_unlock(&batcher->lock);
+
+    return request.elapsed_time;
+}
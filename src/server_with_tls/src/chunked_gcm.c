@@ -0,0 +1,413 @@
+#define _GNU_SOURCE
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <chunked_gcm.h>
+
+typedef struct chunked_header
+{
+    size_t chunk_bytes;
+    uint32_t num_chunks;
+    uint64_t plain_size;
+    unsigned char iv[IV_BYTES];
+    unsigned char fields[CHUNKED_FIELDS_BYTES];     // encoded, the start of every additional data
+} chunked_header;
+
+// Chunks are read into the plaintext buffer and decrypted in place, the
+// reader publishes how many are there and the decrypt threads take them in
+// order
+typedef struct chunked_reader
+{
+    const chunked_header *h;
+    const unsigned char *key;
+    const unsigned char *aad;
+    size_t aad_length;
+    unsigned char *plain;
+    unsigned char *tags;        // TAG_BYTES per chunk
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+    uint32_t read;              // chunks in place
+    uint32_t next;              // next chunk to decrypt
+    bool failed;
+} chunked_reader;
+
+static void
+put_le(unsigned char *out, uint64_t value, int bytes)
+{
+    for (int i = 0; i < bytes; i++) out[i] = (value >> (8 * i)) & 0xff;
+}
+
+static uint64_t
+get_le(const unsigned char *in, int bytes)
+{
+    uint64_t value = 0;
+    for (int i = 0; i < bytes; i++) value |= (uint64_t) in[i] << (8 * i);
+    return value;
+}
+
+static void
+encode_fields(chunked_header *h)
+{
+    unsigned char *out = h->fields;
+    put_le(out, CHUNKED_MAGIC, 4);
+    put_le(out + 4, CHUNKED_VERSION, 2);
+    put_le(out + 6, 0, 2);
+    put_le(out + 8, h->chunk_bytes, 4);
+    put_le(out + 12, h->num_chunks, 4);
+    put_le(out + 16, h->plain_size, 8);
+    memcpy(out + 24, h->iv, IV_BYTES);
+}
+
+static size_t
+chunk_length(const chunked_header *h, uint32_t i)
+{
+    return i + 1 < h->num_chunks ? h->chunk_bytes : h->plain_size - (uint64_t) i * h->chunk_bytes;
+}
+
+static off_t
+chunk_offset(const chunked_header *h, uint32_t i)
+{
+    return CHUNKED_HEADER_BYTES + (off_t) i * (off_t) (h->chunk_bytes + TAG_BYTES);
+}
+
+// Nonce and additional data of chunk i, CHUNKED_HEADER_INDEX for the header
+static void
+chunk_nonce(const chunked_header *h, uint32_t i, unsigned char *nonce)
+{
+    memcpy(nonce, h->iv, IV_BYTES);
+    for (int b = 0; b < 4; b++) nonce[IV_BYTES - 1 - b] ^= (i >> (8 * b)) & 0xff;
+}
+
+static size_t
+chunk_aad(const chunked_header *h, uint32_t i, const unsigned char *aad, size_t aad_length, unsigned char *out)
+{
+    memcpy(out, h->fields, CHUNKED_FIELDS_BYTES);
+    put_le(out + CHUNKED_FIELDS_BYTES, i, 4);
+    if (aad_length > 0) memcpy(out + CHUNKED_FIELDS_BYTES + 4, aad, aad_length);
+    return CHUNKED_FIELDS_BYTES + 4 + aad_length;
+}
+
+static uint32_t
+count_chunks(uint64_t plain_size, size_t chunk_bytes)
+{
+    uint64_t n = plain_size > 0 ? (plain_size + chunk_bytes - 1) / chunk_bytes : 1;
+    return n < CHUNKED_HEADER_INDEX ? (uint32_t) n : 0;
+}
+
+// Seals size bytes of plain into path, chunk_bytes at a time under key and a
+// fresh IV, with aad bound to every chunk. Returns false after removing path.
+bool
+chunked_seal(const char *path, const unsigned char *plain, size_t size, size_t chunk_bytes,
+             const unsigned char *key, const unsigned char *aad, size_t aad_length)
+{
+    mbedtls_ctr_drbg_context ctr_drbg;
+    mbedtls_entropy_context entropy;
+    mbedtls_gcm_context gcm;
+    chunked_header h;
+    unsigned char nonce[IV_BYTES];
+    unsigned char tag[TAG_BYTES];
+    unsigned char *additional = NULL, *sealed = NULL;
+    FILE *fd = NULL;
+    bool ok = false;
+    int ret;
+    char *pers = "aes chunked seal";
+
+    mbedtls_entropy_init(&entropy);
+    mbedtls_ctr_drbg_init(&ctr_drbg);
+    mbedtls_gcm_init(&gcm);
+
+    h.chunk_bytes = chunk_bytes;
+    h.plain_size = size;
+    h.num_chunks = chunk_bytes > 0 && chunk_bytes <= UINT32_MAX ? count_chunks(size, chunk_bytes) : 0;
+    if (h.num_chunks == 0) {
+        fprintf(stderr, "%s: %ld bytes do not fit in chunks of %ld\n", path, size, chunk_bytes);
+        goto exit;
+    }
+
+    // Every sealed file gets its own IV, the key may be shared
+    ret = mbedtls_ctr_drbg_seed(&ctr_drbg, mbedtls_entropy_func, &entropy, (unsigned char *) pers, strlen(pers));
+    if (ret == 0) ret = mbedtls_ctr_drbg_random(&ctr_drbg, h.iv, IV_BYTES);
+    if (ret != 0) {
+        fprintf(stderr, "mbedtls_ctr_drbg failed to extract IV for %s - returned -0x%04x\n", path, -ret);
+        goto exit;
+    }
+    encode_fields(&h);
+
+    additional = (unsigned char *) malloc(CHUNKED_FIELDS_BYTES + 4 + aad_length);
+    sealed = (unsigned char *) malloc(chunk_bytes < size ? chunk_bytes : size > 0 ? size : 1);
+    if (!additional || !sealed) {
+        fprintf(stderr, "Memory allocation for sealing %s failed\n", path);
+        goto exit;
+    }
+    if ((ret = mbedtls_gcm_setkey(&gcm, MBEDTLS_CIPHER_ID_AES, key, KEY_BITS)) != 0) {
+        fprintf(stderr, "mbedtls_gcm_setkey failed for %s - returned -0x%04x\n", path, -ret);
+        goto exit;
+    }
+
+    fd = fopen(path, "wb");
+    if (!fd) {
+        fprintf(stderr, "Error opening %s for writing\n", path);
+        goto exit;
+    }
+
+    chunk_nonce(&h, CHUNKED_HEADER_INDEX, nonce);
+    size_t length = chunk_aad(&h, CHUNKED_HEADER_INDEX, aad, aad_length, additional);
+    ret = mbedtls_gcm_crypt_and_tag(&gcm, MBEDTLS_GCM_ENCRYPT, 0, nonce, IV_BYTES, additional, length,
+                                    NULL, NULL, TAG_BYTES, tag);
+    if (ret != 0 || fwrite(h.fields, 1, CHUNKED_FIELDS_BYTES, fd) != CHUNKED_FIELDS_BYTES ||
+        fwrite(tag, 1, TAG_BYTES, fd) != TAG_BYTES) {
+        fprintf(stderr, "Error writing the header of %s\n", path);
+        goto exit;
+    }
+
+    for (uint32_t i = 0; i < h.num_chunks; i++) {
+        size_t n = chunk_length(&h, i);
+        chunk_nonce(&h, i, nonce);
+        length = chunk_aad(&h, i, aad, aad_length, additional);
+        ret = mbedtls_gcm_crypt_and_tag(&gcm, MBEDTLS_GCM_ENCRYPT, n, nonce, IV_BYTES, additional, length,
+                                        plain + (size_t) i * chunk_bytes, sealed, TAG_BYTES, tag);
+        if (ret != 0) {
+            fprintf(stderr, "mbedtls_gcm failed to seal chunk %u of %s - returned -0x%04x\n", i, path, -ret);
+            goto exit;
+        }
+        if (fwrite(sealed, 1, n, fd) != n || fwrite(tag, 1, TAG_BYTES, fd) != TAG_BYTES) {
+            fprintf(stderr, "Error writing chunk %u of %s\n", i, path);
+            goto exit;
+        }
+    }
+    ok = true;
+
+exit:
+    if (fd && fclose(fd) != 0) ok = false;
+    if (fd && !ok) remove(path);
+    free(additional);
+    free(sealed);
+    mbedtls_gcm_free(&gcm);
+    mbedtls_ctr_drbg_free(&ctr_drbg);
+    mbedtls_entropy_free(&entropy);
+    return ok;
+}
+
+// Reads and authenticates the header. The file must be exactly as long as
+// the header says, so a truncated or extended file fails here.
+static bool
+read_header(int fd, const char *path, mbedtls_gcm_context *gcm, const unsigned char *aad, size_t aad_length,
+            chunked_header *h)
+{
+    unsigned char buf[CHUNKED_HEADER_BYTES];
+    unsigned char nonce[IV_BYTES];
+    struct stat st;
+
+    if (pread(fd, buf, CHUNKED_HEADER_BYTES, 0) != CHUNKED_HEADER_BYTES || fstat(fd, &st) != 0 ||
+        get_le(buf, 4) != CHUNKED_MAGIC || get_le(buf + 4, 2) != CHUNKED_VERSION) {
+        fprintf(stderr, "%s is not a chunked sealed file\n", path);
+        return false;
+    }
+    h->chunk_bytes = get_le(buf + 8, 4);
+    h->num_chunks = get_le(buf + 12, 4);
+    h->plain_size = get_le(buf + 16, 8);
+    memcpy(h->iv, buf + 24, IV_BYTES);
+    memcpy(h->fields, buf, CHUNKED_FIELDS_BYTES);
+
+    if (h->chunk_bytes == 0 || h->plain_size > (uint64_t) SIZE_MAX / 2 ||
+        h->num_chunks != count_chunks(h->plain_size, h->chunk_bytes) ||
+        (uint64_t) st.st_size != CHUNKED_HEADER_BYTES + h->plain_size + (uint64_t) h->num_chunks * TAG_BYTES) {
+        fprintf(stderr, "%s: header does not match the file\n", path);
+        return false;
+    }
+
+    unsigned char *additional = (unsigned char *) malloc(CHUNKED_FIELDS_BYTES + 4 + aad_length);
+    if (!additional) return false;
+    chunk_nonce(h, CHUNKED_HEADER_INDEX, nonce);
+    size_t length = chunk_aad(h, CHUNKED_HEADER_INDEX, aad, aad_length, additional);
+    int ret = mbedtls_gcm_auth_decrypt(gcm, 0, nonce, IV_BYTES, additional, length,
+                                       buf + CHUNKED_FIELDS_BYTES, TAG_BYTES, NULL, NULL);
+    free(additional);
+    if (ret != 0) {
+        fprintf(stderr, "Header authentication failed for %s - returned -0x%04x\n", path, -ret);
+        return false;
+    }
+    return true;
+}
+
+static bool
+decrypt_chunk(chunked_reader *r, mbedtls_gcm_context *gcm, unsigned char *additional, uint32_t i)
+{
+    unsigned char nonce[IV_BYTES];
+    unsigned char *data = r->plain + (size_t) i * r->h->chunk_bytes;
+
+    chunk_nonce(r->h, i, nonce);
+    size_t length = chunk_aad(r->h, i, r->aad, r->aad_length, additional);
+    return mbedtls_gcm_auth_decrypt(gcm, chunk_length(r->h, i), nonce, IV_BYTES, additional, length,
+                                    r->tags + (size_t) i * TAG_BYTES, TAG_BYTES, data, data) == 0;
+}
+
+static bool
+read_chunk(chunked_reader *r, int fd, uint32_t i)
+{
+    size_t n = chunk_length(r->h, i);
+    struct iovec iov[2] = {
+        { r->plain + (size_t) i * r->h->chunk_bytes, n },
+        { r->tags + (size_t) i * TAG_BYTES, TAG_BYTES }
+    };
+    return preadv(fd, iov, 2, chunk_offset(r->h, i)) == (ssize_t) (n + TAG_BYTES);
+}
+
+static void
+fail_reader(chunked_reader *r)
+{
+    pthread_mutex_lock(&r->lock);
+    r->failed = true;
+    pthread_cond_broadcast(&r->ready);
+    pthread_mutex_unlock(&r->lock);
+}
+
+static void *
+decrypt_thread(void *arg)
+{
+    chunked_reader *r = (chunked_reader *) arg;
+    mbedtls_gcm_context gcm;
+
+    mbedtls_gcm_init(&gcm);
+    unsigned char *additional = (unsigned char *) malloc(CHUNKED_FIELDS_BYTES + 4 + r->aad_length);
+    if (!additional || mbedtls_gcm_setkey(&gcm, MBEDTLS_CIPHER_ID_AES, r->key, KEY_BITS) != 0) {
+        fail_reader(r);
+    }
+
+    while (additional) {
+        pthread_mutex_lock(&r->lock);
+        while (!r->failed && r->next < r->h->num_chunks && r->next >= r->read) {
+            pthread_cond_wait(&r->ready, &r->lock);
+        }
+        if (r->failed || r->next >= r->h->num_chunks) {
+            pthread_mutex_unlock(&r->lock);
+            break;
+        }
+        uint32_t i = r->next++;
+        pthread_mutex_unlock(&r->lock);
+
+        if (!decrypt_chunk(r, &gcm, additional, i)) {
+            fprintf(stderr, "Authentication failed for chunk %u\n", i);
+            fail_reader(r);
+        }
+    }
+
+    free(additional);
+    mbedtls_gcm_free(&gcm);
+    return NULL;
+}
+
+// Reads every chunk in order on the calling thread; with more than one
+// thread the chunks are decrypted on threads of their own as they arrive,
+// otherwise each one right after it is read
+static bool
+read_chunks(chunked_reader *r, int fd, mbedtls_gcm_context *gcm, int threads)
+{
+    pthread_t workers[threads > 1 ? threads : 1];
+    int started = 0;
+
+    if (threads > 1 && r->h->num_chunks > 1) {
+        for (; started < threads && (uint32_t) started < r->h->num_chunks; started++) {
+            if (pthread_create(&workers[started], NULL, decrypt_thread, r) != 0) break;
+        }
+    }
+
+    unsigned char *additional = NULL;
+    if (started == 0) {
+        additional = (unsigned char *) malloc(CHUNKED_FIELDS_BYTES + 4 + r->aad_length);
+        if (!additional) return false;
+    }
+
+    for (uint32_t i = 0; i < r->h->num_chunks; i++) {
+        bool ok = read_chunk(r, fd, i);
+        if (ok && started == 0) ok = decrypt_chunk(r, gcm, additional, i);
+        if (!ok) {
+            fprintf(stderr, "Reading or authenticating chunk %u failed\n", i);
+            fail_reader(r);
+            break;
+        }
+
+        pthread_mutex_lock(&r->lock);
+        r->read = i + 1;
+        bool failed = r->failed;
+        pthread_cond_broadcast(&r->ready);
+        pthread_mutex_unlock(&r->lock);
+        if (failed) break;
+    }
+
+    for (int t = 0; t < started; t++) {
+        pthread_join(workers[t], NULL);
+    }
+    free(additional);
+    return !r->failed;
+}
+
+// Opens a chunked sealed file into an anonymous in-memory file, the plaintext
+// never reaches the disk. Decryption runs on up to threads threads while the
+// file is read. Returns the file descriptor, its size in *size, or -1 if the
+// file or any of its chunks fails to authenticate.
+int
+chunked_open_memfd(const char *path, const unsigned char *key, const unsigned char *aad, size_t aad_length,
+                   int threads, size_t *size)
+{
+    mbedtls_gcm_context gcm;
+    chunked_header h;
+    chunked_reader r;
+    int memfd = -1;
+    bool ok = false;
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return -1;
+
+    // Also sets up the AES tables before any thread does
+    mbedtls_gcm_init(&gcm);
+    if (mbedtls_gcm_setkey(&gcm, MBEDTLS_CIPHER_ID_AES, key, KEY_BITS) != 0 ||
+        !read_header(fd, path, &gcm, aad, aad_length, &h)) {
+        goto exit;
+    }
+
+    memfd = memfd_create("sealed_partition", MFD_CLOEXEC);
+    if (memfd < 0 || ftruncate(memfd, (off_t) h.plain_size) != 0) {
+        fprintf(stderr, "Error staging %s in memory\n", path);
+        goto exit;
+    }
+    if (h.plain_size == 0) {
+        ok = true;
+        goto exit;
+    }
+
+    memset(&r, 0, sizeof(chunked_reader));
+    r.h = &h;
+    r.key = key;
+    r.aad = aad;
+    r.aad_length = aad_length;
+    r.plain = (unsigned char *) mmap(NULL, h.plain_size, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+    r.tags = (unsigned char *) malloc((size_t) h.num_chunks * TAG_BYTES);
+    if (r.plain == MAP_FAILED || !r.tags) {
+        fprintf(stderr, "Error mapping %s\n", path);
+        if (r.plain != MAP_FAILED) munmap(r.plain, h.plain_size);
+        free(r.tags);
+        goto exit;
+    }
+    pthread_mutex_init(&r.lock, NULL);
+    pthread_cond_init(&r.ready, NULL);
+
+    ok = read_chunks(&r, fd, &gcm, threads);
+
+    pthread_cond_destroy(&r.ready);
+    pthread_mutex_destroy(&r.lock);
+    munmap(r.plain, h.plain_size);
+    free(r.tags);
+
+exit:
+    mbedtls_gcm_free(&gcm);
+    close(fd);
+    if (!ok) {
+        if (memfd >= 0) close(memfd);
+        return -1;
+    }
+    *size = h.plain_size;
+    return memfd;
+}
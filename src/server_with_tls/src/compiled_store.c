@@ -0,0 +1,245 @@
+#define _GNU_SOURCE
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <compiled_store.h>
+#include <chunked_gcm.h>
+
+#define check_ret(call, ret_value) do {                                        \
+    TRACT_RESULT result = (call);                                              \
+    if (result == TRACT_RESULT_KO) {                                           \
+        fprintf(stderr, "Error calling tract: %s\n", tract_get_last_error());  \
+        return (ret_value);                                                    \
+    }                                                                          \
+} while (0)
+
+char *
+compiled_partition_path(const char *model_name)
+{
+    assert(model_name);
+
+    size_t length = strlen(model_name) + strlen(COMPILED_SUFFIX) + 1;
+    char *path = (char *)malloc(length);
+    if (!path) {
+        fprintf(stderr, "Memory allocation for compiled path failed\n");
+        return NULL;
+    }
+    snprintf(path, length, "%s%s", model_name, COMPILED_SUFFIX);
+    return path;
+}
+
+static TractNnef *
+create_nnef(void)
+{
+    TractNnef *nnef = NULL;
+    check_ret(tract_nnef_create(&nnef), NULL);
+    assert(nnef);
+
+    // ONNX partitions may keep operators that only the onnx/extra registries know
+    if (tract_nnef_enable_tract_core(nnef) != TRACT_RESULT_OK ||
+        tract_nnef_enable_tract_extra(nnef) != TRACT_RESULT_OK ||
+        tract_nnef_enable_onnx(nnef) != TRACT_RESULT_OK) {
+        fprintf(stderr, "Error calling tract: %s\n", tract_get_last_error());
+        tract_nnef_destroy(&nnef);
+        return NULL;
+    }
+    return nnef;
+}
+
+#ifdef USE_AES
+static unsigned char *
+read_fd(int fd, size_t *size)
+{
+    off_t length = lseek(fd, 0, SEEK_END);
+    if (length < 0 || lseek(fd, 0, SEEK_SET) < 0) return NULL;
+
+    unsigned char *buffer = (unsigned char *)malloc(length > 0 ? (size_t)length : 1);
+    if (!buffer) return NULL;
+
+    size_t offset = 0;
+    while (offset < (size_t)length) {
+        ssize_t n = read(fd, buffer + offset, (size_t)length - offset);
+        if (n <= 0) {
+            free(buffer);
+            return NULL;
+        }
+        offset += (size_t)n;
+    }
+    *size = offset;
+    return buffer;
+}
+
+// Seal the plaintext tar held in `plain_fd` into `path` in the chunked format
+// of chunked_gcm.h, with the partition tag bound to every chunk
+static bool
+seal_compiled_partition(int plain_fd, const char *path, const unsigned char *key, const unsigned char *tag)
+{
+    size_t size = 0;
+    unsigned char *plain = read_fd(plain_fd, &size);
+    if (!plain) {
+        fprintf(stderr, "Error reading compiled partition %s\n", path);
+        return false;
+    }
+
+    bool ok = chunked_seal(path, plain, size, SEAL_CHUNK_BYTES, key, tag, TAG_BYTES * 2);
+    free(plain);
+    return ok;
+}
+
+// Open a sealed compiled partition into an anonymous in-memory file, so the
+// plaintext tar never reaches the disk; its chunks are decrypted on
+// DECRYPT_THREADS threads as they are read
+static int
+unseal_compiled_partition(const char *path, const unsigned char *key, const unsigned char *tag, size_t *size)
+{
+    int memfd = chunked_open_memfd(path, key, tag, TAG_BYTES * 2, DECRYPT_THREADS, size);
+    if (memfd < 0) {
+        fprintf(stderr, "Compiled partition authentication failed for %s\n", path);
+    }
+    return memfd;
+}
+#endif
+
+// Compile an ONNX partition once (typed + decluttered) and persist it in NNEF
+// form. The inference model is consumed. Optimization is redone on load since
+// optimized operators are not NNEF serializable. With USE_AES and compiled
+// set, the plaintext tar is also returned in memory, so loads can skip
+// unsealing it; *compiled stays NULL otherwise or if that fails.
+bool
+compile_partition(const char *model_name, TractInferenceModel **inference_model, const unsigned char *key, const unsigned char *tag,
+                  partition_buffer **compiled)
+{
+    assert(model_name);
+    assert(inference_model && *inference_model);
+
+    TractModel *model = NULL;
+    TractNnef *nnef = NULL;
+    bool ok = false;
+
+    if (compiled) *compiled = NULL;
+    char *path = compiled_partition_path(model_name);
+    if (!path) return false;
+
+    if (tract_inference_model_into_typed(inference_model, &model) != TRACT_RESULT_OK ||
+        tract_model_declutter(model) != TRACT_RESULT_OK) {
+        fprintf(stderr, "Error compiling %s: %s\n", model_name, tract_get_last_error());
+        goto exit;
+    }
+
+    nnef = create_nnef();
+    if (!nnef) goto exit;
+
+#ifdef USE_AES
+    assert(key && tag);
+    int memfd = memfd_create("compiled_partition", MFD_CLOEXEC);
+    if (memfd < 0) {
+        fprintf(stderr, "Error creating in-memory file for %s\n", model_name);
+        goto exit;
+    }
+    char fd_path[64];
+    snprintf(fd_path, sizeof(fd_path), "/proc/self/fd/%d", memfd);
+    if (tract_nnef_write_model_to_tar(nnef, fd_path, model) != TRACT_RESULT_OK) {
+        fprintf(stderr, "Error writing compiled %s: %s\n", model_name, tract_get_last_error());
+    } else {
+        ok = seal_compiled_partition(memfd, path, key, tag);
+    }
+    struct stat st;
+    if (ok && compiled && fstat(memfd, &st) == 0) {
+        *compiled = partition_buffer_adopt(memfd, (size_t) st.st_size);
+        if (*compiled) memcpy((*compiled)->tag, tag, TAG_BYTES * 2);
+    } else {
+        close(memfd);
+    }
+#else
+    (void) key;
+    (void) tag;
+    if (tract_nnef_write_model_to_tar(nnef, path, model) != TRACT_RESULT_OK) {
+        fprintf(stderr, "Error writing compiled %s: %s\n", model_name, tract_get_last_error());
+    } else {
+        ok = true;
+    }
+#endif
+
+exit:
+    if (nnef) tract_nnef_destroy(&nnef);
+    if (model) tract_model_destroy(&model);
+    if (*inference_model) tract_inference_model_destroy(inference_model);
+    if (!ok) remove(path);
+    free(path);
+    return ok;
+}
+
+// Loads, optimizes and makes runnable the compiled tar tract finds at path
+static TractRunnable *
+runnable_for_compiled_path(const char *model_name, const char *path)
+{
+    TractModel *model = NULL;
+    TractRunnable *runnable = NULL;
+
+    TractNnef *nnef = create_nnef();
+    if (!nnef) return NULL;
+
+    TRACT_RESULT ret = tract_nnef_model_for_path(nnef, path, &model);
+    tract_nnef_destroy(&nnef);
+    if (ret != TRACT_RESULT_OK) {
+        fprintf(stderr, "Error loading compiled %s: %s\n", model_name, tract_get_last_error());
+        return NULL;
+    }
+    assert(model);
+
+    if (tract_model_optimize(model) != TRACT_RESULT_OK) {
+        fprintf(stderr, "Error optimizing compiled %s: %s\n", model_name, tract_get_last_error());
+        tract_model_destroy(&model);
+        return NULL;
+    }
+
+    check_ret(tract_model_into_runnable(&model, &runnable), NULL);
+    assert(runnable);
+    assert(!model);
+
+    return runnable;
+}
+
+// Returns NULL when no usable compiled form exists, callers fall back to ONNX
+TractRunnable *
+load_compiled_partition(const char *model_name, const unsigned char *key, const unsigned char *tag)
+{
+    assert(model_name);
+
+    char *path = compiled_partition_path(model_name);
+    if (!path) return NULL;
+    if (access(path, R_OK) != 0) {
+        free(path);
+        return NULL;
+    }
+
+#ifdef USE_AES
+    if (!key || !tag) {
+        free(path);
+        return NULL;
+    }
+    size_t size = 0;
+    int memfd = unseal_compiled_partition(path, key, tag, &size);
+    free(path);
+    if (memfd < 0) return NULL;
+    partition_buffer *buffer = partition_buffer_adopt(memfd, size);
+    if (!buffer) return NULL;
+    TractRunnable *runnable = runnable_for_compiled_path(model_name, buffer->path);
+    partition_buffer_free(buffer);
+#else
+    (void) key;
+    (void) tag;
+    TractRunnable *runnable = runnable_for_compiled_path(model_name, path);
+    free(path);
+#endif
+    return runnable;
+}
+
+// Loads a decrypted compiled partition kept in memory, which
+// compile_partition returned
+TractRunnable *
+load_compiled_buffer(const char *model_name, const partition_buffer *buffer)
+{
+    assert(buffer);
+    return runnable_for_compiled_path(model_name, buffer->path);
+}
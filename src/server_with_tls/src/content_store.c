@@ -0,0 +1,350 @@
+#include <unistd.h>
+#include <content_store.h>
+#include <compiled_store.h>
+#include "mbedtls/sha256.h"
+#include "mbedtls/platform_util.h"
+
+static pthread_mutex_t store_lock = PTHREAD_MUTEX_INITIALIZER;
+static stored_partition *store[CONTENT_STORE_BUCKETS];
+
+int
+content_digest(const unsigned char *data, size_t size, unsigned char *digest)
+{
+    int ret = mbedtls_sha256(data, size, digest, 0);
+    if (ret != 0) {
+        fprintf(stderr, "mbedtls_sha256 failed - returned -0x%04x\n", -ret);
+        return -1;
+    }
+    return 0;
+}
+
+#ifdef USE_AES
+// Entries are scoped to the keys their file is encrypted under: they go by
+// the digest of the plaintext digest followed by the key, IV and AAD
+static int
+scoped_digest(const unsigned char *digest, const encrypted_models_info *keys, unsigned char *scoped)
+{
+    unsigned char material[DIGEST_BYTES + KEY_BYTES + IV_BYTES + ADD_DATA_BYTES];
+    memcpy(material, digest, DIGEST_BYTES);
+    memcpy(material + DIGEST_BYTES, keys->key, KEY_BYTES);
+    memcpy(material + DIGEST_BYTES + KEY_BYTES, keys->IV, IV_BYTES);
+    memcpy(material + DIGEST_BYTES + KEY_BYTES + IV_BYTES, keys->AAD, ADD_DATA_BYTES);
+    int ret = content_digest(material, sizeof(material), scoped);
+    mbedtls_platform_zeroize(material, sizeof(material));
+    return ret;
+}
+#endif
+
+static unsigned int
+digest_index(const unsigned char *digest)
+{
+    uint32_t index = (uint32_t) digest[0] << 24 | (uint32_t) digest[1] << 16 | (uint32_t) digest[2] << 8 | digest[3];
+    return index % CONTENT_STORE_BUCKETS;
+}
+
+static stored_partition *
+find_locked(const unsigned char *digest)
+{
+    stored_partition *current = store[digest_index(digest)];
+    while (current) {
+        if (memcmp(current->digest, digest, DIGEST_BYTES) == 0) return current;
+        current = current->next;
+    }
+    return NULL;
+}
+
+// path gets file_name in the directory partitions are stored in
+static int
+models_path(char *path, size_t size, const char *file_name)
+{
+    const char *home_dir = getenv("HOME");
+    if (!home_dir) {
+        fprintf(stderr, "Error: HOME environment variable is not set\n");
+        return -1;
+    }
+#ifdef USE_AES
+    int length = snprintf(path, size, "%s/encrypted_models/%s", home_dir, file_name);
+#else
+    int length = snprintf(path, size, "%s/unencrypted_models/%s", home_dir, file_name);
+#endif
+    if (length < 0 || (size_t) length >= size) {
+        fprintf(stderr, "Path of %s is too long\n", file_name);
+        return -1;
+    }
+    return 0;
+}
+
+static stored_partition *
+acquire(const unsigned char *digest)
+{
+    pthread_mutex_lock(&store_lock);
+    stored_partition *p = find_locked(digest);
+    if (p) p->refs++;
+    pthread_mutex_unlock(&store_lock);
+    return p;
+}
+
+// Takes a reference to the entry of digest, adding one for written if there
+// is none. An owned file is moved under the digest, or removed when the same
+// entry was stored first.
+static stored_partition *
+share_or_store(const unsigned char *digest, const char *written, bool owned, const encrypted_models_info *keys, int i)
+{
+    char path[512], hex[DIGEST_BYTES * 2 + 1];
+
+    pthread_mutex_lock(&store_lock);
+    stored_partition *p = find_locked(digest);
+    if (p) {
+        p->refs++;
+        pthread_mutex_unlock(&store_lock);
+        if (owned) remove(written);
+        return p;
+    }
+
+    p = (stored_partition *) calloc(1, sizeof(stored_partition));
+    if (!p) {
+        fprintf(stderr, "Memory allocation failed for a stored partition\n");
+        pthread_mutex_unlock(&store_lock);
+        return NULL;
+    }
+    if (owned) {
+        for (int j = 0; j < DIGEST_BYTES; j++) {
+            sprintf(hex + j * 2, "%02x", digest[j]);
+        }
+        if (models_path(path, sizeof(path), hex) != 0 || rename(written, path) != 0) {
+            fprintf(stderr, "Error storing %s as %s\n", written, hex);
+            pthread_mutex_unlock(&store_lock);
+            free(p);
+            return NULL;
+        }
+        p->path = strdup(path);
+    } else {
+        p->path = strdup(written);
+    }
+    if (!p->path) {
+        fprintf(stderr, "Memory allocation failed for a stored partition\n");
+        if (owned) remove(path);
+        pthread_mutex_unlock(&store_lock);
+        free(p);
+        return NULL;
+    }
+
+    memcpy(p->digest, digest, DIGEST_BYTES);
+    p->owned = owned;
+    p->refs = 1;
+#ifdef USE_AES
+    memcpy(p->key, keys->key, KEY_BYTES);
+    memcpy(p->IV, keys->IV, IV_BYTES);
+    memcpy(p->AAD, keys->AAD, ADD_DATA_BYTES);
+    memcpy(p->tag, keys->tag[i], TAG_BYTES);
+#else
+    (void) keys;
+    (void) i;
+#endif
+
+    unsigned int index = digest_index(digest);
+    p->next = store[index];
+    store[index] = p;
+    pthread_mutex_unlock(&store_lock);
+    return p;
+}
+
+// Drops a reference, the last one removes the entry along with the files
+// the store wrote for it. Returns true for the last one.
+static bool
+release(stored_partition *p)
+{
+    pthread_mutex_lock(&store_lock);
+    if (--p->refs > 0) {
+        pthread_mutex_unlock(&store_lock);
+        return false;
+    }
+
+    stored_partition **link = &store[digest_index(p->digest)];
+    while (*link && *link != p) link = &(*link)->next;
+    if (*link) *link = p->next;
+
+    if (p->owned) {
+        remove(p->path);
+#ifdef USE_COMPILED_STORE
+        char *compiled = compiled_partition_path(p->path);
+        if (compiled) remove(compiled);
+        free(compiled);
+#endif
+    }
+    pthread_mutex_unlock(&store_lock);
+
+    free(p->path);
+    free(p);
+    return true;
+}
+
+static bool
+release_model_partition(model_partitions *partitions, int i)
+{
+    stored_partition *p = partitions->partitions[i];
+    partitions->partitions[i] = NULL;
+    return p ? release(p) : false;
+}
+
+static void
+free_model_partitions(model_partitions *partitions)
+{
+    if (!partitions) return;
+    for (int i = 0; i < partitions->count; i++) {
+        release_model_partition(partitions, i);
+    }
+    free(partitions->partitions);
+    free(partitions);
+}
+
+model_partitions *
+create_model_partitions(int count)
+{
+    model_partitions *partitions = (model_partitions *) malloc(sizeof(model_partitions));
+    if (!partitions) {
+        fprintf(stderr, "Memory allocation failed for the model partitions\n");
+        return NULL;
+    }
+    partitions->partitions = (stored_partition **) calloc(count > 0 ? count : 1, sizeof(stored_partition *));
+    if (!partitions->partitions) {
+        fprintf(stderr, "Memory allocation failed for the model partitions\n");
+        free(partitions);
+        return NULL;
+    }
+    partitions->count = count;
+    partitions->release_partition = release_model_partition;
+    partitions->free_partitions = free_model_partitions;
+    return partitions;
+}
+
+void
+abort_staged_partitions(char **staged, int count)
+{
+    if (!staged) return;
+    for (int i = 0; i < count; i++) {
+        if (!staged[i]) continue;
+        remove(staged[i]);
+        free(staged[i]);
+    }
+    free(staged);
+}
+
+char **
+stage_partitions(model_partitions *partitions, const unsigned char *digests)
+{
+    char **staged = (char **) calloc(partitions->count > 0 ? partitions->count : 1, sizeof(char *));
+    if (!staged) {
+        fprintf(stderr, "Memory allocation failed for the staged partitions\n");
+        return NULL;
+    }
+
+#ifdef USE_AES
+    // Every registration encrypts under fresh keys, no entry is scoped to them yet
+    digests = NULL;
+#endif
+    for (int i = 0; i < partitions->count; i++) {
+        if (digests && (partitions->partitions[i] = acquire(digests + i * DIGEST_BYTES))) {
+            fprintf(stderr, "Partition %d is already stored as %s\n", i, partitions->partitions[i]->path);
+            continue;
+        }
+
+        char path[512];
+        int fd = -1;
+        if (models_path(path, sizeof(path), ".partition_XXXXXX") == 0) fd = mkstemp(path);
+        if (fd < 0 || !(staged[i] = strdup(path))) {
+            fprintf(stderr, "Error creating a file for partition %d\n", i);
+            if (fd >= 0) {
+                close(fd);
+                remove(path);
+            }
+            for (int j = 0; j < i; j++) release_model_partition(partitions, j);
+            abort_staged_partitions(staged, i);
+            return NULL;
+        }
+        close(fd);
+    }
+    return staged;
+}
+
+// Paths of the model's partitions, NULL-terminated, NULL after releasing
+// every partition if one could not be stored
+static char **
+partition_names(model_partitions *partitions)
+{
+    char **names = (char **) calloc(partitions->count + 1, sizeof(char *));
+    for (int i = 0; names && i < partitions->count; i++) {
+        if (!(names[i] = strdup(partitions->partitions[i]->path))) {
+            for (int j = 0; j < i; j++) free(names[j]);
+            free(names);
+            names = NULL;
+        }
+    }
+    if (!names) {
+        fprintf(stderr, "Memory allocation failed for the partition names\n");
+        for (int i = 0; i < partitions->count; i++) release_model_partition(partitions, i);
+    }
+    return names;
+}
+
+// With USE_AES entries are scoped to keys, so only identical partitions of
+// this model share one and keys->tag is left as written. staged is taken over.
+char **
+commit_partitions(model_partitions *partitions, char **staged, const unsigned char *digests,
+                  encrypted_models_info *keys)
+{
+    int count = partitions->count;
+    bool failed = false;
+
+    for (int i = 0; !failed && i < count; i++) {
+        if (staged[i]) {
+            const unsigned char *digest = digests + i * DIGEST_BYTES;
+#ifdef USE_AES
+            unsigned char scoped[DIGEST_BYTES];
+            if (scoped_digest(digest, keys, scoped) != 0) {
+                failed = true;
+                break;
+            }
+            digest = scoped;
+#endif
+            partitions->partitions[i] = share_or_store(digest, staged[i], true, keys, i);
+            if (!partitions->partitions[i]) {
+                failed = true;
+                break;
+            }
+            free(staged[i]);
+            staged[i] = NULL;
+        }
+    }
+
+    abort_staged_partitions(staged, count);
+    if (failed) {
+        for (int i = 0; i < count; i++) release_model_partition(partitions, i);
+        return NULL;
+    }
+    return partition_names(partitions);
+}
+
+char **
+commit_sources(model_partitions *partitions, char **sources, const unsigned char *digests)
+{
+    for (int i = 0; i < partitions->count; i++) {
+        partitions->partitions[i] = share_or_store(digests + i * DIGEST_BYTES, sources[i], false, NULL, i);
+        if (!partitions->partitions[i]) {
+            for (int j = 0; j < i; j++) release_model_partition(partitions, j);
+            return NULL;
+        }
+    }
+    return partition_names(partitions);
+}
+
+// True for the first registration asking, which then compiles the partition
+bool
+claim_compilation(stored_partition *partition)
+{
+    pthread_mutex_lock(&store_lock);
+    bool first = !partition->compiled;
+    partition->compiled = true;
+    pthread_mutex_unlock(&store_lock);
+    return first;
+}
@@ -1,7 +1,14 @@
 #include <assert.h>
 #include <stdio.h>
 #include <string.h>
+#include <sys/stat.h>
+#include <sys/time.h>
 #include <inference.h>
+#include <compiled_store.h>
+#include <partition_buffer.h>
+#include <content_store.h>
+#include <pipeline.h>
+#include <batcher.h>
 
 // INFERENCE INFO STRUCT - LOADING PHASE
 static TractInferenceModel **
@@ -20,8 +27,76 @@ initialize_inference_models(int num_models)
     return inference_models;
 }
 
+#if defined(USE_AES) || defined(USE_COMPILED_STORE) && !defined(USE_MEMORY_ONLY)
+// Content store entry of the i-th partition, NULL for models registered
+// without one
+static stored_partition *
+stored_partition_of(const model_partitions *partitions, int i)
+{
+    return partitions && i >= 0 && i < partitions->count ? partitions->partitions[i] : NULL;
+}
+#endif
+
+#ifdef USE_MEMORY_ONLY
+// Typed once at registration, requests only spawn their own state on it
+static TractRunnable *
+into_shared_runnable(TractInferenceModel **inference_model)
+{
+    TractModel *model = NULL;
+    TractRunnable *runnable = NULL;
+
+    check_ret(tract_inference_model_into_typed(inference_model, &model), NULL);
+    assert(model);
+
+    check_ret(tract_model_into_runnable(&model, &runnable), NULL);
+    assert(runnable);
+    assert(!model);
+
+    return runnable;
+}
+#endif
+
+#ifndef USE_MEMORY_ONLY
+// Size of the partition on disk, charged against the runnable cache budget
+static size_t
+partition_size(const char *model_name)
+{
+    struct stat st;
+    if (stat(model_name, &st) != 0) {
+        fprintf(stderr, "Error reading the size of %s\n", model_name);
+        return 0;
+    }
+    return (size_t)st.st_size;
+}
+
+#ifdef USE_COMPILED_STORE
+#ifdef USE_AES
+// A decrypted compiled partition saves unsealing it on every load, it is
+// kept if it fits in the resident budget
+static partition_buffer *
+keep_compiled_buffer(partition_buffer *compiled)
+{
+    if (compiled && !partition_buffer_reserve(compiled->size)) {
+        partition_buffer_free(compiled);
+        compiled = NULL;
+    }
+    return compiled;
+}
+#endif
+
+// A partition shared with a model registered earlier is compiled, and kept
+// in memory, by that model only
+static bool
+compiles_partition(const model *m, int i)
+{
+    stored_partition *stored = stored_partition_of(m->partitions, i);
+    return !stored || claim_compilation(stored);
+}
+#endif
+#endif
+
 static void
-onnx_model_inputs(operator_io **io, TractInferenceModel *inference_model, int index, operator_node *head, char *model_name)
+onnx_model_inputs(operator_io **io, TractInferenceModel *inference_model, int index, operator_node **nodes, char *model_name)
 {
     uintptr_t num_inputs = 0;
     char *input_name = NULL;
@@ -57,24 +132,15 @@ onnx_model_inputs(operator_io **io, TractInferenceModel *inference_model, int in
     }
 
     operator_io o_io;
-    operator_node *head2 = NULL;
     o_io.input_names_length = num_inputs;
-    if (num_inputs == 0) {
-        head2 = head;
-        o_io.input_names = NULL;
-        head = NULL;
-    } else {
-        o_io.input_names = input_names;
-    }
+    o_io.input_names = num_inputs == 0 ? NULL : input_names;
     o_io.output_names_length = num_outputs;
     o_io.output_names = output_names;
     insert_into_operator_io(&io, &o_io, index, model_name);
 
     if (num_inputs == 0) {
-        operator_node *child = search_operator_node_by_name(head2, io[index]->model_name);
-        if (!child) return;
-        child->num_inputs = io[index]->input_names_length;
-        child->num_outputs = io[index]->output_names_length;
+        nodes[index]->num_inputs = io[index]->input_names_length;
+        nodes[index]->num_outputs = io[index]->output_names_length;
     }
 
     for (int i=0; i < (int)num_inputs; i++) {
@@ -87,12 +153,36 @@ onnx_model_inputs(operator_io **io, TractInferenceModel *inference_model, int in
     }
     free(output_names);
 
-    update_node(io, index, head);
+    if (num_inputs > 0) update_node(io, index, nodes);
+}
+
+// Frees what load_model_to_memory built before a partition failed to load,
+// the model is left without a plan. Returns -1.
+static int
+discard_model_load(model *m, operator_node *head, operator_node **nodes, operator_io **io,
+                   TractInferenceModel **inference_models, TractRunnable **runnables, int model_count)
+{
+    if (head) {
+        char **visited_nodes = (char **) malloc((model_count + 1) * sizeof(char *));
+        assert(visited_nodes);
+        int visited_count = 0;
+        free_operator_node(head, visited_nodes, &visited_count);
+        free(visited_nodes);
+    }
+    free(nodes);
+    free_operator_io(io);
+    if (runnables) free_runnables(runnables, model_count + 1);
+    free_inference_models(inference_models, model_count + 1);
+    if (m->buffers) {
+        m->buffers->free_buffers(m->buffers);
+        m->buffers = NULL;
+    }
+    return -1;
 }
 
 #ifdef USE_AES
 static TractInferenceModel *
-onnx_model_for_path(char *model_name, TractInferenceModel *inference_model, struct EncryptionParameters *params) {
+onnx_model_for_path(const char *model_name, TractInferenceModel *inference_model, struct EncryptionParameters *params) {
     // Initialize onnx parser
     TractOnnx *onnx = NULL;
     check_ret(tract_onnx_create(&onnx), NULL);
@@ -116,17 +206,17 @@ onnx_model_for_path(char *model_name, TractInferenceModel *inference_model, stru
     return inference_model;
 }
 
-void
+int
 load_model_to_memory(model **m, unsigned char **tags, int count_tags)
 {
-    if (!m) return;
+    if (!m) return -1;
 
     assert(tags);
 
     EncryptionParameters *params = (EncryptionParameters *)malloc(sizeof(EncryptionParameters));
     if (!params) {
         fprintf(stderr, "Memory allocation for params failed\n");
-        return;
+        return -1;
     }
     uint8_t *key = (uint8_t *)malloc(KEY_BYTES);
     uint8_t *iv = (uint8_t *)malloc(IV_BYTES);
@@ -134,8 +224,11 @@ load_model_to_memory(model **m, unsigned char **tags, int count_tags)
     uint8_t *aad = (uint8_t *)malloc(ADD_DATA_BYTES);
     if (!key || !iv || !aad) {
         fprintf(stderr, "Memory allocation for key, iv, tag, aad failed\n");
+        free(key);
+        free(iv);
+        free(aad);
         free(params);
-        return;
+        return -1;
     }
     memcpy(key, (*m)->key, KEY_BYTES);
     memcpy(iv, (*m)->IV, IV_BYTES);
@@ -146,43 +239,61 @@ load_model_to_memory(model **m, unsigned char **tags, int count_tags)
     if (!params->key || !params->iv || !params->aad) {
         fprintf(stderr, "Error reading Encryption parameters from onnx table\n");
         free(params);
-        return;
+        return -1;
     }
 
     char **names = (*m)->names;
     int model_count = get_array_size((void **)names);
     fprintf(stderr, "Model count: %d\n", model_count);
     if (model_count != count_tags) {
+        fprintf(stderr, "Model has %d partitions but %d tags\n", model_count, count_tags);
         free(tag);
         free(key);
         free(iv);
         free(aad);
         free(params);
-        return;
+        return -1;
     }
 
     TractInferenceModel **inference_models = initialize_inference_models(model_count + 1);
+    assert(inference_models);
+    TractRunnable **runnables = NULL;
+#ifdef USE_MEMORY_ONLY
+    runnables = (TractRunnable **)calloc(model_count + 1, sizeof(TractRunnable *));
+    assert(runnables);
+#endif
     int initial_length = 10;
     operator_io **io = init_operator_io(initial_length);
     assert(io);
     operator_node *previous = NULL, *curr_node = NULL, *head = NULL;
+    operator_node **nodes = (operator_node **)calloc(model_count + 1, sizeof(operator_node *));
+    assert(nodes);
+#if !defined(USE_MEMORY_ONLY) && defined(USE_COMPILED_STORE)
+    model_buffers *buffers = create_model_buffers(model_count);
+    (*m)->buffers = buffers;
+#endif
 
     for (int i = 1; i < model_count + 1; i++) {
         tag = (uint8_t *)malloc(TAG_BYTES * 2 + 1);
         if (!tag) {
             fprintf(stderr, "Memory allocation for tag failed\n");
-            free(tag);
             free(key);
             free(iv);
             free(aad);
             free(params);
-            return;
+            return discard_model_load(*m, head, nodes, io, inference_models, runnables, model_count);
         }
         memcpy(tag, tags[i-1], TAG_BYTES * 2);
         tag[TAG_BYTES * 2] = '\0';
         fprintf(stderr, "Tag in load_model_to_memory: %s\n", tag);
         params->tag = tag;
 
+        // Every partition opens with the keys it was stored with
+        const stored_partition *stored = stored_partition_of((*m)->partitions, i - 1);
+        params->key = stored ? stored->key : key;
+        params->iv = stored ? stored->IV : iv;
+        params->aad = stored ? stored->AAD : aad;
+
         inference_models[i] = onnx_model_for_path(names[i-1], inference_models[i], params);
         if (!inference_models[i]) {
             free(tag);
@@ -190,7 +301,7 @@ load_model_to_memory(model **m, unsigned char **tags, int count_tags)
             free(iv);
             free(aad);
             free(params);
-            return;
+            return discard_model_load(*m, head, nodes, io, inference_models, runnables, model_count);
         }
 
         if (i == initial_length) {
@@ -200,16 +311,39 @@ load_model_to_memory(model **m, unsigned char **tags, int count_tags)
         }
 
         curr_node = create_operator_node(names[i-1]);
+        curr_node->index = i;
+        nodes[i] = curr_node;
         curr_node->run_inference = run_inference;
         if (previous) {
             insert_child_to_operator_node(previous, curr_node);
         } else {
             head = create_operator_node("input");
+            nodes[0] = head;
             insert_child_to_operator_node(head, curr_node);
         }
         previous = curr_node;
 
-        onnx_model_inputs(io, inference_models[i], i, head, names[i-1]);
+        onnx_model_inputs(io, inference_models[i], i, nodes, names[i-1]);
+#ifdef USE_MEMORY_ONLY
+        runnables[i] = into_shared_runnable(&inference_models[i]);
+        if (!runnables[i]) {
+            free(tag);
+            free(key);
+            free(iv);
+            free(aad);
+            free(params);
+            return discard_model_load(*m, head, nodes, io, inference_models, runnables, model_count);
+        }
+#elif defined(USE_COMPILED_STORE)
+        partition_buffer *compiled = NULL;
+        if (!compiles_partition(*m, i - 1)) {
+            // Already compiled for the model registered with it first
+        } else if (!compile_partition(names[i-1], &inference_models[i], params->key, tag, buffers ? &compiled : NULL)) {
+            fprintf(stderr, "Compiled form unavailable for %s, falling back to ONNX\n", names[i-1]);
+        } else if (buffers) {
+            buffers->buffers[i-1] = keep_compiled_buffer(compiled);
+        }
+#endif
         free(tag);
     }
 
@@ -217,20 +351,30 @@ load_model_to_memory(model **m, unsigned char **tags, int count_tags)
     free(iv);
     free(aad);
     free(params);
-    free_operator_io(io);
 
+    (*m)->plan = build_execution_plan(nodes, model_count + 1);
+    if (!(*m)->plan) {
+        return discard_model_load(*m, head, nodes, io, inference_models, runnables, model_count);
+    }
     (*m)->head = head;
+    free(nodes);
+    free_operator_io(io);
 
-#ifdef USE_MEMORY_ONLY
-    (*m)->inference_models = inference_models;
-#else
+    (*m)->runnables = runnables;
     free_inference_models(inference_models, model_count + 1);
+
+#ifdef USE_PIPELINE
+    start_model_pipeline(*m, tags);
+#endif
+#ifdef USE_BATCHING
+    (*m)->batcher = create_model_batcher((*m)->plan);
 #endif
+    return 0;
 }
 
 #else
 TractInferenceModel *
-onnx_model_for_path(char *model_name, TractInferenceModel *inference_model) {
+onnx_model_for_path(const char *model_name, TractInferenceModel *inference_model) {
     // Initialize onnx parser
     TractOnnx *onnx = NULL;
     check_ret(tract_onnx_create(&onnx), NULL);
@@ -254,25 +398,33 @@ onnx_model_for_path(char *model_name, TractInferenceModel *inference_model) {
     return inference_model;
 }
 
-void
+int
 load_model_to_memory(model **m)
 {
-    if (!m) return;
+    if (!m) return -1;
 
     char **names = (*m)->names;
     int model_count = get_array_size((void **)names);
     fprintf(stderr, "Model count: %d\n", model_count);
 
     TractInferenceModel **inference_models = initialize_inference_models(model_count + 1);
+    assert(inference_models);
+    TractRunnable **runnables = NULL;
+#ifdef USE_MEMORY_ONLY
+    runnables = (TractRunnable **)calloc(model_count + 1, sizeof(TractRunnable *));
+    assert(runnables);
+#endif
     int initial_length = 10;
     operator_io **io = init_operator_io(initial_length);
     assert(io);
     operator_node *previous = NULL, *curr_node = NULL, *head = NULL;
+    operator_node **nodes = (operator_node **)calloc(model_count + 1, sizeof(operator_node *));
+    assert(nodes);
 
     for (int i = 1; i < model_count + 1; i++) {
         inference_models[i] = onnx_model_for_path(names[i-1], inference_models[i]);
         if (!inference_models[i]) {
-            return;
+            return discard_model_load(*m, head, nodes, io, inference_models, runnables, model_count);
         }
 
         if (i == initial_length) {
@@ -282,127 +434,421 @@ load_model_to_memory(model **m)
         }
 
         curr_node = create_operator_node(names[i-1]);
+        curr_node->index = i;
+        nodes[i] = curr_node;
         curr_node->run_inference = run_inference;
         if (previous) {
             insert_child_to_operator_node(previous, curr_node);
         } else {
             head = create_operator_node("input");
+            nodes[0] = head;
             insert_child_to_operator_node(head, curr_node);
         }
         previous = curr_node;
 
-        onnx_model_inputs(io, inference_models[i], i, head, names[i-1]);
+        onnx_model_inputs(io, inference_models[i], i, nodes, names[i-1]);
+#ifdef USE_MEMORY_ONLY
+        runnables[i] = into_shared_runnable(&inference_models[i]);
+        if (!runnables[i]) {
+            return discard_model_load(*m, head, nodes, io, inference_models, runnables, model_count);
+        }
+#elif defined(USE_COMPILED_STORE)
+        if (!compiles_partition(*m, i - 1)) {
+            // Already compiled for the model registered with it first
+        } else if (!compile_partition(names[i-1], &inference_models[i], NULL, NULL, NULL)) {
+            fprintf(stderr, "Compiled form unavailable for %s, falling back to ONNX\n", names[i-1]);
+        }
+#endif
+    }
+    (*m)->plan = build_execution_plan(nodes, model_count + 1);
+    if (!(*m)->plan) {
+        return discard_model_load(*m, head, nodes, io, inference_models, runnables, model_count);
     }
     (*m)->head = head;
+    free(nodes);
+    (*m)->runnables = runnables;
 
     free_operator_io(io);
     free_inference_models(inference_models, model_count + 1);
+
+#ifdef USE_PIPELINE
+    start_model_pipeline(*m, NULL);
+#endif
+#ifdef USE_BATCHING
+    (*m)->batcher = create_model_batcher((*m)->plan);
+#endif
+    return 0;
 }
 #endif
 
-// INFERENCE
-#if USE_AES == 0 && USE_MEMORY_ONLY == 0 || USE_AES == 1 && USE_MEMORY_ONLY == 1
-void
-run_inference(operator_node **node, TractValue **input_values, TractInferenceModel *inference_model)
+#ifndef USE_MEMORY_ONLY
+// PARTITION LOADING - ON-DISK MODE
+#ifdef USE_AES
+// Index of the partition in the model, -1 if it is not one of its partitions
+static int
+partition_index(const partition_loader *loader, const char *model_name)
 {
-#ifdef USE_SYS_TIME
-    struct timeval t1_run, t2_run;
+    if (!loader->names) return -1;
+    for (int i = 0; loader->names[i]; i++) {
+        if (strcmp(loader->names[i], model_name) == 0) return i;
+    }
+    return -1;
+}
+
+#ifdef USE_COMPILED_STORE
+// Decrypted compiled partition kept at registration, NULL when it is
+// unsealed from disk
+static const partition_buffer *
+find_partition_buffer(const partition_loader *loader, int index)
+{
+    if (!loader->buffers || index < 0 || index >= loader->buffers->count) return NULL;
+    return loader->buffers->buffers[index];
+}
+#endif
 #endif
-    double elapsed_time;
 
+static TractRunnable *
+load_runnable(partition_loader *loader, const char *model_name, const unsigned char *tag)
+{
     TractModel *model = NULL;
-#ifndef USE_MEMORY_ONLY
-        // Initialize onnx parser
-        TractOnnx *onnx = NULL;
-        check(tract_onnx_create(&onnx));
-        assert(onnx);
-
-        // Load the model
-        check(tract_onnx_model_for_path(onnx, (*node)->model_name, &inference_model));
-        assert(inference_model);
-        assert(onnx);
-
-        check(tract_onnx_destroy(&onnx));
-        assert(!onnx);
+    TractInferenceModel *inference_model = NULL;
+    TractRunnable *runnable = NULL;
+#ifdef USE_AES
+    assert(loader->params);
+    int index = partition_index(loader, model_name);
+    // Shared partitions open with the keys they were stored with
+    const stored_partition *stored = stored_partition_of(loader->partitions, index);
+    EncryptionParameters params;
+    params.key = stored ? stored->key : loader->params->key;
+    params.iv = stored ? stored->IV : loader->params->iv;
+    params.aad = stored ? stored->AAD : loader->params->aad;
+    params.tag = tag;
+#endif
 
-        // Transform an inference model into a typed model
-        check(tract_inference_model_into_typed(&inference_model,&model));
-        assert(model);
+#ifdef USE_COMPILED_STORE
+    // Prefer the compiled form persisted at registration, it skips ONNX
+    // parsing. A decrypted one kept in memory only serves the tag it was
+    // authenticated with, other tags go through the sealed file.
+#ifdef USE_AES
+    const partition_buffer *buffer = find_partition_buffer(loader, index);
+    if (buffer && tag && memcmp(buffer->tag, tag, TAG_BYTES * 2) == 0) {
+        runnable = load_compiled_buffer(model_name, buffer);
+    }
+    if (!runnable) runnable = load_compiled_partition(model_name, params.key, tag);
+#else
+    runnable = load_compiled_partition(model_name, NULL, NULL);
+#endif
+    if (runnable) return runnable;
+#endif
 
-        free_inference_model(inference_model);
+    // Load the model
+#ifdef USE_AES
+    inference_model = onnx_model_for_path(model_name, inference_model, &params);
 #else
+    (void) loader;
+    (void) tag;
+    inference_model = onnx_model_for_path(model_name, inference_model);
+#endif
+    if (!inference_model) return NULL;
+
     // Transform an inference model into a typed model
-    check(tract_inference_model_into_typed(&inference_model,&model));
+    check_ret(tract_inference_model_into_typed(&inference_model, &model), NULL);
     assert(model);
-#endif
+
+    free_inference_model(inference_model);
 
     // Make the model runnable
-    TractRunnable *runnable = NULL;
-    check(tract_model_into_runnable(&model, &runnable));
+    check_ret(tract_model_into_runnable(&model, &runnable), NULL);
     assert(runnable);
     assert(!model);
 
-    int argmax = 0;
-    float max = 0.0, val = 0.0;
-    int num_outputs = (*node)->num_outputs;
-    TractValue **outputs = malloc((num_outputs + 1) * sizeof(TractValue *));
-    const float *data = NULL;
+    return runnable;
+}
+
+static void
+init_partition_loader(partition_loader *loader, runnable_cache *cache, const model *m, EncryptionParameters *params)
+{
+    assert(loader);
+    assert(m);
+
+    loader->cache = cache;
+    loader->buffers = m->buffers;
+    loader->partitions = m->partitions;
+    loader->names = m->names;
+    loader->params = params;
+    loader->prefetch.active = false;
+    loader->prefetch.model_name = NULL;
+    loader->prefetch.has_tag = false;
+    loader->prefetch.runnable = NULL;
+}
+
+#ifdef USE_PREFETCH
+static void *
+prefetch_thread(void *arg)
+{
+    partition_loader *loader = (partition_loader *)arg;
+    prefetch_slot *slot = &loader->prefetch;
+
+    slot->runnable = load_runnable(loader, slot->model_name, slot->has_tag ? slot->tag : NULL);
+    return NULL;
+}
+
+// Decrypt, parse and prepare the next partition while the current one runs
+static void
+prefetch_partition(partition_loader *loader, const char *model_name, const unsigned char *tag)
+{
+    assert(loader);
+
+    prefetch_slot *slot = &loader->prefetch;
+    if (slot->active || !model_name) return;
+    if (runnable_cache_contains(loader->cache, model_name, tag)) return;
+
+    slot->model_name = strdup(model_name);
+    slot->has_tag = tag != NULL;
+    if (tag) memcpy(slot->tag, tag, TAG_BYTES * 2);
+    slot->runnable = NULL;
+
+    if (pthread_create(&slot->thread, NULL, prefetch_thread, loader) != 0) {
+        fprintf(stderr, "Error creating prefetch thread for %s\n", model_name);
+        free(slot->model_name);
+        slot->model_name = NULL;
+        return;
+    }
+    slot->active = true;
+}
+
+static TractRunnable *
+take_prefetched(partition_loader *loader, const char *model_name)
+{
+    prefetch_slot *slot = &loader->prefetch;
+    if (!slot->active || strcmp(slot->model_name, model_name) != 0) return NULL;
+
+    pthread_join(slot->thread, NULL);
+    slot->active = false;
+    free(slot->model_name);
+    slot->model_name = NULL;
+
+    TractRunnable *runnable = slot->runnable;
+    slot->runnable = NULL;
+    return runnable;
+}
+#endif
+
+// Wait for an outstanding prefetch and drop its runnable
+static void
+drain_partition_loader(partition_loader *loader)
+{
+#ifdef USE_PREFETCH
+    prefetch_slot *slot = &loader->prefetch;
+    if (!slot->active) return;
+
+    TractRunnable *runnable = take_prefetched(loader, slot->model_name);
+    if (runnable && tract_runnable_release(&runnable) != TRACT_RESULT_OK) {
+        fprintf(stderr, "Error releasing prefetched runnable\n");
+    }
+#else
+    (void) loader;
+#endif
+}
+
+// Cached runnable, then prefetched runnable, then a synchronous load. The
+// partition runs on its own state, which keeps the runnable alive even if
+// the cache evicts it meanwhile, so requests and workers can share entries.
+static TractState *
+acquire_state(partition_loader *loader, const char *model_name, const unsigned char *tag)
+{
+    assert(loader);
+
+    struct timeval t1_load, t2_load;
+
+    TractState *state = runnable_cache_spawn_state(loader->cache, model_name, tag);
+    if (state) return state;
+
+    // The wait is what keeping the partition resident would save, a
+    // prefetch that overlapped the previous partition only leaves the rest
+    gettimeofday(&t1_load, NULL);
+    TractRunnable *runnable = NULL;
+#ifdef USE_PREFETCH
+    runnable = take_prefetched(loader, model_name);
+#endif
+    if (!runnable) runnable = load_runnable(loader, model_name, tag);
+    if (!runnable) return NULL;
+    gettimeofday(&t2_load, NULL);
+    double load_ms = (t2_load.tv_sec - t1_load.tv_sec) * 1000.0;      // sec to ms
+    load_ms += (t2_load.tv_usec - t1_load.tv_usec) / 1000.0;          // us to ms
+
+    if (tract_runnable_spawn_state(runnable, &state) != TRACT_RESULT_OK) {
+        fprintf(stderr, "Error calling tract: %s\n", tract_get_last_error());
+        state = NULL;
+    }
+
+    if (!runnable_cache_put(loader->cache, model_name, tag, runnable, partition_size(model_name), load_ms)) {
+        if (tract_runnable_release(&runnable) != TRACT_RESULT_OK) {
+            fprintf(stderr, "Error releasing runnable\n");
+        }
+    }
+    return state;
+}
+
+// Runs the partition and records its run time for the residency policy
+static void
+run_acquired_state(const plan_step *step, execution_context *ctx, partition_loader *loader, TractState *state)
+{
+    struct timeval t1_run, t2_run;
 
-#ifdef USE_SYS_TIME
     gettimeofday(&t1_run, NULL);
+    run_step_on_state(step, ctx, state);
+    gettimeofday(&t2_run, NULL);
+
+    double run_ms = (t2_run.tv_sec - t1_run.tv_sec) * 1000.0;        // sec to ms
+    run_ms += (t2_run.tv_usec - t1_run.tv_usec) / 1000.0;            // us to ms
+    runnable_cache_record_run(loader->cache, step->node->model_name, run_ms);
+}
+
 #endif
 
-    int k = 0, index = 0;
-    TractValue **inputs = malloc(((*node)->num_inputs + 1) * sizeof(TractValue *));
-    int *indices = (*node)->parent_output_indices;
-    for (int i = 0; i < (*node)->num_inputs; i++) {
-        if (!(*node)->parents) break;
-        if (strcmp((*node)->parents[i]->model_name, "input") == 0) {
-            index++;
-            int num_inputs = get_array_size((void **)input_values);
-            for (int j = 0; j < num_inputs; j++) {
+#ifdef USE_PIPELINE
+// Loads every partition once and hands them to per-stage threads. In
+// memory-only mode the stages share the model's runnables.
+void
+start_model_pipeline(model *m, unsigned char **tags)
+{
+    assert(m && m->plan);
+
+    int num_nodes = m->plan->num_steps + 1;
+#ifdef USE_MEMORY_ONLY
+    (void) tags;
+    if (!m->runnables) return;
+    m->pipeline = create_model_pipeline(m->plan, m->runnables, num_nodes, false, NULL);
+#else
+    EncryptionParameters params;
+    params.key = m->key;
+    params.iv = m->IV;
+    params.aad = m->AAD;
+    params.tag = NULL;
+
+    partition_loader loader;
+    init_partition_loader(&loader, NULL, m, &params);
+
+    TractRunnable **runnables = (TractRunnable **)calloc(num_nodes, sizeof(TractRunnable *));
+    assert(runnables);
+    for (int s = 0; s < m->plan->num_steps; s++) {
+        const operator_node *node = m->plan->steps[s].node;
+        runnables[node->index] = load_runnable(&loader, node->model_name, tags ? tags[node->index - 1] : NULL);
+        if (!runnables[node->index]) {
+            fprintf(stderr, "Error loading %s for the pipeline, running without it\n", node->model_name);
+            free_runnables(runnables, num_nodes);
+            return;
+        }
+    }
+
+    m->pipeline = create_model_pipeline(m->plan, runnables, num_nodes, true, tags);
+    if (!m->pipeline) free_runnables(runnables, num_nodes);
+#endif
+}
+#endif
+
+// INFERENCE
+// Producer outputs (or the request inputs) in the order the partition expects them
+static TractValue **
+gather_inputs(const plan_step *step, execution_context *ctx)
+{
+    TractValue **input_values = ctx->states[0].outputs;
+    int num_request_inputs = ctx->states[0].num_outputs;
+
+    int capacity = 1;
+    for (int i = 0; i < step->num_inputs; i++) {
+        capacity += step->inputs[i].producer == 0 ? num_request_inputs : 1;
+    }
+
+    int k = 0;
+    TractValue **inputs = malloc(capacity * sizeof(TractValue *));
+    assert(inputs);
+    for (int i = 0; i < step->num_inputs; i++) {
+        const plan_input *input = &step->inputs[i];
+        if (input->producer == 0) {
+            for (int j = 0; j < num_request_inputs; j++) {
                 inputs[k++] = input_values[j];
             }
             continue;
         }
-        if (!(*node)->parents[i]->outputs[indices[index]]) {
+        TractValue **producer_outputs = ctx->states[input->producer].outputs;
+        if (!producer_outputs || !producer_outputs[input->output]) {
             fprintf(stderr, "The output is NULL!");
             continue;
         }
-        inputs[k++] = (*node)->parents[i]->outputs[indices[index++]];
-    }
-    if ((*node)->num_inputs == -1 || (*node)->num_parents == 0) {
-        int num_inputs = get_array_size((void **)input_values);
-        inputs = realloc(inputs, (num_inputs + 1) * sizeof(TractValue *));
-        assert(inputs);
-        for (int j = 0; j < num_inputs; j++) {
-            inputs[k++] = input_values[j];
-        }
+        inputs[k++] = producer_outputs[input->output];
     }
     inputs[k] = NULL;
-    check(tract_runnable_run(runnable, inputs, outputs));
-    free(inputs);
+    return inputs;
+}
+
+// Hands the outputs over to the request's context together with the argmax of the last output
+static void
+store_outputs(const operator_node *node, execution_context *ctx, TractValue **outputs, double elapsed_time)
+{
+    int argmax = 0;
+    float max = 0.0;
+    const float *data = NULL;
+    uintptr_t rank = 0;
+    const uintptr_t *shape = NULL;
+    int num_outputs = node->num_outputs;
 
     for (int i = 0; i < num_outputs; i++) {
         if (outputs[i] == NULL) {
             fprintf(stderr, "Output %d is NULL\n", i);
             continue;
         }
-        
-        check(tract_value_as_bytes(outputs[i], NULL, NULL, NULL, (const void**) &data));
-
-        max = data[0];
-        argmax = 0;
-        for(int i = 0; i < 1000; i++) {
-            val = data[i];
-            if(val > max) {
-                max = val;
-                argmax = i;
-            }
+
+        check(tract_value_as_bytes(outputs[i], NULL, &rank, &shape, (const void**) &data));
+
+        uintptr_t length = 1;
+        for (uintptr_t j = 0; j < rank; j++) {
+            length *= shape[j];
         }
-        assert(data[argmax] == max);
+        argmax = row_argmax(data, length, &max);
         data = NULL;
     }
+    outputs[num_outputs] = NULL;
+
+    retain_node_outputs(ctx, node, outputs);
+    node_state *state = &ctx->states[node->index];
+    state->pred = max;
+    state->category = argmax;
+    state->elapsed_time = elapsed_time;
+}
+
+// Runs a partition on a state spawned for this request, the state is destroyed
+void
+run_step_on_state(const plan_step *step, execution_context *ctx, TractState *state)
+{
+    const operator_node *node = step->node;
+#ifdef USE_SYS_TIME
+    struct timeval t1_run, t2_run;
+#endif
+    double elapsed_time;
+
+    int num_outputs = node->num_outputs;
+    TractValue **outputs = calloc(num_outputs + 1, sizeof(TractValue *));
+    assert(outputs);
+
+#ifdef USE_SYS_TIME
+    gettimeofday(&t1_run, NULL);
+#endif
+
+    // A failed run leaves the step without outputs, the state still holds
+    // its runnable and is destroyed all the same
+    TractValue **inputs = gather_inputs(step, ctx);
+    if (tract_state_run(state, inputs, outputs) != TRACT_RESULT_OK) {
+        fprintf(stderr, "Error calling tract: %s\n", tract_get_last_error());
+        free(inputs);
+        free(outputs);
+        if (tract_state_destroy(&state) != TRACT_RESULT_OK) {
+            fprintf(stderr, "Error destroying tract state\n");
+        }
+        return;
+    }
+    free(inputs);
 
 #ifdef USE_SYS_TIME
     gettimeofday(&t2_run, NULL);
@@ -412,62 +858,382 @@ run_inference(operator_node **node, TractValue **input_values, TractInferenceMod
     elapsed_time = 0.0;
 #endif
 
-    check(tract_runnable_release(&runnable));
-    assert(!runnable);
+    check(tract_state_destroy(&state));
+    assert(!state);
 
-    (*node)->outputs = (TractValue **)malloc((num_outputs + 1) * sizeof(TractValue *));
-    for (int i = 0; i < num_outputs; i++) {
-        if (outputs[i] == NULL) {
-            fprintf(stderr, "Output %d is NULL\n", i);
-            continue;
+    store_outputs(node, ctx, outputs, elapsed_time);
+    release_activations(ctx, step);
+}
+
+#if USE_AES == 0 && USE_MEMORY_ONLY == 0 || USE_AES == 1 && USE_MEMORY_ONLY == 1
+void
+#ifdef USE_MEMORY_ONLY
+run_inference(const plan_step *step, execution_context *ctx, TractRunnable *runnable)
+#else
+run_inference(const plan_step *step, execution_context *ctx, partition_loader *loader)
+#endif
+{
+#ifndef USE_MEMORY_ONLY
+    TractState *state = acquire_state(loader, step->node->model_name, NULL);
+    if (!state) return;
+    run_acquired_state(step, ctx, loader, state);
+#else
+    // The runnable is shared by every request, each one runs on its own state
+    TractState *state = NULL;
+    check(tract_runnable_spawn_state(runnable, &state));
+    assert(state);
+    run_step_on_state(step, ctx, state);
+#endif
+}
+#endif
+
+
+// PARALLEL EXECUTION
+// Runs one step on the calling worker, true when the partition produced its outputs
+static bool
+run_step(plan_scheduler *sched, int s)
+{
+    const plan_step *step = &sched->plan->steps[s];
+    const operator_node *node = step->node;
+    struct timeval t1_step, t2_step;
+
+    gettimeofday(&t1_step, NULL);
+#ifdef USE_MEMORY_ONLY
+    assert(sched->runnables);
+    node->run_inference(step, sched->ctx, sched->runnables[node->index]);
+#elif defined(USE_AES)
+    // Workers share the key, every partition is authenticated with its own tag
+    EncryptionParameters params = *sched->params;
+    params.tag = sched->tags[node->index - 1];
+    node->run_inference(step, sched->ctx, &params, sched->loader);
+#else
+    node->run_inference(step, sched->ctx, sched->loader);
+#endif
+    gettimeofday(&t2_step, NULL);
+
+    sched->durations[s] = (t2_step.tv_sec - t1_step.tv_sec) * 1000.0;      // sec to ms
+    sched->durations[s] += (t2_step.tv_usec - t1_step.tv_usec) / 1000.0;   // us to ms
+
+    node_state *state = &sched->ctx->states[node->index];
+    fprintf(stderr, "Model name: %s\n", node->model_name);
+#ifdef USE_AES
+    fprintf(stderr, "Partition_%d: %f ms\n", node->index - 1, state->elapsed_time);
+#elif defined(USE_MEMORY_ONLY) || !defined(USE_SYS_TIME)
+    fprintf(stderr, "Partition_%d: %f ms\n", node->index, state->elapsed_time);
+#else
+    fprintf(sched->fd, "Partition_%d: %f ms\n", node->index, state->elapsed_time);
+#endif
+
+    return state->outputs != NULL;
+}
+
+// Lowest-index ready step first, so a single worker keeps the plan order
+static int
+pop_ready_step(plan_scheduler *sched)
+{
+    int best = 0;
+    for (int i = 1; i < sched->num_ready; i++) {
+        if (sched->ready[i] < sched->ready[best]) best = i;
+    }
+    int s = sched->ready[best];
+    sched->ready[best] = sched->ready[--sched->num_ready];
+    sched->missing[s] = -1;
+
+    while (sched->frontier < sched->plan->num_steps && sched->missing[sched->frontier] == -1) {
+        sched->frontier++;
+    }
+    return s;
+}
+
+static void *
+plan_worker(void *arg)
+{
+    plan_scheduler *sched = (plan_scheduler *)arg;
+    int num_steps = sched->plan->num_steps;
+
+    pthread_mutex_lock(&sched->lock);
+    while (true) {
+        while (!sched->failed && sched->completed < num_steps &&
+               (sched->num_ready == 0 || sched->running >= sched->max_running)) {
+            pthread_cond_wait(&sched->cond, &sched->lock);
+        }
+        if (sched->failed || sched->completed == num_steps) break;
+
+        int s = pop_ready_step(sched);
+        sched->running++;
+#if !defined(USE_MEMORY_ONLY) && defined(USE_PREFETCH)
+        // With a single partition in flight the loader thread is the spare
+        // resident slot: it loads the step that comes next in plan order
+        const plan_step *next = NULL;
+        if (sched->max_running == 1 && MAX_RESIDENT_PARTITIONS > 1 && sched->frontier < num_steps) {
+            next = &sched->plan->steps[sched->frontier];
+        }
+#endif
+        pthread_mutex_unlock(&sched->lock);
+
+#if !defined(USE_MEMORY_ONLY) && defined(USE_PREFETCH)
+        if (next) {
+#ifdef USE_AES
+            prefetch_partition(sched->loader, next->node->model_name, sched->tags[next->node->index - 1]);
+#else
+            prefetch_partition(sched->loader, next->node->model_name, NULL);
+#endif
+        }
+#endif
+        bool ok = run_step(sched, s);
+
+        pthread_mutex_lock(&sched->lock);
+        sched->running--;
+        sched->completed++;
+        if (!ok) {
+            sched->failed = true;
+        } else {
+            sched->elapsed_time += sched->ctx->states[sched->plan->steps[s].node->index].elapsed_time;
+            const plan_step *step = &sched->plan->steps[s];
+            for (int i = 0; i < step->num_dependents; i++) {
+                int d = step->dependents[i];
+                if (--sched->missing[d] == 0) sched->ready[sched->num_ready++] = d;
+            }
         }
-        (*node)->outputs[i] = outputs[i];
+        pthread_cond_broadcast(&sched->cond);
     }
-    (*node)->outputs[num_outputs] = NULL;
-    free(outputs);
-    (*node)->pred = max;
-    (*node)->category = argmax;
-    (*node)->elapsedTime = elapsed_time;
+    pthread_mutex_unlock(&sched->lock);
+    return NULL;
 }
 
+// Longest chain of step durations through the plan, the latency bound no
+// number of workers can beat
+static double
+critical_path(const plan_scheduler *sched)
+{
+    const execution_plan *plan = sched->plan;
+    double *finish = calloc(plan->num_steps, sizeof(double));
+    assert(finish);
+
+    double longest = 0.0;
+    for (int s = 0; s < plan->num_steps; s++) {
+        const plan_step *step = &plan->steps[s];
+        double start = 0.0;
+        for (int i = 0; i < step->num_inputs; i++) {
+            int producer = step->inputs[i].producer;
+            if (producer > 0 && finish[producer - 1] > start) start = finish[producer - 1];
+        }
+        finish[s] = start + sched->durations[s];
+        if (finish[s] > longest) longest = finish[s];
+    }
+    free(finish);
+    return longest;
+}
+
+// Runs every step of the plan on up to PARALLEL_WORKERS threads (the caller
+// included). Returns the summed run time of the partitions, -1 on failure.
 double
-execute_tree(operator_node *node, TractValue **input_values, double elapsed_time, char **visited_nodes, int *visited_count, FILE *fd, TractInferenceModel **inference_models)
+execute_plan(const execution_plan *plan, execution_context *ctx, FILE *fd, TractRunnable **runnables, unsigned char **tags, EncryptionParameters *params, partition_loader *loader)
 {
-    if (!node) {
-        return elapsed_time;
+    assert(plan);
+    assert(ctx);
+
+    plan_scheduler sched;
+    struct timeval t1_plan, t2_plan;
+    int num_steps = plan->num_steps;
+
+    sched.plan = plan;
+    sched.ctx = ctx;
+    sched.fd = fd;
+    sched.runnables = runnables;
+    sched.tags = tags;
+    sched.params = params;
+    sched.loader = loader;
+    sched.missing = malloc(num_steps * sizeof(int));
+    sched.ready = malloc(num_steps * sizeof(int));
+    sched.durations = calloc(num_steps, sizeof(double));
+    if (!sched.missing || !sched.ready || !sched.durations) {
+        fprintf(stderr, "Memory allocation for plan scheduler failed\n");
+        free(sched.missing);
+        free(sched.ready);
+        free(sched.durations);
+        return -1;
+    }
+    sched.num_ready = 0;
+    sched.frontier = 0;
+    sched.running = 0;
+    sched.max_running = PARALLEL_WORKERS < MAX_RESIDENT_PARTITIONS ? PARALLEL_WORKERS : MAX_RESIDENT_PARTITIONS;
+    if (sched.max_running < 1) sched.max_running = 1;
+    sched.completed = 0;
+    sched.failed = false;
+    sched.elapsed_time = 0.0;
+    pthread_mutex_init(&sched.lock, NULL);
+    pthread_cond_init(&sched.cond, NULL);
+
+    for (int s = 0; s < num_steps; s++) {
+        sched.missing[s] = plan->steps[s].num_producers;
+        if (sched.missing[s] == 0) sched.ready[sched.num_ready++] = s;
     }
 
-    if (is_node_visited(node, visited_nodes, *visited_count) == false) {
-        visited_nodes[*visited_count] = node->model_name;
-        (*visited_count)++;
+    gettimeofday(&t1_plan, NULL);
+    int num_threads = 0;
+    pthread_t *workers = NULL;
+    if (sched.max_running > 1) {
+        workers = malloc((sched.max_running - 1) * sizeof(pthread_t));
+        assert(workers);
+        for (int i = 0; i < sched.max_running - 1; i++) {
+            if (pthread_create(&workers[num_threads], NULL, plan_worker, &sched) != 0) {
+                fprintf(stderr, "Error creating plan worker %d\n", i);
+                break;
+            }
+            num_threads++;
+        }
+    }
+    plan_worker(&sched);
+    for (int i = 0; i < num_threads; i++) {
+        pthread_join(workers[i], NULL);
+    }
+    free(workers);
+    gettimeofday(&t2_plan, NULL);
 
-        if (*visited_count != 1) {
-            fprintf(stderr, "Model name: %s\n", node->model_name);
-            if (fd) {
-                node->run_inference(&node, input_values, NULL);
+    double latency = (t2_plan.tv_sec - t1_plan.tv_sec) * 1000.0;      // sec to ms
+    latency += (t2_plan.tv_usec - t1_plan.tv_usec) / 1000.0;          // us to ms
 #ifdef USE_SYS_TIME
-                fprintf(fd, "Partition_%d: %f ms\n", (*visited_count) - 1, node->elapsedTime);
+    FILE *out = fd ? fd : stderr;
+    fprintf(out, "Critical path: %f ms, latency: %f ms, workers: %d\n", critical_path(&sched), latency, num_threads + 1);
+#else
+    (void) latency;
+    fprintf(stderr, "Critical path: %f ms, workers: %d\n", critical_path(&sched), num_threads + 1);
 #endif
-            } else {
-                assert(inference_models);
-                node->run_inference(&node, input_values, inference_models[*visited_count - 1]);
-                fprintf(stderr, "Partition_%d: %f ms\n", (*visited_count) - 1, node->elapsedTime);
-            }
-        
-            elapsed_time += node->elapsedTime;
+
+    double elapsed_time = sched.failed ? -1 : sched.elapsed_time;
+    pthread_cond_destroy(&sched.cond);
+    pthread_mutex_destroy(&sched.lock);
+    free(sched.missing);
+    free(sched.ready);
+    free(sched.durations);
+    return elapsed_time;
+}
+
+// Runs the model of a request on its context, through the pipeline when the model has one
+static double
+run_model_plan(execution_context *ctx, plan_runner *runner)
+{
+    model *m = runner->m;
+#ifdef USE_PIPELINE
+    if (m->pipeline) {
+        double sum = pipeline_run(m->pipeline, ctx, runner->tags);
+        print_model_pipeline(m->pipeline);
+        return sum;
+    }
+#endif
+    return execute_plan(m->plan, ctx, runner->fd, m->runnables, runner->tags, runner->params, runner->loader);
+}
+
+// Destroys the first count input values and frees the array
+static void
+free_input_values(TractValue **input_values, int count)
+{
+    for (int i = 0; i < count; i++) {
+        if (input_values[i] && tract_value_destroy(&input_values[i]) != TRACT_RESULT_OK) {
+            fprintf(stderr, "Error destroying tract value\n");
         }
     }
+    free(input_values);
+}
 
-    for (int i = 0; i < node->num_children; i++) {
-        elapsed_time = execute_tree(node->children[i], input_values, elapsed_time, visited_nodes, visited_count, fd, inference_models);
+// Tensors of the request inputs, NULL-terminated; NULL if an input of
+// size_images[i] floats does not hold the values its shape announces.
+// tract copies the values straight out of the request buffer.
+static TractValue **
+request_input_values(float **images, const int *size_images, int num_images)
+{
+    TractValue **input_values = (TractValue **) calloc(num_images + 1, sizeof(TractValue *));
+    if (!input_values) {
+        fprintf(stderr, "Memory allocation for the input values failed\n");
+        return NULL;
     }
-    return elapsed_time;
+
+    for (int i = 0; i < num_images; i++) {
+        if (size_images[i] < INPUT_SHAPE_FLOATS) {
+            fprintf(stderr, "Input %d of %d floats has no shape\n", i, size_images[i]);
+            free_input_values(input_values, i);
+            return NULL;
+        }
+
+        size_t available = (size_t) (size_images[i] - INPUT_SHAPE_FLOATS);
+        size_t shape[INPUT_SHAPE_FLOATS] = {0};
+        size_t size = 1;
+        int rank = 0;
+        bool valid = true;
+        for (int j = 0; j < INPUT_SHAPE_FLOATS; j++) {
+            float dim = images[i][j];
+            // NaN fails the comparisons as well
+            if (!(dim >= 0 && dim <= (float) available && dim == floorf(dim))) {
+                valid = false;
+                break;
+            }
+            shape[j] = (size_t) dim;
+            if (shape[j] == 0) continue;
+            if (shape[j] > available / size) {
+                valid = false;
+                break;
+            }
+            size *= shape[j];
+            rank++;
+        }
+
+        if (!valid || size > available) {
+            fprintf(stderr, "Input %d of %zu values does not match its shape\n", i, available);
+            free_input_values(input_values, i);
+            return NULL;
+        }
+        fprintf(stderr, "Image shape[%d]: %zu, %zu, %zu, %zu\n", i, shape[0], shape[1], shape[2], shape[3]);
+
+        if (tract_value_from_bytes(TRACT_DATUM_TYPE_F32, rank, shape, images[i] + INPUT_SHAPE_FLOATS, &input_values[i]) != TRACT_RESULT_OK) {
+            fprintf(stderr, "Error calling tract: %s\n", tract_get_last_error());
+            free_input_values(input_values, i);
+            return NULL;
+        }
+    }
+    return input_values;
 }
+
+// Runs a request alone or as part of a batch. The inputs are consumed.
+// Returns the summed run time of the partitions, -1 on failure.
+static double
+run_request(plan_runner *runner, TractValue **input_values, int num_inputs, int num_tags, request_result *result)
+{
+    model *m = runner->m;
+    runner->run = run_model_plan;
+    result->batch_size = 1;
+
+    if (!m->plan) {
+        fprintf(stderr, "Model %s has no execution plan\n", m->id);
+        free_input_values(input_values, num_inputs);
+        return -1;
+    }
+
+#ifdef USE_BATCHING
+    if (m->batcher) return batcher_submit(m->batcher, input_values, num_inputs, runner, runner->tags, num_tags, result);
+#else
+    (void) num_inputs;
+    (void) num_tags;
 #endif
 
+    execution_context *ctx = init_execution_context(m->plan->num_steps + 1, input_values);
+    if (!ctx) return -1;
+
+    double sum = run_model_plan(ctx, runner);
+    if (sum != -1) {
+        node_state *last_state = &ctx->states[m->plan->result_index];
+        result->pred = last_state->pred;
+        result->category = last_state->category;
+        collect_request_result(m->plan, ctx, 0, 0, result);
+    }
+    result->peak_bytes = ctx->peak_bytes;
+    free_execution_context(ctx);
+    return sum;
+}
+
 #ifndef USE_AES
 char *
-inference_no_aes(float **images, int num_images, uint8_t *tokenizer, int tokenizer_size, model *m)
+inference_no_aes(float **images, int *size_images, int num_images, uint8_t *tokenizer, int tokenizer_size, model *m, runnable_cache *cache, request_result *result)
 {
     struct timeval t1_inf, t2_inf;
     double elapsed_time;
@@ -485,6 +1251,7 @@ inference_no_aes(float **images, int num_images, uint8_t *tokenizer, int tokeniz
     }
 
     FILE *fd = NULL;
+    size_t log_size = 0;
 
     if (!images && tokenizer_size > 0){
         int model_count = get_array_size((void **)m->names);
@@ -496,14 +1263,14 @@ inference_no_aes(float **images, int num_images, uint8_t *tokenizer, int tokeniz
         elapsed_time = (t2_inf.tv_sec - t1_inf.tv_sec) * 1000.0;      // sec to ms
         elapsed_time += (t2_inf.tv_usec - t1_inf.tv_usec) / 1000.0;   // us to ms
 
-        fd = fopen("../InferONNX/src/server_with_tls/inference_time_outside_occlum_on_disk_no_aes.txt", "a");
+        fd = open_memstream(&result->log, &log_size);
         if (!fd) {
-            fprintf(stderr, "Error opening inference_time!\n");
+            fprintf(stderr, "Error opening the inference log\n");
             return NULL;
         }
 #ifdef USE_SYS_TIME
         if (fprintf(fd, "Inference time: %f ms\n", elapsed_time) < 0) {
-            fprintf(stderr, "Error writing to file inference_time_outside_occlum_on_disk_no_aes.txt\n");
+            fprintf(stderr, "Error writing the inference log\n");
             fclose(fd);
             return NULL;
         }
@@ -517,82 +1284,82 @@ inference_no_aes(float **images, int num_images, uint8_t *tokenizer, int tokeniz
     int model_count = get_array_size((void **)m->names);
     fprintf(stderr, "Model count: %d\n", model_count);
 
-    fd = fopen("../InferONNX/src/server_with_tls/inference_time_outside_occlum_on_disk_no_aes.txt", "a");
+    // The lines of a request stay together, the server appends them to the
+    // inference_time file under its log lock along with its own timings
+    fd = open_memstream(&result->log, &log_size);
     if (!fd) {
-        fprintf(stderr, "Error opening inference_time_outside_occlum_on_disk_no_aes!\n");
+        fprintf(stderr, "Error opening the inference log\n");
         return NULL;
     }
 
 
-    int size, flag;
-    TractValue *input_value = NULL;
-    TractValue **input_values = (TractValue **) malloc((num_images + 1) * sizeof(TractValue *));
-    for (int i = 0; i < num_images; i++) {
-        size_t shape[4] = {(int)images[i][0], (int)images[i][1], (int)images[i][2], (int)images[i][3]};
-
-        fprintf(stderr, "Image shape[%d]: %zu, %zu, %zu, %zu\n", i, shape[0], shape[1], shape[2], shape[3]);
-
-        flag = 0;
-        size = 1;
-        for (int j = 0; j < 4; j++) {
-            if (shape[j] != 0) {
-                flag++;
-                size *= shape[j];
-            }
-        }
-
-        float *temp_image = (float *) malloc(size * sizeof(float));
-        if (!temp_image) {
-            fprintf(stderr, "Error allocating memory for temp_image\n");
+    TractValue **input_values = request_input_values(images, size_images, num_images);
+    if (!input_values) {
+        fclose(fd);
+        error = (char *) malloc(512 * sizeof(char));
+        if (!error) {
+            fprintf(stderr, "Error allocating memory for error\n");
             return NULL;
         }
-        memcpy(temp_image, images[i] + flag, size * sizeof(float));
-
-        input_value = NULL;
-        check_ret(tract_value_from_bytes(TRACT_DATUM_TYPE_F32, flag, shape, temp_image, &input_value), NULL);
-        free(temp_image);
-
-        input_values[i] = input_value;
+        snprintf(error, 512, "Input does not match its shape");
+        error[511] = '\0';
+        return error;
     }
-    input_values[num_images] = NULL;
 
-    m->head->outputs = input_values;
-
-    char **visited_nodes = (char **) malloc((model_count + 1) * sizeof(char *));
-    int visited_count = 0;
+    partition_loader loader;
+    init_partition_loader(&loader, cache, m, NULL);
+    plan_runner runner = {m, fd, NULL, NULL, &loader, NULL};
 
     gettimeofday(&t1_inf, NULL);
-    double sum = execute_tree(m->head, input_values, 0.0, visited_nodes, &visited_count, fd, m->inference_models);
+    double sum = run_request(&runner, input_values, num_images, 0, result);
+    drain_partition_loader(&loader);
     gettimeofday(&t2_inf, NULL);
-    
-    visited_nodes[model_count] = NULL;
-    free(visited_nodes);
+    if (sum == -1) {
+        fprintf(stderr, "Error running model %s\n", m->id);
+        fclose(fd);
+        return NULL;
+    }
 
-    
     elapsed_time = (t2_inf.tv_sec - t1_inf.tv_sec) * 1000.0;      // sec to ms
     elapsed_time += (t2_inf.tv_usec - t1_inf.tv_usec) / 1000.0;   // us to ms
 #ifdef USE_SYS_TIME
     if (fprintf(fd, "Inference time: %f ms\n", elapsed_time) < 0) {
-        fprintf(stderr, "Error writing to file inference_time_outside_occlum_on_disk_no_aes.txt\n");
+        fprintf(stderr, "Error writing the inference log\n");
         fclose(fd);
         return NULL;
     }
     if (fprintf(fd, "Inference time to run a model: %f ms\n", sum) < 0) {
-        fprintf(stderr, "Error writing to file inference_time_outside_occlum_on_disk_no_aes.txt\n");
+        fprintf(stderr, "Error writing the inference log\n");
+        fclose(fd);
+        return NULL;
+    }
+    unsigned long hits, misses;
+    runnable_cache_counts(cache, &hits, &misses);
+    if (fprintf(fd, "Runnable cache hits: %lu, misses: %lu\n", hits, misses) < 0) {
+        fprintf(stderr, "Error writing the inference log\n");
+        fclose(fd);
+        return NULL;
+    }
+    if (fprintf(fd, "Peak activation bytes: %zu\n", result->peak_bytes) < 0) {
+        fprintf(stderr, "Error writing the inference log\n");
+        fclose(fd);
+        return NULL;
+    }
+    if (fprintf(fd, "Batch size: %d\n", result->batch_size) < 0) {
+        fprintf(stderr, "Error writing the inference log\n");
         fclose(fd);
         return NULL;
     }
 #endif
     fclose(fd);
 
-    operator_node *last_node = search_operator_node_by_name(m->head, m->names[model_count-1]);
     char *prediction = (char *) malloc(512 * sizeof(char));
     if (!prediction) {
         fprintf(stderr, "Error allocating memory for result\n");
         return NULL;
     }
 
-    snprintf(prediction, 512, "Model %s, Inference: Max is %f for category %d!", m->names[model_count-1], last_node->pred, last_node->category);
+    snprintf(prediction, 512, "Model %s, Inference: Max is %f for category %d!", m->names[model_count-1], result->pred, result->category);
     prediction[511] = '\0';
     return prediction;
 }
@@ -600,7 +1367,7 @@ inference_no_aes(float **images, int num_images, uint8_t *tokenizer, int tokeniz
 
 #ifdef USE_MEMORY_ONLY
 char *
-inference_memory_only(float **images, int num_images, model *m)
+inference_memory_only(float **images, int *size_images, int num_images, model *m, request_result *result)
 {
 #ifdef USE_SYS_TIME
     struct timeval t1_inf, t2_inf;
@@ -620,7 +1387,7 @@ inference_memory_only(float **images, int num_images, model *m)
         snprintf(error, 512, "No model found with the given id");
         error[511] = '\0';
         return error;
-    } else if (!m->inference_models) {
+    } else if (!m->runnables) {
         error = (char *) malloc(512 * sizeof(char));
         if (!error) {
             fprintf(stderr, "Error allocating memory for error\n");
@@ -635,47 +1402,28 @@ inference_memory_only(float **images, int num_images, model *m)
     fprintf(stderr, "Model count: %d\n", model_count);
 
     
-    int size, flag;
-    TractValue *input_value = NULL;
-    TractValue **input_values = (TractValue **) malloc((num_images + 1) * sizeof(TractValue *));
-    assert(input_values);
-    for (int i = 0; i < num_images; i++) {
-        size_t shape[4] = {(int)images[i][0], (int)images[i][1], (int)images[i][2], (int)images[i][3]};
-        fprintf(stderr, "Image shape[%d]: %zu, %zu, %zu, %zu\n", i, shape[0], shape[1], shape[2], shape[3]);
-
-        flag = 0;
-        size = 1;
-        for (int j = 0; j < 4; j++) {
-            if (shape[j] != 0) {
-                flag++;
-                size *= shape[j];
-            }
-        }
-
-        float *temp_image = (float *) malloc(size * sizeof(float));
-        if (!temp_image) {
-            fprintf(stderr, "Error allocating memory for temp_image\n");
+    TractValue **input_values = request_input_values(images, size_images, num_images);
+    if (!input_values) {
+        error = (char *) malloc(512 * sizeof(char));
+        if (!error) {
+            fprintf(stderr, "Error allocating memory for error\n");
             return NULL;
         }
-        memcpy(temp_image, images[i] + 4, size * sizeof(float));
-
-        input_value = NULL;
-        check_ret(tract_value_from_bytes(TRACT_DATUM_TYPE_F32, flag, shape, temp_image, &input_value), NULL);
-        free(temp_image);
-
-        input_values[i] = input_value;
+        snprintf(error, 512, "Input does not match its shape");
+        error[511] = '\0';
+        return error;
     }
-    input_values[num_images] = NULL;
-
-    m->head->outputs = input_values;
 
-    char **visited_nodes = (char **) malloc((model_count + 1) * sizeof(char *));
-    int visited_count = 0;
+    plan_runner runner = {m, NULL, NULL, NULL, NULL, NULL};
 
 #ifdef USE_SYS_TIME
     gettimeofday(&t1_inf, NULL);
 #endif
-    double sum = execute_tree(m->head, input_values, 0.0, visited_nodes, &visited_count, NULL, m->inference_models);
+    double sum = run_request(&runner, input_values, num_images, 0, result);
+    if (sum == -1) {
+        fprintf(stderr, "Error running model %s\n", m->id);
+        return NULL;
+    }
 #ifdef USE_SYS_TIME
     gettimeofday(&t2_inf, NULL);
     elapsed_time = (t2_inf.tv_sec - t1_inf.tv_sec) * 1000.0;      // sec to ms
@@ -684,19 +1432,17 @@ inference_memory_only(float **images, int num_images, model *m)
     elapsed_time = 0.0;
 #endif
 
-    visited_nodes[model_count] = NULL;
-    free(visited_nodes);
-
     fprintf(stderr, "Inference time: %f ms\n", elapsed_time);
     fprintf(stderr, "Inference time to run a model: %f ms\n", sum);
+    fprintf(stderr, "Peak activation bytes: %zu\n", result->peak_bytes);
+    fprintf(stderr, "Batch size: %d\n", result->batch_size);
 
-    operator_node *last_node = search_operator_node_by_name(m->head, m->names[model_count-1]);
     char *prediction = (char *) malloc(512 * sizeof(char));
     if (!prediction) {
         fprintf(stderr, "Error allocating memory for result\n");
         return NULL;
     }
-    snprintf(prediction, 512, "Model %s, Inference: Max is %f for category %d!", m->names[model_count-1], last_node->pred, last_node->category);
+    snprintf(prediction, 512, "Model %s, Inference: Max is %f for category %d!", m->names[model_count-1], result->pred, result->category);
     prediction[511] = '\0';
     
     return prediction;
@@ -704,177 +1450,22 @@ inference_memory_only(float **images, int num_images, model *m)
 #else
 
 void
-run_inference(operator_node **node, TractValue **input_values, struct EncryptionParameters *params)
+run_inference(const plan_step *step, execution_context *ctx, struct EncryptionParameters *params, partition_loader *loader)
 {
     assert(params);
 
-#ifdef USE_SYS_TIME
-    struct timeval t1_run, t2_run;
-#endif
-    double elapsed_time;
-
-    // Initialize onnx parser
-    TractOnnx *onnx = NULL;
-    check(tract_onnx_create(&onnx));
-    assert(onnx);
-
-    // Load the model
-    TractModel *model = NULL;
-    TractInferenceModel *inference_model = NULL;
-    if (tract_onnx_model_for_path(onnx, (*node)->model_name, &inference_model, params) != TRACT_RESULT_OK) {
-        fprintf(stderr, "Error calling tract: %s", tract_get_last_error());
-        (*node)->outputs = NULL;
-        check(tract_onnx_destroy(&onnx));
-        assert(!onnx);
+    // Hot partitions skip decryption, parsing and typing entirely
+    TractState *state = acquire_state(loader, step->node->model_name, params->tag);
+    if (!state) {
+        ctx->states[step->node->index].outputs = NULL;
         return;
     }
-    assert(inference_model);
-    assert(onnx);
-
-    check(tract_onnx_destroy(&onnx));
-    assert(!onnx);
-
-    // Transform an inference model into a typed model
-    check(tract_inference_model_into_typed(&inference_model,&model));
-    assert(model);
-
-    free_inference_model(inference_model);
-
-    // Make the model runnable
-    TractRunnable *runnable = NULL;
-    check(tract_model_into_runnable(&model, &runnable));
-    assert(runnable);
-    assert(!model);
-
-    int argmax = 0;
-    float max = 0.0, val = 0.0;
-    int num_outputs = (*node)->num_outputs;
-    TractValue **outputs = malloc((num_outputs + 1) * sizeof(TractValue *));
-    const float *data = NULL;
-
-#ifdef USE_SYS_TIME
-    gettimeofday(&t1_run, NULL);
-#endif
-
-    int k = 0, index = 0;
-    TractValue **inputs = malloc(((*node)->num_inputs + 1) * sizeof(TractValue *));
-    int *indices = (*node)->parent_output_indices;
-    for (int i = 0; i < (*node)->num_inputs; i++) {
-        if (!(*node)->parents) break;
-        if (strcmp((*node)->parents[i]->model_name, "input") == 0) {
-            index++;
-            int num_inputs = get_array_size((void **)input_values);
-            for (int j = 0; j < num_inputs; j++) {
-                inputs[k++] = input_values[j];
-            }
-            continue;
-        }
-        if (!(*node)->parents[i]->outputs[indices[index]]) {
-            fprintf(stderr, "The output is NULL!");
-            continue;
-        }
-        inputs[k++] = (*node)->parents[i]->outputs[indices[index++]];
-    }
-    if ((*node)->num_inputs == -1 || (*node)->num_parents == 0) {
-        int num_inputs = get_array_size((void **)input_values);
-        inputs = realloc(inputs, (num_inputs + 1) * sizeof(TractValue *));
-        assert(inputs);
-        for (int j = 0; j < num_inputs; j++) {
-            inputs[k++] = input_values[j];
-        }
-        fprintf(stderr, "k: %d", k);
-    }
-    inputs[k] = NULL;
-    check(tract_runnable_run(runnable, inputs, outputs));
-    free(inputs);
-
-    for (int i = 0; i < num_outputs; i++) {
-        if (outputs[i] == NULL) {
-            fprintf(stderr, "Output %d is NULL\n", i);
-            continue;
-        }
-        
-        check(tract_value_as_bytes(outputs[i], NULL, NULL, NULL, (const void**) &data));
-
-        max = data[0];
-        argmax = 0;
-        for(int i = 0; i < 1000; i++) {
-            val = data[i];
-            if(val > max) {
-                max = val;
-                argmax = i;
-            }
-        }
-        assert(data[argmax] == max);
-        data = NULL;
-    }
-
-#ifdef USE_SYS_TIME
-    gettimeofday(&t2_run, NULL);
-    elapsed_time = (t2_run.tv_sec - t1_run.tv_sec) * 1000.0;      // sec to ms
-    elapsed_time += (t2_run.tv_usec - t1_run.tv_usec) / 1000.0;   // us to ms
-#else
-    elapsed_time = 0.0;
-#endif
-
-    check(tract_runnable_release(&runnable));
-    assert(!runnable);
 
-    (*node)->outputs = (TractValue **)malloc((num_outputs + 1) * sizeof(TractValue *));
-    for (int i = 0; i < num_outputs; i++) {
-        if (outputs[i] == NULL) {
-            fprintf(stderr, "Output %d is NULL\n", i);
-            continue;
-        }
-        (*node)->outputs[i] = outputs[i];
-    }
-    (*node)->outputs[num_outputs] = NULL;
-    free(outputs);
-    (*node)->pred = max;
-    (*node)->category = argmax;
-    (*node)->elapsedTime = elapsed_time;
-}
-
-double
-execute_tree(operator_node *node, TractValue **input_values, double elapsed_time, char **visited_nodes, int *visited_count, unsigned char **tags, struct EncryptionParameters *params)
-{
-    if (!node) {
-        return elapsed_time;
-    }   
-
-    if (is_node_visited(node, visited_nodes, *visited_count) == false) {
-        visited_nodes[*visited_count] = node->model_name;
-        (*visited_count)++;
-
-        int i = (*visited_count) - 2;
-
-        if (*visited_count != 1) {
-            unsigned char *tag = (uint8_t *)malloc(TAG_BYTES * 2);
-            assert(tag);
-            memcpy(tag, tags[i], TAG_BYTES * 2);
-            params->tag = tag;
-
-            node->run_inference(&node, input_values, params);
-            fprintf(stderr, "Model name: %s\n", node->model_name);
-            fprintf(stderr, "Partition_%d: %f ms\n", i, node->elapsedTime);
-            free(tag);
-
-            if (!node->outputs) {
-                return -1;
-            }
-            
-            elapsed_time += node->elapsedTime;
-        }
-    }
-
-    for (int i = 0; i < node->num_children; i++) {
-        elapsed_time = execute_tree(node->children[i], input_values, elapsed_time, visited_nodes, visited_count, tags, params);
-    }
-    return elapsed_time;
+    run_acquired_state(step, ctx, loader, state);
 }
 
 char *
-inference_aes(float **images, int num_images, uint8_t *tokenizer, int tokenizer_size, model *m, unsigned char **tags, int count_tags)
+inference_aes(float **images, int *size_images, int num_images, uint8_t *tokenizer, int tokenizer_size, model *m, unsigned char **tags, int count_tags, runnable_cache *cache, request_result *result)
 {
 #ifdef USE_SYS_TIME
     struct timeval t1_inf, t2_inf;
@@ -989,53 +1580,31 @@ inference_aes(float **images, int num_images, uint8_t *tokenizer, int tokenizer_
         return error;
     }
 
-    int size, flag;
-    TractValue *input_value = NULL;
-    TractValue **input_values = (TractValue **) malloc((num_images + 1) * sizeof(TractValue *));
-    for (int i = 0; i < num_images; i++) {
-        size_t shape[4] = {(int)images[i][0], (int)images[i][1], (int)images[i][2], (int)images[i][3]};
-        fprintf(stderr, "Image shape[%d]: %zu, %zu, %zu, %zu\n", i, shape[0], shape[1], shape[2], shape[3]);
-
-        flag = 0;
-        size = 1;
-        for (int j = 0; j < 4; j++) {
-            if (shape[j] != 0) {
-                flag++;
-                size *= shape[j];
-            }
-        }
-
-        float *temp_image = (float *) malloc(size * sizeof(float));
-        if (!temp_image) {
-            fprintf(stderr, "Error allocating memory for temp_image\n");
-            free(tag);
-            free(key);
-            free(iv);
-            free(aad);
-            free(params);
+    TractValue **input_values = request_input_values(images, size_images, num_images);
+    if (!input_values) {
+        free(key);
+        free(iv);
+        free(aad);
+        free(params);
+        error = (char *) malloc(512 * sizeof(char));
+        if (!error) {
+            fprintf(stderr, "Error allocating memory for error\n");
             return NULL;
         }
-        memcpy(temp_image, images[i] + flag, size * sizeof(float));
-
-        input_value = NULL;
-        check_ret(tract_value_from_bytes(TRACT_DATUM_TYPE_F32, flag, shape, temp_image, &input_value), NULL);
-        free(temp_image);
-
-        input_values[i] = input_value;
+        snprintf(error, 512, "Input does not match its shape");
+        error[511] = '\0';
+        return error;
     }
-    input_values[num_images] = NULL;
-
-    m->head->outputs = input_values;
 
 #ifdef USE_SYS_TIME
     gettimeofday(&t1_inf, NULL);
 #endif
 
-    char **visited_nodes = (char **) malloc((model_count + 1) * sizeof(char *));
-    int visited_count = 0;
-    double sum = execute_tree(m->head, input_values, 0.0, visited_nodes, &visited_count, tags, params);
-    visited_nodes[model_count] = NULL;
-    free(visited_nodes);
+    partition_loader loader;
+    init_partition_loader(&loader, cache, m, params);
+    plan_runner runner = {m, NULL, tags, params, &loader, NULL};
+    double sum = run_request(&runner, input_values, num_images, count_tags, result);
+    drain_partition_loader(&loader);
 
     if (sum == -1) {
         free(tag);
@@ -1062,15 +1631,17 @@ inference_aes(float **images, int num_images, uint8_t *tokenizer, int tokenizer_
 #endif
     fprintf(stderr, "Inference time: %f ms\n", elapsed_time);
     fprintf(stderr, "Inference time to run a model: %f ms\n", sum);
+    fprintf(stderr, "Peak activation bytes: %zu\n", result->peak_bytes);
+    fprintf(stderr, "Batch size: %d\n", result->batch_size);
+    print_runnable_cache(cache);
 
-    operator_node *last_node = search_operator_node_by_name(m->head, m->names[model_count-1]);
     char *prediction = (char *) malloc(512 * sizeof(char));
     if (!prediction) {
         fprintf(stderr, "Error allocating memory for result\n");
         return NULL;
     }
 
-    snprintf(prediction, 512, "Model %s, Inference: Max is %f for category %d!", m->names[model_count-1], last_node->pred, last_node->category);
+    snprintf(prediction, 512, "Model %s, Inference: Max is %f for category %d!", m->names[model_count-1], result->pred, result->category);
     prediction[511] = '\0';
     
     free(key);
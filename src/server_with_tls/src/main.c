@@ -2,10 +2,16 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <limits.h>
+#include <signal.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <inference.h>
 #include <ssl_crypto.h>
+#include <wire_request.h>
+#include <upload.h>
+#include <content_store.h>
 
 /* HELPER FUNCTIONS */
 static void
@@ -29,38 +35,6 @@ contains_empty_name(char **names, int lenght)
     return false;
 }
 
-char **
-add_path_to_names(char **names, int size_names)
-{
-    assert(names);
-
-    const char *home_dir = getenv("HOME");
-    if (!home_dir) {
-        fprintf(stderr, "Error: HOME environment variable is not set\n");
-        return NULL;
-    }
-
-    for (int i = 0; i < size_names; ++i) {
-        char path[512];
-#ifdef USE_AES
-        snprintf(path, sizeof(path), "%s/encrypted_models/", home_dir);
-#else
-        snprintf(path, sizeof(path), "%s/unencrypted_models/", home_dir);
-#endif
-        strcat(path, names[i]);
-        free(names[i]);
-        names[i] = malloc((strlen(path) +1) * sizeof(char));
-        if (!names[i]) {
-            fprintf(stderr, "Memory allocation failed for adding path to names\n");
-            free_array((void **) names, i);
-            return NULL;
-        }
-        strcpy(names[i], path);
-    }
-
-    return names;
-}
-
 /* STRUCT OPERATIONS*/
 encrypted_models_info *
 initialize_encrypted_models_info(int num_models)
@@ -74,7 +48,6 @@ initialize_encrypted_models_info(int num_models)
     memset(m->key, 0, KEY_BYTES);
     memset(m->IV, 0, IV_BYTES);
     memset(m->AAD, 0, ADD_DATA_BYTES);
-    m->encrypted_model = (unsigned char **) malloc(num_models * sizeof(unsigned char *));
     m->tag = (unsigned char **) malloc(num_models * sizeof(unsigned char *));
     for (int i = 0; i < num_models; ++i) {
         m->tag[i] = (unsigned char *) malloc(TAG_BYTES * sizeof(unsigned char));
@@ -96,6 +69,8 @@ initialize_client_result()
 
     c_l->result = NULL;
     c_l->tag = NULL;
+    c_l->output = NULL;
+    c_l->log = NULL;
 
     return c_l;
 }
@@ -105,10 +80,8 @@ free_encrypted_models_info(encrypted_models_info *m, int num_models)
 {
     assert(m);
     for (int i = 0; i < num_models; ++i) {
-        free(m->encrypted_model[i]);
         free(m->tag[i]);
     }
-    free(m->encrypted_model);
     free(m->tag);
     free(m);
 }
@@ -118,67 +91,21 @@ free_client_result(client_result *c_l)
 {
     assert(c_l);
     free(c_l->result);
-    free(c_l);
-}
-
-char *
-save_model(char *name, unsigned char *model, size_t size_model)
-{
-    assert(name);
-    assert(model);
-
-    FILE *fd;
-    fd = fopen(name, "wb");
-    if (!fd) {
-        fprintf(stderr, "Error opening file %s\n", name);
-        return NULL;
-    }
-    size_t byteswritten = fwrite(model, sizeof(unsigned char), size_model, fd);
-    if (byteswritten != size_model) {
-        fprintf(stderr, "fwrite failed\n");
-        fclose(fd);
-        return NULL;
-    }
-    fclose(fd);
-
-    return "OK";
-}
-
-void
-save_models_no_aes(char **names, int size_names, uint8_t **models, int *size_models)
-{
-    assert(names);
-    assert(models);
-    assert(size_models);
-
-    FILE *fd;
-    for (int i = 0; i < size_names; ++i) {
-        fd = fopen(names[i], "wb");
-        if (!fd) {
-            fprintf(stderr, "Error opening file %s\n", names[i]);
-            continue;
-        }
-        size_t byteswritten = fwrite(models[i], sizeof(uint8_t), size_models[i], fd);
-        if (byteswritten != (size_t)(size_models[i])) {
-            fprintf(stderr, "fwrite failed\n");
-            fclose(fd);
-        }
-        fclose(fd);
+    if (c_l->output) {
+        free_request_result(c_l->output);
+        free(c_l->output);
     }
+    free(c_l->log);
+    free(c_l);
 }
 
-encrypted_models_info *
-encrypt_models(char **names, int size_names, unsigned char **models, int *size_models)
+// Fresh key, IV and AAD for a model of num_models partitions
+static encrypted_models_info *
+generate_model_keys(int num_models)
 {
     mbedtls_ctr_drbg_context ctr_drbg;
     mbedtls_entropy_context entropy;
-    mbedtls_gcm_context gcm;
-
-    unsigned char key[KEY_BYTES];
-    unsigned char iv[IV_BYTES];
-    unsigned char add_data[ADD_DATA_BYTES];
-    unsigned char tag_encr[TAG_BYTES];
-    size_t olen;
+    encrypted_models_info *m = NULL;
     int ret;
 
     // The personalization string should be unique to the application in order to add some
@@ -192,198 +119,81 @@ encrypt_models(char **names, int size_names, unsigned char **models, int *size_m
     ret = mbedtls_ctr_drbg_seed(&ctr_drbg, mbedtls_entropy_func, &entropy, (unsigned char *)pers, strlen(pers));
     if (ret != 0) {
         fprintf(stderr, "mbedtls_ctr_drbg_seed() failed - returned -0x%04x\n", -ret);
-        goto exit_encr;
+        goto exit_keys;
     }
 
-    memset(key, 0, KEY_BYTES);
-    memset(iv, 0, IV_BYTES);
-    memset(add_data, 0, ADD_DATA_BYTES);
-    memset(tag_encr, 0, TAG_BYTES);
+    m = initialize_encrypted_models_info(num_models);
+    if (!m) {
+        ret = 1;
+        goto exit_keys;
+    }
 
     // Generate random bytes for the key (32 Bytes)
-    ret = mbedtls_ctr_drbg_random(&ctr_drbg, key, KEY_BYTES);
+    ret = mbedtls_ctr_drbg_random(&ctr_drbg, m->key, KEY_BYTES);
     if (ret != 0) {
         fprintf(stderr, "mbedtls_ctr_drbg_random failed to extract key - returned -0x%04x\n", -ret);
-        goto exit_encr;
+        goto exit_keys;
     }
 
     // Generate random bytes for the IV (12 Bytes)
-    ret = mbedtls_ctr_drbg_random(&ctr_drbg, iv, IV_BYTES);
+    ret = mbedtls_ctr_drbg_random(&ctr_drbg, m->IV, IV_BYTES);
     if (ret != 0) {
         fprintf(stderr, "mbedtls_ctr_drbg_random failed to extract IV - returned -0x%04x\n", -ret);
-        goto exit_encr;
+        goto exit_keys;
     }
 
     // Generate random bytes for the add_data (64 Bytes)
-    ret = mbedtls_ctr_drbg_random(&ctr_drbg, add_data, ADD_DATA_BYTES);
+    ret = mbedtls_ctr_drbg_random(&ctr_drbg, m->AAD, ADD_DATA_BYTES);
     if (ret != 0) {
         fprintf(stderr, "mbedtls_ctr_drbg_random failed to extract add_data - returned -0x%04x\n", -ret);
-        goto exit_encr;
-    }
-
-    encrypted_models_info *m = initialize_encrypted_models_info(size_names);
-    if (!m) {
-        fprintf(stderr, "Memory allocation failed for encrypted_models_info\n");
-        goto exit_encr;
-    }
-
-    memcpy(m->key, key, KEY_BYTES);
-    memcpy(m->IV, iv, IV_BYTES);
-    memcpy(m->AAD, add_data, ADD_DATA_BYTES);
-
-    unsigned char *encrypted_model = NULL;
-    size_t size_model = 0;
-    for (int i = 0; i < size_names; ++i) {
-        size_model = (size_t)size_models[i];
-        encrypted_model = (unsigned char *)malloc(size_model);
-        if (!encrypted_model) {
-            ret = 1;
-            fprintf(stderr, "Memory allocation for encrypted model `%s` failed\n", names[i]);
-            goto exit_encr;
-        }
-
-        mbedtls_gcm_init(&gcm);
-
-        // Initialize the GCM context with our key and desired cipher
-        ret = mbedtls_gcm_setkey(&gcm,                      // GCM context to be initialized
-                                MBEDTLS_CIPHER_ID_AES,     // cipher to use (a 128-bit block cipher)
-                                key,                       // encryption key
-                                KEY_BITS);                 // key bits
-        if (ret != 0) {
-            fprintf(stderr, "mbedtls_gcm_setkey failed to set the key for AES cipher in encryption process - returned -0x%04x\n", -ret);
-            goto exit_encr;
-        }
-
-        // Start the GCM encryption process
-        ret = mbedtls_gcm_starts(&gcm,                 // GCM context
-                                MBEDTLS_GCM_ENCRYPT,   // mode
-                                iv,                    // initialization vector
-                                IV_BYTES);             // length of IV
-        if (ret != 0) {
-            fprintf(stderr, "mbedtls_gcm_starts failed to start the encryption process - returned -0x%04x\n", -ret);
-            goto exit_encr;
-        }
-
-        // Set additional authenticated data (AAD)
-        ret = mbedtls_gcm_update_ad(&gcm,              // GCM context
-                                    add_data,          // additional data
-                                    ADD_DATA_BYTES);   // length of AAD
-        if (ret != 0) {
-            fprintf(stderr, "mbedtls_gcm_starts failed to set the AAD in the encryption process - returned -0x%04x\n", -ret);
-            goto exit_encr;
-        }
-
-        if (size_model > 32) {
-            size_t rest_len = size_model - 32;
-
-            // Encrypt the first 32 bytes
-            ret = mbedtls_gcm_update(&gcm,               // GCM context
-                                    models[i],           // input data
-                                    32,                  // length of first 32 bytes of input data
-                                    encrypted_model,     // output of encryption process for the first 32 bytes
-                                    size_model,          // length of input data
-                                    &olen);              // length of output data (expected 32)
-            if (ret != 0) {
-                fprintf(stderr, "mbedtls_gcm_update failed to encrypt the first 32 bytes of input data - returned -0x%04x\n", -ret);
-                goto exit_encr;
-            }
-            if (olen != 32) {
-                fprintf(stderr, "mbedtls_gcm_update failed to calculate olen in encryption process, expected 32 - returned -0x%04x\n", -ret);
-                goto exit_encr;
-            }
-
-            // Encrypt the rest of the data
-            ret = mbedtls_gcm_update(&gcm,                     // GCM context
-                                    models[i] + 32,            // input data for the rest data
-                                    rest_len,                  // length of the rest data
-                                    encrypted_model + 32,      // output of encryption process for the rest data
-                                    size_model - 32,           // length of the rest data
-                                    &olen);                    // length of output data (expected rest_len)
-            if (ret != 0) {
-                fprintf(stderr, "mbedtls_gcm_update failed to encrypt the rest of the data - returned -0x%04x\n", -ret);
-                goto exit_encr;
-            }
-            if (olen != rest_len) {
-                fprintf(stderr, "mbedtls_gcm_update failed to calculate olen in encryption process, expected %ld - returned -0x%04x\n", rest_len, -ret);
-                goto exit_encr;
-            }
-        } else {
-            // Encrypt the whole model
-            ret = mbedtls_gcm_update(&gcm,                // GCM context
-                                    models[i],            // input data
-                                    size_model,           // length of input data
-                                    encrypted_model,      // output of encryption process
-                                    size_model,           // length of input data
-                                    &olen);               // length of output data (expected size_model)
-            if (ret != 0) {
-                fprintf(stderr, "mbedtls_gcm_update failed to encrypt the whole data - returned -0x%04x\n", -ret);
-                goto exit_encr;
-            }
-            if (olen != size_model) {
-                fprintf(stderr, "mbedtls_gcm_update failed to calculate olen in the encryption process, expected %ld - returned -0x%04x\n", size_model, -ret);
-                goto exit_encr;
-            }
-        }
-
-        // Finish the GCM encryption process and generate the tag in encryption process
-        ret = mbedtls_gcm_finish(&gcm,           // GCM context
-                                NULL,            // input data, here NULL
-                                0,               // length of input data, here 0
-                                &olen,           // length of output data, here olen
-                                tag_encr,        // buffer for holding the tag
-                                TAG_BYTES);      // length of the tag
-        if (ret != 0) {
-            fprintf(stderr, "mbedtls_gcm_finish failed to finish the encryption process and generate the tag - returned -0x%04x\n", -ret);
-            goto exit_encr;
-        }
-
-        m->encrypted_model[i] = (unsigned char *)malloc(size_model * sizeof(unsigned char));
-        if (!m->encrypted_model[i] || !m->tag[i]) {
-            fprintf(stderr, "Memory allocation for m->encrypted_model || m->tag[i] failed\n");
-            goto exit_encr;
-        }
-        memcpy(m->encrypted_model[i], encrypted_model, size_model);
-        memcpy(m->tag[i], tag_encr, TAG_BYTES);
-
-        if (!save_model(names[i], encrypted_model, size_model)) {
-            fprintf(stderr, "Error saving model %s\n", names[i]);
-            goto exit_encr;
-        }
-        free(encrypted_model);
-
-        fprintf(stderr, "Tag in tag_encr: ");
-        for (int j = 0; j < TAG_BYTES; ++j) {
-            fprintf(stderr, "%02x", tag_encr[j]);
-        }
-        fprintf(stderr, "\n");
-
-        fprintf(stderr, " Tag in m->tag: ");
-        for (int j = 0; j < TAG_BYTES; ++j) {
-            fprintf(stderr, "%02x", m->tag[i][j]);
-        }
-        fprintf(stderr, "\n");
-
-        mbedtls_gcm_free(&gcm);
+        goto exit_keys;
     }
 
-exit_encr:
+exit_keys:
     mbedtls_ctr_drbg_free(&ctr_drbg);
     mbedtls_entropy_free(&entropy);
 
     if (ret != 0) {
-        mbedtls_gcm_free(&gcm);
+        if (m) free_encrypted_models_info(m, num_models);
+        return NULL;
+    }
+    return m;
+}
+
+// Encrypts the partitions of a buffered MODEL request to disk a chunk at a
+// time, several partitions at once, the ciphertext is never held whole.
+// Partitions without a path are already stored and skipped.
+encrypted_models_info *
+encrypt_models(char **paths, int size_names, unsigned char **models, int *size_models)
+{
+    encrypted_models_info *m = generate_model_keys(size_names);
+    if (!m) {
         fprintf(stderr, "FAILURE when encrypting model\n");
         return NULL;
     }
 
+    if (write_partitions(paths, models, size_models, size_names, m) != 0) {
+        fprintf(stderr, "FAILURE when encrypting model\n");
+        free_encrypted_models_info(m, size_names);
+        return NULL;
+    }
     return m;
 }
 
+// Models, inputs, tags and the tokenizer are views into buf, which the request
+// takes over; names are copied. The
+// inputs of MODEL_INPUT start at a multiple of 4 bytes into buf, those of MODEL
+// follow the names and are only checked for presence.
 void 
-deserialize_client_request(const char* buf, request* req)
+deserialize_client_request(char* buf, request* req)
 {
     size_t offset = 0;
 
+    req->buffer = buf;
+    // The legacy format has no result mode, it gets the argmax text
+    req->result_mode = RESULT_ARGMAX;
+    req->top_k = 0;
+
     // int field -> command + id + num_models + num_inputs
     memcpy(&req->command, buf + offset, sizeof(int));
     offset += sizeof(int);
@@ -426,8 +236,7 @@ deserialize_client_request(const char* buf, request* req)
         if (size > 0) {
             req->models = malloc(size * sizeof(uint8_t *));
             for (int i = 0; i < size; ++i) {
-                req->models[i] = malloc(req->size_models[i]);
-                memcpy(req->models[i], buf + offset, req->size_models[i]);
+                req->models[i] = (uint8_t *) (buf + offset);
                 offset += req->size_models[i];
             }
         } else {
@@ -449,8 +258,7 @@ deserialize_client_request(const char* buf, request* req)
             req->input = malloc(num_inputs * sizeof(float *));
             for (int i = 0; i < num_inputs; ++i) {
                 fprintf(stderr, "input_size[%d]: %d\n", i, req->size_inputs[i]);
-                req->input[i] = malloc(req->size_inputs[i] * sizeof(float));
-                memcpy(req->input[i], buf + offset, req->size_inputs[i] * sizeof(float));
+                req->input[i] = (float *) (buf + offset);
                 offset += req->size_inputs[i] * sizeof(float);
             }
         } else {
@@ -478,8 +286,7 @@ deserialize_client_request(const char* buf, request* req)
             req->input = malloc(num_inputs * sizeof(float *));
             for (int i = 0; i < num_inputs; ++i) {
                 fprintf(stderr, "input_size[%d]: %d\n", i, req->size_inputs[i]);
-                req->input[i] = malloc(req->size_inputs[i] * sizeof(float));
-                memcpy(req->input[i], buf + offset, req->size_inputs[i] * sizeof(float));
+                req->input[i] = (float *) (buf + offset);
                 offset += req->size_inputs[i] * sizeof(float);
             }
         } else {
@@ -490,8 +297,7 @@ deserialize_client_request(const char* buf, request* req)
         if (size > 0) {
             req->tags = malloc((size + 1) * sizeof(unsigned char *));
             for (int i = 0; i < size; ++i) {
-                req->tags[i] = malloc(TAG_BYTES * 2);
-                memcpy(req->tags[i], buf + offset, TAG_BYTES * 2);
+                req->tags[i] = (unsigned char *) (buf + offset);
                 offset += TAG_BYTES * 2;
             }
             req->tags[size] = NULL;
@@ -509,8 +315,7 @@ deserialize_client_request(const char* buf, request* req)
 
         // Uint8_t* field -> tokenizer
         if (req->tokenizer_size > 0) {
-            req->tokenizer = malloc(req->tokenizer_size * sizeof(uint8_t));
-            memcpy(req->tokenizer, buf + offset, req->tokenizer_size * sizeof(uint8_t));
+            req->tokenizer = (uint8_t *) (buf + offset);
             offset += req->tokenizer_size * sizeof(uint8_t);
         } else {
             req->tokenizer = NULL;
@@ -521,49 +326,150 @@ deserialize_client_request(const char* buf, request* req)
 void
 free_request(request *req_original)
 {
-    int size = req_original->num_models;
-    int num_inputs = req_original->num_inputs;
     if (req_original->names != NULL) { 
-        for (int i = 0; i < size; ++i) {
+        for (int i = 0; i < req_original->num_models; ++i) {
             free(req_original->names[i]);
         }
         free(req_original->names);
     }
-    if (req_original->size_models != NULL) {
-        free(req_original->size_models);
+    free(req_original->size_models);
+    free(req_original->models);
+    free(req_original->tags);
+    free(req_original->size_inputs);
+    free(req_original->input);
+    free(req_original->buffer);
+
+    // The views are gone with the buffer, a second call is a no-op
+    memset(req_original, 0, sizeof(request));
+}
+
+// A model whose partitions did not load is not registered, the partitions it
+// stored are released
+static client_result *
+reject_model(client_result *c_l, model *m)
+{
+    fprintf(stderr, "Model could not be loaded, registration rejected\n");
+    if (m->partitions) m->partitions->free_partitions(m->partitions);
+    free(m);
+    free_client_result(c_l);
+    return NULL;
+}
+
+// Adds a model whose partitions are on disk to the table and fills c_l with
+// its id and, with AES on disk, the tag of every partition. names carry their
+// path; me holds the key, IV, AAD and tags with USE_AES and is NULL otherwise.
+// The model takes over partitions, its references into the content store.
+static client_result *
+register_model(client_result *c_l, char **names, int num_models, encrypted_models_info *me, model_partitions *partitions,
+               onnx_table *table)
+{
+    model *m = (model *) malloc(sizeof(model));
+    assert(m);
+    m->next = NULL;
+    m->size = 0;
+    m->names = names;
+    m->runnables = NULL;
+    m->plan = NULL;
+    m->pipeline = NULL;
+    m->batcher = NULL;
+    m->buffers = NULL;
+    m->partitions = partitions;
+
+#ifdef USE_AES
+    memcpy(m->key, me->key, KEY_BYTES);
+    memcpy(m->IV, me->IV, IV_BYTES);
+    memcpy(m->AAD, me->AAD, ADD_DATA_BYTES);
+    m->head = NULL;
+
+    unsigned char **tags = (unsigned char **) malloc(num_models * sizeof(unsigned char *));
+    if (!tags) {
+        fprintf(stderr, "Memory allocation failed for tags in MODEL\n");
+        return NULL;
     }
-    if (req_original->models != NULL) {
-        for (int i = 0; i < size; ++i) {
-            free(req_original->models[i]);
+    for (int i = 0; i < num_models; ++i) {
+        tags[i] = (unsigned char *) malloc((TAG_BYTES * 2 + 1) * sizeof(unsigned char));
+        if (!tags[i]) {
+            fprintf(stderr, "Memory allocation failed for tags[i] in MODEL\n");
+            return NULL;
         }
-        free(req_original->models);
-    }
-    if (req_original->tags != NULL) {
-        for (int i = 0; req_original->tags[i] != NULL; ++i) {
-            free(req_original->tags[i]);
+        memset(tags[i], 0, TAG_BYTES * 2 + 1);
+        for (int j = 0; j < TAG_BYTES; ++j) {
+            sprintf((char *)(tags[i] + j * 2), "%02x", me->tag[i][j]);
         }
-        free(req_original->tags);
+        tags[i][TAG_BYTES * 2] = '\0';
     }
-    free(req_original->size_inputs);
-    if (req_original->input != NULL) {
-        for (int i = 0; i < num_inputs; ++i) {
-            free(req_original->input[i]);
+
+    int loaded = load_model_to_memory(&m, tags, num_models);
+
+    for (int i = 0; i < num_models; ++i) {
+        free(tags[i]);
+    }
+    free(tags);
+    if (loaded != 0) return reject_model(c_l, m);
+
+    #if USE_MEMORY_ONLY == 0
+    c_l->tag = (unsigned char **) malloc((num_models + 1)* sizeof(unsigned char *));
+    for (int i = 0; i < num_models; ++i) {
+        c_l->tag[i] = (unsigned char *) malloc(TAG_BYTES * sizeof(unsigned char));
+        if (!c_l->tag[i]) {
+            fprintf(stderr, "Memory allocation failed for c_l->tag in MODEL\n");
+            return NULL;
         }
-        free(req_original->input);
+        memcpy(c_l->tag[i], me->tag[i], TAG_BYTES);
+    }
+    c_l->tag[num_models] = NULL;
+    #endif
+#else
+    (void) me;
+    (void) num_models;
+    memset(m->key, 0, KEY_BYTES);
+    memset(m->IV, 0, IV_BYTES);
+    memset(m->AAD, 0, ADD_DATA_BYTES);
+
+    if (load_model_to_memory(&m) != 0) return reject_model(c_l, m);
+#endif
+
+    char *id_str = insert_into_table(table, m);
+    if (!id_str) {
+        return NULL;
     }
-    if (req_original->tokenizer != NULL) {
-        free(req_original->tokenizer);
+    print_table(table);
+
+    int size = strlen(id_str);
+    c_l->result = (unsigned char *) malloc((size + 1) * sizeof(unsigned char));
+    if (!c_l->result) {
+        fprintf(stderr, "Memory allocation failed for c_l->result in MODEL\n");
+        return NULL;
     }
+    memcpy(c_l->result, id_str, size);
+    c_l->size = size;
+    return c_l;
 }
 
-client_result *
-handle_request(char *client_request, onnx_table *table)
+// Moves the partitions written to staged into the content store and
+// registers the model they make up; partitions sharing the digest of a stored
+// one take its place. Takes over partitions and staged.
+static client_result *
+register_stored_model(client_result *c_l, model_partitions *partitions, char **staged, const unsigned char *digests,
+                      encrypted_models_info *me, onnx_table *table)
 {
-    assert(client_request);
-    
-    request req_copy;
-    deserialize_client_request(client_request, &req_copy);
+    char **paths = c_l ? commit_partitions(partitions, staged, digests, me) : NULL;
+    if (!paths) {
+        if (!c_l) abort_staged_partitions(staged, partitions->count);
+        partitions->free_partitions(partitions);
+        return NULL;
+    }
+
+    int count = partitions->count;
+    c_l = register_model(c_l, paths, count, me, partitions, table);
+    free_array((void **) paths, count);
+    return c_l;
+}
 
+// Runs a deserialized request and frees it
+static client_result *
+process_request(request req_copy, onnx_table *table)
+{
     int command = req_copy.command, id = req_copy.id;
     char **names = req_copy.names;
     uint8_t **models = req_copy.models;
@@ -576,176 +482,57 @@ handle_request(char *client_request, onnx_table *table)
     int tokenizer_size = req_copy.tokenizer_size;
     uint8_t* tokenizer = req_copy.tokenizer;
 
-    int size = 0;
     client_result *c_l = initialize_client_result();
     switch (command) {
     case 0: {
         if (!names || num_models == 0 || !models || contains_empty_name(names, num_models) || (id != -1 || !input || tags || tokenizer_size != 0)) {
             fprintf(stderr, "Invalid request for MODEL\n");
             free_request(&req_copy);
-            free(client_request);
             return NULL;
         } 
 
         fprintf(stderr, "MODEL SIZE: %d\n", size_models[0]);
 
-        names = add_path_to_names(names, num_models);
-
-        if (find_duplicate_names_from_id(table, names)) {
-            char *error = (char *) malloc(512 * sizeof(char));
-            if (!error) {
-                fprintf(stderr, "Error allocating memory for error\n");
-                free_request(&req_copy);
-                free(client_request);
-                return NULL;
-            }
-            snprintf(error, 512, "Model is already in the onnx table");
-            error[511] = '\0';
-            c_l->size = 512;
-            c_l->result = (unsigned char *) malloc((c_l->size + 1) * sizeof(unsigned char));
-            if (!c_l->result) {
-                fprintf(stderr, "Memory allocation failed for c_l->result in MODEL\n");
-                free_request(&req_copy);
-                free(client_request);
-                return NULL;
-            }
-            memcpy(c_l->result, error, c_l->size);
-            free_request(&req_copy);
-            free(client_request);
-            free(error);
-            return c_l;
-        }
-        
-#ifdef USE_AES
-        encrypted_models_info *me = encrypt_models(names, num_models, models, size_models);
-        if (!me) {
-            free_request(&req_copy);
-            free(client_request);
-            return NULL;
-        }
-
-        model *m = (model *) malloc(sizeof(model));
-        assert(m);
-        m->next = NULL;
-        m->size = size;
-        m->names = names;
-        memcpy(m->key, me->key, KEY_BYTES);
-        memcpy(m->IV, me->IV, IV_BYTES);
-        memcpy(m->AAD, me->AAD, ADD_DATA_BYTES);
-        m->inference_models = NULL;
-        m->head = NULL;
-
-        unsigned char **tags = (unsigned char **) malloc(num_models * sizeof(unsigned char *));
-        if (!tags) {
-            fprintf(stderr, "Memory allocation failed for tags in MODEL\n");
-            free_request(&req_copy);
-            free(client_request);
-            free_encrypted_models_info(me, num_models);
-            free(c_l->result);
-            return NULL;
-        }
-        for (int i = 0; i < num_models; ++i) {
-            tags[i] = (unsigned char *) malloc((TAG_BYTES * 2 + 1) * sizeof(unsigned char));
-            if (!tags[i]) {
-                fprintf(stderr, "Memory allocation failed for tags[i] in MODEL\n");
-                free_request(&req_copy);
-                free(client_request);
-                free_encrypted_models_info(me, num_models);
-                free(c_l->result);
-                return NULL;
-            }
-            memset(tags[i], 0, TAG_BYTES * 2 + 1);
-            for (int j = 0; j < TAG_BYTES; ++j) {
-                sprintf((char *)(tags[i] + j * 2), "%02x", me->tag[i][j]);
-            }
-            tags[i][TAG_BYTES * 2] = '\0';
+        // Only the partitions the content store does not hold yet are written
+        unsigned char *digests = (unsigned char *) malloc(num_models * DIGEST_BYTES);
+        model_partitions *partitions = create_model_partitions(num_models);
+        char **staged = NULL;
+        bool hashed = digests && partitions;
+        for (int i = 0; hashed && i < num_models; ++i) {
+            hashed = content_digest(models[i], size_models[i], digests + i * DIGEST_BYTES) == 0;
         }
-  
-        load_model_to_memory(&m, tags, num_models);
-        
-        for (int i = 0; i < num_models; ++i) {
-            free(tags[i]);
-        }
-        free(tags);
-
-    #if USE_MEMORY_ONLY == 0
-        c_l->tag = (unsigned char **) malloc((num_models + 1)* sizeof(unsigned char *));
-        for (int i = 0; i < num_models; ++i) {
-            c_l->tag[i] = (unsigned char *) malloc(TAG_BYTES * sizeof(unsigned char));
-            if (!c_l->tag[i]) {
-                fprintf(stderr, "Memory allocation failed for c_l->tag in MODEL\n");
-                free_request(&req_copy);
-                free(client_request);
-                free_encrypted_models_info(me, num_models);
-                free(c_l->result);
-                return NULL;
-            }
-            memset(c_l->tag[i], 0, TAG_BYTES);
-            memcpy(c_l->tag[i], me->tag[i], TAG_BYTES);
-            
-        }
-        c_l->tag[num_models] = NULL;
-    #endif
-
-        char *id_str = insert_into_table(table, m);
-        if (!id_str) {
-            free_encrypted_models_info(me, num_models);
+        if (hashed) staged = stage_partitions(partitions, digests);
+        if (!staged) {
+            if (partitions) partitions->free_partitions(partitions);
+            free(digests);
             free_request(&req_copy);
-            free(client_request);
             return NULL;
         }
-        
-        free_request(&req_copy);
-        print_table(table);
 
-        size = strlen(id_str);
-        c_l->result = (unsigned char *) malloc((size + 1) * sizeof(unsigned char));
-        if (!c_l->result) {
-            fprintf(stderr, "Memory allocation failed for c_l->result in MODEL\n");
+#ifdef USE_AES
+        encrypted_models_info *me = encrypt_models(staged, num_models, models, size_models);
+        if (!me) {
+            abort_staged_partitions(staged, num_models);
+            partitions->free_partitions(partitions);
+            free(digests);
             free_request(&req_copy);
-            free(client_request);
             return NULL;
         }
-
-        memcpy(c_l->result, id_str, size);
+        c_l = register_stored_model(c_l, partitions, staged, digests, me, table);
         free_encrypted_models_info(me, num_models);
-        c_l->size = size;
 #else 
-        save_models_no_aes(names, num_models, models, size_models);
-        model *m = (model *) malloc(sizeof(model));
-        assert(m);
-        m->next = NULL;
-        m->size = size;
-        m->names = names;
-        memset(m->key, 0, KEY_BYTES);
-        memset(m->IV, 0, IV_BYTES);
-        memset(m->AAD, 0, ADD_DATA_BYTES);
-        m->inference_models = NULL;
-        
-        load_model_to_memory(&m);
-
-        char *id_str = insert_into_table(table, m);
-        if (!id_str) {
-            free_request(&req_copy);
-            free(client_request);
-            return NULL;
-        }
-        
-        free_request(&req_copy);
-        print_table(table);
-
-        size = strlen(id_str);
-        c_l->result = (unsigned char *) malloc((size + 1) * sizeof(unsigned char));
-        if (!c_l->result) {
-            fprintf(stderr, "Memory allocation failed for c_l->result in MODEL\n");
+        if (write_partitions(staged, models, size_models, num_models, NULL) != 0) {
+            abort_staged_partitions(staged, num_models);
+            partitions->free_partitions(partitions);
+            free(digests);
             free_request(&req_copy);
-            free(client_request);
             return NULL;
         }
-
-        memcpy(c_l->result, id_str, size);
-        c_l->size = size;
+        c_l = register_stored_model(c_l, partitions, staged, digests, NULL, table);
 #endif
+        free(digests);
+        free_request(&req_copy);
+        if (!c_l) return NULL;
         break;
     }   
     case 1: {
@@ -800,40 +587,58 @@ handle_request(char *client_request, onnx_table *table)
             if (!c_l->result) {
                 fprintf(stderr, "Memory allocation failed for c_l->result in MODEL\n");
                 free_request(&req_copy);
-                free(client_request);
                 return NULL;
             }
             memcpy(c_l->result, error, c_l->size);
             free_request(&req_copy);
-            free(client_request);
             free(error);
             return c_l;
         }
 
+        // The argmax text always goes back, the top-k or the tensors only if asked for
+        request_result *output = (request_result *) calloc(1, sizeof(request_result));
+        if (!output) {
+            fprintf(stderr, "Memory allocation failed for the inference result\n");
+            free_request(&req_copy);
+            return NULL;
+        }
+        output->mode = req_copy.result_mode;
+        output->k = req_copy.top_k;
+
 #ifdef USE_AES
     #if USE_MEMORY_ONLY == 0
-        result = inference_aes(input, num_inputs, tokenizer, tokenizer_size, m, tags, m->size);
+        result = inference_aes(input, size_inputs, num_inputs, tokenizer, tokenizer_size, m, tags, m->size, table->cache, output);
     #else
-        result = inference_memory_only(input, num_inputs, m);
+        result = inference_memory_only(input, size_inputs, num_inputs, m, output);
     #endif
 #else
-        result = inference_no_aes(input, num_inputs, tokenizer, tokenizer_size, m);
+        result = inference_no_aes(input, size_inputs, num_inputs, tokenizer, tokenizer_size, m, table->cache, output);
 #endif
 
         if (!result) {
+            free_request_result(output);
+            free(output->log);
+            free(output);
             free_request(&req_copy);
-            free(client_request);
             return NULL;
         }
 
         free_request(&req_copy);
+        c_l->log = output->log;
+        output->log = NULL;
+
+        // Outputs that do not allow the mode, and failed runs, answer with the text only
+        if (output->num_top > 0 || output->num_tensors > 0) {
+            c_l->output = output;
+        } else {
+            free(output);
+        }
 
         int size = strlen(result);
         c_l->result = (unsigned char *) malloc((size + 1) * sizeof(unsigned char));
         if (!c_l->result) {
             fprintf(stderr, "Memory allocation failed for c_l->result in MODEL\n");
             free_request(&req_copy);
-            free(client_request);
             return NULL;
         }
         memcpy(c_l->result, result, size);
@@ -846,239 +651,349 @@ handle_request(char *client_request, onnx_table *table)
     default:
         fprintf(stderr, "Invalid command\n");
         free_request(&req_copy);
-        free(client_request);
         return NULL;
     }
 
-    free(client_request);
+    free_request(&req_copy);
     return c_l;
 }
 
-// Debug for SSL
-void
-debug_ssl(void *ctx, int level,
-                     const char *file, int line,
-                     const char *str)
+// Registers a model from partitions staged on the server's host, so their
+// bytes never cross the session. With USE_AES they are encrypted into the
+// content store a chunk at a time like an upload; without it they are
+// registered in place and nothing is copied. Either way a partition must
+// match the digest the client expects, even when the store already holds it.
+static client_result *
+register_local_model(const unsigned char *body, size_t body_length, onnx_table *table)
 {
-    ((void) level);
+    local_model l;
+    client_result *c_l = NULL;
 
-    fprintf((FILE *) ctx, "%s:%04d: %s", file, line, str);
-    fflush((FILE *) ctx);
-}
+    if (local_model_read(&l, body, body_length) != 0) {
+        fprintf(stderr, "Invalid request for MODEL_LOCAL\n");
+        local_model_free(&l);
+        return NULL;
+    }
 
-int
-main(void)
-{
-#ifdef USE_SYS_TIME
-    struct timeval t1, t2, t1_read, t2_read, t1_write, t2_write, t1_handshake, t2_handshake, t1_rest, t2_rest;
-#endif
-    double elapsed_time, elapsed_time_read, elapsed_time_write, elapsed_time_handshake, elapsed_time_rest;
+    unsigned char *digests = (unsigned char *) malloc(l.num_partitions * DIGEST_BYTES);
+    model_partitions *partitions = create_model_partitions(l.num_partitions);
+    if (!digests || !partitions) {
+        if (partitions) partitions->free_partitions(partitions);
+        free(digests);
+        local_model_free(&l);
+        return NULL;
+    }
+    for (int i = 0; i < l.num_partitions; ++i) {
+        memcpy(digests + i * DIGEST_BYTES, l.digests[i], DIGEST_BYTES);
+    }
 
-    int ret;
-    mbedtls_net_context listen_fd, client_fd;
-    const char *pers = "ssl_server";
+#ifdef USE_AES
+    char **staged = stage_partitions(partitions, digests);
+    encrypted_models_info *me = staged ? generate_model_keys(l.num_partitions) : NULL;
+    if (!me || local_model_write(&l, staged, me) != 0) {
+        if (me) free_encrypted_models_info(me, l.num_partitions);
+        abort_staged_partitions(staged, l.num_partitions);
+        partitions->free_partitions(partitions);
+        free(digests);
+        local_model_free(&l);
+        return NULL;
+    }
 
-    mbedtls_entropy_context entropy;
-    mbedtls_ctr_drbg_context ctr_drbg;
-    mbedtls_ssl_context ssl;
-    mbedtls_ssl_config conf;
-    mbedtls_x509_crt srvcert;
-    mbedtls_pk_context pkey;
-#if defined(MBEDTLS_SSL_CACHE_C)
-    mbedtls_ssl_cache_context cache;
-#endif
+    c_l = register_stored_model(initialize_client_result(), partitions, staged, digests, me, table);
+    free_encrypted_models_info(me, l.num_partitions);
+#else
+    char **paths = NULL;
+    if (local_model_verify(&l) != 0 || !(paths = commit_sources(partitions, l.sources, digests))) {
+        partitions->free_partitions(partitions);
+        free(digests);
+        local_model_free(&l);
+        return NULL;
+    }
 
-    mbedtls_net_init(&listen_fd);
-    mbedtls_net_init(&client_fd);
-    mbedtls_ssl_init(&ssl);
-    mbedtls_ssl_config_init(&conf);
-#if defined(MBEDTLS_SSL_CACHE_C)
-    mbedtls_ssl_cache_init(&cache);
+    c_l = initialize_client_result();
+    if (c_l) c_l = register_model(c_l, paths, l.num_partitions, NULL, partitions, table);
+    else partitions->free_partitions(partitions);
+    free_array((void **) paths, l.num_partitions);
 #endif
-    mbedtls_x509_crt_init(&srvcert);
-    mbedtls_pk_init(&pkey);
-    mbedtls_entropy_init(&entropy);
-    mbedtls_ctr_drbg_init(&ctr_drbg);
+    free(digests);
+    local_model_free(&l);
+    return c_l;
+}
 
-#if defined(MBEDTLS_USE_PSA_CRYPTO)
-    psa_status_t status = psa_crypto_init();
-    if (status != PSA_SUCCESS) {
-        fprintf(stderr, stderr, "Failed to initialize PSA Crypto implementation: %d\n",
-                        (int) status);
-        ret = MBEDTLS_ERR_SSL_HW_ACCEL_FAILED;
-        goto exit;
-    }
-#endif /* MBEDTLS_USE_PSA_CRYPTO */
+client_result *
+handle_request(char *client_request, onnx_table *table)
+{
+    assert(client_request);
+    
+    request req_copy;
+    deserialize_client_request(client_request, &req_copy);
+    return process_request(req_copy, table);
+}
 
-#if defined(MBEDTLS_DEBUG_C)
-    mbedtls_debug_set_threshold(DEBUG_LEVEL);
-#endif
+// Version 2 requests: the body is a list of sections
+client_result *
+handle_wire_request(const wire_header *header, char *body, size_t body_length, onnx_table *table)
+{
+    assert(body);
 
-    /*
-     * 1. Seed the RNG
-     */
-    fprintf(stderr, "Seeding the random number generator...");
-    fflush(stdout);
+    if (header->command == WIRE_CMD_MODEL_LOCAL) {
+        client_result *c_l = register_local_model((unsigned char *) body, body_length, table);
+        free(body);
+        return c_l;
+    }
 
-    if ((ret = mbedtls_ctr_drbg_seed(&ctr_drbg, mbedtls_entropy_func, &entropy,
-                                     (const unsigned char *) pers,
-                                     strlen(pers))) != 0) {
-        fprintf(stderr, " failed\n   mbedtls_ctr_drbg_seed returned %d\n", ret);
-        goto exit;
+    request req_copy;
+    if (deserialize_wire_request(header, (unsigned char *) body, body_length, &req_copy) != 0) {
+        fprintf(stderr, "Invalid version 2 request %u\n", header->request_id);
+        free(body);
+        return NULL;
     }
+    return process_request(req_copy, table);
+}
 
-    fprintf(stderr, " ok\n");
+// Debug for SSL
+void
+debug_ssl(void *ctx, int level,
+                     const char *file, int line,
+                     const char *str)
+{
+    ((void) level);
 
-    /*
-     * 2. Load the certificates and private RSA key
-     */
-    fprintf(stderr, "Loading the server cert and key...");
-    fflush(stdout);
+    fprintf((FILE *) ctx, "%s:%04d: %s", file, line, str);
+    fflush((FILE *) ctx);
+}
 
-    /*
-     * This demonstration program uses embedded test certificates.
-     * Instead, you may want to use mbedtls_x509_crt_parse_file() to read the
-     * server and CA certificates, as well as mbedtls_pk_parse_keyfile().
-     */
-    ret = mbedtls_x509_crt_parse_file(&srvcert, "../certificates/cert.pem");
-    if (ret != 0) {
-        fprintf(stderr, " failed\n   mbedtls_x509_crt_parse_file returned %d\n", ret);
-        goto exit;
-    }
+/* SERVER WORKERS */
+static int
+locked_ctr_drbg_random(void *p_server, unsigned char *output, size_t output_len)
+{
+    tls_server *server = (tls_server *) p_server;
 
-    ret =  mbedtls_pk_parse_keyfile(&pkey, "../certificates/key.pem", NULL, mbedtls_ctr_drbg_random, &ctr_drbg);
+    pthread_mutex_lock(&server->rng_lock);
+    int ret = mbedtls_ctr_drbg_random(server->ctr_drbg, output, output_len);
+    pthread_mutex_unlock(&server->rng_lock);
+    return ret;
+}
 
-    if (ret != 0) {
-        fprintf(stderr, " failed\n   mbedtls_pk_parse_keyfile returned %d\n", ret);
-        goto exit;
-    }
+#if defined(MBEDTLS_SSL_CACHE_C)
+static int
+locked_cache_get(void *p_server, unsigned char const *session_id, size_t session_id_len, mbedtls_ssl_session *session)
+{
+    tls_server *server = (tls_server *) p_server;
 
-    fprintf(stderr, " ok\n");
+    pthread_mutex_lock(&server->cache_lock);
+    int ret = mbedtls_ssl_cache_get(server->cache, session_id, session_id_len, session);
+    if (ret == 0) server->resumed_by_id++;
+    pthread_mutex_unlock(&server->cache_lock);
+    return ret;
+}
 
-    /*
-     * 3. Setup the listening TCP socket
-     */
-    fprintf(stderr, "Bind on https://localhost:9998/ ...");
-    fflush(stdout);
+static int
+locked_cache_set(void *p_server, unsigned char const *session_id, size_t session_id_len, const mbedtls_ssl_session *session)
+{
+    tls_server *server = (tls_server *) p_server;
 
-    if ((ret = mbedtls_net_bind(&listen_fd, NULL, "9998", MBEDTLS_NET_PROTO_TCP)) != 0) {
-        fprintf(stderr, " failed\n   mbedtls_net_bind returned %d\n", ret);
-        goto exit;
-    }
+    pthread_mutex_lock(&server->cache_lock);
+    int ret = mbedtls_ssl_cache_set(server->cache, session_id, session_id_len, session);
+    pthread_mutex_unlock(&server->cache_lock);
+    return ret;
+}
+#endif
 
-    fprintf(stderr, " ok\n");
+#if defined(MBEDTLS_SSL_TICKET_C)
+static int
+locked_ticket_write(void *p_server, const mbedtls_ssl_session *session, unsigned char *start, const unsigned char *end, size_t *tlen, uint32_t *lifetime)
+{
+    tls_server *server = (tls_server *) p_server;
 
-    /*
-     * 4. Setup SSL data
-     */
-    fprintf(stderr, "Setting up the SSL data....");
-    fflush(stdout);
+    pthread_mutex_lock(&server->ticket_lock);
+    int ret = mbedtls_ssl_ticket_write(server->ticket, session, start, end, tlen, lifetime);
+    pthread_mutex_unlock(&server->ticket_lock);
+    return ret;
+}
 
-    if ((ret = mbedtls_ssl_config_defaults(&conf,
-                                           MBEDTLS_SSL_IS_SERVER,
-                                           MBEDTLS_SSL_TRANSPORT_STREAM,
-                                           MBEDTLS_SSL_PRESET_DEFAULT)) != 0) {
-        fprintf(stderr, " failed\n   mbedtls_ssl_config_defaults returned %d\n", ret);
-        goto exit;
-    }
+static int
+locked_ticket_parse(void *p_server, mbedtls_ssl_session *session, unsigned char *buf, size_t len)
+{
+    tls_server *server = (tls_server *) p_server;
 
-    mbedtls_ssl_conf_rng(&conf, mbedtls_ctr_drbg_random, &ctr_drbg);
-    mbedtls_ssl_conf_dbg(&conf, debug_ssl, stdout);
+    pthread_mutex_lock(&server->ticket_lock);
+    int ret = mbedtls_ssl_ticket_parse(server->ticket, session, buf, len);
+    if (ret == 0) server->resumed_by_ticket++;
+    pthread_mutex_unlock(&server->ticket_lock);
+    return ret;
+}
+#endif
+
+// Sessions resumed so far, from the id cache and from tickets
+static void
+print_resumption_stats(tls_server *server)
+{
+    unsigned long by_id = 0, by_ticket = 0;
 
 #if defined(MBEDTLS_SSL_CACHE_C)
-    mbedtls_ssl_conf_session_cache(&conf, &cache,
-                                   mbedtls_ssl_cache_get,
-                                   mbedtls_ssl_cache_set);
+    pthread_mutex_lock(&server->cache_lock);
+    by_id = server->resumed_by_id;
+    pthread_mutex_unlock(&server->cache_lock);
 #endif
+#if defined(MBEDTLS_SSL_TICKET_C)
+    pthread_mutex_lock(&server->ticket_lock);
+    by_ticket = server->resumed_by_ticket;
+    pthread_mutex_unlock(&server->ticket_lock);
+#endif
+    fprintf(stderr, "Resumed sessions: %lu by session id, %lu by ticket\n", by_id, by_ticket);
+}
 
-    mbedtls_ssl_conf_ca_chain(&conf, srvcert.next, NULL);
-    if ((ret = mbedtls_ssl_conf_own_cert(&conf, &srvcert, &pkey)) != 0) {
-        fprintf(stderr, " failed\n   mbedtls_ssl_conf_own_cert returned %d\n", ret);
-        goto exit;
-    }
-
-    if ((ret = mbedtls_ssl_setup(&ssl, &conf)) != 0) {
-        fprintf(stderr, " failed\n   mbedtls_ssl_setup returned %d\n", ret);
-        goto exit;
-    }
+// Hands each handshake the worker's own copy of the private key
+static int
+worker_cert_cb(mbedtls_ssl_context *ssl)
+{
+    tls_worker *worker = (tls_worker *) mbedtls_ssl_get_user_data_p(ssl);
 
-    fprintf(stderr, " ok\n");
+    return mbedtls_ssl_set_hs_own_cert(ssl, worker->server->srvcert, &worker->pkey);
+}
 
-    onnx_table *table = init_onnx_table(CAPACITY);
-    char response[BUF_SIZE];
-    unsigned char buf[BUF_SIZE];
-    long request_size = 0;
-    char *client_request = NULL;
-    size_t bytes_read = 0;
-    char *endptr = NULL;
+static void
+init_tls_server(tls_server *server)
+{
+    memset(server, 0, sizeof(tls_server));
+    pthread_mutex_init(&server->rng_lock, NULL);
+#if defined(MBEDTLS_SSL_CACHE_C)
+    pthread_mutex_init(&server->cache_lock, NULL);
+#endif
+#if defined(MBEDTLS_SSL_TICKET_C)
+    pthread_mutex_init(&server->ticket_lock, NULL);
+#endif
+    pthread_mutex_init(&server->log_lock, NULL);
+    pthread_mutex_init(&server->lock, NULL);
+    pthread_cond_init(&server->not_empty, NULL);
+    pthread_cond_init(&server->not_full, NULL);
+}
 
-reset:
-#ifdef MBEDTLS_ERROR_C
-    if (ret != 0) {
-        char error_buf[100];
-        mbedtls_strerror(ret, error_buf, 100);
-        fprintf(stderr, "Last error was: %d - %s\n", ret, error_buf);
-    }
+static void
+free_tls_server(tls_server *server)
+{
+    pthread_cond_destroy(&server->not_full);
+    pthread_cond_destroy(&server->not_empty);
+    pthread_mutex_destroy(&server->lock);
+    pthread_mutex_destroy(&server->log_lock);
+#if defined(MBEDTLS_SSL_TICKET_C)
+    pthread_mutex_destroy(&server->ticket_lock);
 #endif
+#if defined(MBEDTLS_SSL_CACHE_C)
+    pthread_mutex_destroy(&server->cache_lock);
+#endif
+    pthread_mutex_destroy(&server->rng_lock);
+}
 
-    fprintf(stderr, "Resetting the session...");
-    mbedtls_net_free(&client_fd);
+// Blocks while every worker is busy and the queue is full, false once the server stops
+static bool
+push_connection(tls_server *server, int fd)
+{
+    pthread_mutex_lock(&server->lock);
+    while (server->count == CONNECTION_QUEUE_DEPTH && !server->stopping) {
+        pthread_cond_wait(&server->not_full, &server->lock);
+    }
+    if (server->stopping) {
+        pthread_mutex_unlock(&server->lock);
+        return false;
+    }
+    server->connections[(server->head + server->count) % CONNECTION_QUEUE_DEPTH] = fd;
+    server->count++;
+    pthread_cond_signal(&server->not_empty);
+    pthread_mutex_unlock(&server->lock);
+    return true;
+}
 
-    mbedtls_ssl_session_reset(&ssl);
+// Connections accepted before the stop are still served, -1 once drained
+static int
+pop_connection(tls_server *server)
+{
+    pthread_mutex_lock(&server->lock);
+    while (server->count == 0 && !server->stopping) {
+        pthread_cond_wait(&server->not_empty, &server->lock);
+    }
+    int fd = -1;
+    if (server->count > 0) {
+        fd = server->connections[server->head];
+        server->head = (server->head + 1) % CONNECTION_QUEUE_DEPTH;
+        server->count--;
+        pthread_cond_signal(&server->not_full);
+    }
+    pthread_mutex_unlock(&server->lock);
+    return fd;
+}
 
-    /*
-     * 3. Wait until a client connects
-     */
-    fprintf(stderr, "\n\nWaiting for a remote connection ...");
-    fflush(stdout);
+static bool
+server_stopping(tls_server *server)
+{
+    pthread_mutex_lock(&server->lock);
+    bool stopping = server->stopping;
+    pthread_mutex_unlock(&server->lock);
+    return stopping;
+}
 
-    if ((ret = mbedtls_net_accept(&listen_fd, &client_fd,
-                                  NULL, 0, NULL)) != 0) {
-        fprintf(stderr, " failed\n   mbedtls_net_accept returned %d\n", ret);
-        goto exit;
+// The first caller decides the exit code
+static void
+stop_server(tls_server *server, int exit_code)
+{
+    pthread_mutex_lock(&server->lock);
+    if (!server->stopping) {
+        server->stopping = true;
+        server->exit_code = exit_code;
     }
-    fprintf(stderr, "Client accepted\n");
-
-    mbedtls_ssl_set_bio(&ssl, &client_fd, mbedtls_net_send, mbedtls_net_recv, NULL);
+    pthread_cond_broadcast(&server->not_empty);
+    pthread_cond_broadcast(&server->not_full);
+    pthread_mutex_unlock(&server->lock);
 
-    fprintf(stderr, " ok\n");
+    // Wakes the acceptor blocked in accept()
+    shutdown(server->listen_fd->fd, SHUT_RDWR);
+}
 
-    /*
-     * 5. Handshake
-     */
-    gettimeofday(&t1, NULL);
-    gettimeofday(&t1_handshake, NULL);
+// Reads wake up every IDLE_POLL_MS, an idle session ends once the server
+// stops or after KEEPALIVE_IDLE_MS without a request (0 waits forever)
+static bool
+keep_waiting(tls_server *server, int *idle_ms)
+{
+    *idle_ms += IDLE_POLL_MS;
+    if (server_stopping(server)) return false;
+    return KEEPALIVE_IDLE_MS == 0 || *idle_ms < KEEPALIVE_IDLE_MS;
+}
 
-    fprintf(stderr, "Performing the SSL/TLS handshake...");
-    fflush(stdout);
+// Between requests an idle session also gives way, at its next poll, to
+// accepted connections waiting for a worker; its client reconnects
+static bool
+keep_session_waiting(tls_server *server, int *idle_ms)
+{
+    if (!keep_waiting(server, idle_ms)) return false;
 
-    while ((ret = mbedtls_ssl_handshake(&ssl)) != 0) {
-        if (ret != MBEDTLS_ERR_SSL_WANT_READ && ret != MBEDTLS_ERR_SSL_WANT_WRITE) {
-            fprintf(stderr, " failed\n   mbedtls_ssl_handshake returned %d\n", ret);
-            goto reset;
-        }
-    }
-    fprintf(stderr, " ok\n\n");
-    gettimeofday(&t2_handshake, NULL);
+    pthread_mutex_lock(&server->lock);
+    bool queued = server->count > 0;
+    pthread_mutex_unlock(&server->lock);
+    return !queued;
+}
 
-    /*
-     * 6. Read the Request
-     */
-    gettimeofday(&t1_read, NULL);
-    fprintf(stderr, "Read from client:");
-    fflush(stdout);
+// Reads exactly len bytes of the session. A stalled client is dropped like an
+// idle one. Returns 0 or the error that ended the read.
+static int
+read_exactly(tls_worker *worker, unsigned char *buf, size_t len)
+{
+    size_t bytes_read = 0;
+    int idle_ms = 0;
+    int ret;
 
-    do {
-        ret = mbedtls_ssl_read(&ssl, (unsigned char *) buf, BUF_SIZE);
+    while (bytes_read < len) {
+        ret = mbedtls_ssl_read(&worker->ssl, buf + bytes_read, len - bytes_read);
 
-        if (ret == MBEDTLS_ERR_SSL_WANT_READ || ret == MBEDTLS_ERR_SSL_WANT_WRITE) {
+        if (ret == MBEDTLS_ERR_SSL_WANT_READ || ret == MBEDTLS_ERR_SSL_WANT_WRITE ||
+            (ret == MBEDTLS_ERR_SSL_TIMEOUT && keep_waiting(worker->server, &idle_ms))) {
             continue;
         }
 
         if (ret <= 0) {
             switch (ret) {
                 case MBEDTLS_ERR_SSL_PEER_CLOSE_NOTIFY:
-                    fprintf(stderr, " Connection was closed gracefully\n\n");
+                    fprintf(stderr, " Connection was closed gracefully\n");
                     break;
 
                 case MBEDTLS_ERR_NET_CONN_RESET:
@@ -1086,76 +1001,271 @@ reset:
                     break;
 
                 default:
-                    fprintf(stderr, " mbedtls_ssl_read returned -0x%x\n\n", ret);
-                    goto reset;
+                    fprintf(stderr, " mbedtls_ssl_read returned -0x%x\n", (unsigned int) -ret);
+                    break;
             }
+            return ret < 0 ? ret : MBEDTLS_ERR_NET_CONN_RESET;
+        }
+        bytes_read += ret;
+        idle_ms = 0;
+    }
+    return 0;
+}
 
-            break;
+static int
+read_upload(void *ctx, unsigned char *buf, size_t length)
+{
+    return read_exactly((tls_worker *) ctx, buf, length);
+}
+
+// Registers the model of a version 2 MODEL request while its body comes off
+// the session: the names are read first, then every partition is encrypted
+// and written to disk UPLOAD_CHUNK_BYTES at a time, so the memory taken does
+// not grow with the model. A rejected upload is read to its end and answered;
+// *ret is set if the session failed on the way.
+static client_result *
+receive_model_upload(tls_worker *worker, const wire_header *header, onnx_table *table, int *ret)
+{
+    model_upload u;
+    client_result *c_l = NULL;
+
+    *ret = 0;
+    if (upload_init(&u, header, read_upload, worker) != 0) {
+        *ret = MBEDTLS_ERR_SSL_ALLOC_FAILED;
+        return NULL;
+    }
+
+    if (upload_read_names(&u) != 0 || u.num_names == 0 || contains_empty_name(u.names, u.num_names)) {
+        fprintf(stderr, "Invalid request for MODEL\n");
+        goto drain;
+    }
+
+    // The digests are only known once the partitions are written
+    unsigned char *digests = (unsigned char *) malloc(u.num_names * DIGEST_BYTES);
+    model_partitions *partitions = create_model_partitions(u.num_names);
+    char **staged = digests && partitions ? stage_partitions(partitions, NULL) : NULL;
+    if (!staged) {
+        if (partitions) partitions->free_partitions(partitions);
+        free(digests);
+        goto drain;
+    }
+
+#ifdef USE_AES
+    encrypted_models_info *me = generate_model_keys(u.num_names);
+    if (!me || upload_write_partitions(&u, staged, me, digests) != 0) {
+        if (me) free_encrypted_models_info(me, u.num_names);
+        abort_staged_partitions(staged, u.num_names);
+        partitions->free_partitions(partitions);
+        free(digests);
+        goto drain;
+    }
+#else
+    encrypted_models_info *me = NULL;
+    if (upload_write_partitions(&u, staged, NULL, digests) != 0) {
+        abort_staged_partitions(staged, u.num_names);
+        partitions->free_partitions(partitions);
+        free(digests);
+        goto drain;
+    }
+#endif
+
+    c_l = register_stored_model(initialize_client_result(), partitions, staged, digests, me, table);
+#ifdef USE_AES
+    free_encrypted_models_info(me, u.num_names);
+#endif
+    free(digests);
+    upload_free(&u);
+    return c_l;
+
+drain:
+    if (upload_drain(&u) != 0) {
+        *ret = u.error;
+    }
+    upload_free(&u);
+    return c_l;
+}
+
+// Reads the next request of the session. A version 2 request opens with its
+// binary header, which is returned in *header; a legacy one with its length as
+// an ASCII record, and header->magic is left 0. Returns 1 for a request, whose
+// body size is set in *request_size (0 for an empty body and for a
+// registration, which is streamed), 0 once the client ended the session or it
+// went idle, an mbedtls error otherwise.
+// The request clock starts when the header arrives, the idle time in front of
+// it is not part of the request.
+static int
+read_request(tls_worker *worker, wire_header *header, char **client_request, size_t *request_size,
+             struct timeval *t1_read, bool *stop)
+{
+    tls_server *server = worker->server;
+    mbedtls_ssl_context *ssl = &worker->ssl;
+    unsigned char buf[WIRE_HEADER_BYTES + 1];
+    long body_size = 0;
+    char *endptr = NULL;
+    int idle_ms = 0;
+    int ret;
+
+    memset(header, 0, sizeof(wire_header));
+    *request_size = 0;
+    fprintf(stderr, "[worker %d] Read from client:", worker->id);
+    fflush(stdout);
+
+    // Legacy length records are shorter than a header
+    do {
+        ret = mbedtls_ssl_read(ssl, buf, WIRE_HEADER_BYTES);
+    } while (ret == MBEDTLS_ERR_SSL_WANT_READ || ret == MBEDTLS_ERR_SSL_WANT_WRITE ||
+             (ret == MBEDTLS_ERR_SSL_TIMEOUT && keep_session_waiting(server, &idle_ms)));
+
+    if (ret <= 0) {
+        switch (ret) {
+            case 0:
+            case MBEDTLS_ERR_SSL_PEER_CLOSE_NOTIFY:
+                fprintf(stderr, " Connection was closed gracefully\n\n");
+                return 0;
+
+            case MBEDTLS_ERR_NET_CONN_RESET:
+                fprintf(stderr, " Connection was reset by peer\n");
+                return 0;
+
+            case MBEDTLS_ERR_SSL_TIMEOUT:
+                fprintf(stderr, " Session idle for %d ms\n", idle_ms);
+                return 0;
+
+            default:
+                fprintf(stderr, " mbedtls_ssl_read returned -0x%x\n\n", (unsigned int) -ret);
+                return ret;
         }
-        request_size = strtol((char *) buf, &endptr, 10);
-        if (*endptr != '\0') {
-            fprintf(stderr, "The size of the client_request is not an integer!\n");
-            goto reset;
+    }
+    gettimeofday(t1_read, NULL);
+
+    if (wire_has_magic(buf, ret)) {
+        if (ret < WIRE_HEADER_BYTES && (ret = read_exactly(worker, buf + ret, WIRE_HEADER_BYTES - ret)) != 0) {
+            return ret;
         }
-        fprintf(stderr, "Bytes received: %d\n Message from client: %ld\n", ret, request_size);
+        if (wire_decode_header(buf, WIRE_HEADER_BYTES, header) != 0) {
+            fprintf(stderr, "Unsupported protocol version %d\n", header->version);
+            return MBEDTLS_ERR_SSL_BAD_INPUT_DATA;
+        }
+        fprintf(stderr, " version %d, command %d, request %u, %lu bytes\n", header->version, header->command,
+                header->request_id, (unsigned long) header->body_length);
 
-        if (ret == 3 && request_size == 20) {
+        if (header->command == WIRE_CMD_QUIT) {
             fprintf(stderr, "Client wants to close the connection...\n");
-            free_onnx_table(table);
-            ret = 0;
-            goto exit;
+            *stop = true;
+            return 0;
         }
+        // A registration is not buffered, serve_request streams it to disk
+        if (header->command == WIRE_CMD_MODEL) return 1;
 
-        client_request = (char *) malloc((request_size +1) * sizeof(char));
-        if (!client_request) {
-            perror("Memory allocation failed for client_request");
-            goto exit;
+        if (header->body_length > MAX_REQUEST_BYTES) {
+            fprintf(stderr, "Request body of %lu bytes is larger than %ld bytes\n", (unsigned long) header->body_length,
+                    (long) MAX_REQUEST_BYTES);
+            return MBEDTLS_ERR_SSL_BAD_INPUT_DATA;
         }
+        body_size = (long) header->body_length;
+    } else {
+        buf[ret] = '\0';
+        body_size = strtol((char *) buf, &endptr, 10);
+        if (*endptr != '\0' || body_size < 0) {
+            fprintf(stderr, "The size of the client_request is not an integer!\n");
+            return MBEDTLS_ERR_SSL_BAD_INPUT_DATA;
+        }
+        fprintf(stderr, "Bytes received: %d\n Message from client: %ld\n", ret, body_size);
 
-        bytes_read = 0;
-        while (bytes_read < (size_t) request_size) {
-            ret = mbedtls_ssl_read(&ssl, (unsigned char *) (client_request + bytes_read), request_size - bytes_read);
-
-            if (ret == MBEDTLS_ERR_SSL_WANT_READ || ret == MBEDTLS_ERR_SSL_WANT_WRITE) {
-                continue;
-            }
-
-            if (ret <= 0) {
-                switch (ret) {
-                    case MBEDTLS_ERR_SSL_PEER_CLOSE_NOTIFY:
-                        fprintf(stderr, " Connection was closed gracefully\n");
-                        break;
+        if (ret == 3 && body_size == 20) {
+            fprintf(stderr, "Client wants to close the connection...\n");
+            *stop = true;
+            return 0;
+        }
+        if (body_size > MAX_REQUEST_BYTES) {
+            fprintf(stderr, "Request body of %ld bytes is larger than %ld bytes\n", body_size, (long) MAX_REQUEST_BYTES);
+            return MBEDTLS_ERR_SSL_BAD_INPUT_DATA;
+        }
+    }
 
-                    case MBEDTLS_ERR_NET_CONN_RESET:
-                        fprintf(stderr, " Connection was reset by peer\n");
-                        break;
+    // A request the server cannot hold ends its session, the other sessions go on
+    *client_request = (char *) malloc((body_size +1) * sizeof(char));
+    if (!*client_request) {
+        perror("Memory allocation failed for client_request");
+        return MBEDTLS_ERR_SSL_ALLOC_FAILED;
+    }
 
-                    default:
-                        fprintf(stderr, " mbedtls_ssl_read returned -0x%x\n", (unsigned int) -ret);
-                        free(client_request);
-                        goto reset;
-                }
+    if ((ret = read_exactly(worker, (unsigned char *) *client_request, body_size)) != 0) {
+        free(*client_request);
+        *client_request = NULL;
+        return ret;
+    }
+    (*client_request)[body_size] = '\0';
 
-                break;
-            }
-            bytes_read += ret;
-        }
-        client_request[request_size] = '\0';
+    fprintf(stderr, "Bytes received: %ld\n", body_size);
+    *request_size = (size_t) body_size;
+    return 1;
+}
 
-        fprintf(stderr, "Bytes received: %ld\n", bytes_read);
+// Handles one request of the session and writes the response. The handshake
+// time is only charged to the first request of a session. Returns 0 or an
+// mbedtls error, the generic one when the timing file cannot be written; sets
+// *stop on errors that ended the former single-connection loop.
+static int
+serve_request(tls_worker *worker, const wire_header *header, char *client_request, size_t request_size,
+              struct timeval *t1_read, double elapsed_time_handshake, bool *stop)
+{
+#ifdef USE_SYS_TIME
+    struct timeval t2, t2_read, t1_write, t2_write, t1_rest, t2_rest;
+#endif
+    double elapsed_time, elapsed_time_read, elapsed_time_write, elapsed_time_rest;
 
-        if (ret > 0) {
-            break;
-        }
-    } while (1);
+    tls_server *server = worker->server;
+    mbedtls_ssl_context *ssl = &worker->ssl;
+    char *response = NULL;
+    unsigned char *message = NULL;
+    size_t message_size = 0, written = 0;
+    int ret;
 
     gettimeofday(&t2_read, NULL);
 
     gettimeofday(&t1_rest, NULL);
 
-    client_result *c_l = handle_request(client_request, table);
+    char *log = NULL;
+    client_result *c_l;
+    if (header->magic == WIRE_MAGIC) {
+        if (header->command == WIRE_CMD_MODEL) {
+            c_l = receive_model_upload(worker, header, server->table, &ret);
+            if (ret != 0) {
+                if (c_l) free_client_result(c_l);
+                return ret;
+            }
+        } else {
+            c_l = handle_wire_request(header, client_request, request_size, server->table);
+        }
+        message = encode_wire_response(header, c_l, &message_size);
+        if (!message) {
+            if (c_l) free_client_result(c_l);
+            *stop = true;
+            return MBEDTLS_ERR_SSL_ALLOC_FAILED;
+        }
+    } else {
+        c_l = handle_request(client_request, server->table);
+    }
+
+    // Text form of the result: the legacy response, and the log line for both.
+    // It is sized for the result and the hex of every tag.
+    const char *invalid = "Invalid client_request from handle_request\n";
+    size_t response_size = c_l ? (size_t) c_l->size + 1 : strlen(invalid) + 1;
+    for (int i = 0; c_l && c_l->tag && c_l->tag[i]; i++) {
+        response_size += 1 + TAG_BYTES * 2;
+    }
+    response = (char *) malloc(response_size);
+    if (!response) {
+        fprintf(stderr, "Memory allocation failed for the response\n");
+        if (c_l) free_client_result(c_l);
+        free(message);
+        *stop = true;
+        return MBEDTLS_ERR_SSL_ALLOC_FAILED;
+    }
+
     if (!c_l) {
-        strcpy(response, "Invalid client_request from handle_request\n");
+        strcpy(response, invalid);
     } else {
         memcpy(response, c_l->result, c_l->size);
         int current_position = c_l->size;
@@ -1174,43 +1284,63 @@ reset:
             free(c_l->tag);
         }
         response[current_position] = '\0';
+        log = c_l->log;
+        c_l->log = NULL;
         free_client_result(c_l);
     }
 
     gettimeofday(&t2_rest, NULL);
 
     /*
-     * 7. Write the Response
+     * Write the Response
      */
     gettimeofday(&t1_write, NULL);
-    fprintf(stderr, "Write to client:");
+    fprintf(stderr, "[worker %d] Write to client:", worker->id);
     fflush(stdout);
 
-    fprintf(stderr, "\nSSL ciphersuite: %s\n", mbedtls_ssl_get_ciphersuite(&ssl));
+    fprintf(stderr, "\nSSL ciphersuite: %s\n", mbedtls_ssl_get_ciphersuite(ssl));
+
+    if (!message) {
+        message = (unsigned char *) response;
+        message_size = strlen(response);
+    }
+
+    // Records are capped at the maximum fragment length, a large response takes several writes
+    while (written < message_size) {
+        ret = mbedtls_ssl_write(ssl, message + written, message_size - written);
+        if (ret > 0) {
+            written += ret;
+            continue;
+        }
 
-    while ((ret = mbedtls_ssl_write(&ssl, (unsigned char *) response, strlen(response))) <= 0) {
         if (ret == MBEDTLS_ERR_NET_CONN_RESET) {
             fprintf(stderr, " failed\n   peer closed the connection\n");
-            goto reset;
+            if (message != (unsigned char *) response) free(message);
+            free(response);
+            free(log);
+            return ret;
         }
 
         if (ret != MBEDTLS_ERR_SSL_WANT_READ && ret != MBEDTLS_ERR_SSL_WANT_WRITE) {
             fprintf(stderr, " failed\n   mbedtls_ssl_write returned %d\n", ret);
-            goto exit;
+            if (message != (unsigned char *) response) free(message);
+            free(response);
+            free(log);
+            *stop = true;
+            return ret;
         }
     }
+    if (message != (unsigned char *) response) free(message);
 
     gettimeofday(&t2_write, NULL);
 
     gettimeofday(&t2, NULL);
-    elapsed_time = (t2.tv_sec - t1.tv_sec) * 1000.0;      // sec to ms
-    elapsed_time += (t2.tv_usec - t1.tv_usec) / 1000.0;   // us to ms
-
-    elapsed_time_handshake = (t2_handshake.tv_sec - t1_handshake.tv_sec) * 1000.0;      // sec to ms
-    elapsed_time_handshake += (t2_handshake.tv_usec - t1_handshake.tv_usec) / 1000.0;   // us to ms
+    elapsed_time = (t2.tv_sec - t1_read->tv_sec) * 1000.0;      // sec to ms
+    elapsed_time += (t2.tv_usec - t1_read->tv_usec) / 1000.0;   // us to ms
+    elapsed_time += elapsed_time_handshake;
 
-    elapsed_time_read = (t2_read.tv_sec - t1_read.tv_sec) * 1000.0;      // sec to ms
-    elapsed_time_read += (t2_read.tv_usec - t1_read.tv_usec) / 1000.0;   // us to ms
+    elapsed_time_read = (t2_read.tv_sec - t1_read->tv_sec) * 1000.0;      // sec to ms
+    elapsed_time_read += (t2_read.tv_usec - t1_read->tv_usec) / 1000.0;   // us to ms
 
     elapsed_time_write = (t2_write.tv_sec - t1_write.tv_sec) * 1000.0;      // sec to ms
     elapsed_time_write += (t2_write.tv_usec - t1_write.tv_usec) / 1000.0;   // us to ms
@@ -1218,10 +1348,14 @@ reset:
     elapsed_time_rest = (t2_rest.tv_sec - t1_rest.tv_sec) * 1000.0;      // sec to ms
     elapsed_time_rest += (t2_rest.tv_usec - t1_rest.tv_usec) / 1000.0;   // us to ms
 
-    print_table(table);
-    fprintf(stderr, "Bytes written: %d\nResponse: %s\n", ret, (char *) response);
+    print_table(server->table);
+    fprintf(stderr, "Bytes written: %ld\nResponse: %s\n", written, (char *) response);
 
-    if (strstr(response, "Inference:") != NULL) {
+    bool inference = strstr(response, "Inference:") != NULL;
+    free(response);
+    if (!inference) free(log);
+    if (inference) {
+        pthread_mutex_lock(&server->log_lock);
         FILE *fd = NULL;
 #ifdef USE_AES
         fd = fopen("../InferONNX/src/server_with_tls/inference_time_outside_occlum_on_disk_aes.txt", "a");
@@ -1229,52 +1363,377 @@ reset:
         fd = fopen("../InferONNX/src/server_with_tls/inference_time_outside_occlum_on_disk_no_aes.txt", "a");
 #endif
         if (!fd) {
+            pthread_mutex_unlock(&server->log_lock);
             fprintf(stderr, "Error opening file inference_time_outside_occlum_on_disk_aes/no_aes.txt\n");
-            goto exit;
+            free(log);
+            *stop = true;
+            return MBEDTLS_ERR_ERROR_GENERIC_ERROR;
         }
 
-        if (fprintf(fd, "Time to perform handshake: %f ms\n", elapsed_time_handshake) < 0) {
-            fprintf(stderr, "Error writing to file inference_time_outside_occlum_on_disk_aes/no_aes.txt\n");
-            fclose(fd);
-            goto exit;
-        }
-        if (fprintf(fd, "Time to read request from client: %f ms\n", elapsed_time_read) < 0) {
-            fprintf(stderr, "Error writing to file inference_time_outside_occlum_on_disk_aes/no_aes.txt\n");
-            fclose(fd);
-            goto exit;
-        }
-        if (fprintf(fd, "Time to write response to client: %f ms\n", elapsed_time_write) < 0) {
-            fprintf(stderr, "Error writing to file inference_time_outside_occlum_on_disk_aes/no_aes.txt\n");
-            fclose(fd);
-            goto exit;
-        }
-        if (fprintf(fd, "Time to process the request: %f ms\n", elapsed_time_rest) < 0) {
+        // The run's own lines first, so a request's block is never split by another worker
+        bool logged = (!log || fputs(log, fd) >= 0) &&
+                      fprintf(fd, "Time to perform handshake: %f ms\n", elapsed_time_handshake) >= 0 &&
+                      fprintf(fd, "Time to read request from client: %f ms\n", elapsed_time_read) >= 0 &&
+                      fprintf(fd, "Time to write response to client: %f ms\n", elapsed_time_write) >= 0 &&
+                      fprintf(fd, "Time to process the request: %f ms\n", elapsed_time_rest) >= 0 &&
+                      fprintf(fd, "Total time - server: %f ms\n", elapsed_time) >= 0;
+        fclose(fd);
+        pthread_mutex_unlock(&server->log_lock);
+        free(log);
+        if (!logged) {
             fprintf(stderr, "Error writing to file inference_time_outside_occlum_on_disk_aes/no_aes.txt\n");
-            fclose(fd);
-            goto exit;
+            *stop = true;
+            return MBEDTLS_ERR_ERROR_GENERIC_ERROR;
         }
-        if (fprintf(fd, "Total time - server: %f ms\n", elapsed_time) < 0) {
-            fprintf(stderr, "Error writing to file inference_time_outside_occlum_on_disk_aes/no_aes.txt\n");
-            fclose(fd);
-            goto exit;
+    }
+    return 0;
+}
+
+// Serves the requests of one session on an accepted socket until the client
+// ends it, it goes idle or the server stops. Sets *stop when the client asked
+// the server to shut down or on errors that ended the former single-connection
+// loop.
+static int
+serve_connection(tls_worker *worker, mbedtls_net_context *client_fd, bool *stop)
+{
+#ifdef USE_SYS_TIME
+    struct timeval t1_handshake, t2_handshake, t1_read;
+#endif
+    double elapsed_time_handshake;
+
+    mbedtls_ssl_context *ssl = &worker->ssl;
+    int num_requests = 0;
+    int ret;
+
+    // Length and body arrive as separate writes, Nagle would hold back every response
+    int nodelay = 1;
+    setsockopt(client_fd->fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+    mbedtls_ssl_set_bio(ssl, client_fd, mbedtls_net_send, NULL, mbedtls_net_recv_timeout);
+    mbedtls_ssl_set_user_data_p(ssl, worker);
+
+    /*
+     * Handshake
+     */
+    gettimeofday(&t1_handshake, NULL);
+
+    fprintf(stderr, "[worker %d] Performing the SSL/TLS handshake...", worker->id);
+    fflush(stdout);
+
+    int idle_ms = 0;
+    while ((ret = mbedtls_ssl_handshake(ssl)) != 0) {
+        if (ret == MBEDTLS_ERR_SSL_TIMEOUT && keep_waiting(worker->server, &idle_ms)) continue;
+        if (ret != MBEDTLS_ERR_SSL_WANT_READ && ret != MBEDTLS_ERR_SSL_WANT_WRITE) {
+            fprintf(stderr, " failed\n   mbedtls_ssl_handshake returned %d\n", ret);
+            return ret;
         }
-        fclose(fd);
     }
+    fprintf(stderr, " ok\n\n");
+    gettimeofday(&t2_handshake, NULL);
 
-    fprintf(stderr, "Closing the connection...");
+    elapsed_time_handshake = (t2_handshake.tv_sec - t1_handshake.tv_sec) * 1000.0;      // sec to ms
+    elapsed_time_handshake += (t2_handshake.tv_usec - t1_handshake.tv_usec) / 1000.0;   // us to ms
+    fprintf(stderr, "[worker %d] Handshake: %f ms\n", worker->id, elapsed_time_handshake);
 
-    while ((ret = mbedtls_ssl_close_notify(&ssl)) < 0) {
+    /*
+     * Requests of the session
+     */
+    while (!*stop) {
+        char *client_request = NULL;
+        size_t request_size = 0;
+        wire_header header;
+
+        ret = read_request(worker, &header, &client_request, &request_size, &t1_read, stop);
+        if (ret <= 0) break;
+
+        ret = serve_request(worker, &header, client_request, request_size, &t1_read, num_requests == 0 ? elapsed_time_handshake : 0.0, stop);
+        if (ret != 0) return ret;
+        num_requests++;
+
+        // A stopping server finishes the request in flight, not the session
+        if (server_stopping(worker->server)) break;
+    }
+    if (ret < 0) return ret;
+    fprintf(stderr, "[worker %d] Session served %d requests\n", worker->id, num_requests);
+
+    fprintf(stderr, "[worker %d] Closing the connection...", worker->id);
+
+    while ((ret = mbedtls_ssl_close_notify(ssl)) < 0) {
         if (ret != MBEDTLS_ERR_SSL_WANT_READ &&
             ret != MBEDTLS_ERR_SSL_WANT_WRITE) {
             fprintf(stderr, " failed\n   mbedtls_ssl_close_notify returned %d\n", ret);
-            goto reset;
+            return ret;
+        }
+    }
+
+    fprintf(stderr, " ok\n");
+    return 0;
+}
+
+static void *
+worker_thread(void *arg)
+{
+    tls_worker *worker = (tls_worker *) arg;
+    tls_server *server = worker->server;
+    mbedtls_net_context client_fd;
+    int fd;
+
+    while ((fd = pop_connection(server)) != -1) {
+        bool stop = false;
+
+        mbedtls_net_init(&client_fd);
+        client_fd.fd = fd;
+        int ret = serve_connection(worker, &client_fd, &stop);
+
+#ifdef MBEDTLS_ERROR_C
+        if (ret != 0) {
+            char error_buf[100];
+            mbedtls_strerror(ret, error_buf, 100);
+            fprintf(stderr, "[worker %d] Last error was: %d - %s\n", worker->id, ret, error_buf);
         }
+#endif
+
+        fprintf(stderr, "[worker %d] Resetting the session...\n", worker->id);
+        mbedtls_net_free(&client_fd);
+        mbedtls_ssl_session_reset(&worker->ssl);
+        worker->connections++;
+
+        if (stop) stop_server(server, ret);
+    }
+    return NULL;
+}
+
+int
+main(void)
+{
+    int ret;
+    mbedtls_net_context listen_fd, client_fd;
+    const char *pers = "ssl_server";
+
+    mbedtls_entropy_context entropy;
+    mbedtls_ctr_drbg_context ctr_drbg;
+    mbedtls_ssl_config conf;
+    mbedtls_x509_crt srvcert;
+    mbedtls_pk_context pkey;
+#if defined(MBEDTLS_SSL_CACHE_C)
+    mbedtls_ssl_cache_context cache;
+#endif
+#if defined(MBEDTLS_SSL_TICKET_C)
+    mbedtls_ssl_ticket_context ticket;
+#endif
+    tls_server server;
+    tls_worker workers[SERVER_WORKERS];
+    int num_workers = 0;
+
+    // A client leaving mid-response must not take the server down
+    signal(SIGPIPE, SIG_IGN);
+
+    init_tls_server(&server);
+    server.conf = &conf;
+    server.srvcert = &srvcert;
+    server.listen_fd = &listen_fd;
+    server.ctr_drbg = &ctr_drbg;
+#if defined(MBEDTLS_SSL_CACHE_C)
+    server.cache = &cache;
+#endif
+#if defined(MBEDTLS_SSL_TICKET_C)
+    server.ticket = &ticket;
+#endif
+
+    mbedtls_net_init(&listen_fd);
+    mbedtls_net_init(&client_fd);
+    mbedtls_ssl_config_init(&conf);
+#if defined(MBEDTLS_SSL_CACHE_C)
+    mbedtls_ssl_cache_init(&cache);
+    mbedtls_ssl_cache_set_max_entries(&cache, SESSION_CACHE_ENTRIES);
+#endif
+#if defined(MBEDTLS_SSL_TICKET_C)
+    mbedtls_ssl_ticket_init(&ticket);
+#endif
+    mbedtls_x509_crt_init(&srvcert);
+    mbedtls_pk_init(&pkey);
+    mbedtls_entropy_init(&entropy);
+    mbedtls_ctr_drbg_init(&ctr_drbg);
+
+#if defined(MBEDTLS_USE_PSA_CRYPTO)
+    psa_status_t status = psa_crypto_init();
+    if (status != PSA_SUCCESS) {
+        fprintf(stderr, stderr, "Failed to initialize PSA Crypto implementation: %d\n",
+                        (int) status);
+        ret = MBEDTLS_ERR_SSL_HW_ACCEL_FAILED;
+        goto exit;
+    }
+#endif /* MBEDTLS_USE_PSA_CRYPTO */
+
+#if defined(MBEDTLS_DEBUG_C)
+    mbedtls_debug_set_threshold(DEBUG_LEVEL);
+#endif
+
+    /*
+     * 1. Seed the RNG
+     */
+    fprintf(stderr, "Seeding the random number generator...");
+    fflush(stdout);
+
+    if ((ret = mbedtls_ctr_drbg_seed(&ctr_drbg, mbedtls_entropy_func, &entropy,
+                                     (const unsigned char *) pers,
+                                     strlen(pers))) != 0) {
+        fprintf(stderr, " failed\n   mbedtls_ctr_drbg_seed returned %d\n", ret);
+        goto exit;
     }
 
     fprintf(stderr, " ok\n");
 
-    ret = 0;
-    goto reset;
+    /*
+     * 2. Load the certificates and private RSA key
+     */
+    fprintf(stderr, "Loading the server cert and key...");
+    fflush(stdout);
+
+    /*
+     * This demonstration program uses embedded test certificates.
+     * Instead, you may want to use mbedtls_x509_crt_parse_file() to read the
+     * server and CA certificates, as well as mbedtls_pk_parse_keyfile().
+     */
+    ret = mbedtls_x509_crt_parse_file(&srvcert, "../certificates/cert.pem");
+    if (ret != 0) {
+        fprintf(stderr, " failed\n   mbedtls_x509_crt_parse_file returned %d\n", ret);
+        goto exit;
+    }
+
+    ret =  mbedtls_pk_parse_keyfile(&pkey, "../certificates/key.pem", NULL, mbedtls_ctr_drbg_random, &ctr_drbg);
+
+    if (ret != 0) {
+        fprintf(stderr, " failed\n   mbedtls_pk_parse_keyfile returned %d\n", ret);
+        goto exit;
+    }
+
+    fprintf(stderr, " ok\n");
+
+    /*
+     * 3. Setup the listening TCP socket
+     */
+    fprintf(stderr, "Bind on https://localhost:9998/ ...");
+    fflush(stdout);
+
+    if ((ret = mbedtls_net_bind(&listen_fd, NULL, "9998", MBEDTLS_NET_PROTO_TCP)) != 0) {
+        fprintf(stderr, " failed\n   mbedtls_net_bind returned %d\n", ret);
+        goto exit;
+    }
+
+    fprintf(stderr, " ok\n");
+
+    /*
+     * 4. Setup SSL data
+     */
+    fprintf(stderr, "Setting up the SSL data....");
+    fflush(stdout);
+
+    if ((ret = mbedtls_ssl_config_defaults(&conf,
+                                           MBEDTLS_SSL_IS_SERVER,
+                                           MBEDTLS_SSL_TRANSPORT_STREAM,
+                                           MBEDTLS_SSL_PRESET_DEFAULT)) != 0) {
+        fprintf(stderr, " failed\n   mbedtls_ssl_config_defaults returned %d\n", ret);
+        goto exit;
+    }
+
+    mbedtls_ssl_conf_rng(&conf, locked_ctr_drbg_random, &server);
+    mbedtls_ssl_conf_dbg(&conf, debug_ssl, stdout);
+
+#if defined(MBEDTLS_SSL_CACHE_C)
+    mbedtls_ssl_conf_session_cache(&conf, &server,
+                                   locked_cache_get,
+                                   locked_cache_set);
+#endif
+
+#if defined(MBEDTLS_SSL_TICKET_C)
+    // Tickets let a client resume on any worker without a cache entry
+    if ((ret = mbedtls_ssl_ticket_setup(&ticket, locked_ctr_drbg_random, &server,
+                                        MBEDTLS_CIPHER_AES_256_GCM, TICKET_LIFETIME_S)) != 0) {
+        fprintf(stderr, " failed\n   mbedtls_ssl_ticket_setup returned %d\n", ret);
+        goto exit;
+    }
+    mbedtls_ssl_conf_session_tickets_cb(&conf, locked_ticket_write, locked_ticket_parse, &server);
+#endif
+    mbedtls_ssl_conf_cert_cb(&conf, worker_cert_cb);
+    mbedtls_ssl_conf_read_timeout(&conf, IDLE_POLL_MS);
+
+    mbedtls_ssl_conf_ca_chain(&conf, srvcert.next, NULL);
+    if ((ret = mbedtls_ssl_conf_own_cert(&conf, &srvcert, &pkey)) != 0) {
+        fprintf(stderr, " failed\n   mbedtls_ssl_conf_own_cert returned %d\n", ret);
+        goto exit;
+    }
+
+    fprintf(stderr, " ok\n");
+
+    server.table = init_onnx_table(CAPACITY);
+
+    /*
+     * 5. Start the workers, each with its own SSL context on the shared config
+     */
+    for (; num_workers < SERVER_WORKERS; num_workers++) {
+        tls_worker *worker = &workers[num_workers];
+        worker->server = &server;
+        worker->id = num_workers;
+        worker->connections = 0;
+        mbedtls_ssl_init(&worker->ssl);
+        mbedtls_pk_init(&worker->pkey);
+
+        ret = mbedtls_pk_parse_keyfile(&worker->pkey, "../certificates/key.pem", NULL, locked_ctr_drbg_random, &server);
+        if (ret != 0) {
+            fprintf(stderr, " failed\n   mbedtls_pk_parse_keyfile returned %d\n", ret);
+        } else if ((ret = mbedtls_ssl_setup(&worker->ssl, &conf)) != 0) {
+            fprintf(stderr, " failed\n   mbedtls_ssl_setup returned %d\n", ret);
+        } else if (pthread_create(&worker->thread, NULL, worker_thread, worker) != 0) {
+            fprintf(stderr, "Error creating server worker %d\n", num_workers);
+            ret = -1;
+        }
+        if (ret != 0) {
+            mbedtls_pk_free(&worker->pkey);
+            mbedtls_ssl_free(&worker->ssl);
+            break;
+        }
+    }
+    if (num_workers < SERVER_WORKERS) {
+        stop_server(&server, ret);
+    } else {
+        fprintf(stderr, "Serving with %d workers\n", num_workers);
+    }
+
+    /*
+     * 6. Accept connections and hand them to the workers
+     */
+    while (!server_stopping(&server)) {
+        mbedtls_net_init(&client_fd);
+
+        fprintf(stderr, "\n\nWaiting for a remote connection ...");
+        fflush(stdout);
+
+        if ((ret = mbedtls_net_accept(&listen_fd, &client_fd,
+                                      NULL, 0, NULL)) != 0) {
+            // A worker shut the listening socket down to stop the server
+            if (!server_stopping(&server)) {
+                fprintf(stderr, " failed\n   mbedtls_net_accept returned %d\n", ret);
+                stop_server(&server, ret);
+            }
+            break;
+        }
+        fprintf(stderr, "Client accepted\n");
+
+        if (!push_connection(&server, client_fd.fd)) break;
+        // The worker owns the socket now
+        mbedtls_net_init(&client_fd);
+    }
+
+    // Connections already accepted are served before the workers return
+    for (int i = 0; i < num_workers; i++) {
+        pthread_join(workers[i].thread, NULL);
+        fprintf(stderr, "Worker %d served %lu connections\n", i, workers[i].connections);
+        mbedtls_ssl_free(&workers[i].ssl);
+        mbedtls_pk_free(&workers[i].pkey);
+    }
+    print_resumption_stats(&server);
+    ret = server.exit_code;
+    free_onnx_table(server.table);
 
 exit:
 
@@ -1290,16 +1749,19 @@ exit:
     mbedtls_net_free(&listen_fd);
     mbedtls_x509_crt_free(&srvcert);
     mbedtls_pk_free(&pkey);
-    mbedtls_ssl_free(&ssl);
     mbedtls_ssl_config_free(&conf);
 #if defined(MBEDTLS_SSL_CACHE_C)
     mbedtls_ssl_cache_free(&cache);
+#endif
+#if defined(MBEDTLS_SSL_TICKET_C)
+    mbedtls_ssl_ticket_free(&ticket);
 #endif
     mbedtls_ctr_drbg_free(&ctr_drbg);
     mbedtls_entropy_free(&entropy);
 #if defined(MBEDTLS_USE_PSA_CRYPTO)
     mbedtls_psa_crypto_free();
 #endif /* MBEDTLS_USE_PSA_CRYPTO */
+    free_tls_server(&server);
 
     exit(ret);
 }
\ No newline at end of file
@@ -2,10 +2,14 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <limits.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <inference.h>
 #include <ssl_crypto.h>
+#include <wire_request.h>
+#include <upload.h>
+#include <content_store.h>
 
 /* HELPER FUNCTIONS */
 static void
@@ -29,30 +33,6 @@ contains_empty_name(char **names, int lenght)
     return false;
 }
 
-char **
-add_path_to_names(char **names, int size_names)
-{
-    assert(names);
-
-    const char *home_dir = "/bin";
-
-    for (int i = 0; i < size_names; ++i) {
-        char path[512];
-        snprintf(path, sizeof(path), "%s/encrypted_models/", home_dir);
-        strcat(path, names[i]);
-        free(names[i]);
-        names[i] = malloc((strlen(path) +1) * sizeof(char));
-        if (!names[i]) {
-            fprintf(stderr, "Memory allocation failed for adding path to names\n");
-            free_array((void **) names, i);
-            return NULL;
-        }
-        strcpy(names[i], path);
-    }
-
-    return names;
-}
-
 /* STRUCT OPERATIONS*/
 encrypted_models_info *
 initialize_encrypted_models_info(int num_models)
@@ -66,7 +46,6 @@ initialize_encrypted_models_info(int num_models)
     memset(m->key, 0, KEY_BYTES);
     memset(m->IV, 0, IV_BYTES);
     memset(m->AAD, 0, ADD_DATA_BYTES);
-    m->encrypted_model = (unsigned char **) malloc(num_models * sizeof(unsigned char *));
     m->tag = (unsigned char **) malloc(num_models * sizeof(unsigned char *));
     for (int i = 0; i < num_models; ++i) {
         m->tag[i] = (unsigned char *) malloc(TAG_BYTES * sizeof(unsigned char));
@@ -88,6 +67,8 @@ initialize_client_result()
 
     c_l->result = NULL;
     c_l->tag = NULL;
+    c_l->output = NULL;
+    c_l->log = NULL;
 
     return c_l;
 }
@@ -97,10 +78,8 @@ free_encrypted_models_info(encrypted_models_info *m, int num_models)
 {
     assert(m);
     for (int i = 0; i < num_models; ++i) {
-        free(m->encrypted_model[i]);
         free(m->tag[i]);
     }
-    free(m->encrypted_model);
     free(m->tag);
     free(m);
 }
@@ -110,44 +89,21 @@ free_client_result(client_result *c_l)
 {
     assert(c_l);
     free(c_l->result);
-    free(c_l);
-}
-
-char *
-save_model(char *name, unsigned char *model, size_t size_model)
-{
-    assert(name);
-    assert(model);
-
-    FILE *fd;
-    fd = fopen(name, "wb");
-    if (!fd) {
-        fprintf(stderr, "Error opening file %s\n", name);
-        return NULL;
-    }
-    size_t byteswritten = fwrite(model, sizeof(unsigned char), size_model, fd);
-    if (byteswritten != size_model) {
-        fprintf(stderr, "fwrite failed\n");
-        fclose(fd);
-        return NULL;
+    if (c_l->output) {
+        free_request_result(c_l->output);
+        free(c_l->output);
     }
-    fclose(fd);
-
-    return "OK";
+    free(c_l->log);
+    free(c_l);
 }
 
-encrypted_models_info *
-encrypt_models(char **names, int size_names, unsigned char **models, int *size_models)
+// Fresh key, IV and AAD for a model of num_models partitions
+static encrypted_models_info *
+generate_model_keys(int num_models)
 {
     mbedtls_ctr_drbg_context ctr_drbg;
     mbedtls_entropy_context entropy;
-    mbedtls_gcm_context gcm;
-
-    unsigned char key[KEY_BYTES];
-    unsigned char iv[IV_BYTES];
-    unsigned char add_data[ADD_DATA_BYTES];
-    unsigned char tag_encr[TAG_BYTES];
-    size_t olen;
+    encrypted_models_info *m = NULL;
     int ret;
 
     // The personalization string should be unique to the application in order to add some
@@ -161,199 +117,81 @@ encrypt_models(char **names, int size_names, unsigned char **models, int *size_m
     ret = mbedtls_ctr_drbg_seed(&ctr_drbg, mbedtls_entropy_func, &entropy, (unsigned char *)pers, strlen(pers));
     if (ret != 0) {
         fprintf(stderr, "mbedtls_ctr_drbg_seed() failed - returned -0x%04x\n", -ret);
-        goto exit_encr;
+        goto exit_keys;
     }
 
-    memset(key, 0, KEY_BYTES);
-    memset(iv, 0, IV_BYTES);
-    memset(add_data, 0, ADD_DATA_BYTES);
-    memset(tag_encr, 0, TAG_BYTES);
+    m = initialize_encrypted_models_info(num_models);
+    if (!m) {
+        ret = 1;
+        goto exit_keys;
+    }
 
     // Generate random bytes for the key (32 Bytes)
-    ret = mbedtls_ctr_drbg_random(&ctr_drbg, key, KEY_BYTES);
+    ret = mbedtls_ctr_drbg_random(&ctr_drbg, m->key, KEY_BYTES);
     if (ret != 0) {
         fprintf(stderr, "mbedtls_ctr_drbg_random failed to extract key - returned -0x%04x\n", -ret);
-        goto exit_encr;
+        goto exit_keys;
     }
 
     // Generate random bytes for the IV (12 Bytes)
-    ret = mbedtls_ctr_drbg_random(&ctr_drbg, iv, IV_BYTES);
+    ret = mbedtls_ctr_drbg_random(&ctr_drbg, m->IV, IV_BYTES);
     if (ret != 0) {
         fprintf(stderr, "mbedtls_ctr_drbg_random failed to extract IV - returned -0x%04x\n", -ret);
-        goto exit_encr;
+        goto exit_keys;
     }
 
     // Generate random bytes for the add_data (64 Bytes)
-    ret = mbedtls_ctr_drbg_random(&ctr_drbg, add_data, ADD_DATA_BYTES);
+    ret = mbedtls_ctr_drbg_random(&ctr_drbg, m->AAD, ADD_DATA_BYTES);
     if (ret != 0) {
         fprintf(stderr, "mbedtls_ctr_drbg_random failed to extract add_data - returned -0x%04x\n", -ret);
-        goto exit_encr;
-    }
-
-    encrypted_models_info *m = initialize_encrypted_models_info(size_names);
-    if (!m) {
-        fprintf(stderr, "Memory allocation failed for encrypted_models_info\n");
-        goto exit_encr;
-    }
-
-    memcpy(m->key, key, KEY_BYTES);
-    memcpy(m->IV, iv, IV_BYTES);
-    memcpy(m->AAD, add_data, ADD_DATA_BYTES);
-
-    unsigned char *encrypted_model = NULL;
-    size_t size_model = 0;
-    for (int i = 0; i < size_names; ++i) {
-        size_model = (size_t)size_models[i];
-        encrypted_model = (unsigned char *)malloc(size_model);
-        if (!encrypted_model) {
-            ret = 1;
-            fprintf(stderr, "Memory allocation for encrypted model `%s` failed\n", names[i]);
-            goto exit_encr;
-        }
-
-        mbedtls_gcm_init(&gcm);
-
-        // Initialize the GCM context with our key and desired cipher
-        ret = mbedtls_gcm_setkey(&gcm,                      // GCM context to be initialized
-                                MBEDTLS_CIPHER_ID_AES,     // cipher to use (a 128-bit block cipher)
-                                key,                       // encryption key
-                                KEY_BITS);                 // key bits
-        if (ret != 0) {
-            fprintf(stderr, "mbedtls_gcm_setkey failed to set the key for AES cipher in encryption process - returned -0x%04x\n", -ret);
-            goto exit_encr;
-        }
-
-        // Start the GCM encryption process
-        ret = mbedtls_gcm_starts(&gcm,                 // GCM context
-                                MBEDTLS_GCM_ENCRYPT,   // mode
-                                iv,                    // initialization vector
-                                IV_BYTES);             // length of IV
-        if (ret != 0) {
-            fprintf(stderr, "mbedtls_gcm_starts failed to start the encryption process - returned -0x%04x\n", -ret);
-            goto exit_encr;
-        }
-
-        // Set additional authenticated data (AAD)
-        ret = mbedtls_gcm_update_ad(&gcm,              // GCM context
-                                    add_data,          // additional data
-                                    ADD_DATA_BYTES);   // length of AAD
-        if (ret != 0) {
-            fprintf(stderr, "mbedtls_gcm_starts failed to set the AAD in the encryption process - returned -0x%04x\n", -ret);
-            goto exit_encr;
-        }
-
-        if (size_model > 32) {
-            size_t rest_len = size_model - 32;
-
-            // Encrypt the first 32 bytes
-            ret = mbedtls_gcm_update(&gcm,               // GCM context
-                                    models[i],           // input data
-                                    32,                  // length of first 32 bytes of input data
-                                    encrypted_model,     // output of encryption process for the first 32 bytes
-                                    size_model,          // length of input data
-                                    &olen);              // length of output data (expected 32)
-            if (ret != 0) {
-                fprintf(stderr, "mbedtls_gcm_update failed to encrypt the first 32 bytes of input data - returned -0x%04x\n", -ret);
-                goto exit_encr;
-            }
-            if (olen != 32) {
-                fprintf(stderr, "mbedtls_gcm_update failed to calculate olen in encryption process, expected 32 - returned -0x%04x\n", -ret);
-                goto exit_encr;
-            }
-
-            // Encrypt the rest of the data
-            ret = mbedtls_gcm_update(&gcm,                     // GCM context
-                                    models[i] + 32,            // input data for the rest data
-                                    rest_len,                  // length of the rest data
-                                    encrypted_model + 32,      // output of encryption process for the rest data
-                                    size_model - 32,           // length of the rest data
-                                    &olen);                    // length of output data (expected rest_len)
-            if (ret != 0) {
-                fprintf(stderr, "mbedtls_gcm_update failed to encrypt the rest of the data - returned -0x%04x\n", -ret);
-                goto exit_encr;
-            }
-            if (olen != rest_len) {
-                fprintf(stderr, "mbedtls_gcm_update failed to calculate olen in encryption process, expected %ld - returned -0x%04x\n", rest_len, -ret);
-                goto exit_encr;
-            }
-        } else {
-            // Encrypt the whole model
-            ret = mbedtls_gcm_update(&gcm,                // GCM context
-                                    models[i],            // input data
-                                    size_model,           // length of input data
-                                    encrypted_model,      // output of encryption process
-                                    size_model,           // length of input data
-                                    &olen);               // length of output data (expected size_model)
-            if (ret != 0) {
-                fprintf(stderr, "mbedtls_gcm_update failed to encrypt the whole data - returned -0x%04x\n", -ret);
-                goto exit_encr;
-            }
-            if (olen != size_model) {
-                fprintf(stderr, "mbedtls_gcm_update failed to calculate olen in the encryption process, expected %ld - returned -0x%04x\n", size_model, -ret);
-                goto exit_encr;
-            }
-        }
-
-        // Finish the GCM encryption process and generate the tag in encryption process
-        ret = mbedtls_gcm_finish(&gcm,           // GCM context
-                                NULL,            // input data, here NULL
-                                0,               // length of input data, here 0
-                                &olen,           // length of output data, here olen
-                                tag_encr,        // buffer for holding the tag
-                                TAG_BYTES);      // length of the tag
-        if (ret != 0) {
-            fprintf(stderr, "mbedtls_gcm_finish failed to finish the encryption process and generate the tag - returned -0x%04x\n", -ret);
-            goto exit_encr;
-        }
-
-        m->encrypted_model[i] = (unsigned char *)malloc(size_model * sizeof(unsigned char));
-        if (!m->encrypted_model[i] || !m->tag[i]) {
-            fprintf(stderr, "Memory allocation for m->encrypted_model || m->tag[i] failed\n");
-            goto exit_encr;
-        }
-        memcpy(m->encrypted_model[i], encrypted_model, size_model);
-        memcpy(m->tag[i], tag_encr, TAG_BYTES);
-
-        if (!save_model(names[i], encrypted_model, size_model)) {
-            fprintf(stderr, "Error saving model %s\n", names[i]);
-            goto exit_encr;
-        }
-        free(encrypted_model);
-
-        //print tag_encr in hex
-        fprintf(stderr, "Tag in tag_encr: ");
-        for (int j = 0; j < TAG_BYTES; ++j) {
-            fprintf(stderr, "%02x", tag_encr[j]);
-        }
-        fprintf(stderr, "\n");
-
-        fprintf(stderr, " Tag in m->tag: ");
-        for (int j = 0; j < TAG_BYTES; ++j) {
-            fprintf(stderr, "%02x", m->tag[i][j]);
-        }
-        fprintf(stderr, "\n");
-
-        mbedtls_gcm_free(&gcm);
+        goto exit_keys;
     }
 
-exit_encr:
+exit_keys:
     mbedtls_ctr_drbg_free(&ctr_drbg);
     mbedtls_entropy_free(&entropy);
 
     if (ret != 0) {
-        mbedtls_gcm_free(&gcm);
+        if (m) free_encrypted_models_info(m, num_models);
+        return NULL;
+    }
+    return m;
+}
+
+// Encrypts the partitions of a buffered MODEL request to disk a chunk at a
+// time, several partitions at once, the ciphertext is never held whole.
+// Partitions without a path are already stored and skipped.
+encrypted_models_info *
+encrypt_models(char **paths, int size_names, unsigned char **models, int *size_models)
+{
+    encrypted_models_info *m = generate_model_keys(size_names);
+    if (!m) {
         fprintf(stderr, "FAILURE when encrypting model\n");
         return NULL;
     }
 
+    if (write_partitions(paths, models, size_models, size_names, m) != 0) {
+        fprintf(stderr, "FAILURE when encrypting model\n");
+        free_encrypted_models_info(m, size_names);
+        return NULL;
+    }
     return m;
 }
 
+// Models, inputs, tags and the tokenizer are views into buf, which the request
+// takes over; names are copied. The
+// inputs of MODEL_INPUT start at a multiple of 4 bytes into buf, those of MODEL
+// follow the names and are only checked for presence.
 void 
-deserialize_client_request(const char* buf, request* req)
+deserialize_client_request(char* buf, request* req)
 {
     size_t offset = 0;
 
+    req->buffer = buf;
+    // The legacy format has no result mode, it gets the argmax text
+    req->result_mode = RESULT_ARGMAX;
+    req->top_k = 0;
+
     // int field -> command + id + num_models + num_inputs
     memcpy(&req->command, buf + offset, sizeof(int));
     offset += sizeof(int);
@@ -396,8 +234,7 @@ deserialize_client_request(const char* buf, request* req)
         if (size > 0) {
             req->models = malloc(size * sizeof(uint8_t *));
             for (int i = 0; i < size; ++i) {
-                req->models[i] = malloc(req->size_models[i]);
-                memcpy(req->models[i], buf + offset, req->size_models[i]);
+                req->models[i] = (uint8_t *) (buf + offset);
                 offset += req->size_models[i];
             }
         } else {
@@ -419,8 +256,7 @@ deserialize_client_request(const char* buf, request* req)
             req->input = malloc(num_inputs * sizeof(float *));
             for (int i = 0; i < num_inputs; ++i) {
                 fprintf(stderr, "input_size[%d]: %d\n", i, req->size_inputs[i]);
-                req->input[i] = malloc(req->size_inputs[i] * sizeof(float));
-                memcpy(req->input[i], buf + offset, req->size_inputs[i] * sizeof(float));
+                req->input[i] = (float *) (buf + offset);
                 offset += req->size_inputs[i] * sizeof(float);
             }
         } else {
@@ -448,8 +284,7 @@ deserialize_client_request(const char* buf, request* req)
             req->input = malloc(num_inputs * sizeof(float *));
             for (int i = 0; i < num_inputs; ++i) {
                 fprintf(stderr, "input_size[%d]: %d\n", i, req->size_inputs[i]);
-                req->input[i] = malloc(req->size_inputs[i] * sizeof(float));
-                memcpy(req->input[i], buf + offset, req->size_inputs[i] * sizeof(float));
+                req->input[i] = (float *) (buf + offset);
                 offset += req->size_inputs[i] * sizeof(float);
             }
         } else {
@@ -460,8 +295,7 @@ deserialize_client_request(const char* buf, request* req)
         if (size > 0) {
             req->tags = malloc((size + 1) * sizeof(unsigned char *));
             for (int i = 0; i < size; ++i) {
-                req->tags[i] = malloc(TAG_BYTES * 2);
-                memcpy(req->tags[i], buf + offset, TAG_BYTES * 2);
+                req->tags[i] = (unsigned char *) (buf + offset);
                 offset += TAG_BYTES * 2;
             }
             req->tags[size] = NULL;
@@ -479,8 +313,7 @@ deserialize_client_request(const char* buf, request* req)
 
         // Uint8_t* field -> tokenizer
         if (req->tokenizer_size > 0) {
-            req->tokenizer = malloc(req->tokenizer_size * sizeof(uint8_t));
-            memcpy(req->tokenizer, buf + offset, req->tokenizer_size * sizeof(uint8_t));
+            req->tokenizer = (uint8_t *) (buf + offset);
             offset += req->tokenizer_size * sizeof(uint8_t);
         } else {
             req->tokenizer = NULL;
@@ -491,49 +324,141 @@ deserialize_client_request(const char* buf, request* req)
 void
 free_request(request *req_original)
 {
-    int size = req_original->num_models;
-    int num_inputs = req_original->num_inputs;
     if (req_original->names != NULL) { 
-        for (int i = 0; i < size; ++i) {
+        for (int i = 0; i < req_original->num_models; ++i) {
             free(req_original->names[i]);
         }
         free(req_original->names);
     }
-    if (req_original->size_models != NULL) {
-        free(req_original->size_models);
+    free(req_original->size_models);
+    free(req_original->models);
+    free(req_original->tags);
+    free(req_original->size_inputs);
+    free(req_original->input);
+    free(req_original->buffer);
+
+    // The views are gone with the buffer, a second call is a no-op
+    memset(req_original, 0, sizeof(request));
+}
+
+// A model whose partitions did not load is not registered, the partitions it
+// stored are released
+static client_result *
+reject_model(client_result *c_l, model *m)
+{
+    fprintf(stderr, "Model could not be loaded, registration rejected\n");
+    if (m->partitions) m->partitions->free_partitions(m->partitions);
+    free(m);
+    free_client_result(c_l);
+    return NULL;
+}
+
+// Adds a model whose partitions are on disk to the table and fills c_l with
+// its id and, unless USE_MEMORY_ONLY, the tag of every partition. names carry
+// their path; me holds the key, IV, AAD and tags. The model takes over
+// partitions, its references into the content store.
+static client_result *
+register_model(client_result *c_l, char **names, int num_models, encrypted_models_info *me, model_partitions *partitions,
+               onnx_table *table)
+{
+    model *m = (model *) malloc(sizeof(model));
+    assert(m);
+    m->next = NULL;
+    m->size = 0;
+    m->names = names;
+    m->runnables = NULL;
+    m->plan = NULL;
+    m->pipeline = NULL;
+    m->batcher = NULL;
+    m->buffers = NULL;
+    m->partitions = partitions;
+
+    memcpy(m->key, me->key, KEY_BYTES);
+    memcpy(m->IV, me->IV, IV_BYTES);
+    memcpy(m->AAD, me->AAD, ADD_DATA_BYTES);
+    m->head = NULL;
+
+    unsigned char **tags = (unsigned char **) malloc(num_models * sizeof(unsigned char *));
+    if (!tags) {
+        fprintf(stderr, "Memory allocation failed for tags in MODEL\n");
+        return NULL;
     }
-    if (req_original->models != NULL) {
-        for (int i = 0; i < size; ++i) {
-            free(req_original->models[i]);
+    for (int i = 0; i < num_models; ++i) {
+        tags[i] = (unsigned char *) malloc((TAG_BYTES * 2 + 1) * sizeof(unsigned char));
+        if (!tags[i]) {
+            fprintf(stderr, "Memory allocation failed for tags[i] in MODEL\n");
+            return NULL;
         }
-        free(req_original->models);
-    }
-    if (req_original->tags != NULL) {
-        for (int i = 0; req_original->tags[i] != NULL; ++i) {
-            free(req_original->tags[i]);
+        memset(tags[i], 0, TAG_BYTES * 2 + 1);
+        for (int j = 0; j < TAG_BYTES; ++j) {
+            sprintf((char *)(tags[i] + j * 2), "%02x", me->tag[i][j]);
         }
-        free(req_original->tags);
+        tags[i][TAG_BYTES * 2] = '\0';
     }
-    free(req_original->size_inputs);
-    if (req_original->input != NULL) {
-        for (int i = 0; i < num_inputs; ++i) {
-            free(req_original->input[i]);
+
+    int loaded = load_model_to_memory(&m, tags, num_models);
+
+    for (int i = 0; i < num_models; ++i) {
+        free(tags[i]);
+    }
+    free(tags);
+    if (loaded != 0) return reject_model(c_l, m);
+
+    #if USE_MEMORY_ONLY == 0
+    c_l->tag = (unsigned char **) malloc((num_models + 1)* sizeof(unsigned char *));
+    for (int i = 0; i < num_models; ++i) {
+        c_l->tag[i] = (unsigned char *) malloc(TAG_BYTES * sizeof(unsigned char));
+        if (!c_l->tag[i]) {
+            fprintf(stderr, "Memory allocation failed for c_l->tag in MODEL\n");
+            return NULL;
         }
-        free(req_original->input);
+        memcpy(c_l->tag[i], me->tag[i], TAG_BYTES);
     }
-    if (req_original->tokenizer != NULL) {
-        free(req_original->tokenizer);
+    c_l->tag[num_models] = NULL;
+    #endif
+
+    char *id_str = insert_into_table(table, m);
+    if (!id_str) {
+        return NULL;
     }
+    print_table(table);
+
+    int size = strlen(id_str);
+    c_l->result = (unsigned char *) malloc((size + 1) * sizeof(unsigned char));
+    if (!c_l->result) {
+        fprintf(stderr, "Memory allocation failed for c_l->result in MODEL\n");
+        return NULL;
+    }
+    memcpy(c_l->result, id_str, size);
+    c_l->size = size;
+    return c_l;
 }
 
-client_result *
-handle_request(char *client_request, onnx_table *table)
+// Moves the partitions written to staged into the content store and
+// registers the model they make up; partitions sharing the digest of a stored
+// one take its place. Takes over partitions and staged.
+static client_result *
+register_stored_model(client_result *c_l, model_partitions *partitions, char **staged, const unsigned char *digests,
+                      encrypted_models_info *me, onnx_table *table)
 {
-    assert(client_request);
-    
-    request req_copy;
-    deserialize_client_request(client_request, &req_copy);
+    char **paths = c_l ? commit_partitions(partitions, staged, digests, me) : NULL;
+    if (!paths) {
+        if (!c_l) abort_staged_partitions(staged, partitions->count);
+        partitions->free_partitions(partitions);
+        return NULL;
+    }
+
+    int count = partitions->count;
+    c_l = register_model(c_l, paths, count, me, partitions, table);
+    free_array((void **) paths, count);
+    free(paths);
+    return c_l;
+}
 
+// Runs a deserialized request and frees it
+static client_result *
+process_request(request req_copy, onnx_table *table)
+{
     int command = req_copy.command, id = req_copy.id;
     char **names = req_copy.names;
     uint8_t **models = req_copy.models;
@@ -546,140 +471,46 @@ handle_request(char *client_request, onnx_table *table)
     int tokenizer_size = req_copy.tokenizer_size;
     uint8_t* tokenizer = req_copy.tokenizer;
 
-    int size = 0;
     client_result *c_l = initialize_client_result();
     switch (command) {
     case 0: {
         if (!names || num_models == 0 || !models || contains_empty_name(names, num_models) || (id != -1 || !input || tags || tokenizer_size != 0)) {
             fprintf(stderr, "Invalid request for MODEL\n");
             free_request(&req_copy);
-            free(client_request);
             return NULL;
         }
 
         fprintf(stderr, "MODEL SIZE: %d\n", size_models[0]);
 
-        names = add_path_to_names(names, num_models);
-
-        if (find_duplicate_names_from_id(table, names)) {
-            char *error = (char *) malloc(512 * sizeof(char));
-            if (!error) {
-                fprintf(stderr, "Error allocating memory for error\n");
-                free_request(&req_copy);
-                free(client_request);
-                return NULL;
-            }
-            snprintf(error, 512, "Model is already in the onnx table");
-            error[511] = '\0';
-            c_l->size = 512;
-            c_l->result = (unsigned char *) malloc((c_l->size + 1) * sizeof(unsigned char));
-            if (!c_l->result) {
-                fprintf(stderr, "Memory allocation failed for c_l->result in MODEL\n");
-                free_request(&req_copy);
-                free(client_request);
-                return NULL;
-            }
-            memcpy(c_l->result, error, c_l->size);
-            free_request(&req_copy);
-            free(client_request);
-            free(error);
-            return c_l;
-        }
-        
-        encrypted_models_info *me = encrypt_models(names, num_models, models, size_models);
-        if (!me) {
-            free_request(&req_copy);
-            free(client_request);
-            return NULL;
-        }
-
-        model *m = (model *) malloc(sizeof(model));
-        assert(m);
-        m->next = NULL;
-        m->size = size;
-        m->names = names;
-        memcpy(m->key, me->key, KEY_BYTES);
-        memcpy(m->IV, me->IV, IV_BYTES);
-        memcpy(m->AAD, me->AAD, ADD_DATA_BYTES);
-        m->inference_models = NULL;
-        m->head = NULL;
-
-        unsigned char **tags = (unsigned char **) malloc(num_models * sizeof(unsigned char *));
-        if (!tags) {
-            fprintf(stderr, "Memory allocation failed for tags in MODEL\n");
-            free_request(&req_copy);
-            free(client_request);
-            free_encrypted_models_info(me, num_models);
-            free(c_l->result);
-            return NULL;
+        // Only the partitions the content store does not hold yet are written
+        unsigned char *digests = (unsigned char *) malloc(num_models * DIGEST_BYTES);
+        model_partitions *partitions = create_model_partitions(num_models);
+        char **staged = NULL;
+        bool hashed = digests && partitions;
+        for (int i = 0; hashed && i < num_models; ++i) {
+            hashed = content_digest(models[i], size_models[i], digests + i * DIGEST_BYTES) == 0;
         }
-        for (int i = 0; i < num_models; ++i) {
-            tags[i] = (unsigned char *) malloc((TAG_BYTES * 2 + 1) * sizeof(unsigned char));
-            if (!tags[i]) {
-                fprintf(stderr, "Memory allocation failed for tags[i] in MODEL\n");
-                free_request(&req_copy);
-                free(client_request);
-                free_encrypted_models_info(me, num_models);
-                free(c_l->result);
-                return NULL;
-            }
-            memset(tags[i], 0, TAG_BYTES * 2 + 1);
-            for (int j = 0; j < TAG_BYTES; ++j) {
-                sprintf((char *)(tags[i] + j * 2), "%02x", me->tag[i][j]);
-            }
-            tags[i][TAG_BYTES * 2] = '\0';
-        }
-  
-        load_model_to_memory(&m, tags, num_models);
-        
-        for (int i = 0; i < num_models; ++i) {
-            free(tags[i]);
-        }
-        free(tags);
-
-    #if USE_MEMORY_ONLY == 0    
-        c_l->tag = (unsigned char **) malloc((num_models + 1)* sizeof(unsigned char *));
-        for (int i = 0; i < num_models; ++i) {
-            c_l->tag[i] = (unsigned char *) malloc(TAG_BYTES * sizeof(unsigned char));
-            if (!c_l->tag[i]) {
-                fprintf(stderr, "Memory allocation failed for c_l->tag in MODEL\n");
-                free_request(&req_copy);
-                free(client_request);
-                free_encrypted_models_info(me, num_models);
-                free(c_l->result);
-                return NULL;
-            }
-            memset(c_l->tag[i], 0, TAG_BYTES);
-            memcpy(c_l->tag[i], me->tag[i], TAG_BYTES);
-            
-        }
-        c_l->tag[num_models] = NULL;
-    #endif
-
-        char *id_str = insert_into_table(table, m);
-        if (!id_str) {
-            free_encrypted_models_info(me, num_models);
+        if (hashed) staged = stage_partitions(partitions, digests);
+        if (!staged) {
+            if (partitions) partitions->free_partitions(partitions);
+            free(digests);
             free_request(&req_copy);
-            free(client_request);
             return NULL;
         }
-        
-        free_request(&req_copy);
-        print_table(table);
 
-        size = strlen(id_str);
-        c_l->result = (unsigned char *) malloc((size + 1) * sizeof(unsigned char));
-        if (!c_l->result) {
-            fprintf(stderr, "Memory allocation failed for c_l->result in MODEL\n");
+        encrypted_models_info *me = encrypt_models(staged, num_models, models, size_models);
+        if (!me) {
+            abort_staged_partitions(staged, num_models);
+            partitions->free_partitions(partitions);
+            free(digests);
             free_request(&req_copy);
-            free(client_request);
             return NULL;
         }
-
-        memcpy(c_l->result, id_str, size);
+        c_l = register_stored_model(c_l, partitions, staged, digests, me, table);
         free_encrypted_models_info(me, num_models);
-        c_l->size = size;
-
+        free(digests);
+        free_request(&req_copy);
+        if (!c_l) return NULL;
         break;
     }   
     case 1: {
@@ -734,36 +565,51 @@ handle_request(char *client_request, onnx_table *table)
             if (!c_l->result) {
                 fprintf(stderr, "Memory allocation failed for c_l->result in MODEL\n");
                 free_request(&req_copy);
-                free(client_request);
                 return NULL;
             }
             memcpy(c_l->result, error, c_l->size);
             free_request(&req_copy);
-            free(client_request);
             free(error);
             return c_l;
         }
 
+        // The argmax text always goes back, the top-k or the tensors only if asked for
+        request_result *output = (request_result *) calloc(1, sizeof(request_result));
+        if (!output) {
+            fprintf(stderr, "Memory allocation failed for the inference result\n");
+            free_request(&req_copy);
+            return NULL;
+        }
+        output->mode = req_copy.result_mode;
+        output->k = req_copy.top_k;
+
 #if USE_MEMORY_ONLY == 0
-        result = inference_aes(input, num_inputs, tokenizer, tokenizer_size, m, tags, m->size);
+        result = inference_aes(input, size_inputs, num_inputs, tokenizer, tokenizer_size, m, tags, m->size, table->cache, output);
 #else
-        result = inference_memory_only(input, num_inputs, m);
+        result = inference_memory_only(input, size_inputs, num_inputs, m, output);
 #endif
 
         if (!result) {
+            free_request_result(output);
+            free(output);
             free_request(&req_copy);
-            free(client_request);
             return NULL;
         }
 
         free_request(&req_copy);
 
+        // Outputs that do not allow the mode, and failed runs, answer with the text only
+        if (output->num_top > 0 || output->num_tensors > 0) {
+            c_l->output = output;
+        } else {
+            free(output);
+        }
+
         int size = strlen(result);
         c_l->result = (unsigned char *) malloc((size + 1) * sizeof(unsigned char));
         if (!c_l->result) {
             fprintf(stderr, "Memory allocation failed for c_l->result in MODEL\n");
             free_request(&req_copy);
-            free(client_request);
             return NULL;
         }
         memcpy(c_l->result, result, size);
@@ -776,14 +622,89 @@ handle_request(char *client_request, onnx_table *table)
     default:
         fprintf(stderr, "Invalid command\n");
         free_request(&req_copy);
-        free(client_request);
         return NULL;
     }
 
-    free(client_request);
+    free_request(&req_copy);
+    return c_l;
+}
+
+// Registers a model from partitions staged on the host, encrypting them into
+// the content store a chunk at a time like an upload; a partition must match
+// the digest the client expects, even when the store already holds it
+static client_result *
+register_local_model(const unsigned char *body, size_t body_length, onnx_table *table)
+{
+    local_model l;
+    client_result *c_l = NULL;
+
+    if (local_model_read(&l, body, body_length) != 0) {
+        fprintf(stderr, "Invalid request for MODEL_LOCAL\n");
+        local_model_free(&l);
+        return NULL;
+    }
+
+    unsigned char *digests = (unsigned char *) malloc(l.num_partitions * DIGEST_BYTES);
+    model_partitions *partitions = create_model_partitions(l.num_partitions);
+    if (!digests || !partitions) {
+        if (partitions) partitions->free_partitions(partitions);
+        free(digests);
+        local_model_free(&l);
+        return NULL;
+    }
+    for (int i = 0; i < l.num_partitions; ++i) {
+        memcpy(digests + i * DIGEST_BYTES, l.digests[i], DIGEST_BYTES);
+    }
+
+    char **staged = stage_partitions(partitions, digests);
+    encrypted_models_info *me = staged ? generate_model_keys(l.num_partitions) : NULL;
+    if (!me || local_model_write(&l, staged, me) != 0) {
+        if (me) free_encrypted_models_info(me, l.num_partitions);
+        abort_staged_partitions(staged, l.num_partitions);
+        partitions->free_partitions(partitions);
+        free(digests);
+        local_model_free(&l);
+        return NULL;
+    }
+
+    c_l = register_stored_model(initialize_client_result(), partitions, staged, digests, me, table);
+    free_encrypted_models_info(me, l.num_partitions);
+    free(digests);
+    local_model_free(&l);
     return c_l;
 }
 
+client_result *
+handle_request(char *client_request, onnx_table *table)
+{
+    assert(client_request);
+    
+    request req_copy;
+    deserialize_client_request(client_request, &req_copy);
+    return process_request(req_copy, table);
+}
+
+// Version 2 requests: the body is a list of sections
+client_result *
+handle_wire_request(const wire_header *header, char *body, size_t body_length, onnx_table *table)
+{
+    assert(body);
+
+    if (header->command == WIRE_CMD_MODEL_LOCAL) {
+        client_result *c_l = register_local_model((unsigned char *) body, body_length, table);
+        free(body);
+        return c_l;
+    }
+
+    request req_copy;
+    if (deserialize_wire_request(header, (unsigned char *) body, body_length, &req_copy) != 0) {
+        fprintf(stderr, "Invalid version 2 request %u\n", header->request_id);
+        free(body);
+        return NULL;
+    }
+    return process_request(req_copy, table);
+}
+
 // Debug for SSL
 void
 debug_ssl(void *ctx, int level,
@@ -796,6 +717,83 @@ debug_ssl(void *ctx, int level,
     fflush((FILE *) ctx);
 }
 
+// Reads exactly length bytes of the request body off the session
+static int
+read_upload(void *ctx, unsigned char *buf, size_t length)
+{
+    mbedtls_ssl_context *ssl = (mbedtls_ssl_context *) ctx;
+    size_t bytes_read = 0;
+    int ret;
+
+    while (bytes_read < length) {
+        ret = mbedtls_ssl_read(ssl, buf + bytes_read, length - bytes_read);
+        if (ret == MBEDTLS_ERR_SSL_WANT_READ || ret == MBEDTLS_ERR_SSL_WANT_WRITE) {
+            continue;
+        }
+        if (ret <= 0) {
+            fprintf(stderr, " mbedtls_ssl_read returned -0x%x\n", (unsigned int) -ret);
+            return ret < 0 ? ret : MBEDTLS_ERR_NET_CONN_RESET;
+        }
+        bytes_read += ret;
+    }
+    return 0;
+}
+
+// Registers the model of a version 2 MODEL request while its body comes off
+// the session: the names are read first, then every partition is encrypted
+// and written to disk UPLOAD_CHUNK_BYTES at a time, so the memory taken does
+// not grow with the model. A rejected upload is read to its end and answered;
+// *ret is set if the session failed on the way.
+static client_result *
+receive_model_upload(mbedtls_ssl_context *ssl, const wire_header *header, onnx_table *table, int *ret)
+{
+    model_upload u;
+    client_result *c_l = NULL;
+
+    *ret = 0;
+    if (upload_init(&u, header, read_upload, ssl) != 0) {
+        *ret = MBEDTLS_ERR_SSL_ALLOC_FAILED;
+        return NULL;
+    }
+
+    if (upload_read_names(&u) != 0 || u.num_names == 0 || contains_empty_name(u.names, u.num_names)) {
+        fprintf(stderr, "Invalid request for MODEL\n");
+        goto drain;
+    }
+
+    // The digests are only known once the partitions are written
+    unsigned char *digests = (unsigned char *) malloc(u.num_names * DIGEST_BYTES);
+    model_partitions *partitions = create_model_partitions(u.num_names);
+    char **staged = digests && partitions ? stage_partitions(partitions, NULL) : NULL;
+    if (!staged) {
+        if (partitions) partitions->free_partitions(partitions);
+        free(digests);
+        goto drain;
+    }
+
+    encrypted_models_info *me = generate_model_keys(u.num_names);
+    if (!me || upload_write_partitions(&u, staged, me, digests) != 0) {
+        if (me) free_encrypted_models_info(me, u.num_names);
+        abort_staged_partitions(staged, u.num_names);
+        partitions->free_partitions(partitions);
+        free(digests);
+        goto drain;
+    }
+
+    c_l = register_stored_model(initialize_client_result(), partitions, staged, digests, me, table);
+    free_encrypted_models_info(me, u.num_names);
+    free(digests);
+    upload_free(&u);
+    return c_l;
+
+drain:
+    if (upload_drain(&u) != 0) {
+        *ret = u.error;
+    }
+    upload_free(&u);
+    return c_l;
+}
+
 int
 main(void)
 {
@@ -817,6 +815,9 @@ main(void)
 #if defined(MBEDTLS_SSL_CACHE_C)
     mbedtls_ssl_cache_context cache;
 #endif
+#if defined(MBEDTLS_SSL_TICKET_C)
+    mbedtls_ssl_ticket_context ticket;
+#endif
 
     mbedtls_net_init(&listen_fd);
     mbedtls_net_init(&client_fd);
@@ -824,6 +825,10 @@ main(void)
     mbedtls_ssl_config_init(&conf);
 #if defined(MBEDTLS_SSL_CACHE_C)
     mbedtls_ssl_cache_init(&cache);
+    mbedtls_ssl_cache_set_max_entries(&cache, SESSION_CACHE_ENTRIES);
+#endif
+#if defined(MBEDTLS_SSL_TICKET_C)
+    mbedtls_ssl_ticket_init(&ticket);
 #endif
     mbedtls_x509_crt_init(&srvcert);
     mbedtls_pk_init(&pkey);
@@ -921,6 +926,16 @@ main(void)
                                    mbedtls_ssl_cache_set);
 #endif
 
+#if defined(MBEDTLS_SSL_TICKET_C)
+    // A resumed handshake skips the RSA signature, the costliest step in the enclave
+    if ((ret = mbedtls_ssl_ticket_setup(&ticket, mbedtls_ctr_drbg_random, &ctr_drbg,
+                                        MBEDTLS_CIPHER_AES_256_GCM, TICKET_LIFETIME_S)) != 0) {
+        fprintf(stderr, " failed\n   mbedtls_ssl_ticket_setup returned %d\n", ret);
+        goto exit;
+    }
+    mbedtls_ssl_conf_session_tickets_cb(&conf, mbedtls_ssl_ticket_write, mbedtls_ssl_ticket_parse, &ticket);
+#endif
+
     mbedtls_ssl_conf_ca_chain(&conf, srvcert.next, NULL);
     if ((ret = mbedtls_ssl_conf_own_cert(&conf, &srvcert, &pkey)) != 0) {
         fprintf(stderr, " failed\n   mbedtls_ssl_conf_own_cert returned %d\n", ret);
@@ -935,12 +950,15 @@ main(void)
     fprintf(stderr, " ok\n");
 
     onnx_table *table = init_onnx_table(CAPACITY);
-    char response[BUF_SIZE];
+    char *response = NULL;
     long request_size = 0, response_size = 0;
     char *client_request = NULL;
     size_t bytes_read = 0;
     unsigned char buf[BUF_SIZE];
     char *endptr;
+    wire_header header;
+    unsigned char *message = NULL;
+    size_t message_size = 0, written = 0;
 
 reset:
 #ifdef MBEDTLS_ERROR_C
@@ -952,6 +970,8 @@ reset:
 #endif
 
     mbedtls_net_free(&client_fd);
+    free(response);
+    response = NULL;
 
     mbedtls_ssl_session_reset(&ssl);
 
@@ -999,8 +1019,10 @@ reset:
     fprintf(stderr, "Read from client:");
     fflush(stdout);
 
+    memset(&header, 0, sizeof(wire_header));
     do {
-        ret = mbedtls_ssl_read(&ssl, (unsigned char *) buf, BUF_SIZE);
+        // Legacy length records are shorter than a version 2 header
+        ret = mbedtls_ssl_read(&ssl, (unsigned char *) buf, WIRE_HEADER_BYTES);
 
         if (ret == MBEDTLS_ERR_SSL_WANT_READ || ret == MBEDTLS_ERR_SSL_WANT_WRITE) {
             continue;
@@ -1023,18 +1045,58 @@ reset:
 
             break;
         }
-        request_size = strtol((char *) buf, &endptr, 10);
-        if (*endptr != '\0') {
-            fprintf(stderr, "The size of the client_request is not an integer!\n");
-            goto reset;
-        }
-        fprintf(stderr, "Bytes received: %d\n Message from client: %ld\n", ret, request_size);
+        if (wire_has_magic(buf, ret)) {
+            bytes_read = ret;
+            while (bytes_read < WIRE_HEADER_BYTES) {
+                ret = mbedtls_ssl_read(&ssl, buf + bytes_read, WIRE_HEADER_BYTES - bytes_read);
+                if (ret == MBEDTLS_ERR_SSL_WANT_READ || ret == MBEDTLS_ERR_SSL_WANT_WRITE) {
+                    continue;
+                }
+                if (ret <= 0) {
+                    fprintf(stderr, " mbedtls_ssl_read returned -0x%x\n", (unsigned int) -ret);
+                    goto reset;
+                }
+                bytes_read += ret;
+            }
+            if (wire_decode_header(buf, WIRE_HEADER_BYTES, &header) != 0) {
+                fprintf(stderr, "Unsupported version 2 header\n");
+                goto reset;
+            }
+            fprintf(stderr, " version %d, command %d, request %u, %lu bytes\n", header.version, header.command,
+                    header.request_id, (unsigned long) header.body_length);
+
+            if (header.command == WIRE_CMD_QUIT) {
+                fprintf(stderr, "Client wants to close the connection...\n");
+                free_onnx_table(table);
+                ret = 0;
+                goto exit;
+            }
+            // A registration is not buffered, it is streamed to disk below
+            if (header.command == WIRE_CMD_MODEL) {
+                client_request = NULL;
+                request_size = 0;
+                break;
+            }
+            if (header.body_length > INT_MAX) {
+                fprintf(stderr, "Request body of %lu bytes is too large\n", (unsigned long) header.body_length);
+                goto reset;
+            }
+            request_size = (long) header.body_length;
+        } else {
+            buf[ret] = '\0';
+            request_size = strtol((char *) buf, &endptr, 10);
+            if (*endptr != '\0') {
+                fprintf(stderr, "The size of the client_request is not an integer!\n");
+                goto reset;
+            }
+            fprintf(stderr, "Bytes received: %d\n Message from client: %ld\n", ret, request_size);
 
-        if (ret == 3 && request_size == 20) {
-            fprintf(stderr, "Client wants to close the connection...\n");
-            free_onnx_table(table);
-            ret = 0;
-            goto exit;
+            if (ret == 3 && request_size == 20) {
+                fprintf(stderr, "Client wants to close the connection...\n");
+                free_onnx_table(table);
+                ret = 0;
+                goto exit;
+            }
         }
 
         client_request = (char *) malloc((request_size +1) * sizeof(char));
@@ -1085,9 +1147,45 @@ reset:
     gettimeofday(&t1_rest, NULL);
 #endif
 
-    client_result *c_l = handle_request(client_request, table);
+    client_result *c_l;
+    message = NULL;
+    if (header.magic == WIRE_MAGIC) {
+        if (header.command == WIRE_CMD_MODEL) {
+            c_l = receive_model_upload(&ssl, &header, table, &ret);
+            if (ret != 0) {
+                if (c_l) free_client_result(c_l);
+                goto reset;
+            }
+        } else {
+            c_l = handle_wire_request(&header, client_request, request_size, table);
+        }
+        message = encode_wire_response(&header, c_l, &message_size);
+        if (!message) {
+            if (c_l) free_client_result(c_l);
+            goto reset;
+        }
+        response_size = (long) message_size;
+    } else {
+        c_l = handle_request(client_request, table);
+    }
+
+    // Text form of the result: the legacy response, and the log line for both.
+    // It is sized for the result and the hex of every tag.
+    const char *invalid = "Invalid client_request from handle_request\n";
+    size_t text_size = c_l ? (size_t) c_l->size + 1 : strlen(invalid) + 1;
+    for (int i = 0; c_l && c_l->tag && c_l->tag[i]; i++) {
+        text_size += 1 + TAG_BYTES * 2;
+    }
+    response = (char *) malloc(text_size);
+    if (!response) {
+        fprintf(stderr, "Memory allocation failed for the response\n");
+        if (c_l) free_client_result(c_l);
+        free(message);
+        goto reset;
+    }
+
     if (!c_l) {
-        strcpy(response, "Invalid client_request from handle_request\n");
+        strcpy(response, invalid);
     } else {
         memcpy(response, c_l->result, c_l->size);
         int current_position = c_l->size;
@@ -1117,24 +1215,38 @@ reset:
 
     fprintf(stderr, "\nSSL ciphersuite: %s\n", mbedtls_ssl_get_ciphersuite(&ssl));
 
-    response_size = strlen(response);
+    if (!message) {
+        message = (unsigned char *) response;
+        response_size = strlen(response);
+    }
 
 #ifdef USE_SYS_TIME
     gettimeofday(&t2_rest, NULL);
     gettimeofday(&t1_write, NULL);
 #endif
 
-    while ((ret = mbedtls_ssl_write(&ssl, (unsigned char *) response, response_size)) <= 0) {
+    // Records are capped at the maximum fragment length, a large response takes several writes
+    written = 0;
+    while (written < (size_t) response_size) {
+        ret = mbedtls_ssl_write(&ssl, message + written, response_size - written);
+        if (ret > 0) {
+            written += ret;
+            continue;
+        }
+
         if (ret == MBEDTLS_ERR_NET_CONN_RESET) {
             fprintf(stderr, " failed\n   peer closed the connection\n");
+            if (message != (unsigned char *) response) free(message);
             goto reset;
         }
 
         if (ret != MBEDTLS_ERR_SSL_WANT_READ && ret != MBEDTLS_ERR_SSL_WANT_WRITE) {
             fprintf(stderr, " failed\n   mbedtls_ssl_write returned %d\n", ret);
+            if (message != (unsigned char *) response) free(message);
             goto exit;
         }
     }
+    if (message != (unsigned char *) response) free(message);
 
 #ifdef USE_SYS_TIME
     gettimeofday(&t2_write, NULL);
@@ -1163,7 +1275,7 @@ reset:
 #endif
 
     print_table(table);
-    fprintf(stderr, "Bytes written: %d\nResponse: %s\n", ret, (char *) response);
+    fprintf(stderr, "Bytes written: %ld\nResponse: %s\n", written, (char *) response);
 
     if (strstr(response, "Inference:") != NULL) {
         fprintf(stderr, "Time to read request from client: %f ms\n", elapsed_time_read);
@@ -1200,12 +1312,16 @@ exit:
 
     mbedtls_net_free(&client_fd);
     mbedtls_net_free(&listen_fd);
+    free(response);
     mbedtls_x509_crt_free(&srvcert);
     mbedtls_pk_free(&pkey);
     mbedtls_ssl_free(&ssl);
     mbedtls_ssl_config_free(&conf);
 #if defined(MBEDTLS_SSL_CACHE_C)
     mbedtls_ssl_cache_free(&cache);
+#endif
+#if defined(MBEDTLS_SSL_TICKET_C)
+    mbedtls_ssl_ticket_free(&ticket);
 #endif
     mbedtls_ctr_drbg_free(&ctr_drbg);
     mbedtls_entropy_free(&entropy);
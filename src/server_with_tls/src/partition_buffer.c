@@ -0,0 +1,81 @@
+#include <unistd.h>
+#include <partition_buffer.h>
+
+static pthread_mutex_t budget_lock = PTHREAD_MUTEX_INITIALIZER;
+static size_t resident_bytes = 0;
+
+// Takes over fd, an in-memory file of size bytes, whatever happens
+partition_buffer *
+partition_buffer_adopt(int fd, size_t size)
+{
+    partition_buffer *b = (partition_buffer *) calloc(1, sizeof(partition_buffer));
+    if (!b) {
+        fprintf(stderr, "Memory allocation for partition buffer failed\n");
+        close(fd);
+        return NULL;
+    }
+    b->fd = fd;
+    b->size = size;
+    snprintf(b->path, sizeof(b->path), "/proc/self/fd/%d", fd);
+    return b;
+}
+
+void
+partition_buffer_free(partition_buffer *b)
+{
+    if (!b) return;
+    close(b->fd);
+    free(b);
+}
+
+bool
+partition_buffer_reserve(size_t size)
+{
+    pthread_mutex_lock(&budget_lock);
+    bool ok = size <= (size_t) RESIDENT_BUFFER_BYTES - resident_bytes;
+    if (ok) resident_bytes += size;
+    pthread_mutex_unlock(&budget_lock);
+    return ok;
+}
+
+void
+partition_buffer_unreserve(size_t size)
+{
+    pthread_mutex_lock(&budget_lock);
+    resident_bytes -= size < resident_bytes ? size : resident_bytes;
+    pthread_mutex_unlock(&budget_lock);
+}
+
+static void
+free_model_buffers(model_buffers *buffers)
+{
+    if (!buffers) return;
+    for (int i = 0; i < buffers->count; i++) {
+        if (!buffers->buffers[i]) continue;
+        partition_buffer_unreserve(buffers->buffers[i]->size);
+        partition_buffer_free(buffers->buffers[i]);
+    }
+    free(buffers->buffers);
+    free(buffers);
+}
+
+// Slots for the count partitions of a model, all loaded from disk until a
+// buffer is set
+model_buffers *
+create_model_buffers(int count)
+{
+    model_buffers *buffers = (model_buffers *) malloc(sizeof(model_buffers));
+    if (!buffers) {
+        fprintf(stderr, "Memory allocation for model buffers failed\n");
+        return NULL;
+    }
+    buffers->buffers = (partition_buffer **) calloc(count > 0 ? count : 1, sizeof(partition_buffer *));
+    if (!buffers->buffers) {
+        fprintf(stderr, "Memory allocation for model buffers failed\n");
+        free(buffers);
+        return NULL;
+    }
+    buffers->count = count;
+    buffers->free_buffers = free_model_buffers;
+    return buffers;
+}
@@ -0,0 +1,327 @@
+#include <sys/time.h>
+#include <pipeline.h>
+#include <inference.h>
+
+static bool
+init_pipeline_queue(pipeline_queue *queue, int capacity)
+{
+    queue->jobs = (pipeline_job **)malloc(capacity * sizeof(pipeline_job *));
+    if (!queue->jobs) {
+        fprintf(stderr, "Memory allocation for pipeline queue failed\n");
+        return false;
+    }
+    queue->capacity = capacity;
+    queue->head = 0;
+    queue->count = 0;
+    queue->closed = false;
+    pthread_mutex_init(&queue->lock, NULL);
+    pthread_cond_init(&queue->not_empty, NULL);
+    pthread_cond_init(&queue->not_full, NULL);
+    return true;
+}
+
+static void
+free_pipeline_queue(pipeline_queue *queue)
+{
+    pthread_cond_destroy(&queue->not_full);
+    pthread_cond_destroy(&queue->not_empty);
+    pthread_mutex_destroy(&queue->lock);
+    free(queue->jobs);
+}
+
+// Blocks while the queue is full, false once it was closed
+static bool
+pipeline_queue_push(pipeline_queue *queue, pipeline_job *job)
+{
+    pthread_mutex_lock(&queue->lock);
+    while (queue->count == queue->capacity && !queue->closed) {
+        pthread_cond_wait(&queue->not_full, &queue->lock);
+    }
+    if (queue->closed) {
+        pthread_mutex_unlock(&queue->lock);
+        return false;
+    }
+    queue->jobs[(queue->head + queue->count) % queue->capacity] = job;
+    queue->count++;
+    pthread_cond_signal(&queue->not_empty);
+    pthread_mutex_unlock(&queue->lock);
+    return true;
+}
+
+// Blocks while the queue is empty, NULL once it was closed and drained
+static pipeline_job *
+pipeline_queue_pop(pipeline_queue *queue)
+{
+    pthread_mutex_lock(&queue->lock);
+    while (queue->count == 0 && !queue->closed) {
+        pthread_cond_wait(&queue->not_empty, &queue->lock);
+    }
+    pipeline_job *job = NULL;
+    if (queue->count > 0) {
+        job = queue->jobs[queue->head];
+        queue->head = (queue->head + 1) % queue->capacity;
+        queue->count--;
+        pthread_cond_signal(&queue->not_full);
+    }
+    pthread_mutex_unlock(&queue->lock);
+    return job;
+}
+
+static void
+pipeline_queue_close(pipeline_queue *queue)
+{
+    pthread_mutex_lock(&queue->lock);
+    queue->closed = true;
+    pthread_cond_broadcast(&queue->not_empty);
+    pthread_cond_broadcast(&queue->not_full);
+    pthread_mutex_unlock(&queue->lock);
+}
+
+static void
+finish_job(pipeline_job *job, bool failed)
+{
+    pthread_mutex_lock(&job->lock);
+    job->failed = failed;
+    job->done = true;
+    pthread_cond_signal(&job->cond);
+    pthread_mutex_unlock(&job->lock);
+}
+
+static bool
+run_stage_steps(pipeline_stage *stage, execution_context *ctx)
+{
+    model_pipeline *pipeline = stage->pipeline;
+
+    for (int s = stage->first_step; s < stage->last_step; s++) {
+        const plan_step *step = &pipeline->plan->steps[s];
+        const operator_node *node = step->node;
+
+        TractState *state = NULL;
+        if (tract_runnable_spawn_state(pipeline->runnables[node->index], &state) != TRACT_RESULT_OK) {
+            fprintf(stderr, "Error calling tract: %s\n", tract_get_last_error());
+            return false;
+        }
+        run_step_on_state(step, ctx, state);
+        if (!ctx->states[node->index].outputs) return false;
+    }
+    return true;
+}
+
+static void *
+stage_thread(void *arg)
+{
+    pipeline_stage *stage = (pipeline_stage *)arg;
+    struct timeval t1_stage, t2_stage;
+    pipeline_job *job = NULL;
+
+    while ((job = pipeline_queue_pop(stage->in))) {
+        gettimeofday(&t1_stage, NULL);
+        bool ok = run_stage_steps(stage, job->ctx);
+        gettimeofday(&t2_stage, NULL);
+
+        double elapsed_time = (t2_stage.tv_sec - t1_stage.tv_sec) * 1000.0;      // sec to ms
+        elapsed_time += (t2_stage.tv_usec - t1_stage.tv_usec) / 1000.0;          // us to ms
+        pthread_mutex_lock(&stage->pipeline->stats_lock);
+        stage->jobs++;
+        stage->busy_time += elapsed_time;
+        pthread_mutex_unlock(&stage->pipeline->stats_lock);
+
+        if (!ok || !stage->out) {
+            finish_job(job, !ok);
+        } else if (!pipeline_queue_push(stage->out, job)) {
+            finish_job(job, true);
+        }
+    }
+
+    // Shutdown travels down the pipeline once this stage is drained
+    if (stage->out) pipeline_queue_close(stage->out);
+    return NULL;
+}
+
+static void
+stop_pipeline_stages(model_pipeline *pipeline, int num_started)
+{
+    pipeline_queue_close(&pipeline->queues[0]);
+    for (int i = 0; i < num_started; i++) {
+        pthread_join(pipeline->stages[i].thread, NULL);
+    }
+    // Stages that never started leave their queues open
+    for (int i = num_started; i < pipeline->num_stages; i++) {
+        pipeline_queue_close(&pipeline->queues[i]);
+    }
+}
+
+// The runnables are indexed by operator_node::index and must all be loaded.
+// With owns_runnables they are released together with the pipeline, on
+// failure they stay with the caller.
+model_pipeline *
+create_model_pipeline(const execution_plan *plan, TractRunnable **runnables, int num_runnables, bool owns_runnables, unsigned char **tags)
+{
+    assert(plan);
+    assert(runnables);
+
+    int num_steps = plan->num_steps;
+    if (num_steps == 0) return NULL;
+
+    model_pipeline *pipeline = (model_pipeline *)calloc(1, sizeof(model_pipeline));
+    if (!pipeline) {
+        fprintf(stderr, "Memory allocation for pipeline failed\n");
+        return NULL;
+    }
+    pipeline->plan = plan;
+    pipeline->runnables = runnables;
+    pipeline->num_runnables = num_runnables;
+    pipeline->owns_runnables = owns_runnables;
+    pipeline->free_pipeline = free_model_pipeline;
+    pthread_mutex_init(&pipeline->stats_lock, NULL);
+
+    if (tags) {
+        pipeline->tags = (unsigned char **)calloc(num_steps, sizeof(unsigned char *));
+        assert(pipeline->tags);
+        for (int i = 0; i < num_steps; i++) {
+            pipeline->tags[i] = (unsigned char *)malloc(TAG_BYTES * 2);
+            assert(pipeline->tags[i]);
+            memcpy(pipeline->tags[i], tags[i], TAG_BYTES * 2);
+        }
+    }
+
+    pipeline->num_stages = PIPELINE_STAGES > 0 && PIPELINE_STAGES < num_steps ? PIPELINE_STAGES : num_steps;
+    pipeline->stages = (pipeline_stage *)calloc(pipeline->num_stages, sizeof(pipeline_stage));
+    pipeline->queues = (pipeline_queue *)calloc(pipeline->num_stages, sizeof(pipeline_queue));
+    assert(pipeline->stages && pipeline->queues);
+    for (int i = 0; i < pipeline->num_stages; i++) {
+        bool ok = init_pipeline_queue(&pipeline->queues[i], PIPELINE_QUEUE_DEPTH > 0 ? PIPELINE_QUEUE_DEPTH : 1);
+        assert(ok);
+        (void) ok;
+    }
+
+    int started = 0;
+    for (int i = 0; i < pipeline->num_stages; i++) {
+        pipeline_stage *stage = &pipeline->stages[i];
+        stage->pipeline = pipeline;
+        stage->first_step = i * num_steps / pipeline->num_stages;
+        stage->last_step = (i + 1) * num_steps / pipeline->num_stages;
+        stage->in = &pipeline->queues[i];
+        stage->out = i + 1 < pipeline->num_stages ? &pipeline->queues[i + 1] : NULL;
+
+        if (pthread_create(&stage->thread, NULL, stage_thread, stage) != 0) {
+            fprintf(stderr, "Error creating pipeline stage %d\n", i);
+            break;
+        }
+        started++;
+    }
+
+    if (started < pipeline->num_stages) {
+        stop_pipeline_stages(pipeline, started);
+        pipeline->owns_runnables = false;
+        free_model_pipeline(pipeline);
+        return NULL;
+    }
+    return pipeline;
+}
+
+// Runs the request through every stage and waits for the last one. Returns the
+// summed run time of the partitions, -1 on failure.
+double
+pipeline_run(model_pipeline *pipeline, execution_context *ctx, unsigned char **tags)
+{
+    assert(pipeline);
+    assert(ctx);
+
+    const execution_plan *plan = pipeline->plan;
+
+    // Resident partitions were authenticated once, a request must present the same tags
+    if (pipeline->tags) {
+        if (!tags) return -1;
+        for (int i = 0; i < plan->num_steps; i++) {
+            if (memcmp(pipeline->tags[i], tags[i], TAG_BYTES * 2) != 0) {
+                fprintf(stderr, "Tag mismatch for partition %d\n", i);
+                return -1;
+            }
+        }
+    }
+
+    pipeline_job job;
+    job.ctx = ctx;
+    job.done = false;
+    job.failed = false;
+    pthread_mutex_init(&job.lock, NULL);
+    pthread_cond_init(&job.cond, NULL);
+
+    if (!pipeline_queue_push(&pipeline->queues[0], &job)) {
+        job.done = true;
+        job.failed = true;
+    }
+
+    pthread_mutex_lock(&job.lock);
+    while (!job.done) {
+        pthread_cond_wait(&job.cond, &job.lock);
+    }
+    pthread_mutex_unlock(&job.lock);
+
+    pthread_cond_destroy(&job.cond);
+    pthread_mutex_destroy(&job.lock);
+    if (job.failed) return -1;
+
+    double elapsed_time = 0.0;
+    for (int s = 0; s < plan->num_steps; s++) {
+        elapsed_time += ctx->states[plan->steps[s].node->index].elapsed_time;
+    }
+    return elapsed_time;
+}
+
+// Steady-state throughput is bounded by the slowest stage
+void
+print_model_pipeline(model_pipeline *pipeline)
+{
+    if (!pipeline) return;
+
+    int slowest = 0;
+    double slowest_time = 0.0;
+
+    pthread_mutex_lock(&pipeline->stats_lock);
+    for (int i = 0; i < pipeline->num_stages; i++) {
+        pipeline_stage *stage = &pipeline->stages[i];
+        double average = stage->jobs ? stage->busy_time / stage->jobs : 0.0;
+        fprintf(stderr, "Pipeline stage %d (partitions %d-%d): %lu requests, %f ms/request\n",
+                i, stage->first_step, stage->last_step - 1, stage->jobs, average);
+        if (average > slowest_time) {
+            slowest_time = average;
+            slowest = i;
+        }
+    }
+    pthread_mutex_unlock(&pipeline->stats_lock);
+
+    if (slowest_time > 0.0) {
+        fprintf(stderr, "Pipeline bound: %f requests/s (stage %d)\n", 1000.0 / slowest_time, slowest);
+    }
+}
+
+void
+free_model_pipeline(model_pipeline *pipeline)
+{
+    if (!pipeline) return;
+
+    // A pipeline whose creation failed was already stopped
+    pthread_mutex_lock(&pipeline->queues[0].lock);
+    bool running = !pipeline->queues[0].closed;
+    pthread_mutex_unlock(&pipeline->queues[0].lock);
+    if (running) stop_pipeline_stages(pipeline, pipeline->num_stages);
+
+    for (int i = 0; i < pipeline->num_stages; i++) {
+        free_pipeline_queue(&pipeline->queues[i]);
+    }
+    free(pipeline->queues);
+    free(pipeline->stages);
+
+    if (pipeline->tags) {
+        for (int i = 0; i < pipeline->plan->num_steps; i++) {
+            free(pipeline->tags[i]);
+        }
+        free(pipeline->tags);
+    }
+    if (pipeline->owns_runnables) free_runnables(pipeline->runnables, pipeline->num_runnables);
+
+    pthread_mutex_destroy(&pipeline->stats_lock);
+    free(pipeline);
+}
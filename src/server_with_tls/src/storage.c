@@ -1,3 +1,4 @@
+#include <sys/time.h>
 #include <storage.h>
 
 //Hash table for storing the models
@@ -43,20 +44,35 @@ init_onnx_table(int capacity)
     for (int i = 0; i < CAPACITY; i++)
         table->model[i] = NULL;
 
+    table->cache = init_runnable_cache(RUNNABLE_CACHE_BYTES);
+    pthread_rwlock_init(&table->lock, NULL);
+
     return table;
 }
 
+static bool
+contains_key_locked(onnx_table *table, char *id)
+{
+    unsigned int index = hash_function(id);
+    
+    model *current = table->model[index];
+    while (current){
+        if (strcmp(current->id, id) == 0) return true;
+        current = current->next;
+    }
+
+    return false;
+}
+
 char *
 insert_into_table(onnx_table *table, model *m)
 {
     assert(table);
     assert(m->names);
 
-    char *id_dup = find_duplicate_names_from_id(table, m->names);
-    if (id_dup) {
-        return NULL;
-    }
-
+    // Models sharing partitions are told apart by id, the content store
+    // holds one copy of what they share
+    pthread_rwlock_wrlock(&table->lock);
     int id_int = table->count;
     int required_size = snprintf(NULL, 0, "%d", id_int + 1);
     char *id = (char*) malloc((required_size + 1) * sizeof(char));
@@ -64,7 +80,9 @@ insert_into_table(onnx_table *table, model *m)
     id[required_size] = '\0';
 
     unsigned int index = hash_function(id);
-    if (contains_key(table, id)) {
+    if (contains_key_locked(table, id)) {
+        pthread_rwlock_unlock(&table->lock);
+        free(id);
         return NULL;
     };
     
@@ -88,6 +106,7 @@ insert_into_table(onnx_table *table, model *m)
     }
 
     table->count++;
+    pthread_rwlock_unlock(&table->lock);
     return id;
 }
 
@@ -119,37 +138,11 @@ contains_key(onnx_table *table, char *id)
 {
     assert(table);
     assert(id);
-    
-    unsigned int index = hash_function(id);
-    
-    model *current = table->model[index];
-    while (current){
-        if (strcmp(current->id, id) == 0) return true;
-        current = current->next;
-    }
-
-    return false;
-}
-
-char *
-find_duplicate_names_from_id(onnx_table *table, char **names)
-{
-    assert(table);
-    assert(names);
-    
-    for (int i = 0; i < CAPACITY; i++) {
-        model *current = table->model[i];
-        while (current){
-            if (!current->names) continue;
-            for (int j = 0; current->names[j]; j++) {
-                if (!names[j]) return NULL;
-                if (current->names[j] && strcmp(current->names[j], names[j]) == 0) return current->id;
-            }
-            current = current->next;
-        }
-    }
 
-    return NULL;
+    pthread_rwlock_rdlock(&table->lock);
+    bool found = contains_key_locked(table, id);
+    pthread_rwlock_unlock(&table->lock);
+    return found;
 }
 
 model*
@@ -159,14 +152,17 @@ get_model(onnx_table *table, char *id)
     assert(id);
 
     unsigned int index = hash_function(id);
-    
+
+    // Models are only removed at shutdown, the returned one outlives the lock
+    pthread_rwlock_rdlock(&table->lock);
     model *current = table->model[index];
     while (current){
-        if (strcmp(current->id, id) == 0) return table->model[index];
+        if (strcmp(current->id, id) == 0) break;
         current = current->next;
     }
+    pthread_rwlock_unlock(&table->lock);
 
-    return NULL;
+    return current;
 }
 
 void
@@ -192,6 +188,18 @@ free_inference_models(TractInferenceModel **inference_models, int length)
     free(inference_models);
 }
 
+void
+free_runnables(TractRunnable **runnables, int length)
+{
+    assert(runnables);
+    for (int i = 0; i < length; ++i) {
+        if (runnables[i] && tract_runnable_release(&runnables[i]) != TRACT_RESULT_OK) {
+            fprintf(stderr, "Error releasing runnable\n");
+        }
+    }
+    free(runnables);
+}
+
 void
 free_input_indexes(int **input_indexes, int length)
 {
@@ -215,7 +223,13 @@ deallocate_model(model *current)
         free(current->names[i]);
     }
     free(current->names);
-    if (current->inference_models) free_inference_models(current->inference_models, current->size + 1);
+    // Stage threads may still reference the shared runnables
+    if (current->pipeline) current->pipeline->free_pipeline(current->pipeline);
+    if (current->batcher) current->batcher->free_batcher(current->batcher);
+    if (current->buffers) current->buffers->free_buffers(current->buffers);
+    if (current->partitions) current->partitions->free_partitions(current->partitions);
+    if (current->runnables) free_runnables(current->runnables, current->size + 1);
+    free_execution_plan(current->plan);
     char **visited_nodes = (char **) malloc((current->size + 1) * sizeof(char *));
     int visited_count = 0;
     free_operator_node(current->head, visited_nodes, &visited_count);
@@ -233,8 +247,9 @@ remove_model_from_table(onnx_table *table, char *id)
 
     model *previous = NULL;
     unsigned int index = hash_function(id);
-    model *current = table->model[index];
 
+    pthread_rwlock_wrlock(&table->lock);
+    model *current = table->model[index];
     while (current) {
         if (strcmp(current->id, id) == 0){
             
@@ -247,12 +262,21 @@ remove_model_from_table(onnx_table *table, char *id)
                 previous->next=current->next;
             }
 
+            pthread_rwlock_unlock(&table->lock);
+
+            // Runnables of partitions other models share stay cached
+            for (int i = 0; current->partitions && i < current->partitions->count; i++) {
+                if (current->partitions->release_partition(current->partitions, i)) {
+                    runnable_cache_remove(table->cache, current->names[i]);
+                }
+            }
             deallocate_model(current);
             return 1;
         }
         previous = current;
         current = current->next;
     }
+    pthread_rwlock_unlock(&table->lock);
 
     return 0;
 }
@@ -276,6 +300,8 @@ free_onnx_table(onnx_table* table)
     
     table->top=0U;
     free(table->model);
+    free_runnable_cache(table->cache);
+    pthread_rwlock_destroy(&table->lock);
     free(table);
 }
 
@@ -302,10 +328,10 @@ print_models(model *m, int index)
         for (int i = 0; i < ADD_DATA_BYTES; i++) {
             fprintf(stderr, "%02x", current->AAD[i]);
         }
-        if (current->inference_models) {
-            fprintf(stderr, ",\n   TractInferenceModel: (not null)");
+        if (current->runnables) {
+            fprintf(stderr, ",\n   TractRunnable: (not null)");
         } else {
-            fprintf(stderr, ",\n   TractInferenceModel: (null)");
+            fprintf(stderr, ",\n   TractRunnable: (null)");
         }
         if (current->head) {
             fprintf(stderr, ",\n   operator_node: (not null)");
@@ -325,7 +351,11 @@ print_table(onnx_table *table)
 
     model *current;
     
-    if (table->top == 0U) return;
+    pthread_rwlock_rdlock(&table->lock);
+    if (table->top == 0U) {
+        pthread_rwlock_unlock(&table->lock);
+        return;
+    }
     fprintf(stderr, "\nStart table...................\n");
     for (int index = 0; index < CAPACITY; index++){
         current = table->model[index];
@@ -334,6 +364,449 @@ print_table(onnx_table *table)
         }
     }
     fprintf(stderr, "\nEnd table.....................\n");
+    pthread_rwlock_unlock(&table->lock);
+    print_runnable_cache(table->cache);
+}
+
+//Runnable cache for the on-disk mode
+// partition path -> TractRunnable. Paths are those of the content store, so a
+// partition shared by several models is cached once. Every partition requested gets stats:
+// the time a request waited for it to load, its run time, its size and a
+// request rate that decays over time. A miss is kept while the budget allows;
+// past it, it only replaces partitions that save less load time per byte than
+// it would, so the budget holds the partitions that are worth the most for the
+// current traffic and the others are loaded from disk.
+static unsigned int
+runnable_hash_function(const char *name)
+{
+    assert(name);
+
+    unsigned int uiHash = 0U;
+    for (size_t ui = 0U; name[ui] != '\0'; ui++)
+        uiHash = uiHash * HASH_MULTIPLIER + name[ui];
+    return uiHash % RUNNABLE_CACHE_BUCKETS;
+}
+
+runnable_cache *
+init_runnable_cache(size_t budget)
+{
+    runnable_cache *cache = (runnable_cache *) malloc(sizeof(runnable_cache));
+    assert(cache);
+
+    cache->budget = budget;
+    cache->bytes = 0;
+    cache->hits = 0;
+    cache->misses = 0;
+    cache->evictions = 0;
+    cache->rejections = 0;
+    cache->lru_head = NULL;
+    cache->lru_tail = NULL;
+    cache->entries = (runnable_entry **) calloc(RUNNABLE_CACHE_BUCKETS, sizeof(runnable_entry *));
+    assert(cache->entries);
+    cache->stats = (residency_stats **) calloc(RUNNABLE_CACHE_BUCKETS, sizeof(residency_stats *));
+    assert(cache->stats);
+    pthread_mutex_init(&cache->lock, NULL);
+
+    return cache;
+}
+
+static double
+now_ms(void)
+{
+    struct timeval t;
+    gettimeofday(&t, NULL);
+    return t.tv_sec * 1000.0 + t.tv_usec / 1000.0;
+}
+
+static residency_stats *
+find_stats_locked(runnable_cache *cache, const char *name, bool create)
+{
+    unsigned int index = runnable_hash_function(name);
+    residency_stats *current = cache->stats[index];
+    while (current) {
+        if (strcmp(current->name, name) == 0) return current;
+        current = current->next;
+    }
+    if (!create) return NULL;
+
+    current = (residency_stats *) calloc(1, sizeof(residency_stats));
+    if (!current) {
+        fprintf(stderr, "Error allocating memory for residency stats\n");
+        return NULL;
+    }
+    current->name = strdup(name);
+    if (!current->name) {
+        free(current);
+        return NULL;
+    }
+    current->updated_ms = now_ms();
+    current->next = cache->stats[index];
+    cache->stats[index] = current;
+    return current;
+}
+
+static void
+decay_stats(residency_stats *stats, double now)
+{
+    if (now > stats->updated_ms) {
+        stats->rate *= pow(0.5, (now - stats->updated_ms) / RESIDENCY_HALF_LIFE_MS);
+        stats->updated_ms = now;
+    }
+}
+
+// Load time saved per resident byte at the current request rate
+static double
+stats_value(residency_stats *stats, double now)
+{
+    if (!stats || stats->size == 0) return 0.0;
+    decay_stats(stats, now);
+    return stats->rate * stats->load_ms / stats->size;
+}
+
+// First samples are taken as they are, later ones are averaged in
+static void
+average_in(double *average, double sample, bool first)
+{
+    *average = first ? sample : 0.75 * *average + 0.25 * sample;
+}
+
+static void
+lru_unlink(runnable_cache *cache, runnable_entry *entry)
+{
+    if (entry->lru_prev) entry->lru_prev->lru_next = entry->lru_next;
+    else cache->lru_head = entry->lru_next;
+    if (entry->lru_next) entry->lru_next->lru_prev = entry->lru_prev;
+    else cache->lru_tail = entry->lru_prev;
+    entry->lru_prev = NULL;
+    entry->lru_next = NULL;
+}
+
+static void
+lru_push_front(runnable_cache *cache, runnable_entry *entry)
+{
+    entry->lru_prev = NULL;
+    entry->lru_next = cache->lru_head;
+    if (cache->lru_head) cache->lru_head->lru_prev = entry;
+    cache->lru_head = entry;
+    if (!cache->lru_tail) cache->lru_tail = entry;
+}
+
+static void
+free_runnable_entry(runnable_cache *cache, runnable_entry *entry)
+{
+    unsigned int index = runnable_hash_function(entry->name);
+    runnable_entry *current = cache->entries[index], *previous = NULL;
+    while (current && current != entry) {
+        previous = current;
+        current = current->next;
+    }
+    if (current) {
+        if (previous) previous->next = current->next;
+        else cache->entries[index] = current->next;
+    }
+
+    lru_unlink(cache, entry);
+    cache->bytes -= entry->size;
+    if (entry->stats) entry->stats->resident = false;
+
+    if (tract_runnable_release(&entry->runnable) != TRACT_RESULT_OK) {
+        fprintf(stderr, "Error releasing cached runnable\n");
+    }
+    free(entry->name);
+    free(entry);
+}
+
+// A hit returns a state spawned under the lock: the state keeps the runnable
+// alive even if another request evicts it while the partition runs
+TractState *
+runnable_cache_spawn_state(runnable_cache *cache, const char *name, const unsigned char *tag)
+{
+    if (!cache || !name) return NULL;
+
+    TractState *state = NULL;
+    unsigned int index = runnable_hash_function(name);
+
+    pthread_mutex_lock(&cache->lock);
+    // Hits and misses alike count towards the request rate of the partition
+    residency_stats *stats = find_stats_locked(cache, name, true);
+    if (stats) {
+        decay_stats(stats, now_ms());
+        stats->rate += 1.0;
+    }
+
+    runnable_entry *current = cache->entries[index];
+    while (current) {
+        if (strcmp(current->name, name) == 0) {
+            // A hit must present the same tag the partition was authenticated with
+            if (current->has_tag && (!tag || memcmp(current->tag, tag, TAG_BYTES * 2) != 0)) {
+                break;
+            }
+            if (tract_runnable_spawn_state(current->runnable, &state) != TRACT_RESULT_OK) {
+                fprintf(stderr, "Error spawning state for cached runnable %s\n", name);
+                state = NULL;
+                break;
+            }
+            lru_unlink(cache, current);
+            lru_push_front(cache, current);
+            cache->hits++;
+            pthread_mutex_unlock(&cache->lock);
+            return state;
+        }
+        current = current->next;
+    }
+
+    cache->misses++;
+    pthread_mutex_unlock(&cache->lock);
+    return NULL;
+}
+
+bool
+runnable_cache_contains(runnable_cache *cache, const char *name, const unsigned char *tag)
+{
+    if (!cache || !name) return false;
+
+    bool found = false;
+    unsigned int index = runnable_hash_function(name);
+
+    pthread_mutex_lock(&cache->lock);
+    runnable_entry *current = cache->entries[index];
+    while (current) {
+        if (strcmp(current->name, name) == 0) {
+            found = !current->has_tag || (tag && memcmp(current->tag, tag, TAG_BYTES * 2) == 0);
+            break;
+        }
+        current = current->next;
+    }
+    pthread_mutex_unlock(&cache->lock);
+
+    return found;
+}
+
+typedef struct eviction_candidate
+{
+    runnable_entry *entry;
+    double value;
+    int age;                            // position from the LRU tail
+} eviction_candidate;
+
+static int
+compare_candidates(const void *a, const void *b)
+{
+    const eviction_candidate *x = (const eviction_candidate *) a;
+    const eviction_candidate *y = (const eviction_candidate *) b;
+    if (x->value != y->value) return x->value < y->value ? -1 : 1;
+    return x->age - y->age;
+}
+
+// Evicts the entries worth less than value, least valuable and then least
+// recently used first, until size bytes fit. Evicts nothing when they would
+// not be enough.
+static bool
+make_room_locked(runnable_cache *cache, size_t size, double value, double now)
+{
+    int count = 0;
+    for (runnable_entry *e = cache->lru_head; e; e = e->lru_next) count++;
+
+    eviction_candidate *candidates = (eviction_candidate *) malloc((count > 0 ? count : 1) * sizeof(eviction_candidate));
+    if (!candidates) {
+        fprintf(stderr, "Error allocating memory for eviction candidates\n");
+        return false;
+    }
+
+    int num_candidates = 0, age = 0;
+    for (runnable_entry *e = cache->lru_tail; e; e = e->lru_prev, age++) {
+        double entry_value = stats_value(e->stats, now);
+        if (entry_value >= value) continue;
+        candidates[num_candidates].entry = e;
+        candidates[num_candidates].value = entry_value;
+        candidates[num_candidates].age = age;
+        num_candidates++;
+    }
+    qsort(candidates, num_candidates, sizeof(eviction_candidate), compare_candidates);
+
+    size_t freed = 0;
+    int victims = 0;
+    while (victims < num_candidates && cache->bytes - freed + size > cache->budget) {
+        freed += candidates[victims++].entry->size;
+    }
+    bool fits = cache->bytes - freed + size <= cache->budget;
+
+    for (int i = 0; fits && i < victims; i++) {
+        runnable_entry *victim = candidates[i].entry;
+        fprintf(stderr, "Evicting runnable %s\n", victim->name);
+        free_runnable_entry(cache, victim);
+        cache->evictions++;
+    }
+    free(candidates);
+    return fits;
+}
+
+// load_ms is the time the request waited for the runnable. Returns false when
+// the caller keeps ownership of the runnable.
+bool
+runnable_cache_put(runnable_cache *cache, const char *name, const unsigned char *tag, TractRunnable *runnable, size_t size, double load_ms)
+{
+    if (!cache || !name || !runnable) return false;
+
+    unsigned int index = runnable_hash_function(name);
+
+    pthread_mutex_lock(&cache->lock);
+    residency_stats *stats = find_stats_locked(cache, name, true);
+    if (stats) {
+        average_in(&stats->load_ms, load_ms, stats->size == 0);
+        stats->size = size;
+    }
+    if (size > cache->budget) {
+        pthread_mutex_unlock(&cache->lock);
+        return false;
+    }
+
+    runnable_entry *current = cache->entries[index];
+    while (current) {
+        if (strcmp(current->name, name) == 0) {
+            free_runnable_entry(cache, current);
+            break;
+        }
+        current = current->next;
+    }
+
+    double now = now_ms();
+    if (cache->bytes + size > cache->budget && !make_room_locked(cache, size, stats_value(stats, now), now)) {
+        cache->rejections++;
+        pthread_mutex_unlock(&cache->lock);
+        return false;
+    }
+
+    runnable_entry *entry = (runnable_entry *) malloc(sizeof(runnable_entry));
+    if (!entry) {
+        fprintf(stderr, "Error allocating memory for runnable cache entry\n");
+        pthread_mutex_unlock(&cache->lock);
+        return false;
+    }
+    entry->name = strdup(name);
+    entry->has_tag = tag != NULL;
+    if (tag) memcpy(entry->tag, tag, TAG_BYTES * 2);
+    entry->runnable = runnable;
+    entry->size = size;
+    entry->stats = stats;
+    if (stats) stats->resident = true;
+    entry->lru_prev = NULL;
+    entry->lru_next = NULL;
+
+    entry->next = cache->entries[index];
+    cache->entries[index] = entry;
+    lru_push_front(cache, entry);
+    cache->bytes += size;
+    pthread_mutex_unlock(&cache->lock);
+
+    return true;
+}
+
+void
+runnable_cache_record_run(runnable_cache *cache, const char *name, double run_ms)
+{
+    if (!cache || !name) return;
+
+    pthread_mutex_lock(&cache->lock);
+    residency_stats *stats = find_stats_locked(cache, name, false);
+    if (stats) {
+        average_in(&stats->run_ms, run_ms, stats->run_ms == 0.0);
+    }
+    pthread_mutex_unlock(&cache->lock);
+}
+
+static void
+free_residency_stats(residency_stats *stats)
+{
+    free(stats->name);
+    free(stats);
+}
+
+// Drops the runnable and the stats of a partition no model uses anymore
+void
+runnable_cache_remove(runnable_cache *cache, const char *name)
+{
+    if (!cache || !name) return;
+
+    unsigned int index = runnable_hash_function(name);
+
+    pthread_mutex_lock(&cache->lock);
+    runnable_entry *current = cache->entries[index];
+    while (current) {
+        if (strcmp(current->name, name) == 0) {
+            free_runnable_entry(cache, current);
+            break;
+        }
+        current = current->next;
+    }
+
+    residency_stats **link = &cache->stats[index];
+    while (*link) {
+        residency_stats *stats = *link;
+        if (strcmp(stats->name, name) == 0) {
+            *link = stats->next;
+            free_residency_stats(stats);
+            break;
+        }
+        link = &stats->next;
+    }
+    pthread_mutex_unlock(&cache->lock);
+}
+
+void
+free_runnable_cache(runnable_cache *cache)
+{
+    if (!cache) return;
+
+    while (cache->lru_head) {
+        free_runnable_entry(cache, cache->lru_head);
+    }
+    for (int i = 0; i < RUNNABLE_CACHE_BUCKETS; i++) {
+        residency_stats *stats = cache->stats[i], *tmp = NULL;
+        while (stats) {
+            tmp = stats->next;
+            free_residency_stats(stats);
+            stats = tmp;
+        }
+    }
+    pthread_mutex_destroy(&cache->lock);
+    free(cache->stats);
+    free(cache->entries);
+    free(cache);
+}
+
+// Hits and misses so far, read together
+void
+runnable_cache_counts(runnable_cache *cache, unsigned long *hits, unsigned long *misses)
+{
+    *hits = 0;
+    *misses = 0;
+    if (!cache) return;
+
+    pthread_mutex_lock(&cache->lock);
+    *hits = cache->hits;
+    *misses = cache->misses;
+    pthread_mutex_unlock(&cache->lock);
+}
+
+void
+print_runnable_cache(runnable_cache *cache)
+{
+    if (!cache) return;
+
+    pthread_mutex_lock(&cache->lock);
+    fprintf(stderr, "Runnable cache: %zu/%zu bytes, hits: %lu, misses: %lu, evictions: %lu, left on disk: %lu\n",
+            cache->bytes, cache->budget, cache->hits, cache->misses, cache->evictions, cache->rejections);
+    double now = now_ms();
+    for (int i = 0; i < RUNNABLE_CACHE_BUCKETS; i++) {
+        for (residency_stats *stats = cache->stats[i]; stats; stats = stats->next) {
+            double value = stats_value(stats, now);
+            fprintf(stderr, "  %s: %s, %zu bytes, load %.3f ms, run %.3f ms, %.2f requests, saves %.3g ms per MB\n",
+                    stats->name, stats->resident ? "resident" : "on disk", stats->size,
+                    stats->load_ms, stats->run_ms, stats->rate, value * 1024.0 * 1024.0);
+        }
+    }
+    pthread_mutex_unlock(&cache->lock);
 }
 
 
@@ -468,8 +941,10 @@ is_node_visited(operator_node *node, char **visited_nodes, int visited_count)
         return true;
     }
 
+    // Every node owns its copy of the name, so the pointer identifies the
+    // node even when two partitions of a model share a path
     for (int i = 0; i < visited_count; i++) {
-        if (strcmp(visited_nodes[i], node->model_name) == 0) {
+        if (visited_nodes[i] == node->model_name) {
             return true;
         }
     }
@@ -481,7 +956,7 @@ create_operator_node(char *model_name)
 {
     operator_node *node = (operator_node *)malloc(sizeof(operator_node));
     node->model_name = strdup(model_name);
-    node->outputs = NULL;
+    node->index = 0;
     node->num_inputs = -1;
     node->num_outputs = -1;
     node->num_children = 0;
@@ -489,8 +964,8 @@ create_operator_node(char *model_name)
     node->children = NULL;
     node->parents = NULL;
     node->parent_output_indices = NULL;
+    node->output_consumers = NULL;
     node->run_inference = NULL;
-    node->elapsedTime = 0.0;
     return node;
 }
 
@@ -543,13 +1018,30 @@ search_operator_node_by_name(operator_node *node, const char *target_name)
     return NULL;
 }
 
+// The request inputs (index 0) live for the whole request and are not counted
+static void
+count_output_consumer(operator_node *parent, int output)
+{
+    if (parent->index == 0 || parent->num_outputs <= 0) return;
+
+    if (!parent->output_consumers) {
+        parent->output_consumers = (int *)calloc(parent->num_outputs, sizeof(int));
+        assert(parent->output_consumers);
+    }
+    assert(output < parent->num_outputs);
+    parent->output_consumers[output]++;
+}
+
+// nodes is indexed by operator_node::index, the inputs node being 0.
+// Partitions are told apart by index, identical ones share the path of their
+// stored copy.
 void
-update_node(operator_io **io, int id, operator_node *head)
+update_node(operator_io **io, int id, operator_node **nodes)
 {
     assert(io);
     assert(id > -1);
 
-    if (!head) return;
+    if (!nodes) return;
 
     operator_node *parent = NULL, *child = NULL;
     int current_index = 0, found, len = 0, index = 0;
@@ -560,7 +1052,7 @@ update_node(operator_io **io, int id, operator_node *head)
     int *parent_output_indices = (int *)calloc(input_length, sizeof(int));
     assert(parent_output_indices);
 
-    child = search_operator_node_by_name(head, io[id]->model_name);
+    child = nodes[id];
     child->num_inputs = io[id]->input_names_length;
     child->num_outputs = io[id]->output_names_length;
 
@@ -575,9 +1067,10 @@ update_node(operator_io **io, int id, operator_node *head)
 
                 if (strncmp(current_input_names[i], output_name, len) == 0) {
 
-                    parent = search_operator_node_by_name(head, io[current_index]->model_name);
+                    parent = nodes[current_index];
                     insert_parent_to_operator_node(parent, child);
                     parent_output_indices[index++] = j;
+                    count_output_consumer(parent, j);
 
                     found = 1;
                     break;
@@ -610,6 +1103,10 @@ free_operator_node(operator_node *node, char **visited_nodes, int *visited_count
         free(node->parent_output_indices);
     }
 
+    if (node->output_consumers) {
+        free(node->output_consumers);
+    }
+
     visited_nodes[*visited_count] = node->model_name;
     (*visited_count)++;
 
@@ -617,16 +1114,6 @@ free_operator_node(operator_node *node, char **visited_nodes, int *visited_count
         free_operator_node(node->children[i], visited_nodes, visited_count);
     }
 
-    if (node->outputs != NULL) {
-        for (int i = 0; node->outputs[i] != NULL; i++) {
-            if (tract_value_destroy(&node->outputs[i]) != TRACT_RESULT_OK) {
-                fprintf(stderr, "Error destroying tract value\n");
-                return;
-            }
-        }
-        free(node->outputs);
-    }
-
     if (node->children) {
         free(node->children);
         node->children = NULL;
@@ -641,6 +1128,447 @@ free_operator_node(operator_node *node, char **visited_nodes, int *visited_count
     free(node);
 }
 
+// Bytes of one element of a tract datum type, a complex one holds two
+// scalars. 0 for a type tract does not export.
+size_t
+datum_size(DatumType datum_type)
+{
+    switch (datum_type) {
+    case TRACT_DATUM_TYPE_BOOL:
+    case TRACT_DATUM_TYPE_U8:
+    case TRACT_DATUM_TYPE_I8:
+        return 1;
+    case TRACT_DATUM_TYPE_U16:
+    case TRACT_DATUM_TYPE_I16:
+    case TRACT_DATUM_TYPE_F16:
+        return 2;
+    case TRACT_DATUM_TYPE_U32:
+    case TRACT_DATUM_TYPE_I32:
+    case TRACT_DATUM_TYPE_F32:
+    case TRACT_DATUM_TYPE_COMPLEX_I16:
+    case TRACT_DATUM_TYPE_COMPLEX_F16:
+        return 4;
+    case TRACT_DATUM_TYPE_U64:
+    case TRACT_DATUM_TYPE_I64:
+    case TRACT_DATUM_TYPE_F64:
+    case TRACT_DATUM_TYPE_COMPLEX_I32:
+    case TRACT_DATUM_TYPE_COMPLEX_F32:
+        return 8;
+    case TRACT_DATUM_TYPE_COMPLEX_I64:
+    case TRACT_DATUM_TYPE_COMPLEX_F64:
+        return 16;
+    default:
+        return 0;
+    }
+}
+
+// Bytes held by a tensor
+static size_t
+value_size(TractValue *value)
+{
+    DatumType datum_type;
+    uintptr_t rank = 0;
+    const uintptr_t *shape = NULL;
+
+    if (!value || tract_value_as_bytes(value, &datum_type, &rank, &shape, NULL) != TRACT_RESULT_OK) return 0;
+
+    size_t size = datum_size(datum_type);
+    for (uintptr_t i = 0; i < rank; i++) {
+        size *= shape[i];
+    }
+    return size;
+}
+
+static void
+account_bytes(execution_context *ctx, size_t bytes)
+{
+    ctx->live_bytes += bytes;
+    if (ctx->live_bytes > ctx->peak_bytes) ctx->peak_bytes = ctx->live_bytes;
+}
+
+// Same slot order run_inference used to derive from parents/parent_output_indices
+static plan_input *
+plan_step_inputs(const operator_node *node, int *num_inputs)
+{
+    int capacity = (node->num_inputs > 0 ? node->num_inputs : 0) + 1;
+    plan_input *inputs = (plan_input *)malloc(capacity * sizeof(plan_input));
+    assert(inputs);
+
+    int k = 0;
+    int *indices = node->parent_output_indices;
+    for (int i = 0; i < node->num_inputs; i++) {
+        if (!node->parents || !node->parents[i]) break;
+
+        const operator_node *parent = node->parents[i];
+        assert(parent->index < node->index);
+        inputs[k].producer = parent->index;
+        inputs[k].output = parent->index == 0 ? -1 : indices[i];
+        k++;
+    }
+    if (node->num_inputs == -1 || node->num_parents == 0) {
+        inputs[k].producer = 0;
+        inputs[k].output = -1;
+        k++;
+    }
+
+    *num_inputs = k;
+    return inputs;
+}
+
+// `nodes` is indexed by operator_node::index with the input node at 0. update_node
+// only links a partition to earlier ones, so index order is already topological.
+execution_plan *
+build_execution_plan(operator_node **nodes, int num_nodes)
+{
+    assert(nodes);
+    assert(num_nodes > 0);
+
+    execution_plan *plan = (execution_plan *)malloc(sizeof(execution_plan));
+    if (!plan) {
+        fprintf(stderr, "Memory allocation for execution plan failed\n");
+        return NULL;
+    }
+    plan->num_steps = num_nodes - 1;
+    plan->result_index = num_nodes - 1;
+    plan->steps = (plan_step *)calloc(num_nodes, sizeof(plan_step));
+    if (!plan->steps) {
+        fprintf(stderr, "Memory allocation for execution plan steps failed\n");
+        free(plan);
+        return NULL;
+    }
+
+    for (int i = 1; i < num_nodes; i++) {
+        assert(nodes[i] && nodes[i]->index == i);
+        plan_step *step = &plan->steps[i - 1];
+        step->node = nodes[i];
+        step->inputs = plan_step_inputs(nodes[i], &step->num_inputs);
+        step->num_producers = 0;
+        step->num_dependents = 0;
+        step->dependents = NULL;
+    }
+
+    // Step edges for the ready-queue executor, one per distinct producer
+    for (int s = 0; s < plan->num_steps; s++) {
+        plan_step *step = &plan->steps[s];
+        for (int i = 0; i < step->num_inputs; i++) {
+            if (step->inputs[i].producer == 0) continue;
+
+            plan_step *producer = &plan->steps[step->inputs[i].producer - 1];
+            if (producer->num_dependents > 0 && producer->dependents[producer->num_dependents - 1] == s) continue;
+
+            producer->dependents = (int *)realloc(producer->dependents, (producer->num_dependents + 1) * sizeof(int));
+            assert(producer->dependents);
+            producer->dependents[producer->num_dependents++] = s;
+            step->num_producers++;
+        }
+    }
+    return plan;
+}
+
+void
+free_execution_plan(execution_plan *plan)
+{
+    if (!plan) return;
+
+    for (int i = 0; i < plan->num_steps; i++) {
+        free(plan->steps[i].inputs);
+        free(plan->steps[i].dependents);
+    }
+    free(plan->steps);
+    free(plan);
+}
+
+execution_context *
+init_execution_context(int num_nodes, TractValue **input_values)
+{
+    assert(num_nodes > 0);
+    assert(input_values);
+
+    execution_context *ctx = (execution_context *)malloc(sizeof(execution_context));
+    if (!ctx) {
+        fprintf(stderr, "Memory allocation for execution context failed\n");
+        return NULL;
+    }
+    ctx->num_nodes = num_nodes;
+    ctx->live_bytes = 0;
+    ctx->peak_bytes = 0;
+    pthread_mutex_init(&ctx->lock, NULL);
+    ctx->states = (node_state *)calloc(num_nodes, sizeof(node_state));
+    if (!ctx->states) {
+        fprintf(stderr, "Memory allocation for node states failed\n");
+        pthread_mutex_destroy(&ctx->lock);
+        free(ctx);
+        return NULL;
+    }
+    ctx->states[0].outputs = input_values;
+    ctx->states[0].num_outputs = get_array_size((void **)input_values);
+    for (int i = 0; i < ctx->states[0].num_outputs; i++) {
+        account_bytes(ctx, value_size(input_values[i]));
+    }
+    return ctx;
+}
+
+void
+retain_node_outputs(execution_context *ctx, const operator_node *node, TractValue **outputs)
+{
+    assert(ctx);
+    assert(node);
+
+    node_state *state = &ctx->states[node->index];
+    state->outputs = outputs;
+    state->num_outputs = node->num_outputs;
+    state->pending = (int *)calloc(node->num_outputs > 0 ? node->num_outputs : 1, sizeof(int));
+    assert(state->pending);
+    if (node->output_consumers) {
+        memcpy(state->pending, node->output_consumers, node->num_outputs * sizeof(int));
+    }
+
+    pthread_mutex_lock(&ctx->lock);
+    for (int i = 0; i < node->num_outputs; i++) {
+        account_bytes(ctx, value_size(outputs[i]));
+    }
+    pthread_mutex_unlock(&ctx->lock);
+}
+
+static void
+release_node_output(execution_context *ctx, node_state *state, int output)
+{
+    if (!state->outputs || !state->outputs[output]) return;
+
+    ctx->live_bytes -= value_size(state->outputs[output]);
+    if (tract_value_destroy(&state->outputs[output]) != TRACT_RESULT_OK) {
+        fprintf(stderr, "Error destroying tract value\n");
+    }
+    state->outputs[output] = NULL;
+}
+
+// Called once the step has run: producer outputs whose last consumer was this
+// step are destroyed, and so are the step's own outputs that nothing reads
+// (except for the last partition, which holds the result)
+void
+release_activations(execution_context *ctx, const plan_step *step)
+{
+    assert(ctx);
+    assert(step);
+
+    pthread_mutex_lock(&ctx->lock);
+    for (int i = 0; i < step->num_inputs; i++) {
+        if (step->inputs[i].producer == 0) continue;
+
+        node_state *state = &ctx->states[step->inputs[i].producer];
+        int output = step->inputs[i].output;
+        if (!state->pending || state->pending[output] <= 0) continue;
+        if (--state->pending[output] == 0) release_node_output(ctx, state, output);
+    }
+
+    if (step->node->index != ctx->num_nodes - 1) {
+        node_state *state = &ctx->states[step->node->index];
+        for (int i = 0; i < state->num_outputs; i++) {
+            if (state->pending && state->pending[i] == 0) release_node_output(ctx, state, i);
+        }
+    }
+    pthread_mutex_unlock(&ctx->lock);
+}
+
+void
+free_node_outputs(node_state *state)
+{
+    assert(state);
+
+    if (state->outputs) {
+        for (int i = 0; i < state->num_outputs; i++) {
+            if (state->outputs[i] && tract_value_destroy(&state->outputs[i]) != TRACT_RESULT_OK) {
+                fprintf(stderr, "Error destroying tract value\n");
+            }
+        }
+        free(state->outputs);
+        state->outputs = NULL;
+    }
+    free(state->pending);
+    state->pending = NULL;
+}
+
+// Releases the request inputs as well as every activation
+void
+free_execution_context(execution_context *ctx)
+{
+    if (!ctx) return;
+
+    for (int i = 0; i < ctx->num_nodes; i++) {
+        free_node_outputs(&ctx->states[i]);
+    }
+    free(ctx->states);
+    pthread_mutex_destroy(&ctx->lock);
+    free(ctx);
+}
+
+// Category of the best of the first ARGMAX_SCORES scores of a row, the lower
+// one on equal scores; 0 with *max 0 for an empty row. Batched and unbatched
+// requests both use it, so batching does not change a prediction.
+int
+row_argmax(const float *row, uintptr_t length, float *max)
+{
+    if (length == 0) {
+        *max = 0.0;
+        return 0;
+    }
+    if (length > ARGMAX_SCORES) length = ARGMAX_SCORES;
+
+    int argmax = 0;
+    for (uintptr_t i = 1; i < length; i++) {
+        if (row[i] > row[argmax]) argmax = (int) i;
+    }
+    *max = row[argmax];
+    return argmax;
+}
+
+// The result->k best scores of a row, best first; equal scores keep the
+// lower category first like the argmax
+static bool
+top_k_of_row(const float *row, uintptr_t length, request_result *result)
+{
+    int k = result->k < 1 ? 1 : result->k;
+    if ((uintptr_t) k > length) k = (int) length;
+
+    result->top_categories = (int *) malloc(k * sizeof(int));
+    result->top_scores = (float *) malloc(k * sizeof(float));
+    if (!result->top_categories || !result->top_scores) {
+        fprintf(stderr, "Memory allocation failed for the top-k\n");
+        return false;
+    }
+
+    // Insertion into the k best so far, a row holds a few thousand scores
+    int n = 0;
+    for (uintptr_t i = 0; i < length; i++) {
+        float score = row[i];
+        if (n == k && !(score > result->top_scores[k - 1])) continue;
+
+        int j = n < k ? n++ : k - 1;
+        while (j > 0 && result->top_scores[j - 1] < score) {
+            result->top_scores[j] = result->top_scores[j - 1];
+            result->top_categories[j] = result->top_categories[j - 1];
+            j--;
+        }
+        result->top_scores[j] = score;
+        result->top_categories[j] = (int) i;
+    }
+    result->num_top = n;
+    return true;
+}
+
+// Copies rows [first_row, first_row + rows) of an output, rows 0 for all of it
+static bool
+copy_output_rows(const TractValue *value, uintptr_t first_row, uintptr_t rows, output_tensor *tensor)
+{
+    DatumType datum_type;
+    uintptr_t rank = 0;
+    const uintptr_t *shape = NULL;
+    const unsigned char *data = NULL;
+
+    if (tract_value_as_bytes((TractValue *) value, &datum_type, &rank, &shape, (const void **) &data) != TRACT_RESULT_OK) {
+        fprintf(stderr, "Error calling tract: %s\n", tract_get_last_error());
+        return false;
+    }
+
+    size_t row_bytes = datum_size(datum_type);
+    uintptr_t total_rows = rank > 0 ? shape[0] : 1;
+    if (row_bytes == 0 || (rank == 0 && rows != 0)) return false;
+    if (rows == 0) rows = total_rows;
+    if (first_row + rows > total_rows) return false;
+    for (uintptr_t j = 1; j < rank; j++) {
+        row_bytes *= shape[j];
+    }
+
+    tensor->datum_type = datum_type;
+    tensor->rank = rank;
+    tensor->shape = (uintptr_t *) malloc((rank + 1) * sizeof(uintptr_t));
+    tensor->size = row_bytes * rows;
+    tensor->data = malloc(tensor->size + 1);
+    if (!tensor->shape || !tensor->data) {
+        fprintf(stderr, "Memory allocation failed for an output tensor\n");
+        return false;
+    }
+    if (rank > 0) {
+        memcpy(tensor->shape, shape, rank * sizeof(uintptr_t));
+        tensor->shape[0] = rows;
+    }
+    memcpy(tensor->data, data + first_row * row_bytes, tensor->size);
+    return true;
+}
+
+// Fills the top-k or the tensors a request asked for from the outputs of the
+// last partition, restricted to rows [first_row, first_row + rows) of a batch;
+// rows is 0 for a request that ran alone. The top-k is taken from the first
+// row of the last output, where the argmax comes from. Returns false if the
+// outputs do not allow the mode, result then has neither.
+bool
+collect_request_result(const execution_plan *plan, execution_context *ctx, uintptr_t first_row, uintptr_t rows, request_result *result)
+{
+    assert(plan && ctx && result);
+    if (result->mode == RESULT_ARGMAX) return true;
+
+    const operator_node *last = plan->steps[plan->result_index - 1].node;
+    TractValue **outputs = ctx->states[plan->result_index].outputs;
+    int num_outputs = last->num_outputs;
+    if (!outputs || num_outputs == 0) return false;
+
+    if (result->mode == RESULT_TOP_K) {
+        DatumType datum_type;
+        uintptr_t rank = 0, row_length = 1;
+        const uintptr_t *shape = NULL;
+        const float *data = NULL;
+
+        if (tract_value_as_bytes(outputs[num_outputs - 1], &datum_type, &rank, &shape, (const void **) &data) != TRACT_RESULT_OK ||
+            datum_type != TRACT_DATUM_TYPE_F32 || rank == 0 || first_row >= shape[0]) {
+            fprintf(stderr, "The last output has no float rows for a top-k\n");
+            return false;
+        }
+        for (uintptr_t j = 1; j < rank; j++) {
+            row_length *= shape[j];
+        }
+        if (row_length == 0 || !top_k_of_row(data + first_row * row_length, row_length, result)) {
+            free_request_result(result);
+            return false;
+        }
+        return true;
+    }
+
+    result->tensors = (output_tensor *) calloc(num_outputs, sizeof(output_tensor));
+    if (!result->tensors) {
+        fprintf(stderr, "Memory allocation failed for the output tensors\n");
+        return false;
+    }
+    for (int i = 0; i < num_outputs; i++) {
+        result->num_tensors++;
+        if (!outputs[i] || !copy_output_rows(outputs[i], first_row, rows, &result->tensors[i])) {
+            fprintf(stderr, "Output %d of the last partition cannot be sent back\n", i);
+            free_request_result(result);
+            return false;
+        }
+    }
+    return true;
+}
+
+// Frees the top-k and the tensors, mode and the argmax stay
+void
+free_request_result(request_result *result)
+{
+    if (!result) return;
+
+    free(result->top_categories);
+    free(result->top_scores);
+    for (int i = 0; i < result->num_tensors; i++) {
+        free(result->tensors[i].shape);
+        free(result->tensors[i].data);
+    }
+    free(result->tensors);
+    result->top_categories = NULL;
+    result->top_scores = NULL;
+    result->tensors = NULL;
+    result->num_top = 0;
+    result->num_tensors = 0;
+}
+
 void
 print_operator_node(operator_node *node, char **visited_nodes, int *visited_count)
 {
@@ -0,0 +1,818 @@
+#define _GNU_SOURCE
+#include <upload.h>
+#include <compiled_store.h>
+#include <dirent.h>
+#include <errno.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include "mbedtls/sha256.h"
+
+#if UPLOAD_CHUNK_BYTES < 4096
+#error "UPLOAD_CHUNK_BYTES must hold a partition name"
+#endif
+
+// Partition names end up in 512-byte paths
+#define MAX_NAME_BYTES 255
+
+int
+partition_writer_open(partition_writer *w, const char *path, const encrypted_models_info *keys)
+{
+    memset(w, 0, sizeof(partition_writer));
+    w->path = path;
+
+#ifdef USE_AES
+    int ret;
+
+    mbedtls_gcm_init(&w->gcm);
+    if ((ret = mbedtls_gcm_setkey(&w->gcm, MBEDTLS_CIPHER_ID_AES, keys->key, KEY_BITS)) != 0 ||
+        (ret = mbedtls_gcm_starts(&w->gcm, MBEDTLS_GCM_ENCRYPT, keys->IV, IV_BYTES)) != 0 ||
+        (ret = mbedtls_gcm_update_ad(&w->gcm, keys->AAD, ADD_DATA_BYTES)) != 0) {
+        fprintf(stderr, "Setting up AES-GCM for %s failed - returned -0x%04x\n", path, -ret);
+        mbedtls_gcm_free(&w->gcm);
+        return -1;
+    }
+
+    // GCM may hold back a partial block until the next update
+    w->out = (unsigned char *) malloc(UPLOAD_CHUNK_BYTES + 16);
+    if (!w->out) {
+        fprintf(stderr, "Memory allocation failed for the encryption buffer of %s\n", path);
+        mbedtls_gcm_free(&w->gcm);
+        return -1;
+    }
+#else
+    (void) keys;
+#endif
+
+    w->fd = fopen(path, "wb");
+    if (!w->fd) {
+        fprintf(stderr, "Error opening file %s\n", path);
+#ifdef USE_AES
+        mbedtls_gcm_free(&w->gcm);
+        free(w->out);
+#endif
+        return -1;
+    }
+    return 0;
+}
+
+int
+partition_writer_write(partition_writer *w, const unsigned char *data, size_t length)
+{
+    while (length > 0) {
+        size_t n = length < UPLOAD_CHUNK_BYTES ? length : UPLOAD_CHUNK_BYTES;
+        const unsigned char *out = data;
+        size_t olen = n;
+
+#ifdef USE_AES
+        int ret = mbedtls_gcm_update(&w->gcm, data, n, w->out, UPLOAD_CHUNK_BYTES + 16, &olen);
+        if (ret != 0) {
+            fprintf(stderr, "mbedtls_gcm_update failed to encrypt %s - returned -0x%04x\n", w->path, -ret);
+            return -1;
+        }
+        out = w->out;
+#endif
+
+        if (fwrite(out, sizeof(unsigned char), olen, w->fd) != olen) {
+            fprintf(stderr, "fwrite failed for %s\n", w->path);
+            return -1;
+        }
+        w->written += n;
+        data += n;
+        length -= n;
+    }
+    return 0;
+}
+
+// Finishes the partition, with USE_AES its tag goes to tag. Returns 0 or -1,
+// the file is removed on failure.
+int
+partition_writer_close(partition_writer *w, unsigned char *tag)
+{
+    int ret = 0;
+
+#ifdef USE_AES
+    size_t olen = 0;
+    if ((ret = mbedtls_gcm_finish(&w->gcm, w->out, 16, &olen, tag, TAG_BYTES)) != 0) {
+        fprintf(stderr, "mbedtls_gcm_finish failed to generate the tag of %s - returned -0x%04x\n", w->path, -ret);
+    } else if (olen > 0 && fwrite(w->out, sizeof(unsigned char), olen, w->fd) != olen) {
+        fprintf(stderr, "fwrite failed for %s\n", w->path);
+        ret = -1;
+    }
+    mbedtls_gcm_free(&w->gcm);
+    free(w->out);
+    w->out = NULL;
+#else
+    (void) tag;
+#endif
+
+    if (fclose(w->fd) != 0) ret = -1;
+    w->fd = NULL;
+    if (ret != 0) {
+        remove(w->path);
+        return -1;
+    }
+    return 0;
+}
+
+void
+partition_writer_abort(partition_writer *w)
+{
+#ifdef USE_AES
+    mbedtls_gcm_free(&w->gcm);
+    free(w->out);
+    w->out = NULL;
+#endif
+    if (w->fd) fclose(w->fd);
+    w->fd = NULL;
+    remove(w->path);
+}
+
+int
+upload_init(model_upload *u, const wire_header *header, upload_read_fn read, void *ctx)
+{
+    memset(u, 0, sizeof(model_upload));
+    u->read = read;
+    u->ctx = ctx;
+    u->remaining = header->body_length;
+    u->chunk = (unsigned char *) malloc(UPLOAD_CHUNK_BYTES);
+    if (!u->chunk) {
+        fprintf(stderr, "Memory allocation failed for the upload buffer\n");
+        return -1;
+    }
+    return 0;
+}
+
+// Reads the header of the next section, if the body has one
+static int
+next_section(model_upload *u)
+{
+    unsigned char buf[WIRE_SECTION_BYTES];
+
+    u->pending = false;
+    if (u->remaining == 0) return 0;
+    if (u->remaining < WIRE_SECTION_BYTES) {
+        fprintf(stderr, "Upload body ends inside a section header\n");
+        return -1;
+    }
+    if ((u->error = u->read(u->ctx, buf, WIRE_SECTION_BYTES)) != 0) return -1;
+    u->remaining -= WIRE_SECTION_BYTES;
+
+    wire_decode_section(buf, &u->next);
+    if (wire_section_size(u->next.length) - WIRE_SECTION_BYTES > u->remaining) {
+        fprintf(stderr, "Section of %u bytes runs past the upload body\n", u->next.length);
+        return -1;
+    }
+    u->pending = true;
+    return 0;
+}
+
+// Reads the payload of the pending section and its padding a chunk at a time
+// and hands it to w, or drops it if w is NULL, hashing it into sha if set.
+// Returns 0, -1 after a read error and 1 if w failed; the payload is read to
+// its end either way.
+static int
+read_payload(model_upload *u, partition_writer *w, mbedtls_sha256_context *sha)
+{
+    size_t left = wire_section_size(u->next.length) - WIRE_SECTION_BYTES;
+    size_t payload = u->next.length;
+    int failed = 0;
+
+    while (left > 0) {
+        size_t n = left < UPLOAD_CHUNK_BYTES ? left : UPLOAD_CHUNK_BYTES;
+        if ((u->error = u->read(u->ctx, u->chunk, n)) != 0) return -1;
+        u->remaining -= n;
+        left -= n;
+
+        size_t data = n < payload ? n : payload;
+        if (sha && !failed && data > 0 && mbedtls_sha256_update(sha, u->chunk, data) != 0) failed = 1;
+        if (w && !failed && data > 0 && partition_writer_write(w, u->chunk, data) != 0) failed = 1;
+        payload -= data;
+    }
+    u->pending = false;
+    return failed;
+}
+
+static int
+read_name(model_upload *u)
+{
+    if (u->next.length == 0 || u->next.length > MAX_NAME_BYTES) {
+        fprintf(stderr, "Partition name of %u bytes\n", u->next.length);
+        return -1;
+    }
+
+    size_t padded = wire_section_size(u->next.length) - WIRE_SECTION_BYTES;
+    if ((u->error = u->read(u->ctx, u->chunk, padded)) != 0) return -1;
+    u->remaining -= padded;
+    u->pending = false;
+
+    char *name = (char *) malloc(u->next.length + 1);
+    char **names = (char **) realloc(u->names, (u->num_names + 2) * sizeof(char *));
+    if (!name || !names) {
+        fprintf(stderr, "Memory allocation failed for the partition names\n");
+        free(name);
+        if (names) u->names = names;
+        return -1;
+    }
+    memcpy(name, u->chunk, u->next.length);
+    name[u->next.length] = '\0';
+    names[u->num_names++] = name;
+    names[u->num_names] = NULL;
+    u->names = names;
+    return 0;
+}
+
+// Returns 0 with the first partition pending, or at the end of the body if
+// there is none; -1 for a malformed body or a read error
+int
+upload_read_names(model_upload *u)
+{
+    while (1) {
+        if (next_section(u) != 0) return -1;
+        if (!u->pending || u->next.type == WIRE_SECTION_MODEL) return 0;
+
+        if (u->next.type == WIRE_SECTION_NAME) {
+            if (read_name(u) != 0) return -1;
+        } else {
+            if (u->next.type == WIRE_SECTION_INPUT) u->num_inputs++;
+            if (read_payload(u, NULL, NULL) != 0) return -1;
+        }
+    }
+}
+
+static void
+remove_partitions(char **paths, int count)
+{
+    for (int i = 0; i < count; ++i) {
+        remove(paths[i]);
+    }
+}
+
+// Streams the i-th partition to paths[i], its tag goes to keys->tag[i] with
+// USE_AES and the SHA-256 of its plaintext to digests + i * WIRE_DIGEST_BYTES.
+// Returns 0, or -1 for a malformed body, a read error or a failed write, in
+// which case the partitions written so far are removed.
+int
+upload_write_partitions(model_upload *u, char **paths, encrypted_models_info *keys, unsigned char *digests)
+{
+    while (u->pending) {
+        if (u->next.type == WIRE_SECTION_NAME) {
+            fprintf(stderr, "Partition names must come before the partitions\n");
+            goto fail;
+        }
+
+        if (u->next.type == WIRE_SECTION_MODEL) {
+            if (u->num_models == u->num_names) {
+                fprintf(stderr, "More partitions than the %d names\n", u->num_names);
+                goto fail;
+            }
+
+            partition_writer w;
+            mbedtls_sha256_context sha;
+            if (partition_writer_open(&w, paths[u->num_models], keys) != 0) goto fail;
+            mbedtls_sha256_init(&sha);
+            if (mbedtls_sha256_starts(&sha, 0) != 0 || read_payload(u, &w, &sha) != 0 ||
+                mbedtls_sha256_finish(&sha, digests + u->num_models * WIRE_DIGEST_BYTES) != 0) {
+                mbedtls_sha256_free(&sha);
+                partition_writer_abort(&w);
+                goto fail;
+            }
+            mbedtls_sha256_free(&sha);
+            if (partition_writer_close(&w, keys ? keys->tag[u->num_models] : NULL) != 0) goto fail;
+            fprintf(stderr, "Partition %s: %ld bytes written\n", paths[u->num_models], w.written);
+            u->num_models++;
+        } else {
+            if (u->next.type == WIRE_SECTION_INPUT) u->num_inputs++;
+            if (read_payload(u, NULL, NULL) != 0) goto fail;
+        }
+
+        if (next_section(u) != 0) goto fail;
+    }
+
+    if (u->num_models != u->num_names) {
+        fprintf(stderr, "%d partition names for %d partitions\n", u->num_names, u->num_models);
+        goto fail;
+    }
+    return 0;
+
+fail:
+    remove_partitions(paths, u->num_models);
+    return -1;
+}
+
+// Reads and drops the rest of the body, so the session can go on after a
+// rejected upload. Returns 0, or -1 once the session failed.
+int
+upload_drain(model_upload *u)
+{
+    if (u->error != 0) return -1;
+
+    while (u->remaining > 0) {
+        size_t n = u->remaining < UPLOAD_CHUNK_BYTES ? u->remaining : UPLOAD_CHUNK_BYTES;
+        if ((u->error = u->read(u->ctx, u->chunk, n)) != 0) return -1;
+        u->remaining -= n;
+    }
+    u->pending = false;
+    return 0;
+}
+
+void
+upload_free(model_upload *u)
+{
+    if (u->names) {
+        for (int i = 0; i < u->num_names; ++i) {
+            free(u->names[i]);
+        }
+        free(u->names);
+    }
+    free(u->chunk);
+    u->names = NULL;
+    u->chunk = NULL;
+}
+
+// Resolved LOCAL_MODEL_ROOT, NULL if it does not exist
+static char *
+local_root(void)
+{
+    char path[PATH_MAX];
+
+    if (LOCAL_MODEL_ROOT[0] == '/') {
+        snprintf(path, sizeof(path), "%s", LOCAL_MODEL_ROOT);
+    } else {
+        const char *home_dir = getenv("HOME");
+        if (!home_dir) {
+            fprintf(stderr, "Error: HOME environment variable is not set\n");
+            return NULL;
+        }
+        snprintf(path, sizeof(path), "%s/%s", home_dir, LOCAL_MODEL_ROOT);
+    }
+
+    char *root = realpath(path, NULL);
+    if (!root) fprintf(stderr, "Local model root %s: %s\n", path, strerror(errno));
+    return root;
+}
+
+// Resolves a path of the client, relative ones against the root. NULL unless
+// it exists and, with links and ".." resolved, lies under the root.
+static char *
+resolve_local_path(const char *root, const char *path)
+{
+    char joined[PATH_MAX];
+    int length = path[0] == '/' ? snprintf(joined, sizeof(joined), "%s", path)
+                                : snprintf(joined, sizeof(joined), "%s/%s", root, path);
+    if (length < 0 || length >= (int) sizeof(joined)) {
+        fprintf(stderr, "Local path %s is too long\n", path);
+        return NULL;
+    }
+
+    char *resolved = realpath(joined, NULL);
+    if (!resolved) {
+        fprintf(stderr, "Local path %s: %s\n", path, strerror(errno));
+        return NULL;
+    }
+
+    size_t n = strlen(root);
+    if (strncmp(resolved, root, n) != 0 || (root[n - 1] != '/' && resolved[n] != '/' && resolved[n] != '\0')) {
+        fprintf(stderr, "Local path %s is outside of %s\n", path, root);
+        free(resolved);
+        return NULL;
+    }
+    return resolved;
+}
+
+// Appends a partition, which takes over source. Two partitions of a model
+// may not share a file name, it is what their digests and, with USE_AES, their
+// encrypted copies go by.
+static int
+add_partition(local_model *l, char *source, const char *file_name)
+{
+    size_t length = strlen(file_name);
+    if (length == 0 || length > MAX_NAME_BYTES) {
+        fprintf(stderr, "Partition name of %ld bytes\n", length);
+        free(source);
+        return -1;
+    }
+    for (int i = 0; i < l->num_partitions; ++i) {
+        if (strcmp(l->names[i], file_name) == 0) {
+            fprintf(stderr, "Two partitions are named %s\n", file_name);
+            free(source);
+            return -1;
+        }
+    }
+
+    char *name = strdup(file_name);
+    char **sources = (char **) realloc(l->sources, (l->num_partitions + 2) * sizeof(char *));
+    if (sources) l->sources = sources;
+    char **names = (char **) realloc(l->names, (l->num_partitions + 2) * sizeof(char *));
+    if (names) l->names = names;
+    if (!name || !sources || !names) {
+        fprintf(stderr, "Memory allocation failed for the local partitions\n");
+        free(name);
+        free(source);
+        return -1;
+    }
+
+    sources[l->num_partitions] = source;
+    names[l->num_partitions++] = name;
+    sources[l->num_partitions] = NULL;
+    names[l->num_partitions] = NULL;
+    return 0;
+}
+
+// Adds the regular files of a directory in version order, which is how the
+// client orders a directory it uploads. Compiled partitions left next to
+// partitions registered in place are not partitions themselves.
+static int
+add_directory(local_model *l, const char *root, const char *dir)
+{
+    struct dirent **namelist;
+    int count = scandir(dir, &namelist, NULL, versionsort);
+    if (count < 0) {
+        fprintf(stderr, "scandir %s: %s\n", dir, strerror(errno));
+        return -1;
+    }
+
+    int ret = 0;
+    for (int i = 0; i < count; ++i) {
+        const char *file_name = namelist[i]->d_name;
+        size_t length = strlen(file_name);
+        size_t suffix = strlen(COMPILED_SUFFIX);
+        char path[PATH_MAX];
+        struct stat st;
+
+        if (ret == 0 && !(length > suffix && strcmp(file_name + length - suffix, COMPILED_SUFFIX) == 0) &&
+            snprintf(path, sizeof(path), "%s/%s", dir, file_name) < (int) sizeof(path) &&
+            stat(path, &st) == 0 && S_ISREG(st.st_mode)) {
+            // Entries may be links, they have to stay under the root as well
+            char *source = resolve_local_path(root, path);
+            if (!source || add_partition(l, source, file_name) != 0) ret = -1;
+        }
+        free(namelist[i]);
+    }
+    free(namelist);
+    return ret;
+}
+
+static int
+add_local_path(local_model *l, const char *root, const wire_section *section)
+{
+    char path[PATH_MAX];
+    struct stat st;
+
+    if (section->length == 0 || section->length >= sizeof(path) || memchr(section->data, '\0', section->length)) {
+        fprintf(stderr, "Local path section of %u bytes\n", section->length);
+        return -1;
+    }
+    memcpy(path, section->data, section->length);
+    path[section->length] = '\0';
+
+    char *source = resolve_local_path(root, path);
+    if (!source) return -1;
+    if (stat(source, &st) != 0) {
+        fprintf(stderr, "Local path %s: %s\n", path, strerror(errno));
+        free(source);
+        return -1;
+    }
+    if (S_ISDIR(st.st_mode)) {
+        int ret = add_directory(l, root, source);
+        free(source);
+        return ret;
+    }
+    if (!S_ISREG(st.st_mode)) {
+        fprintf(stderr, "Local path %s is not a file\n", path);
+        free(source);
+        return -1;
+    }
+
+    // Named as the client named it, the link rather than its target
+    const char *slash = strrchr(path, '/');
+    return add_partition(l, source, slash ? slash + 1 : path);
+}
+
+// Gives every partition the digest carrying its file name
+static int
+match_digest(local_model *l, const wire_section *section)
+{
+    if (section->length <= WIRE_DIGEST_BYTES) {
+        fprintf(stderr, "Digest section of %u bytes\n", section->length);
+        return -1;
+    }
+
+    const char *file_name = (const char *) section->data + WIRE_DIGEST_BYTES;
+    size_t length = section->length - WIRE_DIGEST_BYTES;
+    for (int i = 0; i < l->num_partitions; ++i) {
+        if (strlen(l->names[i]) != length || memcmp(l->names[i], file_name, length) != 0) continue;
+        if (l->digests[i]) {
+            fprintf(stderr, "Two digests for partition %s\n", l->names[i]);
+            return -1;
+        }
+        l->digests[i] = section->data;
+        return 0;
+    }
+    fprintf(stderr, "Digest for %.*s, which is not a partition\n", (int) length, file_name);
+    return -1;
+}
+
+// Resolves the paths of the request and pairs the partitions with their
+// digests, which point into body. Returns 0, or -1 for a malformed body, a
+// path that is missing or outside of LOCAL_MODEL_ROOT and a partition without
+// its digest. l is to be freed either way.
+int
+local_model_read(local_model *l, const unsigned char *body, size_t body_length)
+{
+    memset(l, 0, sizeof(local_model));
+
+    char *root = local_root();
+    if (!root) return -1;
+
+    // Paths first, the digests may come in any order
+    wire_section section;
+    size_t offset = 0;
+    int ret;
+    while ((ret = wire_next_section(body, body_length, &offset, &section)) == 1) {
+        if (section.type == WIRE_SECTION_LOCAL_PATH && add_local_path(l, root, &section) != 0) {
+            free(root);
+            return -1;
+        }
+    }
+    free(root);
+    if (ret < 0) {
+        fprintf(stderr, "Section at offset %ld runs past the body of %ld bytes\n", offset, body_length);
+        return -1;
+    }
+    if (l->num_partitions == 0) {
+        fprintf(stderr, "No local partitions\n");
+        return -1;
+    }
+
+    l->digests = (const unsigned char **) calloc(l->num_partitions, sizeof(unsigned char *));
+    if (!l->digests) {
+        fprintf(stderr, "Memory allocation failed for the digests\n");
+        return -1;
+    }
+    offset = 0;
+    while (wire_next_section(body, body_length, &offset, &section) == 1) {
+        if (section.type == WIRE_SECTION_DIGEST && match_digest(l, &section) != 0) return -1;
+    }
+    for (int i = 0; i < l->num_partitions; ++i) {
+        if (!l->digests[i]) {
+            fprintf(stderr, "No digest for partition %s\n", l->names[i]);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Reads a local partition a chunk at a time, hands it to w unless w is NULL
+// and checks it against its digest. Returns 0 or -1.
+static int
+copy_partition(const char *source, partition_writer *w, const unsigned char *digest, unsigned char *chunk)
+{
+    mbedtls_sha256_context sha;
+    unsigned char actual[WIRE_DIGEST_BYTES];
+    size_t n;
+
+    FILE *fd = fopen(source, "rb");
+    if (!fd) {
+        fprintf(stderr, "Error opening file %s\n", source);
+        return -1;
+    }
+
+    mbedtls_sha256_init(&sha);
+    int ret = mbedtls_sha256_starts(&sha, 0);
+    while (ret == 0 && (n = fread(chunk, sizeof(unsigned char), UPLOAD_CHUNK_BYTES, fd)) > 0) {
+        ret = mbedtls_sha256_update(&sha, chunk, n);
+        if (ret == 0 && w) ret = partition_writer_write(w, chunk, n);
+    }
+    if (ret == 0 && ferror(fd)) {
+        fprintf(stderr, "fread failed for %s\n", source);
+        ret = -1;
+    }
+    if (ret == 0) ret = mbedtls_sha256_finish(&sha, actual);
+    mbedtls_sha256_free(&sha);
+    fclose(fd);
+
+    if (ret != 0) return -1;
+    if (memcmp(actual, digest, WIRE_DIGEST_BYTES) != 0) {
+        fprintf(stderr, "SHA-256 of %s does not match its digest\n", source);
+        return -1;
+    }
+    return 0;
+}
+
+// Partitions of one registration shared out to the writer threads. Each
+// partition comes from models[i] when models is set, from local otherwise;
+// elapsed[i] is its write time in ms, negative until it is on disk.
+typedef struct partition_pool
+{
+    char **paths;
+    unsigned char **models;
+    const int *sizes;
+    local_model *local;
+    encrypted_models_info *keys;
+    int count;
+    double *elapsed;
+    pthread_mutex_t lock;
+    int next;
+    bool failed;
+} partition_pool;
+
+static int
+write_partition(partition_pool *p, int i, unsigned char *chunk)
+{
+    partition_writer w;
+    int ret;
+
+    // Already stored, a local one is still checked against its digest
+    if (!p->paths[i]) {
+        return p->models ? 0 : copy_partition(p->local->sources[i], NULL, p->local->digests[i], chunk);
+    }
+
+    if (partition_writer_open(&w, p->paths[i], p->keys) != 0) return -1;
+    if (p->models) {
+        ret = partition_writer_write(&w, p->models[i], (size_t) p->sizes[i]);
+    } else {
+        ret = copy_partition(p->local->sources[i], &w, p->local->digests[i], chunk);
+    }
+    if (ret != 0) {
+        partition_writer_abort(&w);
+        return -1;
+    }
+    if (partition_writer_close(&w, p->keys ? p->keys->tag[i] : NULL) != 0) return -1;
+    fprintf(stderr, "Partition %s: %ld bytes written from %s\n", p->paths[i], w.written,
+            p->models ? "the request" : p->local->sources[i]);
+    return 0;
+}
+
+// Takes partitions until there are none left or one failed. Every writer has
+// its own AES-GCM context, only the next index is shared.
+static void *
+partition_thread(void *arg)
+{
+    partition_pool *p = (partition_pool *) arg;
+    struct timeval t1, t2;
+    unsigned char *chunk = NULL;
+
+    if (!p->models && !(chunk = (unsigned char *) malloc(UPLOAD_CHUNK_BYTES))) {
+        fprintf(stderr, "Memory allocation failed for the upload buffer\n");
+        pthread_mutex_lock(&p->lock);
+        p->failed = true;
+        pthread_mutex_unlock(&p->lock);
+        return NULL;
+    }
+
+    for (;;) {
+        pthread_mutex_lock(&p->lock);
+        int i = p->failed || p->next == p->count ? -1 : p->next++;
+        pthread_mutex_unlock(&p->lock);
+        if (i < 0) break;
+
+        gettimeofday(&t1, NULL);
+        int ret = write_partition(p, i, chunk);
+        gettimeofday(&t2, NULL);
+
+        pthread_mutex_lock(&p->lock);
+        if (ret != 0) {
+            p->failed = true;
+        } else {
+            p->elapsed[i] = (t2.tv_sec - t1.tv_sec) * 1000.0;      // sec to ms
+            p->elapsed[i] += (t2.tv_usec - t1.tv_usec) / 1000.0;   // us to ms
+        }
+        pthread_mutex_unlock(&p->lock);
+    }
+    free(chunk);
+    return NULL;
+}
+
+// Writes the partitions of the pool on up to REGISTRATION_THREADS threads, the
+// caller included, and reports the time of each one. On failure the
+// partitions already written are removed.
+static int
+run_partition_pool(partition_pool *p)
+{
+    struct timeval t1, t2;
+    int threads = REGISTRATION_THREADS < p->count ? REGISTRATION_THREADS : p->count;
+    if (threads < 1) threads = 1;
+
+    p->elapsed = (double *) malloc(p->count * sizeof(double));
+    pthread_t *workers = (pthread_t *) malloc(threads * sizeof(pthread_t));
+    if (!p->elapsed || !workers) {
+        fprintf(stderr, "Memory allocation failed for the registration threads\n");
+        free(p->elapsed);
+        free(workers);
+        return -1;
+    }
+    for (int i = 0; i < p->count; ++i) {
+        p->elapsed[i] = -1.0;
+    }
+    p->next = 0;
+    p->failed = false;
+    pthread_mutex_init(&p->lock, NULL);
+
+    // The key generation ran AES on this thread, so its tables are set up
+    // before the writers use them
+    gettimeofday(&t1, NULL);
+    int started = 0;
+    for (; started < threads - 1; ++started) {
+        if (pthread_create(&workers[started], NULL, partition_thread, p) != 0) {
+            fprintf(stderr, "Error creating registration thread %d\n", started);
+            break;
+        }
+    }
+    partition_thread(p);
+    for (int t = 0; t < started; ++t) {
+        pthread_join(workers[t], NULL);
+    }
+    gettimeofday(&t2, NULL);
+    pthread_mutex_destroy(&p->lock);
+
+    double latency = (t2.tv_sec - t1.tv_sec) * 1000.0;      // sec to ms
+    latency += (t2.tv_usec - t1.tv_usec) / 1000.0;          // us to ms
+    double total = 0.0;
+    int written = 0;
+    for (int i = 0; i < p->count; ++i) {
+        if (p->elapsed[i] < 0.0 || !p->paths[i]) continue;
+        if (p->failed) {
+            remove(p->paths[i]);
+        } else {
+            fprintf(stderr, "Partition %s: %f ms\n", p->paths[i], p->elapsed[i]);
+            total += p->elapsed[i];
+            written++;
+        }
+    }
+    if (!p->failed) {
+        fprintf(stderr, "Registration wrote %d of %d partitions in %f ms on %d threads, %f ms of partition time\n",
+                written, p->count, latency, started + 1, total);
+    }
+
+    free(p->elapsed);
+    free(workers);
+    return p->failed ? -1 : 0;
+}
+
+// Writes the i-th buffered partition, size_models[i] bytes, to paths[i],
+// encrypted under keys with USE_AES, its tag goes to keys->tag[i]. Partitions
+// without a path are skipped. Returns 0, or -1 after removing the partitions
+// written so far.
+int
+write_partitions(char **paths, unsigned char **models, const int *size_models, int count, encrypted_models_info *keys)
+{
+    partition_pool p;
+
+    memset(&p, 0, sizeof(partition_pool));
+    p.paths = paths;
+    p.models = models;
+    p.sizes = size_models;
+    p.keys = keys;
+    p.count = count;
+    return run_partition_pool(&p);
+}
+
+// Writes the i-th partition to paths[i] a chunk at a time, encrypted under
+// keys with USE_AES, its tag goes to keys->tag[i]; partitions without a path
+// are only checked against their digest. Returns 0, or -1 if a
+// partition could not be read, written or does not match its digest, in which
+// case the partitions written so far are removed.
+int
+local_model_write(local_model *l, char **paths, encrypted_models_info *keys)
+{
+    partition_pool p;
+
+    memset(&p, 0, sizeof(partition_pool));
+    p.paths = paths;
+    p.local = l;
+    p.keys = keys;
+    p.count = l->num_partitions;
+    return run_partition_pool(&p);
+}
+
+// Checks every partition against its digest without copying it
+int
+local_model_verify(local_model *l)
+{
+    unsigned char *chunk = (unsigned char *) malloc(UPLOAD_CHUNK_BYTES);
+    if (!chunk) {
+        fprintf(stderr, "Memory allocation failed for the upload buffer\n");
+        return -1;
+    }
+
+    int ret = 0;
+    for (int i = 0; ret == 0 && i < l->num_partitions; ++i) {
+        ret = copy_partition(l->sources[i], NULL, l->digests[i], chunk);
+    }
+    free(chunk);
+    return ret;
+}
+
+void
+local_model_free(local_model *l)
+{
+    for (int i = 0; i < l->num_partitions; ++i) {
+        if (l->sources) free(l->sources[i]);
+        if (l->names) free(l->names[i]);
+    }
+    free(l->sources);
+    free(l->names);
+    free(l->digests);
+    memset(l, 0, sizeof(local_model));
+}
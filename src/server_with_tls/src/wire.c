@@ -0,0 +1,218 @@
+#include <string.h>
+#include <wire.h>
+
+static void
+put_u16(unsigned char *out, uint16_t value)
+{
+    out[0] = value & 0xff;
+    out[1] = value >> 8;
+}
+
+static void
+put_u32(unsigned char *out, uint32_t value)
+{
+    for (int i = 0; i < 4; i++) out[i] = (value >> (8 * i)) & 0xff;
+}
+
+static void
+put_u64(unsigned char *out, uint64_t value)
+{
+    for (int i = 0; i < 8; i++) out[i] = (value >> (8 * i)) & 0xff;
+}
+
+static uint16_t
+get_u16(const unsigned char *in)
+{
+    return (uint16_t)(in[0] | (in[1] << 8));
+}
+
+static uint32_t
+get_u32(const unsigned char *in)
+{
+    uint32_t value = 0;
+    for (int i = 3; i >= 0; i--) value = (value << 8) | in[i];
+    return value;
+}
+
+static uint64_t
+get_u64(const unsigned char *in)
+{
+    uint64_t value = 0;
+    for (int i = 7; i >= 0; i--) value = (value << 8) | in[i];
+    return value;
+}
+
+void
+wire_init_header(wire_header *header, uint16_t command, uint32_t flags, uint32_t request_id)
+{
+    header->magic = WIRE_MAGIC;
+    header->version = WIRE_VERSION;
+    header->command = command;
+    header->flags = flags;
+    header->request_id = request_id;
+    header->body_length = 0;
+}
+
+void
+wire_encode_header(const wire_header *header, unsigned char *out)
+{
+    put_u32(out, header->magic);
+    put_u16(out + 4, header->version);
+    put_u16(out + 6, header->command);
+    put_u32(out + 8, header->flags);
+    put_u32(out + 12, header->request_id);
+    put_u64(out + 16, header->body_length);
+}
+
+// Whether the bytes open with the magic of a header; a legacy request opens
+// with its length in ASCII digits
+bool
+wire_has_magic(const unsigned char *in, size_t length)
+{
+    return length >= 4 && get_u32(in) == WIRE_MAGIC;
+}
+
+// Returns 0, -1 if the bytes are not a header of this protocol or -2 for an
+// unsupported version
+int
+wire_decode_header(const unsigned char *in, size_t length, wire_header *header)
+{
+    if (length < WIRE_HEADER_BYTES || get_u32(in) != WIRE_MAGIC) return -1;
+
+    header->magic = WIRE_MAGIC;
+    header->version = get_u16(in + 4);
+    header->command = get_u16(in + 6);
+    header->flags = get_u32(in + 8);
+    header->request_id = get_u32(in + 12);
+    header->body_length = get_u64(in + 16);
+    return header->version == WIRE_VERSION ? 0 : -2;
+}
+
+static size_t
+padded(size_t length)
+{
+    return (length + WIRE_ALIGN - 1) & ~((size_t) WIRE_ALIGN - 1);
+}
+
+size_t
+wire_section_size(size_t length)
+{
+    return WIRE_SECTION_BYTES + padded(length);
+}
+
+// Writes one section at out and returns the end of it
+unsigned char *
+wire_put_section(unsigned char *out, uint16_t type, const void *data, uint32_t length)
+{
+    put_u16(out, type);
+    put_u16(out + 2, 0);
+    put_u32(out + 4, length);
+    if (length > 0) memcpy(out + WIRE_SECTION_BYTES, data, length);
+    memset(out + WIRE_SECTION_BYTES + length, 0, padded(length) - length);
+    return out + wire_section_size(length);
+}
+
+// Decodes the WIRE_SECTION_BYTES in front of a payload that is read separately,
+// the payload and its padding follow them up to wire_section_size(length)
+void
+wire_decode_section(const unsigned char *in, wire_section *section)
+{
+    section->type = get_u16(in);
+    section->length = get_u32(in + 4);
+    section->data = NULL;
+}
+
+// Reads the section at *offset and moves past it. Returns 1 for a section,
+// 0 at the end of the body and -1 if a length runs past it.
+int
+wire_next_section(const unsigned char *body, size_t body_length, size_t *offset, wire_section *section)
+{
+    if (*offset == body_length) return 0;
+    if (body_length - *offset < WIRE_SECTION_BYTES) return -1;
+
+    const unsigned char *in = body + *offset;
+    section->type = get_u16(in);
+    section->length = get_u32(in + 4);
+    if (body_length - *offset - WIRE_SECTION_BYTES < padded(section->length)) return -1;
+
+    section->data = in + WIRE_SECTION_BYTES;
+    *offset += wire_section_size(section->length);
+    return 1;
+}
+
+// Section size of a tensor of the given rank and data size
+size_t
+wire_tensor_size(uint32_t rank, size_t size)
+{
+    return wire_section_size(8 + 8 * (size_t) rank + size);
+}
+
+unsigned char *
+wire_put_tensor(unsigned char *out, uint32_t datum_type, uint32_t rank, const uintptr_t *shape, const void *data, size_t size)
+{
+    size_t length = 8 + 8 * (size_t) rank + size;
+    unsigned char *payload = out + WIRE_SECTION_BYTES;
+
+    put_u16(out, WIRE_SECTION_TENSOR);
+    put_u16(out + 2, 0);
+    put_u32(out + 4, (uint32_t) length);
+    put_u32(payload, datum_type);
+    put_u32(payload + 4, rank);
+    for (uint32_t i = 0; i < rank; i++) {
+        put_u64(payload + 8 + 8 * i, shape[i]);
+    }
+    if (size > 0) memcpy(payload + 8 + 8 * rank, data, size);
+    memset(payload + length, 0, padded(length) - length);
+    return out + wire_section_size(length);
+}
+
+// Returns 0, -1 if the section is not a tensor of at most WIRE_MAX_RANK
+// dimensions. The data stays a view into the section.
+int
+wire_read_tensor(const wire_section *section, wire_tensor *tensor)
+{
+    if (section->type != WIRE_SECTION_TENSOR || section->length < 8) return -1;
+
+    tensor->datum_type = get_u32(section->data);
+    tensor->rank = get_u32(section->data + 4);
+    if (tensor->rank > WIRE_MAX_RANK || section->length < 8 + 8 * tensor->rank) return -1;
+    for (uint32_t i = 0; i < tensor->rank; i++) {
+        tensor->shape[i] = get_u64(section->data + 8 + 8 * i);
+    }
+    tensor->data = section->data + 8 + 8 * tensor->rank;
+    tensor->size = section->length - 8 - 8 * tensor->rank;
+    return 0;
+}
+
+// Writes a top-k section, scores go out as the bits of their float
+unsigned char *
+wire_put_top_k(unsigned char *out, int count, const int *categories, const float *scores)
+{
+    uint32_t length = 8 * (uint32_t) count;
+    unsigned char *payload = out + WIRE_SECTION_BYTES;
+
+    put_u16(out, WIRE_SECTION_TOP_K);
+    put_u16(out + 2, 0);
+    put_u32(out + 4, length);
+    for (int i = 0; i < count; i++) {
+        uint32_t bits;
+        memcpy(&bits, &scores[i], sizeof(bits));
+        put_u32(payload + 8 * i, (uint32_t) categories[i]);
+        put_u32(payload + 8 * i + 4, bits);
+    }
+    return out + wire_section_size(length);
+}
+
+int
+wire_top_k_count(const wire_section *section)
+{
+    return section->type == WIRE_SECTION_TOP_K ? (int) (section->length / 8) : 0;
+}
+
+void
+wire_top_k_entry(const wire_section *section, int i, int32_t *category, float *score)
+{
+    uint32_t bits = get_u32(section->data + 8 * i + 4);
+    *category = (int32_t) get_u32(section->data + 8 * i);
+    memcpy(score, &bits, sizeof(bits));
+}
@@ -0,0 +1,209 @@
+#include <wire_request.h>
+
+// Grows an array of the request by one element; pointer arrays keep a NULL
+// slot past the last element like the legacy request
+static bool
+grow(void **array, int count, size_t element_size)
+{
+    void *grown = realloc(*array, (count + 2) * element_size);
+    if (!grown) return false;
+    memset((char *) grown + (count + 1) * element_size, 0, element_size);
+    *array = grown;
+    return true;
+}
+
+// Returns 0, -1 for a malformed body or when out of memory. Partitions,
+// inputs, tags and the tokenizer are views into body, which is aligned and
+// pads every payload to WIRE_ALIGN, so the inputs are float aligned; on
+// success the request owns body, on failure the caller still does.
+int
+deserialize_wire_request(const wire_header *header, unsigned char *body, size_t body_length, request *req)
+{
+    assert(header);
+    assert(req);
+
+    char **names = NULL;
+    uint8_t **models = NULL;
+    int *size_models = NULL;
+    float **input = NULL;
+    int *size_inputs = NULL;
+    unsigned char **tags = NULL;
+    uint8_t *tokenizer = NULL;
+    int num_names = 0, num_models = 0, num_inputs = 0, num_tags = 0, tokenizer_size = 0;
+    int id = -1;
+    int result_mode = RESULT_ARGMAX, top_k = 0;
+
+    wire_section section;
+    size_t offset = 0;
+    int ret;
+    while ((ret = wire_next_section(body, body_length, &offset, &section)) == 1) {
+        unsigned char *data = (unsigned char *) section.data;
+
+        switch (section.type) {
+        case WIRE_SECTION_NAME: {
+            // Names become the paths of the model, they are the only copies
+            char *name = (char *) malloc(section.length + 1);
+            if (!name || !grow((void **) &names, num_names, sizeof(char *))) {
+                free(name);
+                goto fail;
+            }
+            memcpy(name, data, section.length);
+            name[section.length] = '\0';
+            names[num_names++] = name;
+            break;
+        }
+        case WIRE_SECTION_MODEL:
+            if (!grow((void **) &models, num_models, sizeof(uint8_t *)) ||
+                !grow((void **) &size_models, num_models, sizeof(int))) {
+                goto fail;
+            }
+            models[num_models] = data;
+            size_models[num_models++] = (int) section.length;
+            break;
+        case WIRE_SECTION_INPUT:
+            if (section.length % sizeof(float) != 0 || section.length < INPUT_SHAPE_FLOATS * sizeof(float)) {
+                fprintf(stderr, "Input section of %u bytes is not a float tensor\n", section.length);
+                goto fail;
+            }
+            if (!grow((void **) &input, num_inputs, sizeof(float *)) ||
+                !grow((void **) &size_inputs, num_inputs, sizeof(int))) {
+                goto fail;
+            }
+            input[num_inputs] = (float *) data;
+            size_inputs[num_inputs++] = (int) (section.length / sizeof(float));
+            break;
+        case WIRE_SECTION_TAG:
+            if (section.length != TAG_BYTES * 2) {
+                fprintf(stderr, "Tag section of %u bytes, expected %d\n", section.length, TAG_BYTES * 2);
+                goto fail;
+            }
+            if (!grow((void **) &tags, num_tags, sizeof(unsigned char *))) goto fail;
+            tags[num_tags++] = data;
+            break;
+        case WIRE_SECTION_TOKENIZER:
+            tokenizer = data;
+            tokenizer_size = (int) section.length;
+            break;
+        case WIRE_SECTION_MODEL_ID:
+            if (section.length != sizeof(int32_t)) goto fail;
+            id = (int) (data[0] | (data[1] << 8) | (data[2] << 16) | ((uint32_t) data[3] << 24));
+            break;
+        case WIRE_SECTION_RESULT_MODE:
+            if (section.length != 2 * sizeof(uint32_t)) goto fail;
+            result_mode = (int) (data[0] | (data[1] << 8) | (data[2] << 16) | ((uint32_t) data[3] << 24));
+            top_k = (int) (data[4] | (data[5] << 8) | (data[6] << 16) | ((uint32_t) data[7] << 24));
+            if (result_mode < RESULT_ARGMAX || result_mode > RESULT_RAW || top_k < 0) {
+                fprintf(stderr, "Unknown result mode %d\n", result_mode);
+                goto fail;
+            }
+            break;
+        default:
+            break;      // sections of later revisions
+        }
+    }
+    if (ret < 0) {
+        fprintf(stderr, "Section at offset %ld runs past the body of %ld bytes\n", offset, body_length);
+        goto fail;
+    }
+    if (header->command == WIRE_CMD_MODEL && num_names != num_models) {
+        fprintf(stderr, "%d partition names for %d partitions\n", num_names, num_models);
+        goto fail;
+    }
+
+    fprintf(stderr, "command: %d, id: %d, num_models: %d, num_inputs: %d, num_tags: %d\n", header->command, id, num_models, num_inputs, num_tags);
+
+    // Same shape as the legacy request: num_models counts the partitions of
+    // a registration, the tags of an inference are only NULL-terminated
+    req->command = header->command;
+    req->id = id;
+    req->num_models = num_models;
+    req->num_inputs = num_inputs;
+    req->names = names;
+    req->size_models = size_models;
+    req->models = models;
+    req->size_inputs = size_inputs;
+    req->input = input;
+    req->tags = tags;
+    req->tokenizer_size = tokenizer_size;
+    req->tokenizer = tokenizer;
+    req->buffer = (char *) body;
+    req->result_mode = result_mode;
+    req->top_k = top_k;
+    return 0;
+
+fail:
+    for (int i = 0; i < num_names; i++) free(names[i]);
+    free(names);
+    free(models);
+    free(size_models);
+    free(input);
+    free(size_inputs);
+    free(tags);
+    return -1;
+}
+
+// Response to a version 2 request, the caller frees it. A failed request
+// (c_l NULL) gets the error flag and an error section; the top-k or the
+// tensors of an inference follow the result text, the message is sized for
+// them.
+unsigned char *
+encode_wire_response(const wire_header *request_header, const client_result *c_l, size_t *length)
+{
+    assert(request_header);
+    assert(length);
+
+    const char *error = "Invalid client_request from handle_request";
+    const request_result *output = c_l ? c_l->output : NULL;
+    size_t result_length = 0, body_length;
+    int num_tags = 0;
+
+    if (c_l) {
+        // Error texts are padded to a fixed size after their NUL
+        result_length = strnlen((const char *) c_l->result, c_l->size);
+        body_length = wire_section_size(result_length);
+        while (c_l->tag && c_l->tag[num_tags]) {
+            body_length += wire_section_size(TAG_BYTES);
+            num_tags++;
+        }
+    } else {
+        body_length = wire_section_size(strlen(error));
+    }
+    if (output && output->num_top > 0) {
+        body_length += wire_section_size(8 * (size_t) output->num_top);
+    }
+    for (int i = 0; output && i < output->num_tensors; i++) {
+        body_length += wire_tensor_size(output->tensors[i].rank, output->tensors[i].size);
+    }
+
+    unsigned char *message = (unsigned char *) malloc(WIRE_HEADER_BYTES + body_length);
+    if (!message) {
+        fprintf(stderr, "Memory allocation failed for the wire response\n");
+        return NULL;
+    }
+
+    wire_header header;
+    wire_init_header(&header, request_header->command, WIRE_FLAG_RESPONSE | (c_l ? 0 : WIRE_FLAG_ERROR), request_header->request_id);
+    header.body_length = body_length;
+    wire_encode_header(&header, message);
+
+    unsigned char *out = message + WIRE_HEADER_BYTES;
+    if (c_l) {
+        out = wire_put_section(out, WIRE_SECTION_RESULT, c_l->result, result_length);
+        for (int i = 0; i < num_tags; i++) {
+            out = wire_put_section(out, WIRE_SECTION_TAG, c_l->tag[i], TAG_BYTES);
+        }
+    } else {
+        out = wire_put_section(out, WIRE_SECTION_ERROR, error, strlen(error));
+    }
+    if (output && output->num_top > 0) {
+        out = wire_put_top_k(out, output->num_top, output->top_categories, output->top_scores);
+    }
+    for (int i = 0; output && i < output->num_tensors; i++) {
+        const output_tensor *tensor = &output->tensors[i];
+        out = wire_put_tensor(out, (uint32_t) tensor->datum_type, (uint32_t) tensor->rank, tensor->shape, tensor->data, tensor->size);
+    }
+    assert((size_t) (out - message) == WIRE_HEADER_BYTES + body_length);
+
+    *length = WIRE_HEADER_BYTES + body_length;
+    return message;
+}
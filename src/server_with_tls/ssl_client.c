@@ -7,11 +7,16 @@
 #include <mbedtls/ctr_drbg.h>
 #include <mbedtls/error.h>
 #include <arpa/inet.h>
+#include <netinet/tcp.h>
 #include <string.h>
 #include <assert.h>
 #include <math.h>
 #include <stdbool.h>
+#include <stdarg.h>
 #include <ctype.h>
+#include <limits.h>
+#include <pthread.h>
+#include <time.h>
 #include <sys/time.h>
 
 #include <dirent.h>
@@ -19,6 +24,8 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <unistd.h>
+#include "wire.h"
+#include "mbedtls/sha256.h"
 
 #define SERVER_PORT "9998"
 #define SERVER_NAME "localhost"
@@ -26,6 +33,7 @@
 #define DEBUG_LEVEL 1
 #define BUF_SIZE 4096
 #define TAG_SIZE 16
+#define DATUM_TYPE_F32 52        // TRACT_DATUM_TYPE_F32 of tract.h
 
 typedef struct __attribute__((packed)) {
     int command;
@@ -42,6 +50,43 @@ typedef struct __attribute__((packed)) {
     uint8_t *tokenizer; 
 } request;
 
+typedef struct {
+    mbedtls_net_context server_fd;
+    mbedtls_entropy_context entropy;
+    mbedtls_ctr_drbg_context ctr_drbg;
+    mbedtls_ssl_context ssl;
+    mbedtls_ssl_config conf;
+    mbedtls_x509_crt cacert;
+} tls_session;
+
+// --session <file>: where the TLS session is saved between runs, NULL for a full handshake every time
+static const char *session_file = NULL;
+// --legacy: length-prefixed requests of servers before the version 2 protocol
+static bool legacy_protocol = false;
+// --top-k <k> / --raw: result mode of an inference, the argmax text by default
+static uint32_t result_mode = WIRE_RESULT_ARGMAX;
+static uint32_t top_k = 0;
+
+// load: the inference request is sent by a load generator instead of once.
+// Every connection keeps up to inflight requests pipelined on its session;
+// with a rate the requests arrive as a Poisson process over all connections
+// (open loop), otherwise a new one is sent as soon as an answer comes back
+// (closed loop), concurrency requests in flight in total.
+typedef struct load_config {
+    int connections;
+    int inflight;
+    int concurrency;            // closed loop, 0 for connections * inflight
+    double rate;                // open loop, requests per second
+    double duration;            // seconds
+} load_config;
+
+static bool load_mode = false;
+static load_config load = {1, 1, 0, 0.0, 10.0};
+
+// --digests <file>: expected SHA-256 of the partitions of a 'local' registration,
+// in the format of sha256sum; without it the client hashes the paths itself
+static const char *digest_file = NULL;
+
 /* HELPER FUNCTIONS */
 int
 size_of_file(FILE *fd)
@@ -317,6 +362,100 @@ serialize_client_request(const request* req, ssize_t buffer_len)
     return buffer;
 }
 
+// Size of the version 2 message: the header plus one section per name,
+// partition, input and tag, and the model id and tokenizer if set
+size_t
+calculate_wire_size(const request *req)
+{
+    size_t bytes = WIRE_HEADER_BYTES;
+
+    for (int i = 0; req->names && i < req->num_models; ++i) {
+        bytes += wire_section_size(strlen(req->names[i]));
+    }
+    for (int i = 0; req->models && i < req->num_models; ++i) {
+        bytes += wire_section_size(req->size_models[i]);
+    }
+    for (int i = 0; req->input && i < req->num_inputs; ++i) {
+        if (req->input[i] != NULL) {
+            bytes += wire_section_size(req->size_inputs[i] * sizeof(float));
+        }
+    }
+    for (int i = 0; req->tags && i < req->num_models; ++i) {
+        bytes += wire_section_size(TAG_SIZE * 2);
+    }
+    if (req->command == WIRE_CMD_MODEL_INPUT) {
+        bytes += wire_section_size(sizeof(int32_t));
+        if (result_mode != WIRE_RESULT_ARGMAX) bytes += wire_section_size(2 * sizeof(uint32_t));
+    }
+    if (req->tokenizer != NULL && req->tokenizer_size > 0) {
+        bytes += wire_section_size(req->tokenizer_size);
+    }
+
+    return bytes;
+}
+
+char *
+serialize_wire_request(const request *req, size_t buffer_len)
+{
+    unsigned char *buffer = (unsigned char *)malloc(buffer_len);
+    assert(buffer);
+
+    wire_header header;
+    wire_init_header(&header, req->command, 0, 0);
+    header.body_length = buffer_len - WIRE_HEADER_BYTES;
+    wire_encode_header(&header, buffer);
+
+    unsigned char *out = buffer + WIRE_HEADER_BYTES;
+    for (int i = 0; req->names && i < req->num_models; ++i) {
+        out = wire_put_section(out, WIRE_SECTION_NAME, req->names[i], strlen(req->names[i]));
+    }
+    for (int i = 0; req->models && i < req->num_models; ++i) {
+        out = wire_put_section(out, WIRE_SECTION_MODEL, req->models[i], req->size_models[i]);
+    }
+    for (int i = 0; req->input && i < req->num_inputs; ++i) {
+        if (req->input[i] != NULL) {
+            out = wire_put_section(out, WIRE_SECTION_INPUT, req->input[i], req->size_inputs[i] * sizeof(float));
+        }
+    }
+    for (int i = 0; req->tags && i < req->num_models; ++i) {
+        out = wire_put_section(out, WIRE_SECTION_TAG, req->tags[i], TAG_SIZE * 2);
+    }
+    if (req->command == WIRE_CMD_MODEL_INPUT) {
+        unsigned char id[4];
+        for (int i = 0; i < 4; i++) id[i] = ((uint32_t) req->id >> (8 * i)) & 0xff;
+        out = wire_put_section(out, WIRE_SECTION_MODEL_ID, id, sizeof(id));
+        if (result_mode != WIRE_RESULT_ARGMAX) {
+            unsigned char mode[8];
+            for (int i = 0; i < 4; i++) {
+                mode[i] = (result_mode >> (8 * i)) & 0xff;
+                mode[4 + i] = (top_k >> (8 * i)) & 0xff;
+            }
+            out = wire_put_section(out, WIRE_SECTION_RESULT_MODE, mode, sizeof(mode));
+        }
+    }
+    if (req->tokenizer != NULL && req->tokenizer_size > 0) {
+        out = wire_put_section(out, WIRE_SECTION_TOKENIZER, req->tokenizer, req->tokenizer_size);
+    }
+    assert((size_t)(out - buffer) == buffer_len);
+
+    return (char *)buffer;
+}
+
+// Serializes the request for the protocol in use
+char *
+serialize_request(const request *req, size_t *buffer_len)
+{
+    if (!legacy_protocol) {
+        *buffer_len = calculate_wire_size(req);
+        return serialize_wire_request(req, *buffer_len);
+    }
+
+    *buffer_len = calculate_buffer_size(req);
+    char *buffer = serialize_client_request(req, *buffer_len);
+    buffer[*buffer_len] = '\0';
+    return buffer;
+}
+
 void
 free_request(request *req_original)
 {
@@ -364,27 +503,89 @@ ssl_debug(void *ctx, int level,
     fflush((FILE *) ctx);
 }
 
+// One TLS session to the server, kept open across requests in keep-alive mode
 void
-send_request(char *client_request, size_t request_len, int mode)
+close_session(tls_session *s, int ret, bool failed)
 {
-    struct timeval t1, t2;
-    double elapsed_time;
+#ifdef MBEDTLS_ERROR_C
+    if (failed) {
+        char error_buf[100];
+        mbedtls_strerror(ret, error_buf, 100);
+        fprintf(stderr, "Last error was: %d - %s\n\n", ret, error_buf);
+    }
+#else
+    ((void) ret);
+#endif
 
-    int request_size = snprintf(NULL, 0, "%ld", request_len);
-    char data_size_str[request_size + 1];
-    snprintf(data_size_str, request_size + 1, "%ld", request_len);
-    int ret = 1, len;
-    int exit_code = MBEDTLS_EXIT_FAILURE;
-    mbedtls_net_context server_fd;
+    if (!failed) mbedtls_ssl_close_notify(&s->ssl);
+
+    mbedtls_net_free(&s->server_fd);
+    mbedtls_x509_crt_free(&s->cacert);
+    mbedtls_ssl_free(&s->ssl);
+    mbedtls_ssl_config_free(&s->conf);
+    mbedtls_ctr_drbg_free(&s->ctr_drbg);
+    mbedtls_entropy_free(&s->entropy);
+#if defined(MBEDTLS_USE_PSA_CRYPTO)
+    mbedtls_psa_crypto_free();
+#endif /* MBEDTLS_USE_PSA_CRYPTO */
+}
+
+// Offers the session saved by an earlier run, so the server can skip the
+// certificate and key exchange. Returns 0 if one was offered.
+int
+load_session(tls_session *s)
+{
+    FILE *fd = fopen(session_file, "rb");
+    if (!fd) return 1;      // first run, nothing saved yet
+
+    unsigned char buf[BUF_SIZE];
+    size_t len = fread(buf, 1, sizeof(buf), fd);
+    fclose(fd);
+
+    mbedtls_ssl_session session;
+    mbedtls_ssl_session_init(&session);
+    int ret = mbedtls_ssl_session_load(&session, buf, len);
+    if (ret == 0) ret = mbedtls_ssl_set_session(&s->ssl, &session);
+    if (ret != 0) fprintf(stderr, "Ignoring saved session %s - returned -0x%x\n", session_file, (unsigned int) -ret);
+    mbedtls_ssl_session_free(&session);
+    return ret;
+}
+
+// Saves the session of the completed handshake, ticket included, for the next run
+void
+save_session(tls_session *s)
+{
+    mbedtls_ssl_session session;
+    mbedtls_ssl_session_init(&session);
+
+    unsigned char buf[BUF_SIZE];
+    size_t len;
+    int ret = mbedtls_ssl_get_session(&s->ssl, &session);
+    if (ret == 0) ret = mbedtls_ssl_session_save(&session, buf, sizeof(buf), &len);
+    mbedtls_ssl_session_free(&session);
+    if (ret != 0) {
+        fprintf(stderr, "Saving the session failed - returned -0x%x\n", (unsigned int) -ret);
+        return;
+    }
+
+    FILE *fd = fopen(session_file, "wb");
+    if (!fd) {
+        fprintf(stderr, "Error opening file %s\n", session_file);
+        return;
+    }
+    if (fwrite(buf, 1, len, fd) != len) {
+        fprintf(stderr, "fwrite failed\n");
+    }
+    fclose(fd);
+}
+
+int
+open_session(tls_session *s)
+{
+    int ret = 1;
     uint32_t flags;
     const char *pers = "ssl_client";
 
-    mbedtls_entropy_context entropy;
-    mbedtls_ctr_drbg_context ctr_drbg;
-    mbedtls_ssl_context ssl;
-    mbedtls_ssl_config conf;
-    mbedtls_x509_crt cacert;
-
 #if defined(MBEDTLS_DEBUG_C)
     mbedtls_debug_set_threshold(DEBUG_LEVEL);
 #endif
@@ -392,19 +593,19 @@ send_request(char *client_request, size_t request_len, int mode)
     /*
      * 0. Initialize the RNG and the session data
      */
-    mbedtls_net_init(&server_fd);
-    mbedtls_ssl_init(&ssl);
-    mbedtls_ssl_config_init(&conf);
-    mbedtls_x509_crt_init(&cacert);
-    mbedtls_ctr_drbg_init(&ctr_drbg);
-    mbedtls_entropy_init(&entropy);
+    mbedtls_net_init(&s->server_fd);
+    mbedtls_ssl_init(&s->ssl);
+    mbedtls_ssl_config_init(&s->conf);
+    mbedtls_x509_crt_init(&s->cacert);
+    mbedtls_ctr_drbg_init(&s->ctr_drbg);
+    mbedtls_entropy_init(&s->entropy);
 
 #if defined(MBEDTLS_USE_PSA_CRYPTO)
     psa_status_t status = psa_crypto_init();
     if (status != PSA_SUCCESS) {
         mbedtls_fprintf(stderr, "Failed to initialize PSA Crypto implementation: %d\n",
                         (int) status);
-        goto exit;
+        return ret;
     }
 #endif /* MBEDTLS_USE_PSA_CRYPTO */
 
@@ -412,11 +613,11 @@ send_request(char *client_request, size_t request_len, int mode)
     fflush(stdout);
 
 
-    if ((ret = mbedtls_ctr_drbg_seed(&ctr_drbg, mbedtls_entropy_func, &entropy,
+    if ((ret = mbedtls_ctr_drbg_seed(&s->ctr_drbg, mbedtls_entropy_func, &s->entropy,
                                      (const unsigned char *) pers,
                                      strlen(pers))) != 0) {
         fprintf(stderr, " failed\n   mbedtls_ctr_drbg_seed returned %d\n", ret);
-        goto exit;
+        return ret;
     }
 
     fprintf(stderr, " ok\n");
@@ -427,10 +628,10 @@ send_request(char *client_request, size_t request_len, int mode)
     fprintf(stderr, "Loading the CA root certificate ...");
     fflush(stdout);
 
-    ret = mbedtls_x509_crt_parse_file(&cacert, "../certificates/cert.pem");
+    ret = mbedtls_x509_crt_parse_file(&s->cacert, "../certificates/cert.pem");
     if (ret != 0) {
         fprintf(stderr, " failed\n   mbedtls_x509_crt_parse_file returned %d\n", (unsigned int) - ret);
-        goto exit;
+        return ret;
     }
 
     fprintf(stderr, " ok (%d skipped)\n", ret);
@@ -441,12 +642,16 @@ send_request(char *client_request, size_t request_len, int mode)
     fprintf(stderr, "Connecting to tcp/%s/%s...", SERVER_NAME, SERVER_PORT);
     fflush(stdout);
 
-    if ((ret = mbedtls_net_connect(&server_fd, SERVER_NAME,
+    if ((ret = mbedtls_net_connect(&s->server_fd, SERVER_NAME,
                                    SERVER_PORT, MBEDTLS_NET_PROTO_TCP)) != 0) {
         fprintf(stderr, " failed\n   mbedtls_net_connect returned %d\n", ret);
-        goto exit;
+        return ret;
     }
 
+    // Requests follow each other on the session, their length must not wait for an ACK
+    int nodelay = 1;
+    setsockopt(s->server_fd.fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+
     fprintf(stderr, " ok\n");
 
     /*
@@ -455,59 +660,70 @@ send_request(char *client_request, size_t request_len, int mode)
     fprintf(stderr, "Setting up the SSL/TLS structure...");
     fflush(stdout);
 
-    if ((ret = mbedtls_ssl_config_defaults(&conf,
+    if ((ret = mbedtls_ssl_config_defaults(&s->conf,
                                            MBEDTLS_SSL_IS_CLIENT,
                                            MBEDTLS_SSL_TRANSPORT_STREAM,
                                            MBEDTLS_SSL_PRESET_DEFAULT)) != 0) {
         fprintf(stderr, " failed\n   mbedtls_ssl_config_defaults returned %d\n", ret);
-        goto exit;
+        return ret;
     }
 
     fprintf(stderr, " ok\n");
 
     /* OPTIONAL is not optimal for security,
      * but makes interop easier in this simplified example */
-    mbedtls_ssl_conf_authmode(&conf, MBEDTLS_SSL_VERIFY_OPTIONAL);
-    mbedtls_ssl_conf_ca_chain(&conf, &cacert, NULL);
-    mbedtls_ssl_conf_rng(&conf, mbedtls_ctr_drbg_random, &ctr_drbg);
-    mbedtls_ssl_conf_dbg(&conf, ssl_debug, stdout);
+    mbedtls_ssl_conf_authmode(&s->conf, MBEDTLS_SSL_VERIFY_OPTIONAL);
+    mbedtls_ssl_conf_ca_chain(&s->conf, &s->cacert, NULL);
+    mbedtls_ssl_conf_rng(&s->conf, mbedtls_ctr_drbg_random, &s->ctr_drbg);
+    mbedtls_ssl_conf_dbg(&s->conf, ssl_debug, stdout);
+#if defined(MBEDTLS_SSL_SESSION_TICKETS)
+    mbedtls_ssl_conf_session_tickets(&s->conf, MBEDTLS_SSL_SESSION_TICKETS_ENABLED);
+#endif
 
-    if ((ret = mbedtls_ssl_setup(&ssl, &conf)) != 0) {
+    if ((ret = mbedtls_ssl_setup(&s->ssl, &s->conf)) != 0) {
         fprintf(stderr, " failed\n   mbedtls_ssl_setup returned %d\n", ret);
-        goto exit;
+        return ret;
     }
 
-    if ((ret = mbedtls_ssl_set_hostname(&ssl, SERVER_NAME)) != 0) {
+    if ((ret = mbedtls_ssl_set_hostname(&s->ssl, SERVER_NAME)) != 0) {
         fprintf(stderr, " failed\n  ! mbedtls_ssl_set_hostname returned %d\n", ret);
-        goto exit;
+        return ret;
     }
 
-    mbedtls_ssl_set_bio(&ssl, &server_fd, mbedtls_net_send, mbedtls_net_recv, NULL);
+    mbedtls_ssl_set_bio(&s->ssl, &s->server_fd, mbedtls_net_send, mbedtls_net_recv, NULL);
+
+    bool offered = session_file && load_session(s) == 0;
 
     /*
      * 4. Handshake
      */
+    struct timeval t1, t2;
     fprintf(stderr, "Performing the SSL/TLS handshake...");
     fflush(stdout);
 
-    while ((ret = mbedtls_ssl_handshake(&ssl)) != 0) {
-        goto exit;
+    gettimeofday(&t1, NULL);
+    while ((ret = mbedtls_ssl_handshake(&s->ssl)) != 0) {
         if (ret != MBEDTLS_ERR_SSL_WANT_READ && ret != MBEDTLS_ERR_SSL_WANT_WRITE) {
             fprintf(stderr, " failed\n   mbedtls_ssl_handshake returned -0x%x\n",
                            (unsigned int) -ret);
-            goto exit;
+            return ret;
         }
     }
+    gettimeofday(&t2, NULL);
 
     fprintf(stderr, " ok\n");
 
+    double elapsed_time = (t2.tv_sec - t1.tv_sec) * 1000.0;
+    elapsed_time += (t2.tv_usec - t1.tv_usec) / 1000.0;
+    fprintf(stderr, "Handshake time: %f ms (%s)\n", elapsed_time, offered ? "resumption offered" : "full");
+
     /*
      * 5. Verify the server certificate
      */
     fprintf(stderr, "Verifying peer X.509 certificate...");
 
     /* In real life, we probably want to bail out when ret != 0 */
-    if ((flags = mbedtls_ssl_get_verify_result(&ssl)) != 0) {
+    if ((flags = mbedtls_ssl_get_verify_result(&s->ssl)) != 0) {
 #if !defined(MBEDTLS_X509_REMOVE_INFO)
         char vrfy_buf[512];
 #endif
@@ -520,11 +736,145 @@ send_request(char *client_request, size_t request_len, int mode)
         fprintf(stderr, "%s\n", vrfy_buf);
 #endif
 
-        goto exit;
+        return 1;
 
     } else {
         fprintf(stderr, " ok\n");
     }
+    return 0;
+}
+
+// Reads exactly len bytes of the session. Returns len, 0 if the server closed
+// the session first or the mbedtls error.
+static int
+read_exactly(tls_session *s, unsigned char *buf, size_t len)
+{
+    size_t bytes_read = 0;
+    int ret;
+
+    while (bytes_read < len) {
+        ret = mbedtls_ssl_read(&s->ssl, buf + bytes_read, len - bytes_read);
+        if (ret == MBEDTLS_ERR_SSL_WANT_READ || ret == MBEDTLS_ERR_SSL_WANT_WRITE) continue;
+        if (ret == MBEDTLS_ERR_SSL_PEER_CLOSE_NOTIFY || ret == 0) return 0;
+        if (ret < 0) return ret;
+        bytes_read += ret;
+    }
+    return (int)len;
+}
+
+// Appends to the text of a response, the text is cut at text_size
+static void
+append_text(char *text, size_t text_size, size_t *position, const char *format, ...)
+{
+    if (*position >= text_size - 1) return;
+
+    va_list args;
+    va_start(args, format);
+    int n = vsnprintf(text + *position, text_size - *position, format, args);
+    va_end(args);
+    if (n > 0) *position += (size_t)n < text_size - *position ? (size_t)n : text_size - 1 - *position;
+}
+
+// Reads the version 2 response to request_id and writes it to text the way
+// the legacy server words it: the result, then a space and the hex of every
+// tag; the top-k follows as category (score) pairs and every tensor as its
+// datum type, shape and first values. *failed, if set, tells whether the
+// response has the error flag. Returns the size of the message, 0 if the
+// server closed the session or the mbedtls error.
+static int
+read_wire_response(tls_session *s, uint32_t request_id, char *text, size_t text_size, bool *failed)
+{
+    unsigned char buf[WIRE_HEADER_BYTES];
+    wire_header header;
+    int ret;
+
+    if ((ret = read_exactly(s, buf, WIRE_HEADER_BYTES)) <= 0) return ret;
+    if (wire_decode_header(buf, WIRE_HEADER_BYTES, &header) != 0 || !(header.flags & WIRE_FLAG_RESPONSE) ||
+        header.request_id != request_id) {
+        fprintf(stderr, "failed\n   unexpected response header\n");
+        return MBEDTLS_ERR_SSL_BAD_INPUT_DATA;
+    }
+
+    unsigned char *body = (unsigned char *)malloc(header.body_length + 1);
+    if (!body) {
+        fprintf(stderr, "Memory allocation failed for the response\n");
+        return MBEDTLS_ERR_SSL_ALLOC_FAILED;
+    }
+    if (header.body_length > 0 && (ret = read_exactly(s, body, header.body_length)) <= 0) {
+        free(body);
+        return ret;
+    }
+
+    wire_section section;
+    wire_tensor tensor;
+    size_t offset = 0, position = 0;
+    text[0] = '\0';
+    if (failed) *failed = (header.flags & WIRE_FLAG_ERROR) != 0;
+    while (wire_next_section(body, header.body_length, &offset, &section) == 1) {
+        switch (section.type) {
+        case WIRE_SECTION_RESULT:
+        case WIRE_SECTION_ERROR:
+            append_text(text, text_size, &position, "%.*s", (int)section.length, (const char *)section.data);
+            break;
+        case WIRE_SECTION_TAG:
+            append_text(text, text_size, &position, " ");
+            for (uint32_t i = 0; i < section.length; i++) {
+                append_text(text, text_size, &position, "%02x", section.data[i]);
+            }
+            break;
+        case WIRE_SECTION_TOP_K:
+            append_text(text, text_size, &position, "\nTop-%d:", wire_top_k_count(&section));
+            for (int i = 0; i < wire_top_k_count(&section); i++) {
+                int32_t category;
+                float score;
+                wire_top_k_entry(&section, i, &category, &score);
+                append_text(text, text_size, &position, " %d (%f)", category, score);
+            }
+            break;
+        case WIRE_SECTION_TENSOR:
+            if (wire_read_tensor(&section, &tensor) != 0) {
+                append_text(text, text_size, &position, "\nMalformed tensor of %u bytes", section.length);
+                break;
+            }
+            append_text(text, text_size, &position, "\nTensor of datum type %u, shape ", tensor.datum_type);
+            for (uint32_t i = 0; i < tensor.rank; i++) {
+                append_text(text, text_size, &position, "%s%lu", i > 0 ? "x" : "", (unsigned long)tensor.shape[i]);
+            }
+            append_text(text, text_size, &position, ", %lu bytes", (unsigned long)tensor.size);
+            // The first values of a float tensor, the dump stays readable
+            if (tensor.datum_type == DATUM_TYPE_F32) {
+                append_text(text, text_size, &position, ":");
+                for (size_t i = 0; i < tensor.size / sizeof(float) && i < 8; i++) {
+                    float value;
+                    memcpy(&value, tensor.data + i * sizeof(float), sizeof(float));
+                    append_text(text, text_size, &position, " %f", value);
+                }
+                if (tensor.size / sizeof(float) > 8) append_text(text, text_size, &position, " ...");
+            }
+            break;
+        default:
+            break;
+        }
+    }
+    free(body);
+    return WIRE_HEADER_BYTES + (int)header.body_length;
+}
+
+// Writes one request and reads its response; a legacy request is preceded by
+// its length as a record of its own. The server keeps the session open
+// between requests. Returns 0 or the mbedtls error.
+int
+exchange_request(tls_session *s, char *client_request, size_t request_len, int mode)
+{
+    static uint32_t next_request_id = 1;
+    struct timeval t1, t2;
+    double elapsed_time;
+
+    int request_size = snprintf(NULL, 0, "%ld", request_len);
+    char data_size_str[request_size + 1];
+    snprintf(data_size_str, request_size + 1, "%ld", request_len);
+    int ret = 1, len;
+    uint32_t request_id = 0;
 
     /*
      * 3. Write the GET request
@@ -535,24 +885,35 @@ send_request(char *client_request, size_t request_len, int mode)
     fflush(stdout);
     
     gettimeofday(&t1, NULL);
+
+    if (!legacy_protocol) {
+        // Every request of the session gets its own id, the response echoes it
+        wire_header header;
+        wire_decode_header((unsigned char *)client_request, request_len, &header);
+        header.request_id = request_id = next_request_id++;
+        wire_encode_header(&header, (unsigned char *)client_request);
+        request_size = -1;
+    }
     
     while ((int)total_written < (request_size + 1)) {
-        ret = mbedtls_ssl_write(&ssl, (unsigned char *)(data_size_str + total_written), request_size + 1 - total_written);
-        if (ret != MBEDTLS_ERR_SSL_WANT_READ && ret != MBEDTLS_ERR_SSL_WANT_WRITE && ret < 0) {
+        ret = mbedtls_ssl_write(&s->ssl, (unsigned char *)(data_size_str + total_written), request_size + 1 - total_written);
+        if (ret == MBEDTLS_ERR_SSL_WANT_READ || ret == MBEDTLS_ERR_SSL_WANT_WRITE) continue;
+        if (ret < 0) {
             fprintf(stderr, " failed\n   mbedtls_ssl_write returned %d\n", ret);
-            goto exit;
+            return ret;
         }
         total_written += ret;
     }
 
-    fprintf(stderr, " %ld bytes\nLength: %s\n", total_written, data_size_str);
+    if (legacy_protocol) fprintf(stderr, " %ld bytes\nLength: %s\n", total_written, data_size_str);
 
     total_written = 0;
     while (total_written < request_len) {
-        ret = mbedtls_ssl_write(&ssl, (unsigned char *)(client_request + total_written), request_len - total_written);
-        if (ret != MBEDTLS_ERR_SSL_WANT_READ && ret != MBEDTLS_ERR_SSL_WANT_WRITE && ret < 0) {
+        ret = mbedtls_ssl_write(&s->ssl, (unsigned char *)(client_request + total_written), request_len - total_written);
+        if (ret == MBEDTLS_ERR_SSL_WANT_READ || ret == MBEDTLS_ERR_SSL_WANT_WRITE) continue;
+        if (ret < 0) {
             fprintf(stderr, " failed\n   mbedtls_ssl_write returned %d\n", ret);
-            goto exit;
+            return ret;
         }
         total_written += ret;
     }
@@ -565,34 +926,27 @@ send_request(char *client_request, size_t request_len, int mode)
     fprintf(stderr, "Read from server:");
     fflush(stdout);
 
-    do {
-        len = BUF_SIZE - 1;
-        memset(input, 0, BUF_SIZE);
-        ret = mbedtls_ssl_read(&ssl, input, len);
-        
-        if (ret == MBEDTLS_ERR_SSL_WANT_READ || ret == MBEDTLS_ERR_SSL_WANT_WRITE) {
-            fprintf(stderr, "continue\n");
-            continue;
-        }
-
-        if (ret == MBEDTLS_ERR_SSL_PEER_CLOSE_NOTIFY) {
-            fprintf(stderr, " Connection was closed gracefully\n");
-            break;
-        }
-
-        if (ret < 0) {
-            fprintf(stderr, "failed\n   mbedtls_ssl_read returned %d\n", ret);
-            break;
-        }
-
-        if (ret == 0) {
-            fprintf(stderr, "\n\nEOF\n\n");
-            break;
-        }
+    if (!legacy_protocol) {
+        ret = read_wire_response(s, request_id, (char *)input, BUF_SIZE, NULL);
+    } else {
+        do {
+            len = BUF_SIZE - 1;
+            memset(input, 0, BUF_SIZE);
+            ret = mbedtls_ssl_read(&s->ssl, input, len);
+        } while (ret == MBEDTLS_ERR_SSL_WANT_READ || ret == MBEDTLS_ERR_SSL_WANT_WRITE);
+    }
 
+    if (ret == MBEDTLS_ERR_SSL_PEER_CLOSE_NOTIFY) {
+        fprintf(stderr, " Connection was closed gracefully\n");
+    } else if (ret < 0) {
+        fprintf(stderr, "failed\n   mbedtls_ssl_read returned %d\n", ret);
+        return ret;
+    } else if (ret == 0) {
+        fprintf(stderr, "\n\nEOF\n\n");
+    } else {
         len = ret;
         fprintf(stderr, " %d bytes \nMessage from server: %s\n", len, input);
-    } while (1);
+    }
 
     gettimeofday(&t2, NULL);
     elapsed_time = (t2.tv_sec - t1.tv_sec) * 1000.0;
@@ -628,7 +982,7 @@ send_request(char *client_request, size_t request_len, int mode)
 
     if (!fd) {
         fprintf(stderr, "Error opening inference_time!\n");
-        return;
+        return 0;
     }
 
 #if USE_SYS_TIME_OPERATORS == 0
@@ -644,32 +998,38 @@ send_request(char *client_request, size_t request_len, int mode)
 #endif
     fclose(fd);
     }
+    return 0;
+}
 
-    mbedtls_ssl_close_notify(&ssl);
-
-    exit_code = MBEDTLS_EXIT_SUCCESS;
+// Sends the request num_requests times over one session, the handshake is
+// paid once
+void
+send_request(char *client_request, size_t request_len, int mode, int num_requests)
+{
+    tls_session s;
+    struct timeval t1, t2;
+    int ret = open_session(&s);
 
-exit:
+    if (ret != 0) {
+        close_session(&s, ret, true);
+        return;
+    }
+    if (session_file) save_session(&s);
 
-#ifdef MBEDTLS_ERROR_C
-    if (exit_code != MBEDTLS_EXIT_SUCCESS) {
-        char error_buf[100];
-        mbedtls_strerror(ret, error_buf, 100);
-        fprintf(stderr, "Last error was: %d - %s\n\n", ret, error_buf);
+    gettimeofday(&t1, NULL);
+    int sent = 0;
+    for (; sent < num_requests; sent++) {
+        if ((ret = exchange_request(&s, client_request, request_len, mode)) != 0) break;
     }
-#endif
+    gettimeofday(&t2, NULL);
 
-    mbedtls_net_free(&server_fd);
-    mbedtls_x509_crt_free(&cacert);
-    mbedtls_ssl_free(&ssl);
-    mbedtls_ssl_config_free(&conf);
-    mbedtls_ctr_drbg_free(&ctr_drbg);
-    mbedtls_entropy_free(&entropy);
-#if defined(MBEDTLS_USE_PSA_CRYPTO)
-    mbedtls_psa_crypto_free();
-#endif /* MBEDTLS_USE_PSA_CRYPTO */
+    if (num_requests > 1) {
+        double elapsed_time = (t2.tv_sec - t1.tv_sec) * 1000.0;
+        elapsed_time += (t2.tv_usec - t1.tv_usec) / 1000.0;
+        fprintf(stderr, "Session: %d requests, %f ms/request\n", sent, sent ? elapsed_time / sent : 0.0);
+    }
 
-    if (exit_code != MBEDTLS_EXIT_SUCCESS) return;
+    close_session(&s, ret, ret != 0);
 }
 
 int
@@ -811,10 +1171,8 @@ send_models(char **input_files, struct dirent **namelist, const char *dir_path,
     req_original.tokenizer_size = 0;
     req_original.tokenizer = NULL;
 
-    size_t bufLen = calculate_buffer_size(&req_original);
-
-    char *buffer = serialize_client_request(&req_original, bufLen);
-    buffer[bufLen] = '\0';
+    size_t bufLen;
+    char *buffer = serialize_request(&req_original, &bufLen);
 
         FILE *fd = NULL;
 #ifdef USE_OCCLUM
@@ -855,14 +1213,270 @@ send_models(char **input_files, struct dirent **namelist, const char *dir_path,
 #endif
     fclose(fd);
 
-    send_request(buffer, bufLen, 0);
+    send_request(buffer, bufLen, 0, 1);
     
     free_request(&req_original);
     free(buffer);
 }
 
+/* LOAD GENERATOR */
+typedef struct load_run {
+    pthread_barrier_t ready;    // every session is open, the clock starts
+    double start;
+    double end;                 // no request is issued from then on
+} load_run;
+
+typedef struct load_connection {
+    load_run *run;
+    const char *request;        // version 2 message, stamped with its id per send
+    size_t request_len;
+    int inflight;
+    double rate;                // requests per ms of this connection, 0 for closed loop
+    unsigned int seed;
+    double *latencies;          // ms of every answered request
+    size_t num_latencies;
+    size_t capacity;
+    long sent;
+    long unsent;                // arrivals the window held back until the end
+    long errors;
+    double finished;
+    bool broken;
+} load_connection;
+
+static double
+now_ms(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1000.0 + t.tv_nsec / 1e6;
+}
+
+// Time to the next arrival of a Poisson process of the given rate
+static double
+next_interval(unsigned int *seed, double rate)
+{
+    double u = rand_r(seed) / ((double)RAND_MAX + 1.0);
+    return -log(1.0 - u) / rate;
+}
+
+static int
+send_load_request(tls_session *s, char *message, size_t len, uint32_t request_id)
+{
+    wire_header header;
+    size_t written = 0;
+    int ret;
+
+    wire_decode_header((unsigned char *)message, len, &header);
+    header.request_id = request_id;
+    wire_encode_header(&header, (unsigned char *)message);
+
+    while (written < len) {
+        ret = mbedtls_ssl_write(&s->ssl, (unsigned char *)message + written, len - written);
+        if (ret == MBEDTLS_ERR_SSL_WANT_READ || ret == MBEDTLS_ERR_SSL_WANT_WRITE) continue;
+        if (ret < 0) return ret;
+        written += ret;
+    }
+    return 0;
+}
+
+static void
+record_latency(load_connection *c, double latency)
+{
+    if (c->num_latencies == c->capacity) {
+        size_t capacity = c->capacity ? c->capacity * 2 : 1024;
+        double *latencies = (double *)realloc(c->latencies, capacity * sizeof(double));
+        if (!latencies) {
+            c->errors++;
+            return;
+        }
+        c->latencies = latencies;
+        c->capacity = capacity;
+    }
+    c->latencies[c->num_latencies++] = latency;
+}
+
+// One connection of the load. The server answers a session in order, so the
+// requests in flight are a FIFO of their issue times. In open loop a request
+// is timed from its arrival, not from when the window let it out, so a slow
+// server is charged for the backlog it causes; nothing is issued past the
+// end, arrivals still held back then are counted as unsent.
+static void *
+load_thread(void *arg)
+{
+    load_connection *c = (load_connection *)arg;
+    tls_session s;
+    int ret = open_session(&s);
+
+    c->broken = ret != 0;
+    pthread_barrier_wait(&c->run->ready);
+    pthread_barrier_wait(&c->run->ready);
+    if (c->broken) {
+        close_session(&s, ret, true);
+        return NULL;
+    }
+
+    char *message = (char *)malloc(c->request_len);
+    double *issued = (double *)malloc(c->inflight * sizeof(double));
+    char text[BUF_SIZE];
+    assert(message && issued);
+    memcpy(message, c->request, c->request_len);
+
+    uint32_t next_id = 1, oldest_id = 1;
+    int head = 0, outstanding = 0;
+    double end = c->run->end;
+    double next_arrival = c->run->start;
+    if (c->rate > 0) next_arrival += next_interval(&c->seed, c->rate);
+
+    while (true) {
+        double now = now_ms();
+        while (outstanding < c->inflight && now < end && (c->rate == 0 || next_arrival <= now)) {
+            if ((ret = send_load_request(&s, message, c->request_len, next_id++)) != 0) break;
+            issued[(head + outstanding) % c->inflight] = c->rate > 0 ? next_arrival : now;
+            outstanding++;
+            c->sent++;
+            if (c->rate > 0) next_arrival += next_interval(&c->seed, c->rate);
+        }
+        if (ret != 0) break;
+
+        bool arrivals = c->rate > 0 && now < end && next_arrival < end;
+        if (outstanding == 0) {
+            if (!arrivals) break;
+            if (next_arrival > now) usleep((useconds_t)((next_arrival - now) * 1000));
+            continue;
+        }
+
+        // With room in the window, wait for an answer only until the next arrival
+        if (arrivals && outstanding < c->inflight && !mbedtls_ssl_check_pending(&s.ssl)) {
+            int timeout = (int)ceil(next_arrival - now);
+            if (timeout <= 0) continue;
+            if ((ret = mbedtls_net_poll(&s.server_fd, MBEDTLS_NET_POLL_READ, timeout)) == 0) continue;
+            if (ret < 0) break;
+        }
+
+        // Answers that are not an inference count as errors, like in the drivers
+        bool failed = false;
+        if ((ret = read_wire_response(&s, oldest_id++, text, sizeof(text), &failed)) <= 0) {
+            if (ret == 0) ret = MBEDTLS_ERR_NET_CONN_RESET;
+            break;
+        }
+        ret = 0;
+        if (failed || strstr(text, "Inference:") == NULL) {
+            c->errors++;
+        } else {
+            record_latency(c, now_ms() - issued[head]);
+        }
+        head = (head + 1) % c->inflight;
+        outstanding--;
+    }
+
+    c->finished = now_ms();
+    c->broken = ret != 0;
+    while (c->rate > 0 && next_arrival < end) {
+        c->unsent++;
+        next_arrival += next_interval(&c->seed, c->rate);
+    }
+    close_session(&s, ret, c->broken);
+    free(issued);
+    free(message);
+    return NULL;
+}
+
+static int
+compare_latencies(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+// Nearest-rank percentile of sorted latencies
+static double
+percentile(const double *sorted, size_t n, double p)
+{
+    if (n == 0) return 0.0;
+    size_t rank = (size_t)ceil(p / 100.0 * n);
+    return sorted[rank > 0 ? rank - 1 : 0];
+}
+
+// Runs the load and prints its throughput and latency percentiles as JSON on stdout
+static void
+run_load(const char *client_request, size_t request_len)
+{
+    int connections = load.connections;
+    int concurrency = load.concurrency > 0 ? load.concurrency : connections * load.inflight;
+    if (load.rate == 0 && connections > concurrency) connections = concurrency;
+
+    load_run run;
+    load_connection *c = (load_connection *)calloc(connections, sizeof(load_connection));
+    pthread_t *threads = (pthread_t *)malloc(connections * sizeof(pthread_t));
+    assert(c && threads);
+    pthread_barrier_init(&run.ready, NULL, connections + 1);
+
+    for (int i = 0; i < connections; i++) {
+        c[i].run = &run;
+        c[i].request = client_request;
+        c[i].request_len = request_len;
+        // Closed loop: the concurrency is spread over the connections
+        c[i].inflight = load.rate > 0 ? load.inflight : concurrency / connections + (i < concurrency % connections);
+        c[i].rate = load.rate / connections / 1000.0;
+        c[i].seed = (unsigned int)time(NULL) ^ (unsigned int)(i * 2654435761u);
+        pthread_create(&threads[i], NULL, load_thread, &c[i]);
+    }
+
+    // The sessions are open, the handshakes are not part of the measurement
+    pthread_barrier_wait(&run.ready);
+    run.start = now_ms();
+    run.end = run.start + load.duration * 1000.0;
+    pthread_barrier_wait(&run.ready);
+
+    size_t total = 0;
+    long sent = 0, unsent = 0, errors = 0;
+    int broken = 0;
+    double finished = run.start;
+    for (int i = 0; i < connections; i++) {
+        pthread_join(threads[i], NULL);
+        total += c[i].num_latencies;
+        sent += c[i].sent;
+        unsent += c[i].unsent;
+        errors += c[i].errors;
+        broken += c[i].broken;
+        if (c[i].finished > finished) finished = c[i].finished;
+    }
+    pthread_barrier_destroy(&run.ready);
+
+    double *latencies = (double *)malloc((total + 1) * sizeof(double));
+    assert(latencies);
+    double sum = 0.0;
+    size_t n = 0;
+    for (int i = 0; i < connections; i++) {
+        for (size_t j = 0; j < c[i].num_latencies; j++) {
+            sum += c[i].latencies[j];
+            latencies[n++] = c[i].latencies[j];
+        }
+        free(c[i].latencies);
+    }
+    qsort(latencies, n, sizeof(double), compare_latencies);
+
+    double elapsed = (finished - run.start) / 1000.0;
+    printf("{\"loop\": \"%s\", \"connections\": %d, ", load.rate > 0 ? "open" : "closed", connections);
+    if (load.rate > 0) {
+        printf("\"inflight\": %d, \"target_rate\": %.3f, \"unsent\": %ld, ", load.inflight, load.rate, unsent);
+    } else {
+        printf("\"concurrency\": %d, ", concurrency);
+    }
+    printf("\"duration_s\": %.3f, \"elapsed_s\": %.3f, \"sent\": %ld, \"completed\": %zu, \"errors\": %ld, \"broken_connections\": %d, "
+           "\"throughput_rps\": %.3f, \"latency_ms\": {\"mean\": %.3f, \"p50\": %.3f, \"p90\": %.3f, \"p99\": %.3f, \"p99.9\": %.3f, \"max\": %.3f}}\n",
+           load.duration, elapsed, sent, n, errors, broken, elapsed > 0 ? n / elapsed : 0.0, n ? sum / n : 0.0,
+           percentile(latencies, n, 50), percentile(latencies, n, 90), percentile(latencies, n, 99),
+           percentile(latencies, n, 99.9), n ? latencies[n - 1] : 0.0);
+    fflush(stdout);
+
+    free(latencies);
+    free(threads);
+    free(c);
+}
+
 void
-send_inputs(char **input_names, int id, unsigned char **tags, int size_tags)
+send_inputs(char **input_names, int id, unsigned char **tags, int size_tags, int num_requests)
 {
     fprintf(stderr, "size_tags: %d\n", size_tags);
     request req_original;
@@ -954,12 +1568,14 @@ send_inputs(char **input_names, int id, unsigned char **tags, int size_tags)
         }
     }
     
-    size_t bufLen = calculate_buffer_size(&req_original);
-
-    char *buffer = serialize_client_request(&req_original, bufLen);
-    buffer[bufLen] = '\0';
+    size_t bufLen;
+    char *buffer = serialize_request(&req_original, &bufLen);
     
-    send_request(buffer, bufLen, 1);
+    if (load_mode) {
+        run_load(buffer, bufLen);
+    } else {
+        send_request(buffer, bufLen, 1, num_requests);
+    }
     
     free_request(&req_original);
     free(buffer);
@@ -981,10 +1597,10 @@ send_quit()
     req_original.tags = NULL;
     req_original.tokenizer = NULL;
     req_original.tokenizer_size = 0;
-    size_t bufLen = calculate_buffer_size(&req_original);
-    char *buffer = serialize_client_request(&req_original, bufLen);
+    size_t bufLen;
+    char *buffer = serialize_request(&req_original, &bufLen);
     fprintf(stderr, "%ld", bufLen);
-    send_request(buffer, bufLen, 2);
+    send_request(buffer, bufLen, 2, 1);
     free_request(&req_original);
     free(buffer);
 }
@@ -1076,11 +1692,309 @@ version_sort(const struct dirent **a, const struct dirent **b)
     return custom_strverscmp((*a)->d_name, (*b)->d_name);
 }
 
+/* LOCAL MODELS */
+// Partitions staged on the server's host are registered by path; the body
+// carries the paths and the SHA-256 and file name of every partition
+typedef struct local_request {
+    char **paths;
+    int num_paths;
+    unsigned char **digests;    // digest | file name, the payload of a digest section
+    uint32_t *digest_lengths;
+    int num_digests;
+} local_request;
+
+static int
+add_digest(local_request *r, const unsigned char *digest, const char *file_name)
+{
+    size_t length = WIRE_DIGEST_BYTES + strlen(file_name);
+    unsigned char *payload = (unsigned char *)malloc(length);
+    unsigned char **digests = (unsigned char **)realloc(r->digests, (r->num_digests + 1) * sizeof(unsigned char *));
+    if (digests) r->digests = digests;
+    uint32_t *lengths = (uint32_t *)realloc(r->digest_lengths, (r->num_digests + 1) * sizeof(uint32_t));
+    if (lengths) r->digest_lengths = lengths;
+    if (!payload || !digests || !lengths) {
+        fprintf(stderr, "Memory allocation failed for the digests\n");
+        free(payload);
+        return -1;
+    }
+
+    memcpy(payload, digest, WIRE_DIGEST_BYTES);
+    memcpy(payload + WIRE_DIGEST_BYTES, file_name, length - WIRE_DIGEST_BYTES);
+    r->digests[r->num_digests] = payload;
+    r->digest_lengths[r->num_digests++] = (uint32_t)length;
+    return 0;
+}
+
+static int
+hash_file(const char *path, unsigned char *digest)
+{
+    mbedtls_sha256_context sha;
+    unsigned char buf[BUF_SIZE * 16];
+    size_t n;
+
+    FILE *fd = fopen(path, "rb");
+    if (!fd) {
+        fprintf(stderr, "Error opening file %s\n", path);
+        return -1;
+    }
+    mbedtls_sha256_init(&sha);
+    int ret = mbedtls_sha256_starts(&sha, 0);
+    while (ret == 0 && (n = fread(buf, 1, sizeof(buf), fd)) > 0) {
+        ret = mbedtls_sha256_update(&sha, buf, n);
+    }
+    if (ret == 0 && ferror(fd)) ret = -1;
+    if (ret == 0) ret = mbedtls_sha256_finish(&sha, digest);
+    mbedtls_sha256_free(&sha);
+    fclose(fd);
+    if (ret != 0) fprintf(stderr, "Error hashing %s\n", path);
+    return ret;
+}
+
+// Hashes a partition, or every partition of a directory the way the server
+// lists it: regular files, without the compiled partitions it keeps next to
+// partitions registered in place
+static int
+hash_local_path(local_request *r, const char *path)
+{
+    unsigned char digest[WIRE_DIGEST_BYTES];
+    struct stat st;
+
+    if (stat(path, &st) != 0) {
+        perror(path);
+        return -1;
+    }
+    if (!S_ISDIR(st.st_mode)) {
+        const char *slash = strrchr(path, '/');
+        if (hash_file(path, digest) != 0) return -1;
+        return add_digest(r, digest, slash ? slash + 1 : path);
+    }
+
+    struct dirent **namelist;
+    int num_files = scandir(path, &namelist, NULL, version_sort);
+    if (num_files == -1) {
+        perror("scandir");
+        return -1;
+    }
+
+    int ret = 0;
+    for (int i = 0; i < num_files; i++) {
+        const char *name = namelist[i]->d_name;
+        size_t length = strlen(name);
+        char full_path[1024];
+        snprintf(full_path, sizeof(full_path), "%s/%s", path, name);
+
+        if (ret == 0 && !(length > 9 && strcmp(name + length - 9, ".nnef.tar") == 0) &&
+            stat(full_path, &st) == 0 && S_ISREG(st.st_mode)) {
+            if (hash_file(full_path, digest) != 0 || add_digest(r, digest, name) != 0) ret = -1;
+        }
+        free(namelist[i]);
+    }
+    free(namelist);
+    return ret;
+}
+
+// Lines of sha256sum: the hex digest, a space, a space or '*' and the path
+static int
+read_digest_file(local_request *r, const char *filename)
+{
+    FILE *fd = fopen(filename, "r");
+    if (!fd) {
+        fprintf(stderr, "Error opening file %s\n", filename);
+        return -1;
+    }
+
+    int ret = 0;
+    char *line = NULL;
+    size_t len = 0;
+    while (ret == 0 && getline(&line, &len, fd) != -1) {
+        line[strcspn(line, "\r\n")] = 0;
+        if (line[0] == '\0') continue;
+
+        unsigned char digest[WIRE_DIGEST_BYTES];
+        size_t length = strlen(line);
+        bool valid = length > WIRE_DIGEST_BYTES * 2 + 2 && line[WIRE_DIGEST_BYTES * 2] == ' ' &&
+                     (line[WIRE_DIGEST_BYTES * 2 + 1] == ' ' || line[WIRE_DIGEST_BYTES * 2 + 1] == '*');
+        for (int i = 0; valid && i < WIRE_DIGEST_BYTES; i++) {
+            valid = isxdigit((unsigned char)line[2 * i]) && isxdigit((unsigned char)line[2 * i + 1]) &&
+                    sscanf(line + 2 * i, "%2hhx", &digest[i]) == 1;
+        }
+        if (!valid) {
+            fprintf(stderr, "Invalid digest line in %s: %s\n", filename, line);
+            ret = -1;
+            break;
+        }
+
+        const char *path = line + WIRE_DIGEST_BYTES * 2 + 2;
+        const char *slash = strrchr(path, '/');
+        ret = add_digest(r, digest, slash ? slash + 1 : path);
+    }
+    free(line);
+    fclose(fd);
+
+    if (ret == 0 && r->num_digests == 0) {
+        fprintf(stderr, "%s holds no digests\n", filename);
+        ret = -1;
+    }
+    return ret;
+}
+
+void
+send_local_model(char **paths, int num_paths)
+{
+    local_request r = {paths, num_paths, NULL, NULL, 0};
+    char **resolved = NULL;
+    int ret = 0;
+
+    if (digest_file) {
+        ret = read_digest_file(&r, digest_file);
+    } else {
+        // The client shares the host: the files it hashes are the ones the
+        // server is sent, by absolute path, relative ones would be taken from
+        // the server's model root
+        resolved = (char **)calloc(num_paths, sizeof(char *));
+        assert(resolved);
+        for (int i = 0; ret == 0 && i < num_paths; i++) {
+            resolved[i] = realpath(paths[i], NULL);
+            if (!resolved[i]) {
+                perror(paths[i]);
+                ret = -1;
+                break;
+            }
+            ret = hash_local_path(&r, resolved[i]);
+        }
+        r.paths = resolved;
+    }
+
+    if (ret == 0) {
+        size_t bufLen = WIRE_HEADER_BYTES;
+        for (int i = 0; i < r.num_paths; i++) {
+            bufLen += wire_section_size(strlen(r.paths[i]));
+        }
+        for (int i = 0; i < r.num_digests; i++) {
+            bufLen += wire_section_size(r.digest_lengths[i]);
+        }
+
+        unsigned char *buffer = (unsigned char *)malloc(bufLen);
+        assert(buffer);
+        wire_header header;
+        wire_init_header(&header, WIRE_CMD_MODEL_LOCAL, 0, 0);
+        header.body_length = bufLen - WIRE_HEADER_BYTES;
+        wire_encode_header(&header, buffer);
+
+        unsigned char *out = buffer + WIRE_HEADER_BYTES;
+        for (int i = 0; i < r.num_paths; i++) {
+            out = wire_put_section(out, WIRE_SECTION_LOCAL_PATH, r.paths[i], strlen(r.paths[i]));
+        }
+        for (int i = 0; i < r.num_digests; i++) {
+            out = wire_put_section(out, WIRE_SECTION_DIGEST, r.digests[i], r.digest_lengths[i]);
+        }
+        assert((size_t)(out - buffer) == bufLen);
+
+        fprintf(stderr, "Local model: %d paths, %d digests\n", r.num_paths, r.num_digests);
+        send_request((char *)buffer, bufLen, 0, 1);
+        free(buffer);
+    }
+
+    for (int i = 0; resolved && i < num_paths; i++) {
+        free(resolved[i]);
+    }
+    free(resolved);
+    for (int i = 0; i < r.num_digests; i++) {
+        free(r.digests[i]);
+    }
+    free(r.digests);
+    free(r.digest_lengths);
+}
+
 int
 main(int argc, char *argv[]) 
 {
-    if (argc < 2 || (strcmp(argv[1], "models") != 0 && strcmp(argv[1], "inputs") != 0 && strcmp(argv[1], "quit") != 0)) {
-        fprintf(stderr, "Usage: %s 'inputs' <model_id> <tag_file> <model_input#1> ... <model_input#N> OR\n       %s 'models' <model_input#1> ... <model_input#N> <model_path> OR\n       %s 'quit'\n", argv[0], argv[0], argv[0]);
+    // --keep-alive <n>: send the inference request n times over one session
+    // --session <file>: resume the session saved in file, and save the new one there
+    // --legacy: talk the length-prefixed protocol instead of version 2
+    // --top-k <k>: ask for the k best categories and their scores
+    // --raw: ask for the output tensors of the last partition
+    // --connections <n>, --inflight <n>, --rate <requests/s>, --concurrency <n>,
+    // --duration <s>: shape of the load of the 'load' command
+    // --digests <file>: sha256sum output for the partitions of 'local'
+    int num_requests = 1;
+    while (argc > 1 && strncmp(argv[1], "--", 2) == 0) {
+        const char *option = argv[1];
+        if (strcmp(option, "--legacy") == 0 || strcmp(option, "--raw") == 0) {
+            if (strcmp(option, "--legacy") == 0) {
+                legacy_protocol = true;
+            } else {
+                result_mode = WIRE_RESULT_RAW;
+            }
+            argv[1] = argv[0];
+            argv++;
+            argc--;
+            continue;
+        }
+        if (argc < 3) break;
+
+        const char *value = argv[2];
+        char *endptr;
+        long count = strtol(value, &endptr, 10);
+        bool valid_count = *endptr == '\0' && count > 0 && count <= INT_MAX;
+        double real = strtod(value, &endptr);
+        bool valid_real = *endptr == '\0' && real > 0;
+
+        if (strcmp(option, "--session") == 0) {
+            session_file = value;
+        } else if (strcmp(option, "--digests") == 0) {
+            digest_file = value;
+        } else if (strcmp(option, "--keep-alive") == 0 && valid_count) {
+            num_requests = (int) count;
+        } else if (strcmp(option, "--top-k") == 0 && valid_count) {
+            result_mode = WIRE_RESULT_TOP_K;
+            top_k = (uint32_t) count;
+        } else if (strcmp(option, "--connections") == 0 && valid_count) {
+            load.connections = (int) count;
+        } else if (strcmp(option, "--inflight") == 0 && valid_count) {
+            load.inflight = (int) count;
+        } else if (strcmp(option, "--concurrency") == 0 && valid_count) {
+            load.concurrency = (int) count;
+        } else if (strcmp(option, "--rate") == 0 && valid_real) {
+            load.rate = real;
+        } else if (strcmp(option, "--duration") == 0 && valid_real) {
+            load.duration = real;
+        } else {
+            fprintf(stderr, "Invalid option %s %s\n", option, value);
+            return -1;
+        }
+        argv[2] = argv[0];
+        argv += 2;
+        argc -= 2;
+    }
+    if (legacy_protocol && result_mode != WIRE_RESULT_ARGMAX) {
+        fprintf(stderr, "--top-k and --raw need the version 2 protocol\n");
+        return -1;
+    }
+    if (load.rate > 0 && load.concurrency > 0) {
+        fprintf(stderr, "--rate sets an open loop and --concurrency a closed one, not both\n");
+        return -1;
+    }
+
+    if (argc > 1 && strcmp(argv[1], "load") == 0) {
+        if (legacy_protocol) {
+            fprintf(stderr, "The load generator pipelines version 2 requests, --legacy does not apply\n");
+            return -1;
+        }
+        load_mode = true;
+        argv[1] = "inputs";
+    }
+
+    if (argc > 1 && strcmp(argv[1], "local") == 0 && legacy_protocol) {
+        fprintf(stderr, "Registering by path needs the version 2 protocol, --legacy does not apply\n");
+        return -1;
+    }
+
+    if (argc < 2 || (strcmp(argv[1], "models") != 0 && strcmp(argv[1], "local") != 0 && strcmp(argv[1], "inputs") != 0 && strcmp(argv[1], "quit") != 0)) {
+        fprintf(stderr, "Usage: %s [--legacy] [--keep-alive <n>] [--session <file>] [--top-k <k> | --raw] 'inputs' <model_id> <tag_file> <model_input#1> ... <model_input#N> OR\n"
+                        "       %s [--connections <n>] [--inflight <n>] [--rate <requests/s> | --concurrency <n>] [--duration <s>] [--top-k <k> | --raw] 'load' <model_id> <tag_file> <model_input#1> ... <model_input#N> OR\n"
+                        "       %s 'models' <model_input#1> ... <model_input#N> <model_path> OR\n"
+                        "       %s [--digests <file>] 'local' <server_path#1> ... <server_path#N> OR\n       %s 'quit'\n", argv[0], argv[0], argv[0], argv[0], argv[0]);
         return -1;
     }
 
@@ -1108,6 +2022,12 @@ main(int argc, char *argv[])
             free(namelist[i]);
         }
         free(namelist);
+    } else if (strcmp(argv[1], "local") == 0) {
+        if (argc < 3) {
+            fprintf(stderr, "Usage: %s [--digests <file>] 'local' <server_path#1> ... <server_path#N>\n", argv[0]);
+            return -1;
+        }
+        send_local_model(argv + 2, argc - 2);
     } else if (strcmp(argv[1], "inputs") == 0) {
 
         int number = 3;
@@ -1145,7 +2065,7 @@ main(int argc, char *argv[])
         }
 #endif
 
-        send_inputs(argv + number, id, tags, num_tags);
+        send_inputs(argv + number, id, tags, num_tags, num_requests);
          
         if (tags) {
             for (int i = 0; tags[i]; i++) {
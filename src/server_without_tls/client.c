@@ -1,8 +1,16 @@
+#define _GNU_SOURCE     // memfd_create
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+#include <poll.h>
+#include <time.h>
+#include <limits.h>
 #include <arpa/inet.h>
+#include <netinet/tcp.h>
 #include <fcntl.h> 
 #include <unistd.h>
 #include <assert.h>
@@ -19,8 +27,11 @@
 #include <sys/stat.h>
 #include <unistd.h>
 
+#include <shm_ring.h>
+
 #define SERVER_PORT 9997
 #define SERVER_NAME "127.0.0.1"
+#define UDS_PATH "/tmp/inferonnx.sock"
 
 #define BUF_SIZE 4096
 #define TAG_SIZE 16
@@ -40,6 +51,16 @@ typedef struct __attribute__((packed)) {
     uint8_t *tokenizer;
 } request;
 
+typedef enum {
+    TRANSPORT_TCP,
+    TRANSPORT_UDS,
+    TRANSPORT_SHM               // the Unix domain socket plus a shared-memory ring
+} transport_kind;
+
+static const char *transport_names[] = {"tcp", "uds", "shm"};
+static transport_kind transport = TRANSPORT_TCP;
+static int repeat = 0;          // round trips of an inference request timed after the first
+
 /* HELPER FUNCTIONS */
 int
 size_of_file(FILE *fd)
@@ -234,11 +255,10 @@ calculate_buffer_size(const request* req)
     return bytes;
 }
 
-char * 
-serialize_client_request(const request* req, ssize_t buffer_len)
+// Writes the request into buffer, which holds calculate_buffer_size bytes
+static void
+write_client_request(const request* req, char *buffer)
 {
-    char *buffer = (char *)malloc((buffer_len + 1) * sizeof(char));
-    assert(buffer);
     size_t bytes = 0;
 
     // Int field -> command + id + num_models + num_inputs
@@ -311,7 +331,15 @@ serialize_client_request(const request* req, ssize_t buffer_len)
         memcpy(buffer + bytes, req->tokenizer, req->tokenizer_size * sizeof(uint8_t));
         bytes += req->tokenizer_size * sizeof(uint8_t);
     }
+}
 
+char * 
+serialize_client_request(const request* req, ssize_t buffer_len)
+{
+    char *buffer = (char *)malloc((buffer_len + 1) * sizeof(char));
+    assert(buffer);
+    write_client_request(req, buffer);
+    buffer[buffer_len] = '\0';
     return buffer;
 }
 
@@ -350,79 +378,303 @@ free_request(request *req_original)
     }
 }
 
-void
-send_request(char *client_request, ssize_t request_len, int mode)
+/* TRANSPORTS */
+static int
+connect_server()
 {
-    struct timeval t1, t2;
-    double elapsed_time;
-
-    struct sockaddr_in addr;
-    int client_fd, ret = 1;
-    ssize_t bytes_read = 0;
-    char input[BUF_SIZE];
+    int client_fd, ret;
 
     /*
      * 0. Opening a socket
      */
     fprintf(stderr, "Opening a socket...");
-    client_fd = socket(AF_INET, SOCK_STREAM, 0);
+    client_fd = socket(transport == TRANSPORT_TCP ? AF_INET : AF_UNIX, SOCK_STREAM, 0);
     if (client_fd < 0) {
         fprintf(stderr, " failed\n   socket returned %d\n", client_fd);
-        return;
+        return -1;
     }
     fprintf(stderr, " ok\n");
-    
-    addr.sin_family = AF_INET;
-    addr.sin_port = htons(SERVER_PORT);
-    addr.sin_addr.s_addr = inet_addr(SERVER_NAME);
 
     /*
      * 1. Start the connection
      */
-    fprintf(stderr, "Connecting to %s/%d...", SERVER_NAME, SERVER_PORT);
-    if ((ret = connect(client_fd, (struct sockaddr *)&addr, sizeof(addr))) < 0) {
+    if (transport == TRANSPORT_TCP) {
+        struct sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(SERVER_PORT);
+        addr.sin_addr.s_addr = inet_addr(SERVER_NAME);
+
+        fprintf(stderr, "Connecting to %s/%d...", SERVER_NAME, SERVER_PORT);
+        ret = connect(client_fd, (struct sockaddr *)&addr, sizeof(addr));
+
+        int nodelay = 1;
+        setsockopt(client_fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+    } else {
+        struct sockaddr_un addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        strncpy(addr.sun_path, UDS_PATH, sizeof(addr.sun_path) - 1);
+
+        fprintf(stderr, "Connecting to %s...", UDS_PATH);
+        ret = connect(client_fd, (struct sockaddr *)&addr, sizeof(addr));
+    }
+    if (ret < 0) {
         fprintf(stderr, " failed\n   connect returned %d\n", ret);
-        return;
+        close(client_fd);
+        return -1;
     }
+    fprintf(stderr, " ok\n");
 
-    /*
-     * 2. Write the GET request
-     */
-    int total_written = 0;
-
-    fprintf(stderr, "\nWrite to server:");
-
-    int request_size = (int)request_len;
-    fprintf(stderr, "Request size: %ld, request_size (int): %d\n", request_len, request_size);
-    
-    gettimeofday(&t1, NULL);
+    return client_fd;
+}
 
-    if ((total_written = send(client_fd, &request_size, sizeof(request_size), 0) < 0)) {
-        fprintf(stderr, "Error sending request size\n");
-        return;
+static bool
+send_all(int fd, const char *data, size_t length, int flags)
+{
+    while (length > 0) {
+        ssize_t bytes_send = send(fd, data, length, MSG_NOSIGNAL | flags);
+        if (bytes_send < 0) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        data += bytes_send;
+        length -= bytes_send;
     }
-    fprintf(stderr, " %d bytes\n", total_written);
+    return true;
+}
 
-    if ((total_written = send(client_fd, client_request, request_size, 0)) < 0) {
+// Sends a length-prefixed request and reads the response. The prefix is held
+// back for the request, a segment of its own would wait for the delayed ACK.
+static ssize_t
+exchange_socket(int fd, const char *client_request, int request_size, char *input, size_t input_size)
+{
+    if (!send_all(fd, (const char *)&request_size, sizeof(request_size), MSG_MORE) || !send_all(fd, client_request, request_size, 0)) {
         fprintf(stderr, "Error sending request\n");
-        return;
+        return -1;
     }
 
-    fprintf(stderr, "Bytes written for message: %d\n\n", total_written);
+    ssize_t bytes_read = read(fd, input, input_size - 1);
+    if (bytes_read < 0) {
+        fprintf(stderr, "Connection closed by server\n");
+        return -1;
+    }
+    input[bytes_read] = '\0';
+    return bytes_read;
+}
 
-    /*
-     * 7. Read the response
-     */
-    fprintf(stderr, "Read from server:");
+typedef struct ring_client {
+    ring_header *header;
+    size_t size;
+    uint64_t slot_bytes;
+    int doorbell_fd;
+    int completion_fd;
+} ring_client;
 
-    if ((bytes_read = read(client_fd, input, sizeof(input) - 1)) < 0) {
+static void
+close_ring(ring_client *ring)
+{
+    if (ring->header) munmap(ring->header, ring->size);
+    if (ring->doorbell_fd >= 0) close(ring->doorbell_fd);
+    if (ring->completion_fd >= 0) close(ring->completion_fd);
+}
+
+// Creates a ring with one slot large enough for the request and passes it to
+// the server with the length prefix of a setup
+static bool
+open_ring(int fd, size_t request_len, ring_client *ring)
+{
+    char input[BUF_SIZE];
+    int memfd;
+
+    memset(ring, 0, sizeof(*ring));
+    ring->doorbell_fd = -1;
+    ring->completion_fd = -1;
+
+    // One byte more, the server terminates the request in the slot
+    ring->slot_bytes = (request_len + 1 + RING_ALIGN - 1) / RING_ALIGN * RING_ALIGN;
+    ring->size = ring_size(1, ring->slot_bytes);
+
+    if ((memfd = memfd_create("inferonnx-ring", MFD_CLOEXEC | MFD_ALLOW_SEALING)) < 0 ||
+        ftruncate(memfd, ring->size) < 0 ||
+        fcntl(memfd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW) < 0) {
+        perror("Failed to create the ring");
+        if (memfd >= 0) close(memfd);
+        return false;
+    }
+    ring->header = (ring_header *)mmap(NULL, ring->size, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+    ring->doorbell_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    ring->completion_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (ring->header == MAP_FAILED || ring->doorbell_fd < 0 || ring->completion_fd < 0) {
+        perror("Failed to set up the ring");
+        if (ring->header == MAP_FAILED) ring->header = NULL;
+        close_ring(ring);
+        close(memfd);
+        return false;
+    }
+    ring->header->magic = RING_MAGIC;
+    ring->header->num_slots = 1;
+    ring->header->slot_bytes = ring->slot_bytes;
+
+    int request_size = RING_SETUP_LENGTH;
+    int fds[RING_SETUP_FDS] = {memfd, ring->doorbell_fd, ring->completion_fd};
+    union {
+        char buf[CMSG_SPACE(sizeof(fds))];
+        struct cmsghdr align;
+    } control;
+    struct iovec iov = { .iov_base = &request_size, .iov_len = sizeof(request_size) };
+    struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1, .msg_control = control.buf, .msg_controllen = sizeof(control.buf) };
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+    ssize_t bytes_send = sendmsg(fd, &msg, MSG_NOSIGNAL);
+    close(memfd);   // the mappings keep it
+    if (bytes_send != sizeof(request_size)) {
+        fprintf(stderr, "Error sending the ring setup\n");
+        close_ring(ring);
+        return false;
+    }
+
+    ssize_t bytes_read = read(fd, input, sizeof(input) - 1);
+    if (bytes_read <= 0) {
         fprintf(stderr, "Connection closed by server\n");
-        close(client_fd);
-        return;
+        close_ring(ring);
+        return false;
     }
     input[bytes_read] = '\0';
+    fprintf(stderr, "%s", input);
+    if (strncmp(input, "Ring:", 5) != 0) {
+        close_ring(ring);
+        return false;
+    }
+    return true;
+}
+
+// Submits the request written in the slot and waits for the response; the
+// socket only tells when the server went away
+static ssize_t
+exchange_ring(int fd, ring_client *ring, size_t request_len, char *input, size_t input_size)
+{
+    ring_slot *slot = &ring->header->slots[0];
+    uint64_t one = 1, count;
+
+    slot->request_length = request_len;
+    atomic_store_explicit(&slot->state, RING_SLOT_SUBMITTED, memory_order_release);
+    if (write(ring->doorbell_fd, &one, sizeof(one)) < 0) {
+        perror("Failed to signal the server");
+        return -1;
+    }
+
+    struct pollfd fds[2] = {{ .fd = ring->completion_fd, .events = POLLIN }, { .fd = fd, .events = POLLIN }};
+    while (atomic_load_explicit(&slot->state, memory_order_acquire) != RING_SLOT_DONE) {
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR) continue;
+            perror("poll");
+            return -1;
+        }
+        if (fds[1].revents) {
+            fprintf(stderr, "Connection closed by server\n");
+            return -1;
+        }
+        if (read(ring->completion_fd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+            perror("Failed to read the completions");
+            return -1;
+        }
+    }
+
+    size_t length = slot->response_length < input_size - 1 ? slot->response_length : input_size - 1;
+    memcpy(input, ring_response_area(ring->header, ring->slot_bytes, 0), length);
+    input[length] = '\0';
+    atomic_store_explicit(&slot->state, RING_SLOT_FREE, memory_order_relaxed);
+    return length;
+}
+
+static double
+now_us()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static int
+compare_latencies(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+// Nearest-rank percentile of sorted latencies
+static double
+percentile(const double *sorted, size_t n, double p)
+{
+    if (n == 0) return 0.0;
+    size_t rank = (size_t)ceil(p / 100.0 * n);
+    return sorted[rank > 0 ? rank - 1 : 0];
+}
+
+static void
+print_latencies(double *latencies, int n, size_t request_len)
+{
+    double sum = 0;
+    for (int i = 0; i < n; i++) {
+        sum += latencies[i];
+    }
+    qsort(latencies, n, sizeof(double), compare_latencies);
+
+    fprintf(stdout, "{\"transport\": \"%s\", \"request_bytes\": %ld, \"repeat\": %d, ", transport_names[transport], request_len, n);
+    fprintf(stdout, "\"latency_us\": {\"mean\": %.1f, \"p50\": %.1f, \"p90\": %.1f, \"p99\": %.1f, \"min\": %.1f, \"max\": %.1f}}\n",
+            sum / n, percentile(latencies, n, 50), percentile(latencies, n, 90), percentile(latencies, n, 99), latencies[0], latencies[n - 1]);
+}
+
+void
+send_request(const request *req, int mode)
+{
+    struct timeval t1, t2;
+    double elapsed_time;
+
+    int client_fd;
+    ssize_t bytes_read = 0;
+    char input[BUF_SIZE];
+    ring_client ring;
+    bool use_ring = transport == TRANSPORT_SHM && mode != 2;    // quit is a bare length prefix
+
+    size_t request_len = calculate_buffer_size(req);
+    int request_size = (int)request_len;
+    fprintf(stderr, "Request size: %ld, request_size (int): %d\n", request_len, request_size);
 
+    if ((client_fd = connect_server()) < 0) {
+        return;
+    }
+
+    /*
+     * 2. Write the request, in place in the slot of a ring
+     */
+    char *client_request;
+    if (use_ring) {
+        if (!open_ring(client_fd, request_len, &ring)) {
+            close(client_fd);
+            return;
+        }
+        client_request = ring_request_area(ring.header, ring.slot_bytes, 0);
+        write_client_request(req, client_request);
+    } else {
+        client_request = serialize_client_request(req, request_len);
+    }
+
+    gettimeofday(&t1, NULL);
+    if (use_ring) {
+        bytes_read = exchange_ring(client_fd, &ring, request_len, input, sizeof(input));
+    } else {
+        bytes_read = exchange_socket(client_fd, client_request, request_size, input, sizeof(input));
+    }
     gettimeofday(&t2, NULL);
+    if (bytes_read < 0) {
+        goto exit;
+    }
     elapsed_time = (t2.tv_sec - t1.tv_sec) * 1000.0;
     elapsed_time += (t2.tv_usec - t1.tv_usec) / 1000.0;
 
@@ -440,20 +692,51 @@ send_request(char *client_request, ssize_t request_len, int mode)
 
         if (!fd) {
             fprintf(stderr, "\nError opening inference_time_cpu_...!\n");
-            return;
+            goto exit;
         }
 
 #if USE_SYS_TIME_OPERATORS == 0
         if (fprintf(fd, "Total time - client: %f ms\n", elapsed_time) < 0) {
             fprintf(stderr, "Error writing to file\n");
-            return;
+            fclose(fd);
+            goto exit;
         }
 #endif
         fclose(fd);
     }
 
-    fprintf(stdout, " %ld bytes \nMessage from server: %s\n Connection was closed gracefully\n", bytes_read, input);
+    fprintf(stdout, " %ld bytes \nMessage from server: %s\n", bytes_read, input);
+
+    /*
+     * 3. --repeat: the same request again on the connection, the first round
+     *    trip paid for the connection and the ring setup
+     */
+    if (mode == 1 && repeat > 0) {
+        double *latencies = (double *)malloc(repeat * sizeof(double));
+        assert(latencies);
+        int n = 0;
+        for (; n < repeat; n++) {
+            double start = now_us();
+            if (use_ring) {
+                bytes_read = exchange_ring(client_fd, &ring, request_len, input, sizeof(input));
+            } else {
+                bytes_read = exchange_socket(client_fd, client_request, request_size, input, sizeof(input));
+            }
+            if (bytes_read <= 0) break;
+            latencies[n] = now_us() - start;
+        }
+        if (n > 0) print_latencies(latencies, n, request_len);
+        free(latencies);
+    }
+
+    fprintf(stdout, " Connection was closed gracefully\n");
 
+exit:
+    if (use_ring) {
+        close_ring(&ring);
+    } else {
+        free(client_request);
+    }
     close(client_fd);
 }
 
@@ -596,11 +879,6 @@ send_models(char **input_files, struct dirent **namelist, const char *dir_path,
     req_original.tokenizer_size = 0;
     req_original.tokenizer = NULL;
 
-    size_t bufLen = calculate_buffer_size(&req_original);
-
-    char *buffer = serialize_client_request(&req_original, bufLen);
-    buffer[bufLen] = '\0';
-
     FILE *fd = NULL;
 #ifdef USE_AES
     fd = fopen("../inference_time_cpu_memory_only_aes.txt", "a");
@@ -622,10 +900,9 @@ send_models(char **input_files, struct dirent **namelist, const char *dir_path,
 #endif
     fclose(fd); 
 
-    send_request(buffer, bufLen, 0);
+    send_request(&req_original, 0);
     
     free_request(&req_original);
-    free(buffer);
 }
 
 void
@@ -721,15 +998,9 @@ send_inputs(char **input_names, int id, unsigned char **tags, int size_tags)
         }
     }
     
-    size_t bufLen = calculate_buffer_size(&req_original);
-
-    char *buffer = serialize_client_request(&req_original, bufLen);
-    buffer[bufLen] = '\0';
-    
-    send_request(buffer, bufLen, 1);
+    send_request(&req_original, 1);
     
     free_request(&req_original);
-    free(buffer);
 }
 
 void
@@ -748,12 +1019,8 @@ send_quit()
     req_original.tags = NULL;
     req_original.tokenizer = NULL;
     req_original.tokenizer_size = 0;
-    size_t bufLen = calculate_buffer_size(&req_original);
-    char *buffer = serialize_client_request(&req_original, bufLen);
-    fprintf(stderr, "%ld", bufLen);
-    send_request(buffer, bufLen, 2);
+    send_request(&req_original, 2);
     free_request(&req_original);
-    free(buffer);
 }
 
 unsigned char **
@@ -846,8 +1113,34 @@ version_sort(const struct dirent **a, const struct dirent **b)
 int
 main(int argc, char *argv[]) 
 {
+    // --transport tcp|uds|shm: port 9997, the Unix domain socket, or the Unix
+    // domain socket with the requests in a shared-memory ring
+    // --repeat <n>: send the inference request n more times on the connection
+    // and print their latency as JSON
+    while (argc > 2 && strncmp(argv[1], "--", 2) == 0) {
+        const char *option = argv[1], *value = argv[2];
+        char *endptr;
+        long count = strtol(value, &endptr, 10);
+
+        if (strcmp(option, "--transport") == 0 && strcmp(value, "tcp") == 0) {
+            transport = TRANSPORT_TCP;
+        } else if (strcmp(option, "--transport") == 0 && strcmp(value, "uds") == 0) {
+            transport = TRANSPORT_UDS;
+        } else if (strcmp(option, "--transport") == 0 && strcmp(value, "shm") == 0) {
+            transport = TRANSPORT_SHM;
+        } else if (strcmp(option, "--repeat") == 0 && *endptr == '\0' && count > 0 && count <= INT_MAX) {
+            repeat = (int)count;
+        } else {
+            fprintf(stderr, "Invalid option %s %s\n", option, value);
+            return -1;
+        }
+        argv[2] = argv[0];
+        argv += 2;
+        argc -= 2;
+    }
+
     if (argc < 2 || (strcmp(argv[1], "models") != 0 && strcmp(argv[1], "inputs") != 0 && strcmp(argv[1], "quit") != 0)) {
-        fprintf(stderr, "Usage: %s 'inputs' <model_id> <tag_file> <model_input#1> ... <model_input#N> OR\n       %s 'models' <model_input#1> ... <model_input#N> <model_path> OR\n       %s 'quit'\n", argv[0], argv[0], argv[0]);
+        fprintf(stderr, "Usage: %s [--transport tcp|uds|shm] [--repeat <n>] 'inputs' <model_id> <tag_file> <model_input#1> ... <model_input#N> OR\n       %s [--transport tcp|uds|shm] 'models' <model_input#1> ... <model_input#N> <model_path> OR\n       %s [--transport tcp|uds|shm] 'quit'\n", argv[0], argv[0], argv[0]);
         return -1;
     }
 
@@ -6,6 +6,7 @@
 #include <math.h>
 #include <stdint.h>
 #include <errno.h>
+#include <pthread.h>
 
 #include <sys/time.h>  // for gettimeofday()
 #include <tract.h>
@@ -19,6 +20,8 @@
 #include <mbedtls/error.h>
 #include <mbedtls/debug.h>
 
+#include <shm_ring.h>
+
 #define KEY_BYTES 32
 #define KEY_BITS KEY_BYTES * 8
 #define IV_BYTES 12
@@ -29,6 +32,18 @@
 #define HASH_MULTIPLIER 65599
 #define CAPACITY 3000
 
+// Event loop: threads running the requests, and events taken per epoll_wait
+#ifndef SERVER_WORKERS
+#define SERVER_WORKERS 4
+#endif
+#define MAX_EVENTS 256
+#define LISTEN_BACKLOG 1024
+
+// Unix domain socket served next to port 9997
+#ifndef UDS_PATH
+#define UDS_PATH "/tmp/inferonnx.sock"
+#endif
+
 typedef struct __attribute__((packed)) {
     int command;
     int id;
@@ -42,6 +57,8 @@ typedef struct __attribute__((packed)) {
     unsigned char **tags;
     int tokenizer_size;
     uint8_t *tokenizer;
+    char *buffer;               // receive buffer: models, input, tags and tokenizer
+                                // point into it, it is freed with the request
 } request;
 
 typedef struct encrypted_models_info
@@ -89,6 +106,7 @@ typedef struct model
     unsigned char IV[IV_BYTES];
     unsigned char AAD[ADD_DATA_BYTES];
     operator_node *head;
+    pthread_mutex_t lock;       // the nodes hold the outputs of the running request, one at a time
     struct model *next;
 } model;
 
@@ -97,6 +115,7 @@ typedef struct onnx_table
     int count;
     model **model;
     unsigned int top;
+    pthread_rwlock_t lock;      // lookups from the inference workers, exclusive for insert/remove
 } onnx_table;
 
 typedef struct {
@@ -105,4 +124,84 @@ typedef struct {
     char **input_names;
     int output_names_length;
     char **output_names;
-}operator_io;
\ No newline at end of file
+}operator_io;
+
+// What an epoll event points to, besides the listening sockets and the
+// wake-up counter
+typedef enum {
+    SOURCE_CONNECTION,
+    SOURCE_RING
+} event_source;
+
+// Where a connection is in its current request
+typedef enum {
+    CONN_READ_LENGTH,           // reading the length prefix
+    CONN_READ_REQUEST,          // reading the request itself
+    CONN_PROCESSING,            // handed to an inference worker
+    CONN_WRITE                  // sending the response
+} connection_state;
+
+typedef struct connection {
+    event_source source;
+    int fd;
+    bool local;                 // accepted on the Unix domain socket
+    connection_state state;
+    int request_size;
+    size_t length_read;
+    char *request;
+    size_t request_read;
+    char response[BUF_SIZE];
+    size_t response_len;
+    size_t response_written;
+    bool closed;                // the peer went away while the request was processing
+    int passed_fds[RING_SETUP_FDS];
+    int num_passed_fds;         // received with the length prefix of a ring setup
+    struct shm_ring *ring;
+    struct timeval t1, t2_read, t1_rest, t2_rest, t1_write;
+    struct connection *next;    // worker queue or list of processed requests
+    struct connection *prev_open, *next_open;
+} connection;
+
+// A slot of a ring handed to the inference workers
+typedef struct ring_job {
+    struct shm_ring *ring;
+    uint32_t slot;
+    bool queued;                // event loop only, set until the job comes back
+    struct ring_job *next;      // worker queue or list of answered slots
+} ring_job;
+
+// Shared-memory ring of a local connection, see shm_ring.h
+typedef struct shm_ring {
+    event_source source;
+    ring_header *header;        // the mapped memfd
+    size_t size;
+    uint32_t num_slots;         // geometry checked at setup
+    uint64_t slot_bytes;
+    int doorbell_fd;            // eventfd, signalled by the client for submitted slots
+    int completion_fd;          // eventfd, signalled by the workers for answered slots
+    int in_flight;              // slots handed to the workers, event loop only
+    bool closed;                // its connection is gone, freed once in_flight drops to 0
+    ring_job jobs[RING_MAX_SLOTS];
+    struct shm_ring *next;      // list of rings to free after a batch of events
+} shm_ring;
+
+typedef struct event_loop {
+    int epoll_fd;
+    int listen_fd;
+    int uds_fd;                 // listening Unix domain socket
+    int wake_fd;                // eventfd, signalled by the workers for every processed request
+    onnx_table *table;
+    connection *open;           // every open connection, closed at shutdown
+    connection *closed;         // closed while handling a batch of events, freed after it
+    shm_ring *closed_rings;
+    int in_flight;              // requests handed to the workers, event loop only
+    bool stopping;
+    pthread_t workers[SERVER_WORKERS];
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty;
+    connection *queue_head, *queue_tail;
+    connection *done;
+    ring_job *ring_queue_head, *ring_queue_tail;
+    ring_job *ring_done;
+    bool shutdown;              // the workers exit once the queue is empty
+} event_loop;
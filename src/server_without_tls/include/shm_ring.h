@@ -0,0 +1,71 @@
+#ifndef SHM_RING_H
+#define SHM_RING_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdatomic.h>
+
+// Shared-memory ring between the server and a client on the same host. The
+// client creates a memfd holding a ring_header followed by num_slots slots,
+// each a request area of slot_bytes and a response area of RING_RESPONSE_BYTES,
+// and two eventfds. It passes the three over the Unix domain socket with a
+// length prefix of RING_SETUP_LENGTH; the server maps the memfd and answers
+// over the socket.
+//
+// A request is serialized in place into the request area of a free slot, as on
+// the socket without the length prefix. The client then sets request_length,
+// moves the slot to SUBMITTED and signals the doorbell eventfd. The server runs
+// the request straight from the slot, writes the response text into the
+// response area, moves the slot to DONE and signals the completion eventfd.
+// Until then the slot belongs to the server; afterwards the client may read
+// the response and submit the slot again.
+#define RING_MAGIC 0x474E4952u         // "RING"
+#define RING_SETUP_LENGTH -1
+#define RING_SETUP_FDS 3               // memfd, doorbell eventfd, completion eventfd
+#define RING_MAX_SLOTS 64
+#define RING_ALIGN 4096                // slot areas start at page boundaries
+#define RING_RESPONSE_BYTES 4096
+
+enum {
+    RING_SLOT_FREE,
+    RING_SLOT_SUBMITTED,
+    RING_SLOT_RUNNING,
+    RING_SLOT_DONE
+};
+
+typedef struct ring_slot {
+    _Atomic uint32_t state;
+    uint32_t request_length;
+    uint32_t response_length;
+} __attribute__((aligned(64))) ring_slot;
+
+typedef struct ring_header {
+    uint32_t magic;
+    uint32_t num_slots;
+    uint64_t slot_bytes;               // request area of a slot, a multiple of RING_ALIGN
+    ring_slot slots[RING_MAX_SLOTS];
+} ring_header;
+
+#define RING_DATA_OFFSET ((sizeof(ring_header) + RING_ALIGN - 1) / RING_ALIGN * RING_ALIGN)
+
+static inline size_t
+ring_size(uint32_t num_slots, uint64_t slot_bytes)
+{
+    return RING_DATA_OFFSET + (size_t) num_slots * (slot_bytes + RING_RESPONSE_BYTES);
+}
+
+// Both take the geometry agreed at setup, not the one in the header, which
+// the client can still write to
+static inline char *
+ring_request_area(ring_header *ring, uint64_t slot_bytes, uint32_t slot)
+{
+    return (char *) ring + RING_DATA_OFFSET + (size_t) slot * (slot_bytes + RING_RESPONSE_BYTES);
+}
+
+static inline char *
+ring_response_area(ring_header *ring, uint64_t slot_bytes, uint32_t slot)
+{
+    return ring_request_area(ring, slot_bytes, slot) + slot_bytes;
+}
+
+#endif // SHM_RING_H
@@ -513,21 +513,9 @@ inference_aes(float **images, int num_images, uint8_t *tokenizer, int tokenizer_
             }
         }
 
-        float *temp_image = (float *) malloc(size * sizeof(float));
-        if (!temp_image) {
-            fprintf(stderr, "Error allocating memory for temp_image\n");
-            free(tag);
-            free(key);
-            free(iv);
-            free(aad);
-            free(params);
-            return NULL;
-        }
-        memcpy(temp_image, images[i] + flag, size * sizeof(float));
-
+        // tract copies the tensor straight out of the request buffer
         input_value = NULL;
-        check_ret(tract_value_from_bytes(TRACT_DATUM_TYPE_F32, flag, shape, temp_image, &input_value), NULL);
-        free(temp_image);
+        check_ret(tract_value_from_bytes(TRACT_DATUM_TYPE_F32, flag, shape, images[i] + flag, &input_value), NULL);
 
         input_values[i] = input_value;
     }
@@ -893,16 +881,9 @@ inference_no_aes(float **images, int num_images, uint8_t *tokenizer, int tokeniz
             }
         }
 
-        float *temp_image = (float *) malloc(size * sizeof(float));
-        if (!temp_image) {
-            fprintf(stderr, "Error allocating memory for temp_image\n");
-            return NULL;
-        }
-        memcpy(temp_image, images[i] + flag, size * sizeof(float));
-
+        // tract copies the tensor straight out of the request buffer
         input_value = NULL;
-        check_ret(tract_value_from_bytes(TRACT_DATUM_TYPE_F32, flag, shape, temp_image, &input_value), NULL);
-        free(temp_image);
+        check_ret(tract_value_from_bytes(TRACT_DATUM_TYPE_F32, flag, shape, images[i] + flag, &input_value), NULL);
 
         input_values[i] = input_value;
     }
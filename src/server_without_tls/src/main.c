@@ -1,9 +1,17 @@
+#define _GNU_SOURCE     // accept4, F_GET_SEALS
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <inference.h>
 
 /* HELPER FUNCTIONS */
@@ -380,11 +388,17 @@ exit_encr:
 }
 #endif
 
+// Models, inputs, tags and the tokenizer are views into buf, which the request
+// takes over; names are copied since they become the model's paths. The
+// inputs of MODEL_INPUT start at a multiple of 4 bytes into buf, those of MODEL
+// follow the names and are only checked for presence.
 void 
-deserialize_client_request(const char* buf, request* req)
+deserialize_client_request(char* buf, request* req)
 {
     size_t offset = 0;
 
+    req->buffer = buf;
+
     // int field -> command + id + num_models + num_inputs
     memcpy(&req->command, buf + offset, sizeof(int));
     offset += sizeof(int);
@@ -427,8 +441,7 @@ deserialize_client_request(const char* buf, request* req)
         if (size > 0) {
             req->models = malloc(size * sizeof(uint8_t *));
             for (int i = 0; i < size; ++i) {
-                req->models[i] = malloc(req->size_models[i]);
-                memcpy(req->models[i], buf + offset, req->size_models[i]);
+                req->models[i] = (uint8_t *) (buf + offset);
                 offset += req->size_models[i];
             }
         } else {
@@ -450,8 +463,7 @@ deserialize_client_request(const char* buf, request* req)
             req->input = malloc(num_inputs * sizeof(float *));
             for (int i = 0; i < num_inputs; ++i) {
                 fprintf(stderr, "input_size[%d]: %d\n", i, req->size_inputs[i]);
-                req->input[i] = malloc(req->size_inputs[i] * sizeof(float));
-                memcpy(req->input[i], buf + offset, req->size_inputs[i] * sizeof(float));
+                req->input[i] = (float *) (buf + offset);
                 offset += req->size_inputs[i] * sizeof(float);
             }
         } else {
@@ -479,8 +491,7 @@ deserialize_client_request(const char* buf, request* req)
             req->input = malloc(num_inputs * sizeof(float *));
             for (int i = 0; i < num_inputs; ++i) {
                 fprintf(stderr, "input_size[%d]: %d\n", i, req->size_inputs[i]);
-                req->input[i] = malloc(req->size_inputs[i] * sizeof(float));
-                memcpy(req->input[i], buf + offset, req->size_inputs[i] * sizeof(float));
+                req->input[i] = (float *) (buf + offset);
                 offset += req->size_inputs[i] * sizeof(float);
             }
         } else {
@@ -491,8 +502,7 @@ deserialize_client_request(const char* buf, request* req)
         if (size > 0) {
             req->tags = malloc((size + 1) * sizeof(unsigned char *));
             for (int i = 0; i < size; ++i) {
-                req->tags[i] = malloc(TAG_BYTES * 2);
-                memcpy(req->tags[i], buf + offset, TAG_BYTES * 2);
+                req->tags[i] = (unsigned char *) (buf + offset);
                 offset += TAG_BYTES * 2;
             }
             req->tags[size] = NULL;
@@ -510,8 +520,7 @@ deserialize_client_request(const char* buf, request* req)
 
         // Uint8_t* field -> tokenizer
         if (req->tokenizer_size > 0) {
-            req->tokenizer = malloc(req->tokenizer_size * sizeof(uint8_t));
-            memcpy(req->tokenizer, buf + offset, req->tokenizer_size * sizeof(uint8_t));
+            req->tokenizer = (uint8_t *) (buf + offset);
             offset += req->tokenizer_size * sizeof(uint8_t);
         } else {
             req->tokenizer = NULL;
@@ -522,48 +531,33 @@ deserialize_client_request(const char* buf, request* req)
 void
 free_request(request *req_original)
 {
-    int size = req_original->num_models;
-    int num_inputs = req_original->num_inputs;
     if (req_original->names != NULL) { 
-        for (int i = 0; i < size; ++i) {
+        for (int i = 0; i < req_original->num_models; ++i) {
             free(req_original->names[i]);
         }
         free(req_original->names);
     }
-    if (req_original->size_models != NULL) {
-        free(req_original->size_models);
-    }
-    if (req_original->models != NULL) {
-        for (int i = 0; i < size; ++i) {
-            free(req_original->models[i]);
-        }
-        free(req_original->models);
-    }
-    if (req_original->tags != NULL) {
-        for (int i = 0; req_original->tags[i] != NULL; ++i) {
-            free(req_original->tags[i]);
-        }
-        free(req_original->tags);
-    }
+    free(req_original->size_models);
+    free(req_original->models);
+    free(req_original->tags);
     free(req_original->size_inputs);
-    if (req_original->input != NULL) {
-        for (int i = 0; i < num_inputs; ++i) {
-            free(req_original->input[i]);
-        }
-        free(req_original->input);
-    }
-    if (req_original->tokenizer != NULL) {
-        free(req_original->tokenizer);
-    }
+    free(req_original->input);
+    free(req_original->buffer);
+
+    // The views are gone with the buffer, a second call is a no-op
+    memset(req_original, 0, sizeof(request));
 }
 
+// Takes the request unless it is not owned, as a ring slot that stays with
+// the client
 client_result *
-handle_request(char *client_request, onnx_table *table)
+handle_request(char *client_request, bool owned, onnx_table *table)
 {
     assert(client_request);
     
     request req_copy;
     deserialize_client_request(client_request, &req_copy);
+    if (!owned) req_copy.buffer = NULL;
 
     int command = req_copy.command, id = req_copy.id;
     char **names = req_copy.names;
@@ -584,7 +578,6 @@ handle_request(char *client_request, onnx_table *table)
         if (!names || num_models == 0 || !models || contains_empty_name(names, num_models) || (id != -1 || !input || tags || tokenizer_size != 0)) {
             fprintf(stderr, "Invalid request for MODEL\n");
             free_request(&req_copy);
-            free(client_request);
             return NULL;
         } 
 
@@ -597,7 +590,6 @@ handle_request(char *client_request, onnx_table *table)
             if (!error) {
                 fprintf(stderr, "Error allocating memory for error\n");
                 free_request(&req_copy);
-                free(client_request);
                 return NULL;
             }
             snprintf(error, 512, "Model is already in the onnx table");
@@ -607,12 +599,10 @@ handle_request(char *client_request, onnx_table *table)
             if (!c_l->result) {
                 fprintf(stderr, "Memory allocation failed for c_l->result in MODEL\n");
                 free_request(&req_copy);
-                free(client_request);
                 return NULL;
             }
             memcpy(c_l->result, error, c_l->size);
             free_request(&req_copy);
-            free(client_request);
             free(error);
             return c_l;
         }
@@ -621,12 +611,12 @@ handle_request(char *client_request, onnx_table *table)
         encrypted_models_info *me = encrypt_models(names, num_models, models, size_models);
         if (!me) {
             free_request(&req_copy);
-            free(client_request);
             return NULL;
         }
 
         model *m = (model *) malloc(sizeof(model));
         assert(m);
+        pthread_mutex_init(&m->lock, NULL);
         m->next = NULL;
         m->size = size;
         m->names = names;
@@ -640,7 +630,6 @@ handle_request(char *client_request, onnx_table *table)
         if (!tags) {
             fprintf(stderr, "Memory allocation failed for tags in MODEL\n");
             free_request(&req_copy);
-            free(client_request);
             free_encrypted_models_info(me, num_models);
             free(c_l->result);
             return NULL;
@@ -650,7 +639,6 @@ handle_request(char *client_request, onnx_table *table)
             if (!tags[i]) {
                 fprintf(stderr, "Memory allocation failed for tags[i] in MODEL\n");
                 free_request(&req_copy);
-                free(client_request);
                 free_encrypted_models_info(me, num_models);
                 free(c_l->result);
                 return NULL;
@@ -673,7 +661,6 @@ handle_request(char *client_request, onnx_table *table)
         if (!id_str) {
             free_encrypted_models_info(me, num_models);
             free_request(&req_copy);
-            free(client_request);
             return NULL;
         }
         
@@ -685,7 +672,6 @@ handle_request(char *client_request, onnx_table *table)
         if (!c_l->result) {
             fprintf(stderr, "Memory allocation failed for c_l->result in MODEL\n");
             free_request(&req_copy);
-            free(client_request);
             return NULL;
         }
 
@@ -696,6 +682,7 @@ handle_request(char *client_request, onnx_table *table)
         save_models_no_aes(names, num_models, models, size_models);
         model *m = (model *) malloc(sizeof(model));
         assert(m);
+        pthread_mutex_init(&m->lock, NULL);
         m->next = NULL;
         m->size = size;
         m->names = names;
@@ -708,7 +695,6 @@ handle_request(char *client_request, onnx_table *table)
         char *id_str = insert_into_table(table, m);
         if (!id_str) {
             free_request(&req_copy);
-            free(client_request);
             return NULL;
         }
 
@@ -720,7 +706,6 @@ handle_request(char *client_request, onnx_table *table)
         if (!c_l->result) {
             fprintf(stderr, "Memory allocation failed for c_l->result in MODEL\n");
             free_request(&req_copy);
-            free(client_request);
             return NULL;
         }
 
@@ -781,24 +766,23 @@ handle_request(char *client_request, onnx_table *table)
             if (!c_l->result) {
                 fprintf(stderr, "Memory allocation failed for c_l->result in MODEL\n");
                 free_request(&req_copy);
-                free(client_request);
                 return NULL;
             }
             memcpy(c_l->result, error, c_l->size);
             free_request(&req_copy);
-            free(client_request);
             free(error);
             return c_l;
         }
 
+        pthread_mutex_lock(&m->lock);
 #ifdef USE_AES
         result = inference_aes(input, num_inputs, tokenizer, tokenizer_size, m, tags, m->size);
 #else
         result = inference_no_aes(input, num_inputs, tokenizer, tokenizer_size, m);
 #endif
+        pthread_mutex_unlock(&m->lock);
         if (!result) {
             free_request(&req_copy);
-            free(client_request);
             return NULL;
         }
 
@@ -809,7 +793,6 @@ handle_request(char *client_request, onnx_table *table)
         if (!c_l->result) {
             fprintf(stderr, "Memory allocation failed for c_l->result in MODEL\n");
             free_request(&req_copy);
-            free(client_request);
             return NULL;
         }
         memcpy(c_l->result, result, size);
@@ -822,34 +805,660 @@ handle_request(char *client_request, onnx_table *table)
     default:
         fprintf(stderr, "Invalid command\n");
         free_request(&req_copy);
-        free(client_request);
         return NULL;
     }
 
-    free(client_request);
+    free_request(&req_copy);
     return c_l;
 }
 
 
+/* EVENT LOOP */
+static void
+build_response(client_result *c_l, char *response)
+{
+    if (!c_l) {
+        strcpy(response, "Invalid client_request from handle_request\n");
+        return;
+    }
+
+    memcpy(response, c_l->result, c_l->size);
+    int current_position = c_l->size;
+    if (c_l->tag) {
+        for (size_t i = 0; c_l->tag[i] != NULL; ++i) {
+            response[current_position++] = ' '; // Add a space separator
+            fprintf(stderr, "Tag: ");
+            for (size_t j = 0; j < TAG_BYTES; ++j) {
+                fprintf(stderr, "%02x", c_l->tag[i][j]);
+                sprintf(response + current_position, "%02x", c_l->tag[i][j]);
+                current_position += 2;
+            }
+            fprintf(stderr, "\n"); 
+            free(c_l->tag[i]);
+        }
+        free(c_l->tag);
+    }
+    response[current_position] = '\0';
+    free_client_result(c_l);
+}
+
+static double
+elapsed_ms(struct timeval *start, struct timeval *end)
+{
+    double elapsed_time = (end->tv_sec - start->tv_sec) * 1000.0;      // sec to ms
+    elapsed_time += (end->tv_usec - start->tv_usec) / 1000.0;          // us to ms
+    return elapsed_time;
+}
+
+static void
+log_request_time(connection *c, struct timeval *t2)
+{
+    FILE *fd = NULL;
+#ifdef USE_AES
+    fd = fopen("../inference_time_cpu_memory_only_aes.txt", "a");
+#else     
+    #ifdef USE_MEMORY_ONLY
+    fd = fopen("../inference_time_cpu_memory_only_no_aes.txt", "a");
+    #else
+    fd = fopen("../inference_time_cpu_on_disk_no_aes.txt", "a");
+    #endif
+#endif
+    if (!fd) {
+        fprintf(stderr, "Error opening file inference_time_cpu_....txt\n");
+        return;
+    }
+    if (fprintf(fd, "Time to read request from client: %f ms\n", elapsed_ms(&c->t1, &c->t2_read)) < 0 ||
+        fprintf(fd, "Time to write response to client: %f ms\n", elapsed_ms(&c->t1_write, t2)) < 0 ||
+        fprintf(fd, "Time to process the request: %f ms\n", elapsed_ms(&c->t1_rest, &c->t2_rest)) < 0 ||
+        fprintf(fd, "Total time - server: %f ms\n", elapsed_ms(&c->t1, t2)) < 0) {
+        fprintf(stderr, "Error writing to file inference_time_cpu.txt\n");
+    }
+    fclose(fd);
+}
+
+// Runs the request of a ring slot where the client wrote it and answers in the
+// slot, without a copy through a socket
+static void
+run_ring_job(event_loop *loop, ring_job *job)
+{
+    shm_ring *ring = job->ring;
+    ring_slot *slot = &ring->header->slots[job->slot];
+    char *request = ring_request_area(ring->header, ring->slot_bytes, job->slot);
+    char response[BUF_SIZE];
+    uint32_t length = slot->request_length;
+    uint64_t one = 1;
+
+    if (length == 0 || length >= ring->slot_bytes) {
+        fprintf(stderr, "Ring request of %u bytes does not fit its slot\n", length);
+        build_response(NULL, response);
+    } else {
+        request[length] = '\0';
+        build_response(handle_request(request, false, loop->table), response);
+    }
+
+    // Built aside, the client may write to the slot at any time
+    size_t response_len = strlen(response);
+    memcpy(ring_response_area(ring->header, ring->slot_bytes, job->slot), response, response_len + 1);
+    slot->response_length = response_len;
+    atomic_store_explicit(&slot->state, RING_SLOT_DONE, memory_order_release);
+    fprintf(stderr, "Ring slot %u answered: %s\n", job->slot, response);
+
+    if (write(ring->completion_fd, &one, sizeof(one)) < 0) {
+        perror("Failed to signal the ring");
+    }
+}
+
+// Runs complete requests off the event loop and hands the responses back
+static void *
+inference_worker(void *arg)
+{
+    event_loop *loop = (event_loop *) arg;
+    uint64_t one = 1;
+    bool ring_first = false;
+
+    for (;;) {
+        pthread_mutex_lock(&loop->lock);
+        while (!loop->queue_head && !loop->ring_queue_head && !loop->shutdown) {
+            pthread_cond_wait(&loop->not_empty, &loop->lock);
+        }
+
+        // Alternates between the queues, neither transport starves the other
+        connection *c = NULL;
+        ring_job *job = NULL;
+        ring_first = !ring_first;
+        if (loop->ring_queue_head && (ring_first || !loop->queue_head)) {
+            job = loop->ring_queue_head;
+            loop->ring_queue_head = job->next;
+            if (!loop->ring_queue_head) loop->ring_queue_tail = NULL;
+        } else if (loop->queue_head) {
+            c = loop->queue_head;
+            loop->queue_head = c->next;
+            if (!loop->queue_head) loop->queue_tail = NULL;
+        } else {
+            pthread_mutex_unlock(&loop->lock);
+            break;
+        }
+        pthread_mutex_unlock(&loop->lock);
+
+        if (job) {
+            run_ring_job(loop, job);
+
+            pthread_mutex_lock(&loop->lock);
+            job->next = loop->ring_done;
+            loop->ring_done = job;
+            pthread_mutex_unlock(&loop->lock);
+        } else {
+            gettimeofday(&c->t1_rest, NULL);
+            client_result *c_l = handle_request(c->request, true, loop->table);   // takes the request
+            c->request = NULL;
+            build_response(c_l, c->response);
+            gettimeofday(&c->t2_rest, NULL);
+
+            pthread_mutex_lock(&loop->lock);
+            c->next = loop->done;
+            loop->done = c;
+            pthread_mutex_unlock(&loop->lock);
+        }
+
+        if (write(loop->wake_fd, &one, sizeof(one)) < 0) {
+            perror("Failed to wake the event loop");
+        }
+    }
+
+    return NULL;
+}
+
+static void
+close_passed_fds(connection *c)
+{
+    for (int i = 0; i < c->num_passed_fds; i++) {
+        close(c->passed_fds[i]);
+    }
+    c->num_passed_fds = 0;
+}
+
+static void
+free_connection(connection *c)
+{
+    close_passed_fds(c);
+    free(c->request);
+    free(c);
+}
+
+/* SHARED-MEMORY RINGS */
+static void
+free_ring(shm_ring *ring)
+{
+    munmap(ring->header, ring->size);
+    if (ring->doorbell_fd >= 0) close(ring->doorbell_fd);
+    close(ring->completion_fd);
+    free(ring);
+}
+
+static void
+free_closed_rings(event_loop *loop)
+{
+    while (loop->closed_rings) {
+        shm_ring *ring = loop->closed_rings;
+        loop->closed_rings = ring->next;
+        free_ring(ring);
+    }
+}
+
+// The client keeps its end of the doorbell, so closing ours alone would not
+// take it out of the epoll set. Slots still with the workers keep the ring
+// mapped until they are answered.
+static void
+close_ring(event_loop *loop, shm_ring *ring)
+{
+    if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, ring->doorbell_fd, NULL) < 0) {
+        perror("epoll_ctl failed to remove a ring");
+    }
+    close(ring->doorbell_fd);
+    ring->doorbell_fd = -1;
+    ring->closed = true;
+
+    if (ring->in_flight == 0) {
+        ring->next = loop->closed_rings;
+        loop->closed_rings = ring;
+    }
+}
+
+// Maps the ring passed with a setup and watches its doorbell, the response
+// goes into the connection
+static void
+setup_ring(event_loop *loop, connection *c)
+{
+    ring_header header;
+    struct stat st;
+    int seals;
+
+    if (c->ring || c->num_passed_fds != RING_SETUP_FDS) {
+        snprintf(c->response, BUF_SIZE, "Invalid ring setup: expected %d descriptors over the Unix domain socket\n", RING_SETUP_FDS);
+        return;
+    }
+
+    // A shrinkable memfd could be cut under the mapping
+    int memfd = c->passed_fds[0];
+    if (fstat(memfd, &st) < 0 || (seals = fcntl(memfd, F_GET_SEALS)) < 0 || !(seals & F_SEAL_SHRINK) ||
+        pread(memfd, &header, sizeof(header), 0) != sizeof(header)) {
+        snprintf(c->response, BUF_SIZE, "Invalid ring setup: not a memfd sealed against shrinking\n");
+        return;
+    }
+    if (header.magic != RING_MAGIC || header.num_slots == 0 || header.num_slots > RING_MAX_SLOTS ||
+        header.slot_bytes < RING_ALIGN || header.slot_bytes % RING_ALIGN != 0 || header.slot_bytes > INT32_MAX ||
+        (size_t) st.st_size != ring_size(header.num_slots, header.slot_bytes)) {
+        snprintf(c->response, BUF_SIZE, "Invalid ring setup: bad ring header\n");
+        return;
+    }
+
+    shm_ring *ring = (shm_ring *) calloc(1, sizeof(shm_ring));
+    if (!ring) {
+        snprintf(c->response, BUF_SIZE, "Invalid ring setup: out of memory\n");
+        return;
+    }
+    ring->source = SOURCE_RING;
+    ring->size = st.st_size;
+    ring->num_slots = header.num_slots;
+    ring->slot_bytes = header.slot_bytes;
+    ring->header = (ring_header *) mmap(NULL, ring->size, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+    if (ring->header == MAP_FAILED) {
+        perror("Failed to map the ring");
+        snprintf(c->response, BUF_SIZE, "Invalid ring setup: mmap failed\n");
+        free(ring);
+        return;
+    }
+    for (uint32_t i = 0; i < ring->num_slots; i++) {
+        ring->jobs[i].ring = ring;
+        ring->jobs[i].slot = i;
+    }
+
+    // The flags are shared with the client: a full counter must not block a
+    // worker, nor an empty one the event loop
+    ring->doorbell_fd = c->passed_fds[1];
+    ring->completion_fd = c->passed_fds[2];
+    fcntl(ring->doorbell_fd, F_SETFL, fcntl(ring->doorbell_fd, F_GETFL) | O_NONBLOCK);
+    fcntl(ring->completion_fd, F_SETFL, fcntl(ring->completion_fd, F_GETFL) | O_NONBLOCK);
+
+    struct epoll_event event = { .events = EPOLLIN | EPOLLET, .data.ptr = ring };
+    if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, ring->doorbell_fd, &event) < 0) {
+        perror("epoll_ctl failed for a ring");
+        snprintf(c->response, BUF_SIZE, "Invalid ring setup: the doorbell is not an eventfd\n");
+        munmap(ring->header, ring->size);
+        free(ring);
+        return;
+    }
+
+    close(memfd);
+    c->num_passed_fds = 0;
+    c->ring = ring;
+    snprintf(c->response, BUF_SIZE, "Ring: %u slots of %lu bytes\n", ring->num_slots, ring->slot_bytes);
+}
+
+static void
+submit_ring_job(event_loop *loop, ring_job *job)
+{
+    job->queued = true;
+    job->next = NULL;
+    job->ring->in_flight++;
+    loop->in_flight++;
+
+    pthread_mutex_lock(&loop->lock);
+    if (loop->ring_queue_tail) loop->ring_queue_tail->next = job;
+    else loop->ring_queue_head = job;
+    loop->ring_queue_tail = job;
+    pthread_cond_signal(&loop->not_empty);
+    pthread_mutex_unlock(&loop->lock);
+}
+
+// Hands the submitted slots to the workers. A slot whose job has not come back
+// is skipped, whatever the client wrote to its state.
+static void
+take_ring_requests(event_loop *loop, shm_ring *ring)
+{
+    if (loop->stopping || ring->closed) return;
+
+    for (uint32_t i = 0; i < ring->num_slots; i++) {
+        ring_slot *slot = &ring->header->slots[i];
+        if (ring->jobs[i].queued || atomic_load_explicit(&slot->state, memory_order_acquire) != RING_SLOT_SUBMITTED) {
+            continue;
+        }
+        atomic_store_explicit(&slot->state, RING_SLOT_RUNNING, memory_order_relaxed);
+        submit_ring_job(loop, &ring->jobs[i]);
+    }
+}
+
+static void
+ring_doorbell(event_loop *loop, shm_ring *ring)
+{
+    uint64_t count;
+    if (read(ring->doorbell_fd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+        perror("Failed to read a ring doorbell");
+    }
+    take_ring_requests(loop, ring);
+}
+
+// Later events of the same epoll_wait batch may still point to the connection,
+// it is freed after the batch
+static void
+close_connection(event_loop *loop, connection *c)
+{
+    if (close(c->fd) < 0) {
+        fprintf(stderr, "Failed to close the connection!\n");
+    }
+    c->fd = -1;
+    if (c->ring) close_ring(loop, c->ring);
+
+    if (c->prev_open) c->prev_open->next_open = c->next_open;
+    else loop->open = c->next_open;
+    if (c->next_open) c->next_open->prev_open = c->prev_open;
+
+    // A worker still holds it, freed once its response comes back
+    if (c->state == CONN_PROCESSING) {
+        c->closed = true;
+    } else {
+        c->next = loop->closed;
+        loop->closed = c;
+    }
+}
+
+static void
+free_closed_connections(event_loop *loop)
+{
+    while (loop->closed) {
+        connection *c = loop->closed;
+        loop->closed = c->next;
+        free_connection(c);
+    }
+}
+
+static void
+stop_accepting(event_loop *loop)
+{
+    if (loop->listen_fd < 0) return;
+
+    fprintf(stderr, "Closing the server...\n");
+    if (close(loop->listen_fd) < 0 || close(loop->uds_fd) < 0) {
+        fprintf(stderr, "Failed to close the server!\n");
+    }
+    unlink(UDS_PATH);
+    loop->listen_fd = -1;
+    loop->uds_fd = -1;
+}
+
+static void
+submit_request(event_loop *loop, connection *c)
+{
+    c->state = CONN_PROCESSING;
+    c->next = NULL;
+    loop->in_flight++;
+
+    pthread_mutex_lock(&loop->lock);
+    if (loop->queue_tail) loop->queue_tail->next = c;
+    else loop->queue_head = c;
+    loop->queue_tail = c;
+    pthread_cond_signal(&loop->not_empty);
+    pthread_mutex_unlock(&loop->lock);
+}
+
+// Reads into the length prefix. On the Unix domain socket the prefix of a ring
+// setup carries the descriptors of the ring, kept until the prefix is complete.
+static ssize_t
+read_length(connection *c)
+{
+    char *at = (char *) &c->request_size + c->length_read;
+    size_t length = sizeof(c->request_size) - c->length_read;
+    if (!c->local) return read(c->fd, at, length);
+
+    union {
+        char buf[CMSG_SPACE(RING_SETUP_FDS * sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    struct iovec iov = { .iov_base = at, .iov_len = length };
+    struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1, .msg_control = control.buf, .msg_controllen = sizeof(control.buf) };
+
+    ssize_t bytes_received = recvmsg(c->fd, &msg, MSG_CMSG_CLOEXEC);
+    if (bytes_received <= 0) return bytes_received;
+
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) continue;
+        int count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        for (int i = 0; i < count; i++) {
+            int fd;
+            memcpy(&fd, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+            if (c->num_passed_fds < RING_SETUP_FDS) c->passed_fds[c->num_passed_fds++] = fd;
+            else close(fd);
+        }
+    }
+    return bytes_received;
+}
+
+static void write_response(event_loop *loop, connection *c);
+
+static void
+start_response(event_loop *loop, connection *c)
+{
+    c->state = CONN_WRITE;
+    c->response_len = strlen(c->response);
+    c->response_written = 0;
+    gettimeofday(&c->t1_write, NULL);
+    write_response(loop, c);
+}
+
+// Reads until the socket is drained, parsing the length-prefixed requests as
+// the bytes arrive. At most one request per connection is processed at a time,
+// the rest stays in the socket until its response is written.
+static void
+read_requests(event_loop *loop, connection *c)
+{
+    while (c->state == CONN_READ_LENGTH || c->state == CONN_READ_REQUEST) {
+        ssize_t bytes_received;
+        if (c->state == CONN_READ_LENGTH) {
+            bytes_received = read_length(c);
+        } else {
+            bytes_received = read(c->fd, c->request + c->request_read, c->request_size - c->request_read);
+        }
+
+        if (bytes_received < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return;   // the next edge brings more
+            perror("Read error");
+            close_connection(loop, c);
+            return;
+        } else if (bytes_received == 0) {
+            if (c->length_read > 0) fprintf(stderr, "Connection closed by client\n");
+            close_connection(loop, c);
+            return;
+        }
+
+        if (c->state == CONN_READ_LENGTH) {
+            if (c->length_read == 0) gettimeofday(&c->t1, NULL);
+            c->length_read += bytes_received;
+            if (c->length_read < sizeof(c->request_size)) continue;
+
+            fprintf(stderr, "\nMessage from client: %d\n", c->request_size);
+            if (c->request_size == 20) {
+                fprintf(stderr, "Client wants to close the connection...\n");
+                loop->stopping = true;
+                stop_accepting(loop);
+                close_connection(loop, c);
+                return;
+            }
+            if (c->request_size == RING_SETUP_LENGTH && !loop->stopping) {
+                setup_ring(loop, c);
+                close_passed_fds(c);
+                start_response(loop, c);
+                return;
+            }
+            close_passed_fds(c);
+            if (c->request_size <= 0 || loop->stopping) {
+                close_connection(loop, c);
+                return;
+            }
+
+            c->request = (char *) malloc((c->request_size + 1) * sizeof(char));
+            if (!c->request) {
+                perror("Memory allocation failed for client_request");
+                close_connection(loop, c);
+                return;
+            }
+            c->request_read = 0;
+            c->state = CONN_READ_REQUEST;
+        } else {
+            c->request_read += bytes_received;
+            if (c->request_read < (size_t) c->request_size) continue;
+
+            c->request[c->request_size] = '\0';
+            fprintf(stderr, "Bytes received: %ld\n", c->request_read);
+            gettimeofday(&c->t2_read, NULL);
+            submit_request(loop, c);
+        }
+    }
+}
+
+// Sends what the socket takes; the rest goes out on the next EPOLLOUT edge
+static void
+write_response(event_loop *loop, connection *c)
+{
+    while (c->response_written < c->response_len) {
+        ssize_t bytes_send = send(c->fd, c->response + c->response_written, c->response_len - c->response_written, MSG_NOSIGNAL);
+        if (bytes_send < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return;
+            perror("Failed to send the response to client");
+            close_connection(loop, c);
+            return;
+        }
+        c->response_written += bytes_send;
+    }
+
+    struct timeval t2;
+    gettimeofday(&t2, NULL);
+    fprintf(stderr, "Bytes written: %ld\nResponse: %s\n", c->response_written, c->response);
+    if (strstr(c->response, "Inference:") != NULL) {
+        log_request_time(c, &t2);
+    }
+
+    c->state = CONN_READ_LENGTH;
+    c->length_read = 0;
+    c->request_size = 0;
+
+    // Bytes that arrived during processing raised no new edge
+    read_requests(loop, c);
+}
+
+static void
+complete_requests(event_loop *loop)
+{
+    uint64_t count;
+    if (read(loop->wake_fd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+        perror("Failed to read the wake-up counter");
+    }
+
+    pthread_mutex_lock(&loop->lock);
+    connection *done = loop->done;
+    ring_job *ring_done = loop->ring_done;
+    loop->done = NULL;
+    loop->ring_done = NULL;
+    pthread_mutex_unlock(&loop->lock);
+
+    // The workers answered the slots themselves
+    while (ring_done) {
+        ring_job *job = ring_done;
+        shm_ring *ring = job->ring;
+        ring_done = job->next;
+        job->queued = false;
+        loop->in_flight--;
+
+        if (--ring->in_flight == 0 && ring->closed) {
+            ring->next = loop->closed_rings;
+            loop->closed_rings = ring;
+        } else {
+            take_ring_requests(loop, ring);     // submitted again before the job came back
+        }
+    }
+
+    while (done) {
+        connection *c = done;
+        done = c->next;
+        loop->in_flight--;
+
+        if (c->closed) {
+            free_connection(c);
+            continue;
+        }
+
+        start_response(loop, c);
+    }
+}
+
+static void
+accept_connections(event_loop *loop, int *listen_fd)
+{
+    bool local = listen_fd == &loop->uds_fd;
+
+    while (*listen_fd >= 0) {
+        int fd = accept4(*listen_fd, NULL, NULL, SOCK_NONBLOCK);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) perror("Accept failed");
+            return;
+        }
+
+        // Responses are small and written in one go, they must not wait for an ACK
+        if (!local) {
+            int nodelay = 1;
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+        }
+
+        connection *c = (connection *) calloc(1, sizeof(connection));
+        if (!c) {
+            fprintf(stderr, "Memory allocation failed for connection\n");
+            close(fd);
+            continue;
+        }
+        c->source = SOURCE_CONNECTION;
+        c->fd = fd;
+        c->local = local;
+        c->state = CONN_READ_LENGTH;
+
+        // Registered for both directions once, edge-triggered
+        struct epoll_event event = { .events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET, .data.ptr = c };
+        if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, fd, &event) < 0) {
+            perror("epoll_ctl failed for connection");
+            close(fd);
+            free(c);
+            continue;
+        }
+
+        c->next_open = loop->open;
+        if (loop->open) loop->open->prev_open = c;
+        loop->open = c;
+    }
+}
+
 int
 main()
 {
-    struct timeval t1, t2, t1_read, t2_read, t1_write, t2_write, t1_rest, t2_rest;
-    double elapsed_time, elapsed_time_write, elapsed_time_read, elapsed_time_rest;
-    int server_fd, admin;
+    event_loop loop;
     struct sockaddr_in address;
-    int addrlen = sizeof(address);
+    struct sockaddr_un local_address;
     
+    memset(&loop, 0, sizeof(loop));
+
     /*
      * 0. Opening a socket
      */
     fprintf(stderr, "Opening a socket...");
-    if ((server_fd = socket(AF_INET, SOCK_STREAM, 0)) == -1) {
+    if ((loop.listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0)) == -1) {
         fprintf(stderr, "\nFailed to open a socket\n");
         exit(EXIT_FAILURE);
     }
     fprintf(stderr, " ok\n");
     
+    int reuse = 1;
+    setsockopt(loop.listen_fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
     memset(&address, 0, sizeof(address));
     address.sin_family = AF_INET;
     address.sin_addr.s_addr = INADDR_ANY;
@@ -859,214 +1468,141 @@ main()
      * 1. Setup the listening socket on port 9997
      */
     fprintf(stderr, "Bind on https://localhost:9997/ ...");
-    if (bind(server_fd, (struct sockaddr *)&address, sizeof(address)) == -1) {
+    if (bind(loop.listen_fd, (struct sockaddr *)&address, sizeof(address)) == -1) {
         fprintf(stderr, "\nFailed to bind on https://localhost:9997/\n");
         exit(EXIT_FAILURE);
     }
     fprintf(stderr, " ok\n");
     
     fprintf(stderr, "Listen on https://localhost:9997/ ...");
-    if (listen(server_fd, 3) < 0) {
+    if (listen(loop.listen_fd, LISTEN_BACKLOG) < 0) {
         fprintf(stderr, "\nFailed to listen on https://localhost:9997/\n");
         exit(EXIT_FAILURE);
     }
+    fprintf(stderr, " ok\n");
 
-    onnx_table *table = init_onnx_table(CAPACITY);
-    char response[BUF_SIZE];
-    int request_size = 0;
-    char *client_request = NULL;
-    size_t bytes_read, bytes_send = 0, bytes_received = 0;
-
-    while (1) {
-        /*
-        * 2. Wait until a client connects
-        */
-        fprintf(stderr, "\n\nWaiting for a remote connection ...");
-        if ((admin = accept(server_fd, (struct sockaddr *)&address, (socklen_t*)&addrlen)) < 0) {
-            perror("Accept failed");
-            exit(EXIT_FAILURE);
-        }
-
-        /*
-        * 3. Read the Request
-        */
-        fprintf(stderr, "\nRead from client:");
-
-        gettimeofday(&t1, NULL);
-        gettimeofday(&t1_read, NULL);
-
-        bytes_read = read(admin, &request_size, sizeof(request_size));
-        if ((int)bytes_read < 0) {
-            perror("Read error");
-            return -1;
-        } else if ((int)bytes_read == 0) {
-            fprintf(stderr, "Connection closed by client\n");
-            free(client_request);
-            exit(EXIT_FAILURE);
-        }
-        fprintf(stderr, "Bytes received: %ld\n Message from client: %d\n", bytes_read, request_size);
-
+    /*
+     * 1b. And on the Unix domain socket, for clients on the same host
+     */
+    memset(&local_address, 0, sizeof(local_address));
+    local_address.sun_family = AF_UNIX;
+    strncpy(local_address.sun_path, UDS_PATH, sizeof(local_address.sun_path) - 1);
+    unlink(UDS_PATH);   // left behind by a server that did not shut down
+
+    fprintf(stderr, "Listen on %s ...", UDS_PATH);
+    if ((loop.uds_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0)) == -1 ||
+        bind(loop.uds_fd, (struct sockaddr *)&local_address, sizeof(local_address)) == -1 ||
+        listen(loop.uds_fd, LISTEN_BACKLOG) < 0) {
+        fprintf(stderr, "\nFailed to listen on %s\n", UDS_PATH);
+        exit(EXIT_FAILURE);
+    }
+    fprintf(stderr, " ok\n");
 
-        if (request_size == 20) {
-            fprintf(stderr, "Client wants to close the connection...\n");
-            free_onnx_table(table);
+    /*
+     * 2. Event loop and inference workers
+     */
+    loop.table = init_onnx_table(CAPACITY);
+    pthread_mutex_init(&loop.lock, NULL);
+    pthread_cond_init(&loop.not_empty, NULL);
 
-            fprintf(stderr, "Closing the connection...\n");
-	        if (close(admin) < 0) {
-                fprintf(stderr, "Failed to close the connection!\n");
-                exit(EXIT_FAILURE);
-            }
-            fprintf(stderr, "Closing the server...\n");
-            if (close(server_fd) < 0) {
-                fprintf(stderr, "Failed to close the server!\n");
-                exit(EXIT_FAILURE);
-            }
+    if ((loop.epoll_fd = epoll_create1(0)) < 0 || (loop.wake_fd = eventfd(0, EFD_NONBLOCK)) < 0) {
+        perror("Failed to set up the event loop");
+        exit(EXIT_FAILURE);
+    }
 
-            return 0;
-        }
+    struct epoll_event event = { .events = EPOLLIN | EPOLLET, .data.ptr = &loop.listen_fd };
+    if (epoll_ctl(loop.epoll_fd, EPOLL_CTL_ADD, loop.listen_fd, &event) < 0) {
+        perror("epoll_ctl failed for the listening socket");
+        exit(EXIT_FAILURE);
+    }
+    event.data.ptr = &loop.uds_fd;
+    if (epoll_ctl(loop.epoll_fd, EPOLL_CTL_ADD, loop.uds_fd, &event) < 0) {
+        perror("epoll_ctl failed for the Unix domain socket");
+        exit(EXIT_FAILURE);
+    }
+    event.data.ptr = &loop.wake_fd;
+    if (epoll_ctl(loop.epoll_fd, EPOLL_CTL_ADD, loop.wake_fd, &event) < 0) {
+        perror("epoll_ctl failed for the wake-up counter");
+        exit(EXIT_FAILURE);
+    }
 
-        client_request = (char *) malloc((request_size +1) * sizeof(char));
-        if (!client_request) {
-            perror("Memory allocation failed for client_request");
+    for (int i = 0; i < SERVER_WORKERS; i++) {
+        if (pthread_create(&loop.workers[i], NULL, inference_worker, &loop) != 0) {
+            fprintf(stderr, "Failed to start inference worker %d\n", i);
             exit(EXIT_FAILURE);
         }
+    }
 
-        bytes_read = 0;
-        bytes_received = 0;
-        while ((int)bytes_read < request_size) {
-            bytes_received = read(admin, client_request + bytes_read, request_size - bytes_read);
-            if ((int)bytes_received < 0) {
-                if (errno == EINTR) {
-                    continue; // Interrupted, retry
-                } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
-                    // No more data available, return bytes read so far
-                    break;
-                } else {
-                    perror("Read error");
-                    return -1;
-                }
-            } else if (bytes_received == 0) {
-                fprintf(stderr, "Connection closed by client\n");
-                free(client_request);
-                exit(EXIT_FAILURE);
-            }
-            bytes_read += bytes_received;
+    /*
+     * 3. Serve the connections until a client asks to quit and the requests
+     *    already handed to the workers are answered
+     */
+    struct epoll_event events[MAX_EVENTS];
+    while (!loop.stopping || loop.in_flight > 0) {
+        int n = epoll_wait(loop.epoll_fd, events, MAX_EVENTS, -1);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            perror("epoll_wait failed");
+            break;
         }
-        client_request[request_size] = '\0';
-
-        fprintf(stderr, "Bytes received: %ld\n", bytes_read);
-
-        gettimeofday(&t2_read, NULL);
-
-        gettimeofday(&t1_rest, NULL);
 
-        client_result *c_l = handle_request(client_request, table);
-        if (!c_l) {
-            strcpy(response, "Invalid client_request from handle_request\n");
-        } else {
-            memcpy(response, c_l->result, c_l->size);
-            int current_position = c_l->size;
-            if (c_l->tag) {
-                for (size_t i = 0; c_l->tag[i] != NULL; ++i) {
-                    response[current_position++] = ' '; // Add a space separator
-                    fprintf(stderr, "Tag: ");
-                    for (size_t j = 0; j < TAG_BYTES; ++j) {
-                        fprintf(stderr, "%02x", c_l->tag[i][j]);
-                        sprintf(response + current_position, "%02x", c_l->tag[i][j]);
-                        current_position += 2;
-                    }
-                    fprintf(stderr, "\n"); 
-                    free(c_l->tag[i]);
+        for (int i = 0; i < n; i++) {
+            if (events[i].data.ptr == &loop.listen_fd || events[i].data.ptr == &loop.uds_fd) {
+                accept_connections(&loop, (int *) events[i].data.ptr);
+            } else if (events[i].data.ptr == &loop.wake_fd) {
+                complete_requests(&loop);
+            } else if (*(event_source *) events[i].data.ptr == SOURCE_RING) {
+                shm_ring *ring = (shm_ring *) events[i].data.ptr;
+                if (ring->doorbell_fd >= 0) ring_doorbell(&loop, ring);
+            } else {
+                connection *c = (connection *) events[i].data.ptr;
+                if (c->fd < 0) continue;
+                if (c->state == CONN_WRITE) {
+                    if (events[i].events & (EPOLLOUT | EPOLLERR | EPOLLHUP)) write_response(&loop, c);
+                } else if (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLERR | EPOLLHUP)) {
+                    read_requests(&loop, c);
                 }
-                free(c_l->tag);
             }
-            response[current_position] = '\0';
-            free_client_result(c_l);
-        }
-
-        gettimeofday(&t2_rest, NULL);
-        
-        /*
-        * 4. Write the Response
-        */
-        gettimeofday(&t1_write, NULL);
-        fprintf(stderr, "Write to client:");
-
-        if (send(admin, response, strlen(response), 0) < 0) {
-            perror("Failed to send the response to client\n");
-            free(client_request);
-            free_client_result(c_l);
-            exit(EXIT_FAILURE);
         }
+        free_closed_connections(&loop);
+        free_closed_rings(&loop);
+    }
 
-        gettimeofday(&t2_write, NULL);
-
-        gettimeofday(&t2, NULL);
-        elapsed_time = (t2.tv_sec - t1.tv_sec) * 1000.0;      // sec to ms
-        elapsed_time += (t2.tv_usec - t1.tv_usec) / 1000.0;   // us to ms
-
-        elapsed_time_read = (t2_read.tv_sec - t1_read.tv_sec) * 1000.0;      // sec to ms
-        elapsed_time_read += (t2_read.tv_usec - t1_read.tv_usec) / 1000.0;   // us to ms
-
-        elapsed_time_write = (t2_write.tv_sec - t1_write.tv_sec) * 1000.0;      // sec to ms
-        elapsed_time_write += (t2_write.tv_usec - t1_write.tv_usec) / 1000.0;   // us to ms
-        
-        elapsed_time_rest = (t2_rest.tv_sec - t1_rest.tv_sec) * 1000.0;      // sec to ms
-        elapsed_time_rest += (t2_rest.tv_usec - t1_rest.tv_usec) / 1000.0;   // us to ms
-        
-        print_table(table);
-        fprintf(stderr, "Bytes written: %ld\nResponse: %s\n", bytes_send, response);
-
-        if (strstr(response, "Inference:") != NULL) {
-FILE *fd = NULL;
-#ifdef USE_AES
-            fd = fopen("../inference_time_cpu_memory_only_aes.txt", "a");
-#else     
-        #ifdef USE_MEMORY_ONLY
-            fd = fopen("../inference_time_cpu_memory_only_no_aes.txt", "a");
-        #else
-            fd = fopen("../inference_time_cpu_on_disk_no_aes.txt", "a");
-        #endif
-#endif
-            if (!fd) {
-                fprintf(stderr, "Error opening file inference_time_cpu_....txt\n");
-                exit(EXIT_FAILURE);
-            }
-            if (fprintf(fd, "Time to read request from client: %f ms\n", elapsed_time_read) < 0) {
-                fprintf(stderr, "Error writing to file inference_time_cpu.txt\n");
-                fclose(fd);
-                exit(EXIT_FAILURE);
-            }
-            if (fprintf(fd, "Time to write response to client: %f ms\n", elapsed_time_write) < 0) {
-                fprintf(stderr, "Error writing to file inference_time_cpu.txt\n");
-                fclose(fd);
-                exit(EXIT_FAILURE);
-            }
-            if (fprintf(fd, "Time to process the request: %f ms\n", elapsed_time_rest) < 0) {
-                fprintf(stderr, "Error writing to file inference_time_cpu.txt\n");
-                fclose(fd);
-                exit(EXIT_FAILURE);
-            }
-            if (fprintf(fd, "Total time - server: %f ms\n", elapsed_time) < 0) {
-                fprintf(stderr, "Error writing to file inference_time_cpu.txt\n");
-                fclose(fd);
-                exit(EXIT_FAILURE);
-            }
-            fclose(fd);
-        }
+    pthread_mutex_lock(&loop.lock);
+    loop.shutdown = true;
+    pthread_cond_broadcast(&loop.not_empty);
+    pthread_mutex_unlock(&loop.lock);
+    for (int i = 0; i < SERVER_WORKERS; i++) {
+        pthread_join(loop.workers[i], NULL);
+    }
 
-        fprintf(stderr, "Closing the connection...");
-	    if (close(admin) < 0) {
-            fprintf(stderr, "Failed to close the connection!\n");
-            exit(EXIT_FAILURE);
+    // Requests still queued when epoll_wait failed were never processed
+    while (loop.done) {
+        connection *c = loop.done;
+        loop.done = c->next;
+        if (c->closed) free_connection(c);
+        else c->state = CONN_WRITE;
+    }
+    while (loop.ring_done) {
+        ring_job *job = loop.ring_done;
+        loop.ring_done = job->next;
+        if (--job->ring->in_flight == 0 && job->ring->closed) {
+            job->ring->next = loop.closed_rings;
+            loop.closed_rings = job->ring;
         }
     }
-
-    fprintf(stderr, "Closing the server...\n");
-    if (close(server_fd) < 0) {
-        fprintf(stderr, "Failed to close the server!\n");
-        exit(EXIT_FAILURE);
+    while (loop.open) {
+        close_connection(&loop, loop.open);
     }
+    free_closed_connections(&loop);
+    free_closed_rings(&loop);
+    stop_accepting(&loop);
+
+    free_onnx_table(loop.table);
+    close(loop.wake_fd);
+    close(loop.epoll_fd);
+    pthread_cond_destroy(&loop.not_empty);
+    pthread_mutex_destroy(&loop.lock);
     
     return 0;
 }
@@ -43,17 +43,54 @@ init_onnx_table(int capacity)
     for (int i = 0; i < CAPACITY; i++)
         table->model[i] = NULL;
 
+    pthread_rwlock_init(&table->lock, NULL);
+
     return table;
 }
 
+static bool
+contains_key_locked(onnx_table *table, char *id)
+{
+    unsigned int index = hash_function(id);
+    
+    model *current = table->model[index];
+    while (current){
+        if (strcmp(current->id, id) == 0) return true;
+        current = current->next;
+    }
+
+    return false;
+}
+
+static char *
+find_duplicate_names_locked(onnx_table *table, char **names)
+{
+    for (int i = 0; i < CAPACITY; i++) {
+        model *current = table->model[i];
+        while (current){
+            if (!current->names) continue;
+            for (int j = 0; current->names[j]; j++) {
+                if (!names[j]) return NULL;
+                if (current->names[j] && strcmp(current->names[j], names[j]) == 0) return current->id;
+            }
+            current = current->next;
+        }
+    }
+
+    return NULL;
+}
+
 char *
 insert_into_table(onnx_table *table, model *m)
 {
     assert(table);
     assert(m->names);
 
-    char *id_dup = find_duplicate_names_from_id(table, m->names);
+    // The duplicate check and the insert must not interleave with another registration
+    pthread_rwlock_wrlock(&table->lock);
+    char *id_dup = find_duplicate_names_locked(table, m->names);
     if (id_dup) {
+        pthread_rwlock_unlock(&table->lock);
         return NULL;
     }
 
@@ -64,7 +101,9 @@ insert_into_table(onnx_table *table, model *m)
     id[required_size] = '\0';
 
     unsigned int index = hash_function(id);
-    if (contains_key(table, id)) {
+    if (contains_key_locked(table, id)) {
+        pthread_rwlock_unlock(&table->lock);
+        free(id);
         return NULL;
     };
     
@@ -88,6 +127,7 @@ insert_into_table(onnx_table *table, model *m)
     }
 
     table->count++;
+    pthread_rwlock_unlock(&table->lock);
     return id;
 }
 
@@ -119,16 +159,11 @@ contains_key(onnx_table *table, char *id)
 {
     assert(table);
     assert(id);
-    
-    unsigned int index = hash_function(id);
-    
-    model *current = table->model[index];
-    while (current){
-        if (strcmp(current->id, id) == 0) return true;
-        current = current->next;
-    }
 
-    return false;
+    pthread_rwlock_rdlock(&table->lock);
+    bool found = contains_key_locked(table, id);
+    pthread_rwlock_unlock(&table->lock);
+    return found;
 }
 
 char *
@@ -136,20 +171,11 @@ find_duplicate_names_from_id(onnx_table *table, char **names)
 {
     assert(table);
     assert(names);
-    
-    for (int i = 0; i < CAPACITY; i++) {
-        model *current = table->model[i];
-        while (current){
-            if (!current->names) continue;
-            for (int j = 0; current->names[j]; j++) {
-                if (!names[j]) return NULL;
-                if (current->names[j] && strcmp(current->names[j], names[j]) == 0) return current->id;
-            }
-            current = current->next;
-        }
-    }
 
-    return NULL;
+    pthread_rwlock_rdlock(&table->lock);
+    char *id = find_duplicate_names_locked(table, names);
+    pthread_rwlock_unlock(&table->lock);
+    return id;
 }
 
 model*
@@ -159,14 +185,17 @@ get_model(onnx_table *table, char *id)
     assert(id);
 
     unsigned int index = hash_function(id);
-    
+
+    // Models are only removed at shutdown, the returned one outlives the lock
+    pthread_rwlock_rdlock(&table->lock);
     model *current = table->model[index];
     while (current){
-        if (strcmp(current->id, id) == 0) return table->model[index];
+        if (strcmp(current->id, id) == 0) break;
         current = current->next;
     }
+    pthread_rwlock_unlock(&table->lock);
 
-    return NULL;
+    return current;
 }
 
 void
@@ -221,6 +250,7 @@ deallocate_model(model *current)
     visited_nodes[current->size] = NULL;
     free(visited_nodes);
 
+    pthread_mutex_destroy(&current->lock);
     free(current);
 }
 
@@ -232,8 +262,9 @@ remove_model_from_table(onnx_table *table, char *id)
 
     model *previous = NULL;
     unsigned int index = hash_function(id);
-    model *current = table->model[index];
 
+    pthread_rwlock_wrlock(&table->lock);
+    model *current = table->model[index];
     while (current) {
         if (strcmp(current->id, id) == 0){
             
@@ -246,12 +277,15 @@ remove_model_from_table(onnx_table *table, char *id)
                 previous->next=current->next;
             }
 
+            pthread_rwlock_unlock(&table->lock);
+
             deallocate_model(current);
             return 1;
         }
         previous = current;
         current = current->next;
     }
+    pthread_rwlock_unlock(&table->lock);
 
     return 0;
 }
@@ -275,6 +309,7 @@ free_onnx_table(onnx_table* table)
     
     table->top=0U;
     free(table->model);
+    pthread_rwlock_destroy(&table->lock);
     free(table);
 }
 
@@ -319,7 +354,11 @@ print_table(onnx_table *table)
 
     model *current;
     
-    if (table->top == 0U) return;
+    pthread_rwlock_rdlock(&table->lock);
+    if (table->top == 0U) {
+        pthread_rwlock_unlock(&table->lock);
+        return;
+    }
     fprintf(stderr, "\nStart table...................\n");
     for (int index = 0; index < CAPACITY; index++){
         current = table->model[index];
@@ -328,6 +367,7 @@ print_table(onnx_table *table)
         }
     }
     fprintf(stderr, "\nEnd table.....................\n");
+    pthread_rwlock_unlock(&table->lock);
 }
 
 